@@ -37,6 +37,56 @@
 #define _BROKER_H_
 #include "dd_classes.h"
 #include "keys.h"
+
+// Virtual nodes per shard on the root tier hash ring
+#define DD_SHARD_VNODES 64
+// Forwards between two child brokers before a shortcut is suggested
+#define DD_SHORTCUT_THRESHOLD 100
+#define DD_SHORTCUT_MAX_ROUTES 1024
+// Defaults for the cache of destinations the root didn't know
+#define DD_NODST_TTL 1000
+#define DD_NODST_MAX 4096
+// Router messages read per wakeup, and data messages handled per turn
+#define DD_ROUTER_BATCH 256
+#define DD_DATA_BUDGET 256
+#define DD_DATA_LANE_MAX 4096
+// Default validity of session tickets, in seconds
+#define DD_TICKET_LIFETIME 3600
+// Milliseconds the clock of a resuming client may be off from ours, an
+// older RESUME is refused and each one is accepted once within that time
+#define DD_RESUME_WINDOW 30000
+// Admission control of client registrations: challenges outstanding at
+// once, queued ADDLCL handled per second and the size of that queue
+#define DD_ADMIT_MAX 256
+#define DD_ADMIT_RATE 1000
+#define DD_ADMIT_QUEUE 10000
+// ms between turns of the admission queue, and before an unanswered
+// challenge or a queued ADDLCL is given up
+#define DD_ADMIT_TICK 100
+#define DD_CHALL_TIMEOUT 5000
+// ms between pings to the active parent, and pings it may miss before we
+// fail over to the standby. Everything else runs on a 1 s heartbeat and
+// without a standby the parent is given the old 3 s to answer.
+#define DD_PARENT_PROBE 250
+#define DD_PARENT_MISSES 3
+#define DD_HEARTBEAT 1000
+
+// Connection towards a higher broker besides the active dealer
+struct _parent_link {
+  char *endpoint;
+  zsock_t *sock;
+  zframe_t *broker_id;
+  int state, timeout;
+};
+typedef struct _parent_link parent_link;
+
+// Point on the consistent hash ring of the root tier
+struct _shard_point {
+  uint32_t hash;
+  int shard;
+};
+typedef struct _shard_point shard_point;
+
 struct _dd_broker_t {
   // Connection strings
   char *broker_scope;
@@ -52,7 +102,7 @@ struct _dd_broker_t {
   /* char *syslog_enabled; */
 
 
-  int state, timeout;
+  int state, timeout, heartbeat_ticks;
 
   // Timer IDs
   int br_timeout_loop, cli_timeout_loop, heartbeat_loop, reg_loop;
@@ -68,6 +118,9 @@ struct _dd_broker_t {
   zlist_t *scope;
   zlist_t *rstrings;
   zlist_t *pub_strings, *sub_strings;
+  // Ordered list of parent brokers, dealer_connect is the active one
+  zlist_t *dealer_strings;
+  int reg_attempts;
 
   // main loop
   zloop_t *loop;
@@ -77,10 +130,30 @@ struct _dd_broker_t {
   zsock_t *subN;
   zsock_t *pubS;
   zsock_t *subS;
+  // topics subscribed to from the south, pubS reports each subscription so
+  // retained publications reach every broker that subscribes, they are
+  // passed on once
+  zhash_t *south_topics;
   zsock_t *rsock;
   zsock_t *dsock;
   zsock_t *http;
 
+  // Warm standby registration with the next parent in dealer_strings
+  parent_link *standby;
+
+  // Sharded root tier, shard 0 is the dealer socket
+  zlist_t *shard_strings;
+  parent_link **shards;
+  int num_shards;
+  shard_point *shard_ring;
+  int shard_ring_len;
+  int shard_loop;
+
+  // Direct links to sibling brokers, shortcut_connect is what we offer
+  char *shortcut_connect;
+  zhash_t *shortcut_links;  // endpoint -> parent_link
+  zhash_t *shortcut_routes; // destination -> parent_link
+
   // Hash tables
   // hash-table for local clients
   struct cds_lfht *lcl_cli_ht;
@@ -88,8 +161,24 @@ struct _dd_broker_t {
 
   // hash-table for distant clients
   struct cds_lfht *dist_cli_ht;
+  // hash-table for recently unknown destinations
+  struct cds_lfht *nodst_ht;
+  int nodst_ttl, nodst_max, nodst_count, nodst_loop;
+  // hash-table for clients under flow control
+  struct cds_lfht *flow_ht;
+  int flow_count, flow_window, flow_backlog, flow_tenant_backlog, flow_policy;
+  uint64_t flow_drops;
+  // data plane messages waiting behind control traffic, a ring of
+  // DD_DATA_LANE_MAX
+  dd_rmsg_t **data_lane;
+  int lane_head, lane_count;
+  int data_timer;
+  // receive buffers for the router socket
+  msgpool_t *msgpool;
   // hash-table for local br
   struct cds_lfht *lcl_br_ht;
+  // node caches for the client, broker and negative cache tables
+  slab_t *lcl_cli_slab, *dist_cli_slab, *lcl_br_slab, *nodst_slab;
 
   // hash-table for subscriptions
   struct cds_lfht *subscribe_ht;
@@ -101,18 +190,58 @@ struct _dd_broker_t {
   // keys and crypto
   char nonce[crypto_box_NONCEBYTES];
   ddbrokerkeys_t *keys;
+  // session tickets, the key is derived from the broker private key so
+  // tickets survive a restart
+  unsigned char ticket_key[crypto_secretbox_KEYBYTES];
+  int ticket_lifetime;
+  // proofs of the RESUMEs accepted in the last DD_RESUME_WINDOW, mac hex ->
+  // expiry, so none is accepted twice
+  zhash_t *resume_seen;
+  int64_t resume_swept;
+  // challenges sent to clients, sockid hex -> expiry, and ADDLCLs waiting
+  // for one of them to finish
+  zhash_t *chall_pending;
+  zlist_t *admit_queue;
+  int admit_max, admit_rate, admit_queue_max, admit_loop;
+  uint64_t admit_drops;
+  // per tenant quotas, 0 for no limit
+  int tenant_max_clients, tenant_max_subs;
+  uint64_t tenant_max_bytes;
+  // tenants whose clients on local transports may skip payload encryption,
+  // only granted if the router is bound to nothing but ipc:// endpoints
+  zhash_t *plaintext_tenants;
+  int router_ipc_only;
+  // group whose members' shared memory rings are mapped besides our own
+  // user's, -1 for none
+  int shm_gid;
+  // last retained publication per topic, NULL if retention is off
+  retain_t *retain;
+  // durable log of publications, NULL if log_dir isn't set
+  char *log_dir;
+  size_t log_segment;
+  int log_segments;
+  // topics logged in all and per tenant, 0 for no limit
+  int log_topics, tenant_max_log_topics;
+  publog_t *publog;
+  // notifications held for offline destinations, NULL if queue_max is 0
+  int queue_max, queue_ttl, queue_dests;
+  size_t queue_bytes;
+  char *queue_spill;
+  sfqueue_t *sfq;
 
 };
 typedef struct _lcl_broker local_broker;
 typedef struct _dist_node dist_client;
 typedef struct _lcl_node local_client;
 typedef struct _subscription_node subscribe_node;
+typedef struct _nodst_node nodst_node;
 
 void del_cli_up(dd_broker_t *self, char *prefix_name);
+void queue_gone(dd_broker_t *self, char *dst);
 void add_cli_up(dd_broker_t *self, char *prefix_name, int distancoe);
 
-void forward_locally(dd_broker_t *self, zframe_t *dest_sockid, char *src_string,
-                     zmsg_t *msg);
+int forward_locally(dd_broker_t *self, zframe_t *dest_sockid, char *src_string,
+                    zmsg_t *msg, int plaintext);
 
 void forward_down(dd_broker_t *self, char *src_string, char *dst_string,
                   zframe_t *br_sockid, zmsg_t *msg);
@@ -0,0 +1,64 @@
+#ifndef _COMPRESSOR_H_
+#define _COMPRESSOR_H_
+#include <czmq.h>
+
+// Payloads shorter than this aren't worth compressing
+#define DD_COMP_MIN 64
+// Largest payload a receiver decompresses
+#define DD_COMP_MAX (64 * 1024 * 1024)
+// Peers whose dictionaries and state we keep, all forgotten when full
+#define DD_COMP_PEERS 1024
+// Milliseconds before asking a source for the same dictionary again
+#define DD_COMP_ASK 1000
+
+// Targets and topics starting with prefix are compressed at level, with a
+// dictionary if one was given
+struct _comp_rule {
+  char *prefix;
+  int level;
+  void *cdict;
+  void *dict; // as given, for receivers that ask for it
+  size_t dictlen;
+  unsigned dict_id;
+};
+typedef struct _comp_rule comp_rule_t;
+
+// zstd state of a client. Payloads are compressed by the sending thread and
+// decompressed by the client's loop, each with its own context.
+struct _compressor {
+  zlist_t *rules;
+  // dictionaries for decompressing, by their id
+  zhash_t *ddicts;
+  // the same, sent by peers that were asked for them, by source and id
+  zhash_t *peer_ddicts;
+  zhash_t *sent;  // targets given a dictionary, by target and id
+  zhash_t *plain; // targets that can't decompress, by name
+  zhash_t *asked; // when a source was last asked for a dictionary
+  void *cctx, *dctx;
+};
+typedef struct _compressor compressor_t;
+
+compressor_t *compressor_new();
+void compressor_destroy(compressor_t **self_p);
+int compressor_add_rule(compressor_t *self, const char *prefix, int level,
+                        const void *dict, size_t dictlen);
+int compressor_add_dict(compressor_t *self, const void *dict, size_t dictlen);
+int compressor_add_peer_dict(compressor_t *self, const char *source,
+                             const void *dict, size_t dictlen);
+comp_rule_t *compressor_rule(compressor_t *self, const char *dst);
+comp_rule_t *compressor_rule_by_dict(compressor_t *self, unsigned id);
+int compressor_sent(compressor_t *self, const char *dst, comp_rule_t *rule);
+void compressor_set_plain(compressor_t *self, const char *dst);
+int compressor_missing(compressor_t *self, const char *source,
+                       const void *src, size_t len, unsigned *id);
+int compressor_ask(compressor_t *self, const char *source, unsigned id,
+                   int64_t now);
+size_t compressor_bound(size_t len);
+size_t compressor_pack(compressor_t *self, comp_rule_t *rule, void *dst,
+                       size_t cap, const void *src, size_t len);
+unsigned char *compressor_unpack(compressor_t *self, const char *source,
+                                 const void *src, size_t len,
+                                 size_t *outlen);
+int compressor_train(void *dict, size_t capacity, const void *samples,
+                     const size_t *sizes, unsigned count);
+#endif
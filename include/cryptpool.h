@@ -0,0 +1,60 @@
+#ifndef _CRYPTPOOL_H_
+#define _CRYPTPOOL_H_
+#include <pthread.h>
+#include <sodium.h>
+
+// Most worker threads started by default, fewer on small machines
+#define DD_CRYPT_WORKERS 4
+// Batches smaller than this in both jobs and bytes are done by the caller
+#define DD_CRYPT_PAR_JOBS 8
+#define DD_CRYPT_PAR_BYTES 65536
+// Jobs claimed at a time by a thread
+#define DD_CRYPT_CHUNK 4
+
+// Payload cipher suites. All of them use a 24 byte nonce and a 16 byte
+// MAC on the wire, so sealed messages have the same size.
+#define DD_SUITE_BOX 0     // crypto_box, XSalsa20-Poly1305
+#define DD_SUITE_AESGCM 1  // AES-256-GCM, only with hardware AES
+#define DD_SUITE_XCHACHA 2 // XChaCha20-Poly1305-IETF
+#define DD_SUITES 3
+
+// One message sealed or opened with a precalculated key, from
+// crypto_box_beforenm for DD_SUITE_BOX and from dd_keys_suitek for the
+// others. Sealed messages look like on the wire, the nonce followed by the
+// ciphertext and MAC. To seal, the caller puts the nonce in the first
+// crypto_box_NONCEBYTES of out, which needs room for inlen + NONCEBYTES +
+// MACBYTES. To open, out needs room for inlen - NONCEBYTES - MACBYTES.
+struct _crypt_job {
+  int suite;
+  const unsigned char *key;
+  const unsigned char *in;
+  size_t inlen;
+  unsigned char *out;
+  int rc;
+};
+typedef struct _crypt_job crypt_job_t;
+
+struct _cryptpool {
+  int nworkers;
+  pthread_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  // held by the thread handing out a batch, one batch at a time
+  pthread_mutex_t batch;
+  // the batch being worked on
+  crypt_job_t *jobs;
+  int njobs, open;
+  // next job to claim, and workers inside the batch
+  int next, busy;
+  int stop;
+};
+typedef struct _cryptpool cryptpool_t;
+
+cryptpool_t *cryptpool_new(int workers);
+void cryptpool_destroy(cryptpool_t **self_p);
+void cryptpool_seal(cryptpool_t *self, crypt_job_t *jobs, int n);
+void cryptpool_open(cryptpool_t *self, crypt_job_t *jobs, int n);
+uint32_t dd_suites_available();
+const char *dd_suite_name(int suite);
+int dd_suite_parse(const char *name);
+#endif
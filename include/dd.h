@@ -54,6 +54,8 @@ extern "C" {
 #define DD_ERROR_REGFAIL 1
 #define DD_ERROR_NODST 2
 #define DD_ERROR_VERSION 3
+#define DD_ERROR_BUSY 4
+#define DD_ERROR_QUOTA 5
 
 // On connection
 typedef void(dd_on_con)(void *);
@@ -65,24 +67,102 @@ typedef void(dd_on_data)(char *, unsigned char *, int, void *);
 typedef void(dd_on_pub)(char *, char *, unsigned char *, int, void *);
 // On receive ERROR
 typedef void(dd_on_error)(int, char *, void *);
+// On receive a chunk of a stream, with the stream id, the offset of the
+// chunk in the stream and whether it is the last one
+typedef void(dd_on_chunk)(char *, uint64_t, uint64_t, unsigned char *, int,
+                          int, void *);
+// On acknowledgement of reliable notifications to a target, up to and
+// including the one with the given number
+typedef void(dd_on_ack)(char *, uint64_t, void *);
 
 // class definition for a DoubleDecker client
 typedef struct _dd_t dd_t;
+// a stream of notifications to one target
+typedef struct _dd_stream_t dd_stream_t;
 // subscribed topics
 typedef struct _ddtopic_t ddtopic_t;
 
 typedef struct _dd_keys_t dd_keys_t;
 
 // DD Client functions
+// The client runs in a thread of its own. The calls below may be made from
+// other threads as well, they wait while that thread handles a message,
+// and the callbacks run while the calls from other threads wait.
 CZMQ_EXPORT dd_t *dd_new(char *client_name, char *endpoint, char *keyfile,
                          dd_on_con con, dd_on_discon discon, dd_on_data data,
                          dd_on_pub pub, dd_on_error error);
 CZMQ_EXPORT zactor_t *ddactor_new(char *client_name, char *endpoint,
                                   char *keyfile);
 CZMQ_EXPORT int dd_subscribe(dd_t *self, char *topic, char *scope);
+// Subscribes and replays the publications the broker logged after seq, see
+// dd_get_pub_seq. Replayed publications may repeat ones already handled.
+CZMQ_EXPORT int dd_subscribe_from(dd_t *self, char *topic, char *scope,
+                                  uint64_t seq);
+// Number of the publication being handled in on_pub in the broker's log,
+// 0 if the broker doesn't log it
+CZMQ_EXPORT uint64_t dd_get_pub_seq(dd_t *self);
 CZMQ_EXPORT int dd_unsubscribe(dd_t *self, char *topic, char *scope);
+// Same as the above for count topics, scopes[i] applies to topics[i], and
+// with the same return values. Nothing to do for count 0 is a success.
+CZMQ_EXPORT int dd_subscribe_many(dd_t *self, char **topics, char **scopes,
+                                  int count);
+CZMQ_EXPORT int dd_unsubscribe_many(dd_t *self, char **topics, char **scopes,
+                                    int count);
 CZMQ_EXPORT int dd_publish(dd_t *self, char *topic, char *message, int mlen);
+// Publishes and asks the broker to keep the message as the topic's current
+// value, which it hands to clients that subscribe later
+CZMQ_EXPORT int dd_publish_retained(dd_t *self, char *topic, char *message,
+                                    int mlen);
 CZMQ_EXPORT int dd_notify(dd_t *self, char *target, char *message, int mlen);
+// Same as the above for count messages, encrypted as one batch
+CZMQ_EXPORT int dd_publish_many(dd_t *self, char *topic, char **messages,
+                                int *lengths, int count);
+CZMQ_EXPORT int dd_notify_many(dd_t *self, char *target, char **messages,
+                               int *lengths, int count);
+// Threads helping to encrypt and decrypt large batches, 0 for none. May
+// be called at any time, batches already started finish on the old ones.
+CZMQ_EXPORT int dd_set_crypto_workers(dd_t *self, int workers);
+// Lets the broker and clients running as other members of group map our
+// shared memory ring, by default only processes of the same user can.
+// Call before the client registers. Returns -1 for an unknown group.
+CZMQ_EXPORT int dd_set_shm_group(dd_t *self, const char *group);
+// Compress notifications to targets and publications on topics starting
+// with prefix with zstd at level before encrypting them. With a dictionary,
+// from dd_train_dictionary, receivers are sent it when they need it, a
+// notified target before the first payload, a subscriber when it asks
+// after dropping one. Returns -1 if the library was built without zstd.
+CZMQ_EXPORT int dd_set_compression(dd_t *self, char *prefix, int level,
+                                   const void *dict, size_t dictlen);
+// Dictionary for payloads compressed by others, so nothing is dropped
+// before asking them for it, see dd_set_compression
+CZMQ_EXPORT int dd_add_dictionary(dd_t *self, const void *dict,
+                                  size_t dictlen);
+// Trains a dictionary of at most capacity bytes from count samples stored
+// back to back, sizes[i] long. Returns its size or -1.
+CZMQ_EXPORT int dd_train_dictionary(void *dict, size_t capacity,
+                                    const void *samples, const size_t *sizes,
+                                    unsigned count);
+// Payloads of any size, sent in encrypted chunks of at most DD_CHUNK_SIZE
+// and handed to the on_chunk callback of the target in order. Chunks are
+// reliable notifications, sent again until the target acknowledges them,
+// and at most DD_STREAM_WINDOW of them are in flight per stream.
+CZMQ_EXPORT void dd_set_on_chunk(dd_t *self, dd_on_chunk chunk);
+CZMQ_EXPORT dd_stream_t *dd_stream_new(dd_t *self, char *target);
+// Returns how many bytes of data were taken, fewer than len if the window
+// filled up, and -1 if none were, with errno EAGAIN if the window is full.
+// Write the rest once on_ack reports progress for the target.
+CZMQ_EXPORT int dd_stream_write(dd_stream_t *stream, char *data, int len);
+// Sends what is left as the last chunk
+CZMQ_EXPORT int dd_stream_close(dd_stream_t **stream_p);
+// Notifications the target acknowledges once it has handed them to its
+// on_data callback. They are numbered per target from 1, in seq if it isn't
+// NULL, and sent again until acknowledged, also across reconnects, so the
+// target may see one more than once. Numbering starts over at 1 for a
+// target that acknowledged everything and was idle for a while. Returns -1
+// if too many are waiting for the target.
+CZMQ_EXPORT int dd_notify_reliable(dd_t *self, char *target, char *message,
+                                   int mlen, uint64_t *seq);
+CZMQ_EXPORT void dd_set_on_ack(dd_t *self, dd_on_ack ack);
 CZMQ_EXPORT void dd_destroy(dd_t **self_p);
 CZMQ_EXPORT const char *dd_get_version();
 
@@ -112,6 +192,51 @@ CZMQ_EXPORT int dd_broker_set_loglevel(dd_broker_t *self, char *logstr);
 CZMQ_EXPORT int dd_broker_set_keyfile(dd_broker_t *self, char *key_file);
 CZMQ_EXPORT int dd_broker_set_config(dd_broker_t *self, char *config_file);
 CZMQ_EXPORT int dd_broker_set_dealer(dd_broker_t *self, char *dealer_string);
+CZMQ_EXPORT int dd_broker_add_dealer(dd_broker_t *self, char *dealer_string);
+CZMQ_EXPORT int dd_broker_add_shard(dd_broker_t *self, char *shard_string);
+CZMQ_EXPORT int dd_broker_set_shortcut(dd_broker_t *self,
+                                       char *shortcut_string);
+CZMQ_EXPORT int dd_broker_set_nodst_ttl(dd_broker_t *self, char *ttl_string);
+CZMQ_EXPORT int dd_broker_set_nodst_max(dd_broker_t *self, char *max_string);
+CZMQ_EXPORT int dd_broker_set_flow_window(dd_broker_t *self,
+                                          char *window_string);
+CZMQ_EXPORT int dd_broker_set_flow_backlog(dd_broker_t *self,
+                                           char *backlog_string);
+CZMQ_EXPORT int dd_broker_set_flow_tenant_backlog(dd_broker_t *self,
+                                                  char *backlog_string);
+CZMQ_EXPORT int dd_broker_set_flow_policy(dd_broker_t *self,
+                                          char *policy_string);
+CZMQ_EXPORT int dd_broker_set_ticket_lifetime(dd_broker_t *self,
+                                              char *lifetime_string);
+CZMQ_EXPORT int dd_broker_set_admit_max(dd_broker_t *self, char *max_string);
+CZMQ_EXPORT int dd_broker_set_admit_rate(dd_broker_t *self, char *rate_string);
+CZMQ_EXPORT int dd_broker_set_admit_queue(dd_broker_t *self,
+                                          char *queue_string);
+CZMQ_EXPORT int dd_broker_set_tenant_max_clients(dd_broker_t *self,
+                                                 char *max_string);
+CZMQ_EXPORT int dd_broker_set_tenant_max_subs(dd_broker_t *self,
+                                              char *max_string);
+CZMQ_EXPORT int dd_broker_set_tenant_max_bytes(dd_broker_t *self,
+                                               char *max_string);
+CZMQ_EXPORT int dd_broker_set_plaintext(dd_broker_t *self,
+                                        char *tenants_string);
+CZMQ_EXPORT int dd_broker_set_shm_group(dd_broker_t *self, char *group);
+CZMQ_EXPORT int dd_broker_set_retain(dd_broker_t *self, char *max_string);
+CZMQ_EXPORT int dd_broker_set_log_dir(dd_broker_t *self, char *dir);
+CZMQ_EXPORT int dd_broker_set_log_segment(dd_broker_t *self,
+                                          char *size_string);
+CZMQ_EXPORT int dd_broker_set_log_segments(dd_broker_t *self,
+                                           char *count_string);
+CZMQ_EXPORT int dd_broker_set_log_topics(dd_broker_t *self, char *max_string);
+CZMQ_EXPORT int dd_broker_set_tenant_max_log_topics(dd_broker_t *self,
+                                                    char *max_string);
+CZMQ_EXPORT int dd_broker_set_queue_max(dd_broker_t *self, char *max_string);
+CZMQ_EXPORT int dd_broker_set_queue_bytes(dd_broker_t *self,
+                                          char *size_string);
+CZMQ_EXPORT int dd_broker_set_queue_ttl(dd_broker_t *self, char *ttl_string);
+CZMQ_EXPORT int dd_broker_set_queue_dests(dd_broker_t *self,
+                                          char *max_string);
+CZMQ_EXPORT int dd_broker_set_queue_spill(dd_broker_t *self, char *dir);
 CZMQ_EXPORT int dd_broker_add_router(dd_broker_t *self, char *router_string);
 CZMQ_EXPORT int dd_broker_del_router(dd_broker_t *self, char *router_string);
 #endif
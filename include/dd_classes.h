@@ -11,6 +11,7 @@ extern "C" {
 #include <err.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <signal.h>
 #include <sodium.h>
 #include <stdio.h>
@@ -41,9 +42,19 @@ extern "C" {
 #include "ddlog.h"
 #include "keys.h"
 #include "trie.h"
+#include "slab.h"
+#include "msgpool.h"
+#include "cryptpool.h"
+#include "shmring.h"
+#include "compressor.h"
+#include "retain.h"
+#include "publog.h"
+#include "sfqueue.h"
+#include "reliable.h"
 #include "broker.h"
 #include "murmurhash.h"
 #include "htable.h"
+#include "flow.h"
 #include "protocol.h"
 #include "sublist.h"
 #include "xxhash.h"
@@ -76,13 +87,25 @@ extern const uint32_t dd_cmd_unsub;
 extern const uint32_t dd_cmd_sendpublic;
 extern const uint32_t dd_cmd_pubpublic;
 extern const uint32_t dd_cmd_sendpt;
-extern const uint32_t dd_cmd_forwardpt;
 extern const uint32_t dd_cmd_datapt;
 extern const uint32_t dd_cmd_subok;
+extern const uint32_t dd_cmd_activate;
+extern const uint32_t dd_cmd_route;
+extern const uint32_t dd_cmd_credit;
+extern const uint32_t dd_cmd_resume;
+extern const uint32_t dd_cmd_submany;
+extern const uint32_t dd_cmd_unsubmany;
+extern const uint32_t dd_cmd_sendshm;
+extern const uint32_t dd_cmd_datashm;
+extern const uint32_t dd_cmd_replay;
 extern const uint32_t dd_version;
 extern const uint32_t dd_error_regfail;
 extern const uint32_t dd_error_nodst;
 extern const uint32_t dd_error_version;
+extern const uint32_t dd_error_busy;
+extern const uint32_t dd_error_quota;
+
+int dd_backoff(int attempt);
 
 #endif
 #ifdef __cplusplus
@@ -0,0 +1,47 @@
+#ifndef _FLOW_H_
+#define _FLOW_H_
+#include <urcu.h>
+#include <urcu/rculfhash.h>
+#include "dd_classes.h"
+
+// What to do when a client's backlog is full
+#define DD_FLOW_DROP_OLDEST 0
+#define DD_FLOW_DROP_NEWEST 1
+#define DD_FLOW_BLOCK 2
+#define DD_FLOW_DISCONNECT 3
+
+// Defaults, in messages
+#define DD_FLOW_WINDOW 1000
+#define DD_FLOW_BACKLOG 1000
+#define DD_FLOW_TENANT_BACKLOG 100000
+
+// Clients that have sent DD_CMD_CREDIT, others are never held back
+struct _flow_client {
+  zframe_t *sockid;
+  uint64_t cookie;
+  ddtenant_t *tenant;
+  // messages sent to / consumed by the client, the difference is the
+  // number in flight
+  uint32_t sent, acked;
+  // complete ROUTER messages waiting for credit
+  zlist_t *backlog;
+  uint64_t drops;
+  // backlog overflowed under DD_FLOW_DISCONNECT
+  int disconnect;
+  struct cds_lfht_node node;
+};
+typedef struct _flow_client flow_client;
+
+int flow_send(dd_broker_t *self, zframe_t *sockid, const uint32_t *cmd,
+              char *str1, char *str2, zmsg_t *msg);
+int flow_send_control(dd_broker_t *self, zframe_t *sockid,
+                      const uint32_t *cmd, char *str1, char *str2,
+                      zmsg_t *msg);
+int32_t flow_inflight(uint32_t sent, uint32_t acked);
+void flow_account(uint32_t *sent, uint32_t *acked, uint32_t consumed);
+void flow_credit(dd_broker_t *self, zframe_t *sockid, local_client *ln,
+                 uint32_t consumed);
+void flow_remove(dd_broker_t *self, zframe_t *sockid);
+void flow_destroy(dd_broker_t *self);
+int flow_policy_from_str(char *policy);
+#endif
@@ -6,10 +6,13 @@
 #define RCU_MEMBARRIER
 #define XXHSEED 1234
 #define MAXTENANTNAME 256
+// Names shorter than this are stored inside the node
+#define DD_NAME_INLINE 48
 
-// subscriptions[sockid] = ["b.topicA/0/1/2/", "b.topicB/0/1/2/"]
+// subscriptions[sockid] = {"b.topicA/0/1/2/", "b.topicB/0/1/2/"}
 struct _subscription_node {
-  zlist_t *topics;
+  // only the keys matter, the items point back to the node
+  zhash_t *topics;
   zframe_t *sockid;
   struct cds_lfht_node node;
 };
@@ -19,14 +22,21 @@ struct _lcl_node {
   char *name; // client name		/* Node content */
   char *prefix_name;
   char *tenant;
+  ddtenant_t *ten;
   uint64_t cookie;
   zframe_t *sockid;
   int timeout;
+  // exchanges SENDPT/DATAPT instead of encrypted payloads
+  int plaintext;
+  // the ring the client puts SENDSHM payloads in, if the broker mapped it
+  shmring_t *shm;
   // sockid_node for lcl_cli_ht
   // prename_node and rev_lcl_cli_ht (combine with dist_node?)
   struct cds_lfht_node lcl_node; // Chaining in hash table
   struct cds_lfht_node rev_node; // Chaining in hash table
   // struct cds_lfht_node node;
+  char name_buf[DD_NAME_INLINE];
+  char prefix_buf[DD_NAME_INLINE];
 };
 
 // Distant nodes
@@ -34,7 +44,17 @@ struct _dist_node {
   char *name; /* Node content */
   zframe_t *broker;
   int distance;
+  // notifications forwarded towards this client, for shortcut hints
+  int forwards;
   struct cds_lfht_node node; /* Chaining in hash table */
+  char name_buf[DD_NAME_INLINE];
+};
+
+// Destinations that a higher broker answered with ERROR_NODST
+struct _nodst_node {
+  char *name;
+  int64_t expires;
+  struct cds_lfht_node node;
 };
 
 // Local broker
@@ -43,6 +63,10 @@ struct _lcl_broker {
   uint64_t cookie;
   int distance;
   int timeout;
+  // standby brokers don't have their clients announced further up
+  int standby;
+  // where siblings can reach this broker directly, NULL if not offered
+  char *endpoint;
   struct cds_lfht_node node; /* Chaining in hash table */
 };
 int insert_local_client(dd_broker_t *self, zframe_t *sockid, ddtenant_t *ten,
@@ -52,15 +76,25 @@ dist_client *hashtable_has_dist_node(dd_broker_t *self, char *prefix_name);
 void hashtable_insert_dist_node(dd_broker_t *self, char *prefix_name,
                                 zframe_t *sockid, int dist);
 void delete_dist_clients(dd_broker_t *self, local_broker *br);
+void hashtable_insert_nodst(dd_broker_t *self, char *prefix_name);
+int hashtable_has_nodst(dd_broker_t *self, char *prefix_name);
+void hashtable_remove_nodst(dd_broker_t *self, char *prefix_name);
+void hashtable_expire_nodst(dd_broker_t *self, int all);
 local_broker *hashtable_has_local_broker(dd_broker_t *self, zframe_t *sockid,
                                          uint64_t cookie, int update);
 
-void hashtable_insert_local_broker(dd_broker_t *self, zframe_t *sockid,
-                                   uint64_t cookie);
+local_broker *hashtable_insert_local_broker(dd_broker_t *self,
+                                            zframe_t *sockid, uint64_t cookie);
 local_client *hashtable_has_rev_local_node(dd_broker_t *self, char *prefix_name,
                                            int update);
 local_client *hashtable_has_local_node(dd_broker_t *self, zframe_t *sockid,
                                        zframe_t *cookie, int update);
+local_client *hashtable_find_local_node(dd_broker_t *self, const void *sockid,
+                                        size_t len, uint64_t cookie,
+                                        int update);
+local_broker *hashtable_find_local_broker(dd_broker_t *self,
+                                          const void *sockid, size_t len,
+                                          uint64_t cookie, int update);
 void hashtable_unlink_rev_local_node(dd_broker_t *self, char *prefix_name);
 void hashtable_unlink_local_node(dd_broker_t *self, zframe_t *sockid,
                                  uint64_t cookie);
@@ -69,8 +103,13 @@ void hashtable_insert_local_node(dd_broker_t *self, zframe_t *sockid,
 int remove_subscriptions(dd_broker_t *self, zframe_t *sockid);
 int remove_subscription(dd_broker_t *self, zframe_t *sockid, char *topic);
 int insert_subscription(dd_broker_t *self, zframe_t *sockid, char *topic);
+int has_subscription(dd_broker_t *self, zframe_t *sockid, char *topic);
 void hashtable_subscribe_destroy(struct cds_lfht **self_p);
 void hashtable_local_client_destroy(struct cds_lfht **self_p);
+void hashtable_free_local_node(dd_broker_t *self, local_client *ln);
+void hashtable_slabs_new(dd_broker_t *self);
+void hashtable_slabs_flush(dd_broker_t *self);
+void hashtable_slabs_destroy(dd_broker_t *self);
 int zlist_contains_str(zlist_t *list, char *string);
 void print_zlist_str(zlist_t *list);
 void print_sub_ht(dd_broker_t *self);
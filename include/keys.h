@@ -28,6 +28,7 @@
 #define _DDKEYS_H_
 
 #include "dd.h"
+#include "cryptpool.h"
 
 typedef struct ddbrokerkeys {
   // list of tenant names
@@ -48,6 +49,16 @@ typedef struct tenantsinfo {
   char *name;
   uint64_t cookie;
   char *boxk;
+  // flow control accounting in the broker
+  int queued;
+  uint64_t drops;
+  // quota accounting in the broker
+  int clients, subscriptions;
+  uint64_t queued_bytes;
+  // payload cipher suites as configured, the whole tenant uses the first
+  // one, none keeps crypto_box without negotiation
+  int suites[DD_SUITES];
+  int nsuites;
 } ddtenant_t;
 
 dd_keys_t *dd_keys_new(const char *filename);
@@ -62,6 +73,8 @@ const uint8_t *dd_keys_ddpub(dd_keys_t *self);
 const uint8_t *dd_keys_pubboxk(dd_keys_t *self);
 const uint8_t *dd_keys_publicpub(dd_keys_t *self);
 const uint8_t *dd_keys_priv(dd_keys_t *self);
+uint32_t dd_keys_suites(dd_keys_t *self);
+const uint8_t *dd_keys_suitek(dd_keys_t *self, int suite);
 
 ddbrokerkeys_t *read_ddbrokerkeys(char *filename);
 void dd_broker_keys_destroy(ddbrokerkeys_t **);
@@ -0,0 +1,42 @@
+#ifndef _MSGPOOL_H_
+#define _MSGPOOL_H_
+#include <czmq.h>
+#include <zmq.h>
+
+// Parts received into the pooled zmq_msg_t, enough for the sockid,
+// version, command, cookie and destination or topic. The rest, the
+// payload of data messages, is received into zframe_t that are handed on
+// without copying them, see rmsg_zmsg.
+#define DD_RMSG_HEAD 5
+// Payload frames set up in a fresh message, grows for longer messages
+#define DD_RMSG_FRAMES 4
+
+// A multipart message received straight into zmq_msg_t parts, which are
+// kept for the next message once it is released
+struct _dd_rmsg {
+  int size;
+  zmq_msg_t parts[DD_RMSG_HEAD];
+  // parts from DD_RMSG_HEAD on, NULL once rmsg_zmsg took them
+  zframe_t **frames;
+  int cap;
+};
+typedef struct _dd_rmsg dd_rmsg_t;
+
+// Released messages kept for reuse, owned by a single thread
+struct _msgpool {
+  dd_rmsg_t **free;
+  int nfree, max;
+  // messages received, and how many of them needed a new dd_rmsg_t
+  uint64_t recvs, misses;
+};
+typedef struct _msgpool msgpool_t;
+
+msgpool_t *msgpool_new(int max);
+void msgpool_destroy(msgpool_t **self_p);
+dd_rmsg_t *msgpool_recv(msgpool_t *self, void *sock);
+void msgpool_release(msgpool_t *self, dd_rmsg_t **msg_p);
+void *rmsg_data(dd_rmsg_t *msg, int part);
+size_t rmsg_size(dd_rmsg_t *msg, int part);
+char *rmsg_str(dd_rmsg_t *msg, int part, char *buf, size_t len);
+zmsg_t *rmsg_zmsg(dd_rmsg_t *msg, int from);
+#endif
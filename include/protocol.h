@@ -26,9 +26,49 @@ extern "C" {
 #define DD_CMD_SENDPUBLIC 18
 #define DD_CMD_PUBPUBLIC 19
 #define DD_CMD_SENDPT 20
-#define DD_CMD_FORWARDPT 21
+#define DD_CMD_FORWARDPT 21 // reserved, never sent: plaintext stays on its broker
 #define DD_CMD_DATAPT 22
 #define DD_CMD_SUBOK 23
+#define DD_CMD_ACTIVATE 24
+#define DD_CMD_ROUTE 25
+#define DD_CMD_CREDIT 26
+#define DD_CMD_RESUME 27
+#define DD_CMD_SUBMANY 28
+#define DD_CMD_UNSUBMANY 29
+#define DD_CMD_SENDSHM 30
+#define DD_CMD_DATASHM 31
+#define DD_CMD_REPLAY 32
+
+// Set in the cipher suites offered by a client on a local transport that
+// accepts plaintext within its tenant
+#define DD_OFFER_PLAINTEXT 0x80000000u
+
+// Clients report consumed messages at least this often
+#define DD_CREDIT_BATCH 64
+// Messages read from the broker before decrypting them as a batch
+#define DD_RECV_BATCH 64
+// Streams are sent in chunks of at most this many bytes, each prefixed by
+// the stream id, the offset of the chunk and DD_CHUNK_* flags
+#define DD_CHUNK_SIZE (256 * 1024)
+#define DD_CHUNK_HDR 20
+#define DD_CHUNK_LAST 1
+// Chunks of one stream sent and not yet acknowledged by the target, writes
+// beyond that fail with EAGAIN
+#define DD_STREAM_WINDOW 16
+// Flags in a frame after the payload of a notification or publication,
+// which is only there if any of them are set
+#define DD_PAYLOAD_CHUNK 1 // a chunk of a stream
+#define DD_PAYLOAD_ZSTD 2  // compressed before it was encrypted
+#define DD_PAYLOAD_RETAIN 4 // kept by the broker for new subscribers
+#define DD_PAYLOAD_SEQ 8    // followed by its uint64_t number in the log
+#define DD_PAYLOAD_REPLAY 16 // replayed from the log
+#define DD_PAYLOAD_RELIABLE 32 // starts with a DD_REL_HDR header
+#define DD_PAYLOAD_ACK 64      // acknowledges reliable notifications
+#define DD_PAYLOAD_DICT 128    // a compression dictionary, see compressor.c
+#define DD_PAYLOAD_DICTREQ 256 // asks for one by its uint32_t id
+// Bounds of the reconnect backoff, in milliseconds
+#define DD_BACKOFF_MIN 500
+#define DD_BACKOFF_MAX 30000
 #endif
 #ifdef __cplusplus
 }
@@ -0,0 +1,60 @@
+#ifndef _PUBLOG_H_
+#define _PUBLOG_H_
+#include <czmq.h>
+
+// Size of a segment file and how many of them a topic keeps by default
+#define DD_LOG_SEGMENT (16 * 1024 * 1024)
+#define DD_LOG_SEGMENTS 8
+// Topics logged by default, publications on further ones aren't logged
+#define DD_LOG_TOPICS 1024
+// Publications replayed before the client has to ask for more
+#define DD_REPLAY_BATCH 256
+
+// A segment file of a topic's log, holding the publications from first to
+// last. Only the one written to stays mapped, the others are mapped while
+// a replay reads them.
+struct _publog_seg {
+  char *path;
+  unsigned char *map;
+  size_t size, used;
+  uint64_t first, last;
+};
+typedef struct _publog_seg publog_seg_t;
+
+struct _publog_topic {
+  char *pubtopic;
+  char *dir;
+  // oldest first, only the last one is written to
+  zlist_t *segs;
+};
+typedef struct _publog_topic publog_topic_t;
+
+// Publication logs by pubtopic. Sequence numbers are shared by all topics
+// and survive a restart of the broker.
+struct _publog {
+  char *dir;
+  size_t seg_size;
+  int max_segs;
+  uint64_t seq;
+  zhash_t *topics;
+  // topics in all and per tenant, the part of pubtopics before the first
+  // dot, 0 for no limit
+  int max_topics, tenant_max_topics;
+  zhash_t *tenants; // topics per tenant
+  uint64_t refused; // publications on topics beyond those limits
+};
+typedef struct _publog publog_t;
+
+// Called for each replayed publication, returns -1 to stop the replay
+typedef int(publog_fn)(void *arg, uint64_t seq, const char *source,
+                       const char *topic, zmsg_t *payload);
+
+publog_t *publog_new(const char *dir, size_t seg_size, int max_segs);
+void publog_destroy(publog_t **self_p);
+uint64_t publog_append(publog_t *self, const char *pubtopic,
+                       const char *source, const char *topic,
+                       zmsg_t *payload);
+uint64_t publog_replay(publog_t *self, const char *prefix, uint64_t from,
+                       uint64_t until, int max, publog_fn *fn, void *arg,
+                       int *done);
+#endif
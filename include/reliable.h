@@ -0,0 +1,74 @@
+#ifndef _RELIABLE_H_
+#define _RELIABLE_H_
+#include <czmq.h>
+
+// Notifications in flight to one target before it has to acknowledge them
+#define DD_REL_WINDOW 256
+// Notifications waiting for the window beyond that
+#define DD_REL_PENDING 4096
+// Milliseconds without an acknowledgement before the window is sent again,
+// doubled on every retransmission up to DD_REL_RTO_MAX
+#define DD_REL_RTO 500
+#define DD_REL_RTO_MAX 8000
+#define DD_REL_TICK 100
+// Repeated acknowledgements that trigger a retransmission right away
+#define DD_REL_DUPACKS 3
+// Session, sequence number and oldest unacknowledged number in front of a
+// reliable notification, session and cumulative number in an ACK
+#define DD_REL_HDR 24
+#define DD_REL_ACK 16
+// Senders a receiver keeps track of, and targets with everything
+// acknowledged a sender keeps before it forgets them
+#define DD_REL_PEERS 1024
+// Milliseconds a target is kept once everything sent to it is acknowledged
+#define DD_REL_IDLE 60000
+
+struct _rel_msg {
+  uint64_t seq;
+  uint32_t flags; // DD_PAYLOAD_* sealed along with DD_PAYLOAD_RELIABLE
+  int len;
+  char *data;
+};
+typedef struct _rel_msg rel_msg_t;
+
+// Notifications to one target, numbered from 1 within a random session.
+// Everything up to base - 1 is acknowledged, up to sent was sent at least
+// once and up to next - 1 is queued.
+struct _rel_out {
+  char *target;
+  uint64_t session;
+  uint64_t base, sent, next;
+  zlist_t *msgs; // unacknowledged, oldest first
+  int64_t progress; // last sent or acknowledged
+  int rto, dupacks;
+};
+typedef struct _rel_out rel_out_t;
+
+// What a receiver expects next from a sender's session
+struct _rel_in {
+  char *source;
+  uint64_t session;
+  uint64_t expected;
+  int ack_due;
+};
+typedef struct _rel_in rel_in_t;
+
+struct _reliable {
+  zhash_t *out;      // by target
+  zhash_t *sessions; // the same, by session
+  zhash_t *in;       // by source and session
+  int acks_due;
+};
+typedef struct _reliable reliable_t;
+
+reliable_t *reliable_new();
+void reliable_destroy(reliable_t **self_p);
+rel_out_t *reliable_out(reliable_t *self, const char *target);
+int reliable_expire(reliable_t *self, int64_t now, int idle);
+int reliable_queue(rel_out_t *out, const char *data, int len, uint32_t flags,
+                   uint64_t *seq);
+rel_out_t *reliable_ack(reliable_t *self, uint64_t session, uint64_t ack,
+                        int *acked);
+int reliable_accept(reliable_t *self, const char *source, uint64_t session,
+                    uint64_t seq, uint64_t base);
+#endif
@@ -0,0 +1,29 @@
+#ifndef _RETAIN_H_
+#define _RETAIN_H_
+#include <czmq.h>
+
+// The last retained publication on a topic, as it is sent to subscribers
+struct _retained {
+  char *pubtopic; // tenant, topic and scope
+  char *source;
+  char *topic;
+  zmsg_t *payload;
+};
+typedef struct _retained retained_t;
+
+// Retained publications by pubtopic, the oldest is dropped beyond max
+struct _retain {
+  zhash_t *entries;
+  // pubtopics, in the order they were first retained
+  zlist_t *order;
+  size_t max;
+  uint64_t bytes;
+};
+typedef struct _retain retain_t;
+
+retain_t *retain_new(size_t max);
+void retain_destroy(retain_t **self_p);
+int retain_put(retain_t *self, const char *pubtopic, const char *source,
+               const char *topic, zmsg_t *payload);
+zlist_t *retain_match(retain_t *self, const char *prefix);
+#endif
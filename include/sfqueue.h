@@ -0,0 +1,64 @@
+#ifndef _SFQUEUE_H_
+#define _SFQUEUE_H_
+#include <czmq.h>
+
+// How long a notification waits for its destination, in milliseconds
+#define DD_SFQ_TTL 60000
+// Bytes queued for a single destination
+#define DD_SFQ_BYTES (1024 * 1024)
+// Bytes held in memory for all destinations, beyond that notifications are
+// spilled to disk or refused
+#define DD_SFQ_MEMORY (64 * 1024 * 1024)
+// Destinations with notifications waiting, in all and per tenant
+#define DD_SFQ_DESTS 4096
+#define DD_SFQ_TENANT_DESTS 256
+// Clients that unregistered and may be queued for, beyond that the oldest
+// ones get NODST
+#define DD_SFQ_GONE 65536
+
+// A notification waiting for its destination, in memory or spilled
+struct _sfq_msg {
+  char *src;
+  int64_t expires;
+  size_t size;
+  zmsg_t *payload; // NULL if it was spilled
+  size_t off;      // where it is in the spill file
+  size_t len;
+};
+typedef struct _sfq_msg sfq_msg_t;
+
+// Notifications for one destination, oldest first. Once one of them is
+// spilled the file is mapped until the destination is drained.
+struct _sfq_dest {
+  char *dst;
+  zlist_t *msgs;
+  size_t bytes, mem;
+  char *path;
+  unsigned char *map;
+  size_t size, used;
+};
+typedef struct _sfq_dest sfq_dest_t;
+
+struct _sfqueue {
+  zhash_t *dests;
+  zhash_t *tenants; // destinations per tenant, the part before the dot
+  // clients that unregistered, until when notifications for them are held
+  zhash_t *gone;
+  size_t max, max_bytes;
+  int ttl, tenant_max_dests;
+  char *spill_dir;
+  size_t mem;
+  uint64_t drops;
+};
+typedef struct _sfqueue sfqueue_t;
+
+sfqueue_t *sfqueue_new(size_t max);
+void sfqueue_destroy(sfqueue_t **self_p);
+int sfqueue_put(sfqueue_t *self, const char *src, const char *dst,
+                zmsg_t *payload);
+void sfqueue_gone(sfqueue_t *self, const char *dst, int64_t now);
+sfq_dest_t *sfqueue_take(sfqueue_t *self, const char *dst);
+zmsg_t *sfqueue_payload(sfq_dest_t *dest, sfq_msg_t *msg);
+void sfqueue_dest_free(sfq_dest_t **dest_p);
+int sfqueue_expire(sfqueue_t *self, int64_t now);
+#endif
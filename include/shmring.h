@@ -0,0 +1,52 @@
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Size of the ring a client on ipc:// sets up for its payloads
+#define DD_SHM_SIZE (8 * 1024 * 1024)
+// Smaller payloads go through ZMQ as before
+#define DD_SHM_MIN 4096
+#define DD_SHM_NAME 64
+// Rings of other clients a client keeps mapped
+#define DD_SHM_PEERS 64
+
+// Record states, in the record header in shared memory
+#define SHM_REC_BUSY 1 // written, waiting for the reader
+#define SHM_REC_FREE 2 // released by the reader
+#define SHM_REC_PAD 3  // filler up to the end of the ring
+
+// Start of the shared memory segment, followed by the records
+struct _shmring_hdr {
+  uint32_t magic;
+  uint32_t unused;
+  uint64_t size;
+  // absolute positions, only moved by the owner
+  uint64_t head, tail;
+};
+
+// A mapping of a ring, either created by its owner, who writes the
+// records, or opened by a peer that reads and releases them
+struct _shmring {
+  char name[DD_SHM_NAME];
+  struct _shmring_hdr *hdr;
+  unsigned char *data;
+  // copied from the header when mapped, peers don't trust later changes
+  uint64_t size;
+  int owner;
+  // who may map it, see shmring_shared
+  uid_t uid;
+  gid_t gid;
+  int group;
+};
+typedef struct _shmring shmring_t;
+
+shmring_t *shmring_create(const char *name, size_t size, int gid);
+shmring_t *shmring_open(const char *name, int gid);
+int shmring_shared(shmring_t *self, shmring_t *peer);
+void shmring_destroy(shmring_t **self_p);
+void *shmring_reserve(shmring_t *self, size_t len, uint64_t *off);
+void *shmring_get(shmring_t *self, uint64_t off, size_t len);
+void shmring_release(shmring_t *self, uint64_t off, size_t len);
+#endif
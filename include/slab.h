@@ -0,0 +1,40 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+#include <urcu.h>
+#include <czmq.h>
+
+// Objects carved out of each chunk, and objects per call_rcu batch
+#define SLAB_CHUNK 256
+#define SLAB_BATCH 64
+
+// Called on an object before its memory is reused, to release what it
+// points to
+typedef void(slab_fini_fn)(void *obj);
+
+struct _slab_batch;
+
+// Cache of fixed size objects, used by a single thread except for the
+// call_rcu callbacks that hand reclaimed objects back
+struct _slab {
+  size_t size;
+  slab_fini_fn *fini;
+  // free objects, linked through their first word
+  void *free_list;
+  // objects reclaimed after a grace period, pushed by call_rcu callbacks
+  void *reclaimed;
+  // objects waiting to be handed to call_rcu
+  struct _slab_batch *batch;
+  // objects handed to call_rcu and not yet reclaimed
+  unsigned long waiting;
+  zlist_t *chunks;
+  size_t in_use;
+};
+typedef struct _slab slab_t;
+
+slab_t *slab_new(size_t size, slab_fini_fn *fini);
+void slab_destroy(slab_t **self_p);
+void *slab_alloc(slab_t *self);
+void slab_free(slab_t *self, void *obj);
+void slab_free_rcu(slab_t *self, void *obj);
+void slab_flush(slab_t *self);
+#endif
@@ -15,6 +15,7 @@ int sublist_delete(dd_t *self, char *topic, char *scope);
 void sublist_activate(dd_t *self, char *topic, char *scope);
 void sublist_deactivate_all(dd_t *self);
 void sublist_print(dd_t *self);
+zhashx_t *dd_get_subindex(dd_t *self);
 #endif
 #ifdef __cplusplus
 }
@@ -123,6 +123,12 @@ int nn_trie_subscribe(struct nn_trie *self, const uint8_t *data,
 int nn_trie_unsubscribe(struct nn_trie *self, const uint8_t *data,
                         size_t size, zframe_t *, uint8_t dir);
 
+/*  Remove the sockid from all of the n strings, which have to be sorted.
+    Parts of the trie shared between the strings are visited only once.
+    Returns the number of subscriptions removed. */
+int nn_trie_unsubscribe_many(struct nn_trie *self, char **topics, int n,
+                             zframe_t *sockid);
+
 /*  Checks the supplied string. If it matches it returns 1, if it does not
     it returns 0. */
 int nn_trie_match(struct nn_trie *self, const uint8_t *data, size_t size);
@@ -61,6 +61,7 @@ void usage() {
       "-d [ADDR]\n"
       "       For example tcp://1.2.3.4:5555\n"
       "       Dealer should be connected to Router of another broker\n"
+      "       Standby parents with comma tcp://1.2.3.4:5555,tcp://1.2.3.5:5555\n"
       "-l [CHAR]\n"
       "       e:ERROR,w:WARNING,n:NOTICE,i:INFO,d:DEBUG,q:QUIET\n"
       "-w [ADDR]\n"
@@ -94,7 +95,63 @@ int get_config(dd_broker_t *self, char *conffile) {
   zconfig_t *child = zconfig_child(root);
   while (child != NULL) {
     if (streq(zconfig_name(child), "dealer")) {
-      dd_broker_set_dealer(self, zconfig_value(child));
+      dd_broker_add_dealer(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "shard")) {
+      dd_broker_add_shard(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "shortcut")) {
+      dd_broker_set_shortcut(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "nodst_ttl")) {
+      dd_broker_set_nodst_ttl(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "nodst_max")) {
+      dd_broker_set_nodst_max(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "flow_window")) {
+      dd_broker_set_flow_window(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "flow_backlog")) {
+      dd_broker_set_flow_backlog(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "flow_tenant_backlog")) {
+      dd_broker_set_flow_tenant_backlog(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "flow_policy")) {
+      dd_broker_set_flow_policy(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "ticket_lifetime")) {
+      dd_broker_set_ticket_lifetime(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "admit_max")) {
+      dd_broker_set_admit_max(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "admit_rate")) {
+      dd_broker_set_admit_rate(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "admit_queue")) {
+      dd_broker_set_admit_queue(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "tenant_max_clients")) {
+      dd_broker_set_tenant_max_clients(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "tenant_max_subs")) {
+      dd_broker_set_tenant_max_subs(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "tenant_max_bytes")) {
+      dd_broker_set_tenant_max_bytes(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "plaintext")) {
+      dd_broker_set_plaintext(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "shm_group")) {
+      dd_broker_set_shm_group(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "retain")) {
+      dd_broker_set_retain(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "log_dir")) {
+      dd_broker_set_log_dir(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "log_segment")) {
+      dd_broker_set_log_segment(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "log_segments")) {
+      dd_broker_set_log_segments(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "log_topics")) {
+      dd_broker_set_log_topics(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "tenant_max_log_topics")) {
+      dd_broker_set_tenant_max_log_topics(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "queue_max")) {
+      dd_broker_set_queue_max(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "queue_bytes")) {
+      dd_broker_set_queue_bytes(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "queue_ttl")) {
+      dd_broker_set_queue_ttl(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "queue_dests")) {
+      dd_broker_set_queue_dests(self, zconfig_value(child));
+    } else if (streq(zconfig_name(child), "queue_spill")) {
+      dd_broker_set_queue_spill(self, zconfig_value(child));
     } else if (streq(zconfig_name(child), "scope")) {
       dd_broker_set_scope(self, zconfig_value(child));
     } else if (streq(zconfig_name(child), "router")) {
@@ -0,0 +1,88 @@
+/*
+ * flow_test.c --- checks the window arithmetic of flow control
+ *
+ * The broker's sent count and the client's consumed count are uint32_t
+ * that wrap, and the client's may run ahead (messages the broker sent
+ * around flow control) or start over (REGOK). Neither may leave the client
+ * without credit for good. Run by make check.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "flow.h"
+
+#define WINDOW DD_FLOW_WINDOW
+
+static int s_room(uint32_t sent, uint32_t acked) {
+  return flow_inflight(sent, acked) < WINDOW;
+}
+
+static void test_wrap() {
+  // sent wrapped past 0, acked didn't yet
+  uint32_t acked = UINT32_MAX - 10;
+  uint32_t sent = acked + 20;
+  assert(flow_inflight(sent, acked) == 20);
+  assert(s_room(sent, acked));
+  sent = acked + WINDOW;
+  assert(!s_room(sent, acked));
+  flow_account(&sent, &acked, UINT32_MAX - 10 + 500);
+  assert(acked == UINT32_MAX - 10 + 500);
+  assert(flow_inflight(sent, acked) == WINDOW - 500);
+  assert(s_room(sent, acked));
+}
+
+static void test_ahead() {
+  // the client counted messages we didn't, it still gets credit
+  uint32_t sent = 100, acked = 90;
+  flow_account(&sent, &acked, 105);
+  assert(sent == 100 && acked == 100);
+  assert(s_room(sent, acked));
+
+  // the same across the wrap
+  sent = 3;
+  acked = UINT32_MAX - 3;
+  flow_account(&sent, &acked, 10);
+  assert(sent == 3 && acked == 3);
+
+  // and from there on it is limited again
+  sent += WINDOW;
+  assert(!s_room(sent, acked));
+
+  // even if it got ahead before the check, in flight is negative
+  assert(flow_inflight(100, 105) < 0);
+  assert(s_room(100, 105));
+}
+
+static void test_restart() {
+  // REGOK reset the client's count to 0
+  uint32_t sent = 5000, acked = 4000;
+  assert(!s_room(sent, acked));
+  flow_account(&sent, &acked, 0);
+  assert(sent == 0 && acked == 0 && s_room(sent, acked));
+  // and both count up from there
+  sent += WINDOW;
+  assert(!s_room(sent, acked));
+  flow_account(&sent, &acked, 64);
+  assert(acked == 64 && s_room(sent, acked));
+}
+
+static void test_normal() {
+  uint32_t sent = 0, acked = 0;
+  int i;
+  for (i = 0; i < WINDOW; i++)
+    sent++;
+  assert(!s_room(sent, acked));
+  flow_account(&sent, &acked, 64);
+  assert(sent == WINDOW && acked == 64 && s_room(sent, acked));
+  flow_account(&sent, &acked, 64);
+  assert(sent == WINDOW && acked == 64);
+}
+
+int main(int argc, char **argv) {
+  test_wrap();
+  test_ahead();
+  test_restart();
+  test_normal();
+  printf("flow_test: OK\n");
+  return 0;
+}
@@ -51,6 +51,7 @@ static int s_on_pubN_msg(zloop_t *loop, zsock_t *handle, void *arg);
 static int s_on_pubS_msg(zloop_t *loop, zsock_t *handle, void *arg);
 static int s_on_router_msg(zloop_t *loop, zsock_t *handle, void *arg);
 static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *arg);
+static int s_on_standby_msg(zloop_t *loop, zsock_t *handle, void *arg);
 static int s_register(zloop_t *loop, int timer_id, void *arg);
 static int s_heartbeat(zloop_t *loop, int timer_id, void *arg);
 static int s_check_cli_timeout(zloop_t *loop, int timer_fd, void *arg);
@@ -59,23 +60,48 @@ static int s_check_br_timeout(zloop_t *loop, int timer_fd, void *arg);
 static void s_cb_high_error(dd_broker_t *self, zmsg_t *msg);
 static void s_cb_addbr(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg);
 static void s_cb_addlcl(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg);
+static void s_send_chall(dd_broker_t *self, zframe_t *sockid,
+                         ddtenant_t *ten);
+static void s_admit_enqueue(dd_broker_t *self, zframe_t *sockid, char *hash);
 static void s_cb_adddcl(dd_broker_t *self, zframe_t *sockid,
                         zframe_t *cookie_frame, zmsg_t *msg);
-static void s_cb_chall(dd_broker_t *self, zmsg_t *msg);
+static void s_cb_activate(dd_broker_t *self, zframe_t *sockid,
+                          zframe_t *cookie_frame);
+static void s_cli_up(dd_broker_t *self, char *prefix_name, int distance,
+                     uint32_t takeover);
+static void s_cb_chall(dd_broker_t *self, zsock_t *sock, zframe_t **broker_id,
+                       char *role, zmsg_t *msg);
 static void s_cb_challok(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg);
+static void s_cb_resume(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg);
 static void s_cb_forward_dsock(dd_broker_t *self, zmsg_t *msg);
-static void s_cb_forward_rsock(dd_broker_t *self, zframe_t *sockid,
-                               zframe_t *cookie_frame, zmsg_t *msg);
+static void s_cb_forward_rsock(dd_broker_t *self, dd_rmsg_t *msg);
 static void s_cb_nodst_dsock(dd_broker_t *self, zmsg_t *msg);
 static void s_cb_nodst_rsock(dd_broker_t *self, zmsg_t *msg);
-static void s_cb_pub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
-                     zmsg_t *msg);
+static void s_cb_pub(dd_broker_t *self, dd_rmsg_t *msg);
 static void s_cb_ping(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie);
+static void s_cb_credit(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
+                        zmsg_t *msg);
 static void s_cb_regok(dd_broker_t *self, zmsg_t *msg);
-static void s_cb_send(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
-                      zmsg_t *msg);
+static void s_cb_send(dd_broker_t *self, dd_rmsg_t *msg, int pt, int shm);
 static void s_cb_sub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
                      zmsg_t *msg);
+static void s_cb_submany(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
+                         zmsg_t *msg);
+static void s_subscribe(dd_broker_t *self, zframe_t *sockid, local_client *ln,
+                        char *topic, char *scopestr, zmsg_t *subok,
+                        zlist_t *fresh);
+static void s_send_retained(dd_broker_t *self, zframe_t *sockid,
+                            zlist_t *fresh);
+static int s_retain(dd_broker_t *self, char *pubtopic, char *source,
+                    char *topic, zmsg_t *payload);
+static void s_pass_retained(dd_broker_t *self, zsock_t *pub, zframe_t *pathv,
+                            zframe_t *topic_frame);
+static zmsg_t *s_log(dd_broker_t *self, char *pubtopic, char *source,
+                     char *topic, zmsg_t *payload);
+static void s_cb_replay(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
+                        zmsg_t *msg);
+static int s_queue(dd_broker_t *self, char *src, char *dst, zmsg_t *payload);
+static void s_drain_queued(dd_broker_t *self, char *dst);
 static void s_cb_unreg_br(dd_broker_t *self, char *name, zmsg_t *msg);
 static void s_cb_unreg_cli(dd_broker_t *self, zframe_t *sockid,
                            zframe_t *cookie, zmsg_t *msg);
@@ -83,7 +109,23 @@ static void s_cb_unreg_dist_cli(dd_broker_t *self, zframe_t *sockid,
                                 zframe_t *cookie_frame, zmsg_t *msg);
 static void s_cb_unsub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
                        zmsg_t *msg);
+static void s_cb_unsubmany(dd_broker_t *self, zframe_t *sockid,
+                           zframe_t *cookie, zmsg_t *msg);
+static void s_unsubscribe(dd_broker_t *self, zframe_t *sockid,
+                          local_client *ln, char *topic, char *scopestr);
 static void s_self_destroy(dd_broker_t **self_p);
+static void s_standby_start(dd_broker_t *self);
+static void s_standby_stop(dd_broker_t *self);
+static void s_failover(dd_broker_t *self);
+static void s_shard_start(dd_broker_t *self);
+static int s_on_shard_msg(zloop_t *loop, zsock_t *handle, void *arg);
+static void s_shard_move(dd_broker_t *self, int shard, int up);
+static zsock_t *s_shard_sock(dd_broker_t *self, char *name);
+static int s_is_root(dd_broker_t *self);
+static void s_cb_route(dd_broker_t *self, zmsg_t *msg);
+static void s_shortcut_hint(dd_broker_t *self, zframe_t *sockid,
+                            char *dst_string, dist_client *dn);
+static void s_shortcut_heartbeat(dd_broker_t *self);
 void print_ddbrokerkeys(ddbrokerkeys_t *keys);
 void dest_invalid_rsock(dd_broker_t *self, zframe_t *sockid, char *src_string,
                         char *dst_string);
@@ -140,6 +182,7 @@ static void s_cb_high_error(dd_broker_t *self, zmsg_t *msg) {
     char *dst_string = zmsg_popstr(msg);
     // source of failing command
     char *src_string = zmsg_popstr(msg);
+    hashtable_insert_nodst(self, dst_string);
 
     // Check if src_string is a local client
     if ((ln = hashtable_has_rev_local_node(self, src_string, 0))) {
@@ -166,14 +209,13 @@ static void s_cb_high_error(dd_broker_t *self, zmsg_t *msg) {
     if ((ln = hashtable_has_rev_local_node(self, cli_name, 0))) {
       dd_info(" - Removed local client: %s", ln->prefix_name);
       int a = remove_subscriptions(self, ln->sockid);
+      ln->ten->subscriptions -= a;
+      flow_remove(self, ln->sockid);
       dd_info("   - Removed %d subscriptions", a);
       hashtable_unlink_local_node(self, ln->sockid, ln->cookie);
       hashtable_unlink_rev_local_node(self, ln->prefix_name);
       remote_reg_failed(self, ln->sockid, "remote");
-      zframe_destroy(&ln->sockid);
-      free(ln->prefix_name);
-      free(ln->name);
-      free(ln);
+      hashtable_free_local_node(self, ln);
     } else if ((dn = hashtable_has_dist_node(self, cli_name))) {
       dd_info(" - Removed distant client: %s", cli_name);
       remote_reg_failed(self, dn->broker, cli_name);
@@ -240,6 +282,274 @@ cleanup:
     free(ciphertext);
 }
 
+/** Session tickets
+ * A ticket is nonce | secretbox(expiry | cookie | client name) under a key
+ * only the broker knows. It shows the client passed the challenge for this
+ * tenant and name before, so it can skip it. REGOK hands the client the
+ * ticket along with a key derived from it, boxed to the tenant like the
+ * challenge. RESUME carries the ticket and the time, authenticated with
+ * that key, so a ticket seen on the wire is of no use to anyone else and
+ * a RESUME can't be replayed.
+ */
+#define DD_TICKET_HEADER (sizeof(int64_t) + sizeof(uint64_t))
+
+// The key the holder of ticket authenticates RESUME with
+static void s_ticket_auth_key(dd_broker_t *self, const unsigned char *ticket,
+                              size_t len, unsigned char *key) {
+  crypto_generichash(key, crypto_auth_KEYBYTES, ticket, len, self->ticket_key,
+                     sizeof(self->ticket_key));
+}
+
+static zframe_t *s_ticket_new(dd_broker_t *self, ddtenant_t *ten,
+                              char *client_name) {
+  if (self->ticket_lifetime <= 0)
+    return NULL;
+  size_t namelen = strlen(client_name);
+  size_t plainlen = DD_TICKET_HEADER + namelen;
+  unsigned char *plain = malloc(plainlen);
+  int64_t expires = zclock_time() / 1000 + self->ticket_lifetime;
+  memcpy(plain, &expires, sizeof(expires));
+  memcpy(plain + sizeof(expires), &ten->cookie, sizeof(ten->cookie));
+  memcpy(plain + DD_TICKET_HEADER, client_name, namelen);
+
+  // the ticket followed by its key, for the client only
+  size_t ticketlen =
+      crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + plainlen;
+  size_t innerlen = ticketlen + crypto_auth_KEYBYTES;
+  unsigned char *inner = malloc(innerlen);
+  randombytes_buf(inner, crypto_secretbox_NONCEBYTES);
+  crypto_secretbox_easy(inner + crypto_secretbox_NONCEBYTES, plain, plainlen,
+                        inner, self->ticket_key);
+  free(plain);
+  s_ticket_auth_key(self, inner, ticketlen, inner + ticketlen);
+
+  zframe_t *boxed =
+      zframe_new(NULL, crypto_box_NONCEBYTES + crypto_box_MACBYTES + innerlen);
+  unsigned char *dest = zframe_data(boxed);
+  nonce_increment((unsigned char *)self->nonce, crypto_box_NONCEBYTES);
+  memcpy(dest, self->nonce, crypto_box_NONCEBYTES);
+  crypto_box_easy_afternm(dest + crypto_box_NONCEBYTES, inner, innerlen, dest,
+                          (const unsigned char *)ten->boxk);
+  sodium_memzero(inner, innerlen);
+  free(inner);
+  return boxed;
+}
+
+// Returns the client name if the ticket is valid for the tenant, else NULL
+static char *s_ticket_open(dd_broker_t *self, ddtenant_t *ten,
+                           zframe_t *ticket) {
+  size_t overhead = crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES;
+  size_t len = zframe_size(ticket);
+  if (self->ticket_lifetime <= 0 || len <= overhead + DD_TICKET_HEADER ||
+      len > overhead + DD_TICKET_HEADER + MAXTENANTNAME)
+    return NULL;
+
+  size_t plainlen = len - overhead;
+  unsigned char *plain = malloc(plainlen + 1);
+  unsigned char *data = zframe_data(ticket);
+  char *client_name = NULL;
+  int64_t expires;
+  uint64_t cookie;
+  if (crypto_secretbox_open_easy(plain, data + crypto_secretbox_NONCEBYTES,
+                                 len - crypto_secretbox_NONCEBYTES, data,
+                                 self->ticket_key) != 0)
+    goto cleanup;
+  memcpy(&expires, plain, sizeof(expires));
+  memcpy(&cookie, plain + sizeof(expires), sizeof(cookie));
+  if (expires < zclock_time() / 1000 || cookie != ten->cookie)
+    goto cleanup;
+  plain[plainlen] = '\0';
+  client_name = strdup((char *)plain + DD_TICKET_HEADER);
+cleanup:
+  free(plain);
+  return client_name;
+}
+
+// Forgets proofs of RESUMEs that are too old to be accepted anyway, at
+// most once a second
+static void s_resume_sweep(dd_broker_t *self, int64_t now) {
+  if (now - self->resume_swept < 1000)
+    return;
+  self->resume_swept = now;
+  zlist_t *keys = zhash_keys(self->resume_seen);
+  char *key = zlist_first(keys);
+  while (key) {
+    int64_t *expires = zhash_lookup(self->resume_seen, key);
+    if (*expires < now)
+      zhash_delete(self->resume_seen, key);
+    key = zlist_next(keys);
+  }
+  zlist_destroy(&keys);
+}
+
+// Whether the sender of RESUME holds the key of ticket: mac authenticates
+// the time it was sent along with the ticket, that time is recent and the
+// same proof wasn't accepted before
+static int s_resume_proven(dd_broker_t *self, zframe_t *ticket,
+                           zframe_t *stamp, zframe_t *mac) {
+  if (stamp == NULL || mac == NULL || zframe_size(stamp) != sizeof(int64_t) ||
+      zframe_size(mac) != crypto_auth_BYTES)
+    return 0;
+  int64_t sent, now = zclock_time();
+  memcpy(&sent, zframe_data(stamp), sizeof(sent));
+  if (sent < now - DD_RESUME_WINDOW || sent > now + DD_RESUME_WINDOW)
+    return 0;
+
+  unsigned char key[crypto_auth_KEYBYTES];
+  s_ticket_auth_key(self, zframe_data(ticket), zframe_size(ticket), key);
+  size_t len = sizeof(sent) + zframe_size(ticket);
+  unsigned char *authed = malloc(len);
+  memcpy(authed, &sent, sizeof(sent));
+  memcpy(authed + sizeof(sent), zframe_data(ticket), zframe_size(ticket));
+  int ok = crypto_auth_verify(zframe_data(mac), authed, len, key) == 0;
+  free(authed);
+  sodium_memzero(key, sizeof(key));
+  if (!ok)
+    return 0;
+
+  s_resume_sweep(self, now);
+  char *hex = zframe_strhex(mac);
+  if (zhash_lookup(self->resume_seen, hex)) {
+    free(hex);
+    return 0;
+  }
+  int64_t *expires = malloc(sizeof(int64_t));
+  *expires = sent + DD_RESUME_WINDOW;
+  zhash_insert(self->resume_seen, hex, expires);
+  zhash_freefn(self->resume_seen, hex, free);
+  free(hex);
+  return 1;
+}
+
+// The tenant's cipher suite, -1 if the tenant has none configured and -2
+// if the client doesn't support it. Clients open what others in the tenant
+// sealed, on this broker or another one, so all of them use the first
+// suite configured rather than the first one each of them supports.
+static int s_pick_suite(ddtenant_t *ten, uint32_t offered) {
+  if (ten->nsuites == 0)
+    return -1;
+  if (offered & (1 << ten->suites[0]))
+    return ten->suites[0];
+  return -2;
+}
+
+// Cipher suites offered by the client at the end of CHALLOK or RESUME,
+// older clients don't offer any
+static uint32_t s_pop_suites(zmsg_t *msg) {
+  uint32_t offered = 0;
+  zframe_t *frame = zmsg_pop(msg);
+  if (frame && zframe_size(frame) == sizeof(offered))
+    memcpy(&offered, zframe_data(frame), sizeof(offered));
+  zframe_destroy(&frame);
+  return offered;
+}
+
+// Whether a local client other than ln passes payloads through the ring
+static int s_ring_claimed(dd_broker_t *self, const char *name,
+                          local_client *ln) {
+  struct cds_lfht_iter iter;
+  local_client *np;
+  int claimed = 0;
+  rcu_read_lock();
+  cds_lfht_for_each_entry(self->lcl_cli_ht, &iter, np, lcl_node) {
+    if (np != ln && np->shm && streq(np->shm->name, name)) {
+      claimed = 1;
+      break;
+    }
+  }
+  rcu_read_unlock();
+  return claimed;
+}
+
+// Register an authenticated local client and hand it a fresh ticket, the
+// cipher suite to use within its tenant if the tenant has any, whether it
+// may skip encryption and whether the broker mapped its shared memory ring
+static void s_admit_local(dd_broker_t *self, zframe_t *sockid,
+                          ddtenant_t *ten, char *client_name,
+                          uint32_t offered, char *ring) {
+  int suite = s_pick_suite(ten, offered);
+  if (suite == -2) {
+    dd_warning("%s.%s doesn't support cipher suite %s, refusing it",
+               ten->name, client_name, dd_suite_name(ten->suites[0]));
+    zsock_send(self->rsock, "fbbbs", sockid, &dd_version, 4, &dd_cmd_error, 4,
+               &dd_error_regfail, 4, "cipher suite not supported");
+    return;
+  }
+  if (self->tenant_max_clients > 0 &&
+      ten->clients >= self->tenant_max_clients) {
+    dd_warning("Tenant %s is at its client quota, refusing %s", ten->name,
+               client_name);
+    zsock_send(self->rsock, "fbbbs", sockid, &dd_version, 4, &dd_cmd_error, 4,
+               &dd_error_quota, 4, "client quota exceeded");
+    return;
+  }
+  int retval = insert_local_client(self, sockid, ten, client_name);
+  if (retval == -1) {
+    // TODO: send error message
+    remote_reg_failed(self, sockid, "local");
+    return;
+  }
+  char prefix_name[MAXTENANTNAME];
+  snprintf(prefix_name, MAXTENANTNAME, "%s.%s", ten->name, client_name);
+  uint32_t plaintext = 0;
+  uint32_t shm = 0;
+  local_client *ln = hashtable_has_rev_local_node(self, prefix_name, 0);
+  if (ln && (offered & DD_OFFER_PLAINTEXT) && self->router_ipc_only &&
+      self->plaintext_tenants &&
+      zhash_lookup(self->plaintext_tenants, ten->name))
+    plaintext = ln->plaintext = 1;
+  if (ln && ring && strncmp(ring, "/dd-", 4) == 0) {
+    shmring_destroy(&ln->shm);
+    if (s_ring_claimed(self, ring, ln)) {
+      dd_warning("%s offered %s, the ring of another client", prefix_name,
+                 ring);
+    } else if ((ln->shm = shmring_open(ring, self->shm_gid))) {
+      shm = 1;
+    } else {
+      dd_warning("Could not map the ring %s of %s", ring, prefix_name);
+    }
+  }
+  zframe_t *ticket = s_ticket_new(self, ten, client_name);
+  if (suite >= 0 || plaintext || shm) {
+    // the suite (-1 for none), plaintext and shared memory flags follow the
+    // ticket, which is empty if there is none
+    int32_t chosen = suite;
+    if (ticket == NULL)
+      ticket = zframe_new_empty();
+    zsock_send(self->rsock, "fbbbfbbb", sockid, &dd_version, 4, &dd_cmd_regok,
+               4, &ten->cookie, sizeof(ten->cookie), ticket, &chosen,
+               sizeof(chosen), &plaintext, sizeof(plaintext), &shm,
+               sizeof(shm));
+  } else if (ticket) {
+    zsock_send(self->rsock, "fbbbf", sockid, &dd_version, 4, &dd_cmd_regok, 4,
+               &ten->cookie, sizeof(ten->cookie), ticket);
+  } else {
+    zsock_send(self->rsock, "fbbb", sockid, &dd_version, 4, &dd_cmd_regok, 4,
+               &ten->cookie, sizeof(ten->cookie));
+  }
+  zframe_destroy(&ticket);
+  dd_info(" + Added local client: %s.%s", ten->name, client_name);
+  if (suite >= 0)
+    dd_debug("%s.%s uses cipher suite %s", ten->name, client_name,
+             dd_suite_name(suite));
+  if (plaintext)
+    dd_info("%s exchanges plaintext within its tenant", prefix_name);
+  if (shm)
+    dd_debug("%s passes payloads through %s", prefix_name, ring);
+  if (self->state != DD_STATE_ROOT)
+    add_cli_up(self, prefix_name, 0);
+  s_drain_queued(self, prefix_name);
+}
+
+// The optional ring name after the suites, see s_admit_local
+static void s_admit_offer(dd_broker_t *self, zframe_t *sockid,
+                          ddtenant_t *ten, char *client_name, zmsg_t *msg) {
+  uint32_t offered = s_pop_suites(msg);
+  char *ring = zmsg_size(msg) > 0 ? zmsg_popstr(msg) : NULL;
+  s_admit_local(self, sockid, ten, client_name, offered, ring);
+  free(ring);
+}
+
 static void s_cb_addlcl(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
 #ifdef DEBUG
   dd_debug("s_cb_addlcl called");
@@ -252,10 +562,24 @@ static void s_cb_addlcl(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
     dd_error("Error, got ADDLCL without hash!");
     return;
   }
+  // don't let a registration storm run the broker out of crypto, clients
+  // beyond admit_max challenges wait in line
+  if (self->admit_max > 0 &&
+      (zlist_size(self->admit_queue) > 0 ||
+       zhash_size(self->chall_pending) >= (size_t)self->admit_max)) {
+    s_admit_enqueue(self, sockid, hash);
+    free(hash);
+    return;
+  }
   ddtenant_t *ten;
 
   ten = zhash_lookup(self->keys->tenantkeys, hash);
   free(hash);
+  s_send_chall(self, sockid, ten);
+}
+
+static void s_send_chall(dd_broker_t *self, zframe_t *sockid,
+                         ddtenant_t *ten) {
   if (ten == NULL) {
     dd_error("Could not find key for client");
     zsock_send(self->rsock, "fbbbs", sockid, &dd_version, 4, &dd_cmd_error, 4,
@@ -282,7 +606,76 @@ static void s_cb_addlcl(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
   free(ciphertext);
   if (retval != 0) {
     dd_error("Error sending challenge!");
+    return;
+  }
+  if (self->admit_max > 0) {
+    char *key = zframe_strhex(sockid);
+    int64_t *expires = malloc(sizeof(int64_t));
+    *expires = zclock_mono() + DD_CHALL_TIMEOUT;
+    zhash_update(self->chall_pending, key, expires);
+    zhash_freefn(self->chall_pending, key, free);
+    free(key);
+  }
+}
+
+static int s_admit(zloop_t *loop, int timer_id, void *arg) {
+  dd_broker_t *self = arg;
+  int64_t now = zclock_mono();
+
+  // forget challenges that were never answered
+  zlist_t *keys = zhash_keys(self->chall_pending);
+  char *key = zlist_first(keys);
+  while (key) {
+    int64_t *expires = zhash_lookup(self->chall_pending, key);
+    if (*expires < now)
+      zhash_delete(self->chall_pending, key);
+    key = zlist_next(keys);
+  }
+  zlist_destroy(&keys);
+
+  int budget = self->admit_rate * DD_ADMIT_TICK / 1000;
+  if (budget < 1)
+    budget = 1;
+  zmsg_t *m;
+  while (budget > 0 &&
+         zhash_size(self->chall_pending) < (size_t)self->admit_max &&
+         (m = zlist_pop(self->admit_queue))) {
+    zframe_t *sockid = zmsg_pop(m);
+    zframe_t *queued = zmsg_pop(m);
+    char *hash = zmsg_popstr(m);
+    // the client has most likely given up and reconnected by now
+    if (*(int64_t *)zframe_data(queued) + DD_CHALL_TIMEOUT >= now) {
+      s_send_chall(self, sockid, zhash_lookup(self->keys->tenantkeys, hash));
+      budget--;
+    }
+    free(hash);
+    zframe_destroy(&queued);
+    zframe_destroy(&sockid);
+    zmsg_destroy(&m);
+  }
+
+  if (zlist_size(self->admit_queue) == 0) {
+    zloop_timer_end(loop, self->admit_loop);
+    self->admit_loop = -1;
+  }
+  return 0;
+}
+
+static void s_admit_enqueue(dd_broker_t *self, zframe_t *sockid, char *hash) {
+  if (zlist_size(self->admit_queue) >= (size_t)self->admit_queue_max) {
+    // the client will try again after its backoff
+    self->admit_drops++;
+    return;
   }
+  int64_t now = zclock_mono();
+  zmsg_t *m = zmsg_new();
+  zmsg_addmem(m, zframe_data(sockid), zframe_size(sockid));
+  zmsg_addmem(m, &now, sizeof(now));
+  zmsg_addstr(m, hash);
+  zlist_append(self->admit_queue, m);
+  if (self->admit_loop == -1)
+    self->admit_loop =
+        zloop_timer(self->loop, DD_ADMIT_TICK, 0, s_admit, self);
 }
 
 static void s_cb_adddcl(dd_broker_t *self, zframe_t *sockid,
@@ -294,7 +687,8 @@ static void s_cb_adddcl(dd_broker_t *self, zframe_t *sockid,
   zmsg_print(msg);
 #endif
   uint64_t *cookie = (uint64_t *)zframe_data(cookie_frame);
-  if (hashtable_has_local_broker(self, sockid, *cookie, 0) == NULL) {
+  local_broker *br = hashtable_has_local_broker(self, sockid, *cookie, 0);
+  if (br == NULL) {
     dd_warning("Got ADDDCL from unregistered broker...");
     return;
   }
@@ -303,37 +697,104 @@ static void s_cb_adddcl(dd_broker_t *self, zframe_t *sockid,
   char *name = zmsg_popstr(msg);
   zframe_t *dist_frame = zmsg_pop(msg);
   int *dist = (int *)zframe_data(dist_frame);
+  // set when a standby took the client over from a broker that failed
+  uint32_t takeover = 0;
+  zframe_t *takeover_frame = zmsg_pop(msg);
+  if (takeover_frame && zframe_size(takeover_frame) == sizeof(takeover))
+    memcpy(&takeover, zframe_data(takeover_frame), sizeof(takeover));
+  zframe_destroy(&takeover_frame);
   // does name exist in local hashtable?
   local_client *ln;
 
   if ((ln = hashtable_has_rev_local_node(self, name, 0))) {
     dd_info(" - Local client '%s' already exists!", name);
-    remote_reg_failed(self, sockid, name);
+    if (!br->standby)
+      remote_reg_failed(self, sockid, name);
     free(name);
 
-  } else if ((dn = hashtable_has_dist_node(self, name))) {
+  } else if ((dn = hashtable_has_dist_node(self, name)) &&
+             (takeover || zframe_eq(dn->broker, sockid))) {
+    // We reached it through the broker that failed, or we already reach
+    // it through this one. Brokers above us still reach it through us, so
+    // the route only changes here and nothing goes up.
+    dd_info(" + Moved remote client: %s (%d)", name, *dist);
+    hashtable_remove_dist_node(self, name);
+    hashtable_insert_dist_node(self, name, sockid, *dist);
+    free(name);
+
+  } else if (dn) {
     dd_info(" - Remote client '%s' already exists!", name);
-    remote_reg_failed(self, sockid, name);
+    // a standby broker mirrors clients that may already be reachable
+    // through us, that is not an error
+    if (!br->standby)
+      remote_reg_failed(self, sockid, name);
     free(name);
 
   } else {
     hashtable_insert_dist_node(self, name, sockid, *dist);
     dd_info(" + Added remote client: %s (%d)", name, *dist);
-    add_cli_up(self, name, *dist);
+    // a takeover goes up until it reaches the broker that knew the old
+    // route
+    if (!br->standby)
+      s_cli_up(self, name, *dist, takeover);
+    s_drain_queued(self, name);
+    free(name);
   }
   zframe_destroy(&dist_frame);
 }
 
-static void s_cb_chall(dd_broker_t *self, zmsg_t *msg) {
+// A standby broker takes over, announce the clients it has mirrored to us.
+// The mirror was kept up to date, so nothing has to come from the standby.
+// Everything it mirrored goes up as a takeover, the closest broker above
+// that knew a client through the broker that failed moves it over to us
+// instead of refusing it, and only brokers below that one learn anything.
+static void s_cb_activate(dd_broker_t *self, zframe_t *sockid,
+                          zframe_t *cookie_frame) {
+#ifdef DEBUG
+  dd_debug("s_cb_activate called");
+  zframe_print(sockid, "sockid");
+#endif
+  uint64_t *cook = (uint64_t *)zframe_data(cookie_frame);
+  local_broker *br = hashtable_has_local_broker(self, sockid, *cook, 1);
+  if (br == NULL) {
+    dd_warning("Got ACTIVATE from unregistered broker...");
+    return;
+  }
+  if (!br->standby)
+    return;
+  br->standby = 0;
+
+  char buf[256];
+  dd_info(" + Standby broker %s activated", zframe_tostr(sockid, buf));
+
+  struct cds_lfht_iter iter;
+  dist_client *nd;
+  rcu_read_lock();
+  cds_lfht_first(self->dist_cli_ht, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  while (ht_node != NULL) {
+    rcu_read_unlock();
+    nd = caa_container_of(ht_node, dist_client, node);
+    if (zframe_eq(nd->broker, sockid))
+      s_cli_up(self, nd->name, nd->distance, 1);
+    rcu_read_lock();
+    cds_lfht_next(self->dist_cli_ht, &iter);
+    ht_node = cds_lfht_iter_get_node(&iter);
+  }
+  rcu_read_unlock();
+}
+
+static void s_cb_chall(dd_broker_t *self, zsock_t *sock, zframe_t **broker_id,
+                       char *role, zmsg_t *msg) {
   int retval = 0;
 #ifdef DEBUG
   dd_debug("s_cb_chall called");
   zmsg_print(msg);
 #endif
   zframe_t *encrypted = zmsg_pop(msg);
-  if (self->broker_id)
-    zframe_destroy(&self->broker_id);
-  self->broker_id = zmsg_pop(msg);
+  if (*broker_id)
+    zframe_destroy(broker_id);
+  *broker_id = zmsg_pop(msg);
   unsigned char *data = zframe_data(encrypted);
 
   int enclen = zframe_size(encrypted);
@@ -348,8 +809,12 @@ static void s_cb_chall(dd_broker_t *self, zmsg_t *msg) {
   }
   zframe_t *temp_frame = zframe_new(decrypted, enclen - crypto_box_NONCEBYTES -
                                                    crypto_box_MACBYTES);
-  zsock_send(self->dsock, "bbfss", &dd_version, 4, &dd_cmd_challok, 4,
-             temp_frame, self->keys->hash, "broker");
+  if (self->shortcut_connect && streq(role, "broker"))
+    zsock_send(sock, "bbfsss", &dd_version, 4, &dd_cmd_challok, 4,
+               temp_frame, self->keys->hash, role, self->shortcut_connect);
+  else
+    zsock_send(sock, "bbfss", &dd_version, 4, &dd_cmd_challok, 4, temp_frame,
+               self->keys->hash, role);
 cleanup:
   zframe_destroy(&temp_frame);
   zframe_destroy(&encrypted);
@@ -363,7 +828,6 @@ static void s_cb_challok(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
   zmsg_print(msg);
 #endif
 
-  int retval;
   zframe_t *cook = zmsg_pop(msg);
   uint64_t *cookie = (uint64_t *)zframe_data(cook);
   char *hash = zmsg_popstr(msg);
@@ -383,7 +847,10 @@ static void s_cb_challok(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
     }
     dd_debug("Authentication of broker %s successful!", client_name);
     if (NULL == hashtable_has_local_broker(self, sockid, *cookie, 0)) {
-      hashtable_insert_local_broker(self, sockid, *cookie);
+      local_broker *br = hashtable_insert_local_broker(self, sockid, *cookie);
+      br->standby = (strcmp(client_name, "standby") == 0);
+      if (zmsg_size(msg) > 0)
+        br->endpoint = zmsg_popstr(msg);
 
       const char *pubs_endpoint = zsock_endpoint(self->pubS);
       const char *subs_endpoint = zsock_endpoint(self->subS);
@@ -392,12 +859,18 @@ static void s_cb_challok(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
                  4, &self->keys->cookie, sizeof(self->keys->cookie),
                  pubs_endpoint, subs_endpoint);
       char buf[256];
-      dd_info(" + Added broker: %s", zframe_tostr(sockid, buf));
+      dd_info(" + Added %s: %s", br->standby ? "standby broker" : client_name,
+              zframe_tostr(sockid, buf));
       goto cleanup;
     }
     goto cleanup;
   }
   // tenant <-> broker authentication
+  if (zhash_size(self->chall_pending) > 0) {
+    char *key = zframe_strhex(sockid);
+    zhash_delete(self->chall_pending, key);
+    free(key);
+  }
   ddtenant_t *ten;
   ten = zhash_lookup(self->keys->tenantkeys, hash);
   if (ten == NULL) {
@@ -418,30 +891,145 @@ static void s_cb_challok(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
     goto cleanup;
   }
 
-  retval = insert_local_client(self, sockid, ten, client_name);
-  if (retval == -1) {
-    // TODO: send error message
-    remote_reg_failed(self, sockid, "local");
-    // dd_error("DD_CMD_CHALLOK: Couldn't insert local client!");
+  s_admit_offer(self, sockid, ten, client_name, msg);
+
+cleanup:
+  if (hash)
+    free(hash);
+  if (client_name)
+    free(client_name);
+  if (cook)
+    zframe_destroy(&cook);
+}
+
+static void s_cb_resume(dd_broker_t *self, zframe_t *sockid, zmsg_t *msg) {
+#ifdef DEBUG
+  dd_debug("s_cb_resume called");
+  zframe_print(sockid, "sockid");
+  zmsg_print(msg);
+#endif
+
+  char *client_name = NULL;
+  char *hash = zmsg_popstr(msg);
+  zframe_t *ticket = zmsg_pop(msg);
+  zframe_t *stamp = zmsg_pop(msg);
+  zframe_t *mac = zmsg_pop(msg);
+  if (hash == NULL || ticket == NULL) {
+    dd_error("DD_CMD_RESUME: misformed message!");
     goto cleanup;
   }
-  zsock_send(self->rsock, "fbbb", sockid, &dd_version, 4, &dd_cmd_regok, 4,
-             &ten->cookie, sizeof(ten->cookie));
-  dd_info(" + Added local client: %s.%s", ten->name, client_name);
+
+  ddtenant_t *ten = zhash_lookup(self->keys->tenantkeys, hash);
+  if (ten)
+    client_name = s_ticket_open(self, ten, ticket);
+  if (client_name && !s_resume_proven(self, ticket, stamp, mac)) {
+    dd_warning("DD_CMD_RESUME: no proof of holding the ticket");
+    free(client_name);
+    client_name = NULL;
+  }
+  if (client_name == NULL) {
+    // expired, from another broker, forged or replayed, fall back to the
+    // challenge
+    dd_debug("DD_CMD_RESUME: ticket not accepted, sending challenge");
+    s_send_chall(self, sockid, ten);
+    goto cleanup;
+  }
+
+  // The registration of the client's previous connection may still be
+  // around if it reconnected before timing out. Only the client holds the
+  // key of its ticket, so the new connection takes the name over.
   char prefix_name[MAXTENANTNAME];
-  int prelen = snprintf(prefix_name, 200, "%s.%s", ten->name, client_name);
-  if (self->state != DD_STATE_ROOT)
-    add_cli_up(self, prefix_name, 0);
+  snprintf(prefix_name, MAXTENANTNAME, "%s.%s", ten->name, client_name);
+  local_client *ln = hashtable_has_rev_local_node(self, prefix_name, 0);
+  if (ln && !zframe_eq(ln->sockid, sockid)) {
+    zframe_t *old = zframe_dup(ln->sockid);
+    unreg_cli(self, old, ln->cookie);
+    zframe_destroy(&old);
+  }
+  dd_info("Resumed session of %s", prefix_name);
+  s_admit_offer(self, sockid, ten, client_name, msg);
 
 cleanup:
   if (hash)
     free(hash);
   if (client_name)
     free(client_name);
-  if (cook)
-    zframe_destroy(&cook);
+  if (ticket)
+    zframe_destroy(&ticket);
+  zframe_destroy(&stamp);
+  zframe_destroy(&mac);
+}
+
+// Plaintext is only delivered to local clients of this broker that are in
+// plaintext mode themselves, and never across tenants. It is never
+// forwarded to other brokers or queued.
+static int s_pt_refused(int pt, local_client *ln, int srcpublic,
+                        int dstpublic) {
+  if (!pt)
+    return 0;
+  if (srcpublic || dstpublic || (ln && !ln->plaintext)) {
+    dd_warning("Not delivering plaintext to %s",
+               ln ? ln->prefix_name : "another tenant");
+    return 1;
+  }
+  return 0;
+}
+
+// Holds a notification for a destination that isn't registered anywhere,
+// returns -1 if queueing is off, the destination didn't unregister within
+// queue_ttl or its queue is full
+static int s_queue(dd_broker_t *self, char *src, char *dst, zmsg_t *payload) {
+  if (self->sfq == NULL)
+    return -1;
+  if (sfqueue_put(self->sfq, src, dst, payload) != 0) {
+    if (zhash_lookup(self->sfq->dests, dst))
+      dd_warning("Queue for %s is full, dropping notification from %s", dst,
+                 src);
+    return -1;
+  }
+  dd_debug("Queued notification from %s for %s", src, dst);
+  return 0;
+}
+
+// dst unregistered, notifications for it are held for a while if we are
+// the root, see s_queue
+void queue_gone(dd_broker_t *self, char *dst) {
+  if (self->sfq && s_is_root(self))
+    sfqueue_gone(self->sfq, dst, zclock_mono());
+}
+
+// Hands the notifications held for dst to it, in the order they were sent,
+// now that it has registered with us or below us
+static void s_drain_queued(dd_broker_t *self, char *dst) {
+  if (self->sfq == NULL)
+    return;
+  sfq_dest_t *dest = sfqueue_take(self->sfq, dst);
+  if (dest == NULL)
+    return;
+  dd_info("Delivering %zu queued notifications to %s", zlist_size(dest->msgs),
+          dst);
+  int dstpublic = strncmp(dst, "public.", 7) == 0;
+  local_client *ln = hashtable_has_rev_local_node(self, dst, 0);
+  dist_client *dn = ln ? NULL : hashtable_has_dist_node(self, dst);
+  sfq_msg_t *msg = zlist_first(dest->msgs);
+  while (msg) {
+    int srcpublic = strncmp(msg->src, "public.", 7) == 0;
+    zmsg_t *payload = sfqueue_payload(dest, msg);
+    if (ln) {
+      char *from = msg->src;
+      if ((!srcpublic && !dstpublic) || (srcpublic && dstpublic))
+        from = strchr(msg->src, '.') + 1;
+      forward_locally(self, ln->sockid, from, payload, 0);
+    } else if (dn) {
+      forward_down(self, msg->src, dst, dn->broker, payload);
+    }
+    zmsg_destroy(&payload);
+    msg = zlist_next(dest->msgs);
+  }
+  sfqueue_dest_free(&dest);
 }
 
+// FORWARD from a broker we are connected to
 static void s_cb_forward_dsock(dd_broker_t *self, zmsg_t *msg) {
 #ifdef DEBUG
   dd_debug("s_cb_forward_dsock called");
@@ -469,16 +1057,17 @@ static void s_cb_forward_dsock(dd_broker_t *self, zmsg_t *msg) {
   if ((ln = hashtable_has_rev_local_node(self, dst, 0))) {
     if ((srcpublic && !dstpublic) || (!srcpublic && dstpublic)) {
       dd_debug("Forward_dsock, not stripping tenant %s", src);
-      forward_locally(self, ln->sockid, src, msg);
+      forward_locally(self, ln->sockid, src, msg, 0);
     } else {
       dd_debug("Forward_dsock, stripping tenant %s", src);
       char *dot = strchr(src, '.');
-      forward_locally(self, ln->sockid, dot + 1, msg);
+      forward_locally(self, ln->sockid, dot + 1, msg, 0);
     }
   } else if ((dn = hashtable_has_dist_node(self, dst))) {
     forward_down(self, src, dst, dn->broker, msg);
-  } else if (self->state == DD_STATE_ROOT) {
-    dest_invalid_dsock(self, src, dst);
+  } else if (s_is_root(self)) {
+    if (s_queue(self, src, dst, msg) != 0)
+      dest_invalid_dsock(self, src, dst);
   } else {
     forward_up(self, src, dst, msg);
   }
@@ -486,27 +1075,26 @@ static void s_cb_forward_dsock(dd_broker_t *self, zmsg_t *msg) {
   free(dst);
 }
 
-static void s_cb_forward_rsock(dd_broker_t *self, zframe_t *sockid,
-                               zframe_t *cookie_frame, zmsg_t *msg) {
+// [sockid, version, FORWARD, cookie, source, destination, payload..]
+static void s_cb_forward_rsock(dd_broker_t *self, dd_rmsg_t *msg) {
 #ifdef DEBUG
   dd_debug("s_cb_forward_rsock called");
-  zframe_print(sockid, "sockid");
-  zframe_print(cookie_frame, "cookie");
-  zmsg_print(msg);
 #endif
 
-  uint64_t *cookie;
-  cookie = (uint64_t *)zframe_data(cookie_frame);
-  if (!hashtable_has_local_broker(self, sockid, *cookie, 1)) {
+  uint64_t *cookie = (uint64_t *)rmsg_data(msg, 3);
+  local_broker *br = hashtable_find_local_broker(
+      self, rmsg_data(msg, 0), rmsg_size(msg, 0), *cookie, 1);
+  if (!br) {
     dd_warning("Unregistered broker trying to forward!");
     return;
   }
 
-  if (zmsg_size(msg) < 2)
+  char src_string[MAXTENANTNAME];
+  char dst_string[MAXTENANTNAME];
+  if (!rmsg_str(msg, 4, src_string, sizeof src_string) ||
+      !rmsg_str(msg, 5, dst_string, sizeof dst_string))
     return;
-
-  char *src_string = zmsg_popstr(msg);
-  char *dst_string = zmsg_popstr(msg);
+  zmsg_t *payload = rmsg_zmsg(msg, 6);
 
   int srcpublic = 0, dstpublic = 0;
 
@@ -522,21 +1110,22 @@ static void s_cb_forward_rsock(dd_broker_t *self, zframe_t *sockid,
   if ((ln = hashtable_has_rev_local_node(self, dst_string, 0))) {
     if ((srcpublic && !dstpublic) || (!srcpublic && dstpublic)) {
       dd_debug("Forward_rsock, not stripping tenant %s", src_string);
-      forward_locally(self, ln->sockid, src_string, msg);
+      forward_locally(self, ln->sockid, src_string, payload, 0);
     } else {
       dd_debug("Forward_dsock, stripping tenant %s", src_string);
       char *dot = strchr(src_string, '.');
-      forward_locally(self, ln->sockid, dot + 1, msg);
+      forward_locally(self, ln->sockid, dot + 1, payload, 0);
     }
   } else if ((dn = hashtable_has_dist_node(self, dst_string))) {
-    forward_down(self, src_string, dst_string, dn->broker, msg);
-  } else if (self->state == DD_STATE_ROOT) {
-    dest_invalid_rsock(self, sockid, src_string, dst_string);
+    s_shortcut_hint(self, br->sockid, dst_string, dn);
+    forward_down(self, src_string, dst_string, dn->broker, payload);
+  } else if (s_is_root(self) || hashtable_has_nodst(self, dst_string)) {
+    if (!s_is_root(self) || s_queue(self, src_string, dst_string, payload) != 0)
+      dest_invalid_rsock(self, br->sockid, src_string, dst_string);
   } else {
-    forward_up(self, src_string, dst_string, msg);
+    forward_up(self, src_string, dst_string, payload);
   }
-  free(src_string);
-  free(dst_string);
+  zmsg_destroy(&payload);
 }
 
 /*
@@ -569,26 +1158,27 @@ static void s_cb_nodst_rsock(dd_broker_t *self, zmsg_t *msg) {
   dd_error("s_cb_nodst_rsock called, not implemented!");
 }
 
-static void s_cb_pub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
-                     zmsg_t *msg) {
+// [sockid, version, PUB, cookie, topic, pathv, payload..]
+static void s_cb_pub(dd_broker_t *self, dd_rmsg_t *msg) {
 #ifdef DEBUG
   dd_debug("s_cb_pub called");
-  zframe_print(sockid, "sockid");
-  zframe_print(cookie, "cookie");
-  zmsg_print(msg);
 #endif
 
-  char *topic = zmsg_popstr(msg);
-  zframe_t *pathv = zmsg_pop(msg);
+  char topic[MAXTENANTNAME];
+  if (!rmsg_str(msg, 4, topic, sizeof topic) || topic[0] == '\0') {
+    dd_error("DD_CMD_PUB: misformed message!");
+    return;
+  }
 
   local_client *ln;
-  ln = hashtable_has_local_node(self, sockid, cookie, 1);
+  uint64_t *cookie = (uint64_t *)rmsg_data(msg, 3);
+  ln = hashtable_find_local_node(self, rmsg_data(msg, 0), rmsg_size(msg, 0),
+                                 *cookie, 1);
   if (!ln) {
     dd_warning("Unregistered client trying to send!");
-    zframe_destroy(&pathv);
-    free(topic);
     return;
   }
+  zmsg_t *payload = rmsg_zmsg(msg, 6);
   int srcpublic = 0;
   int dstpublic = 0;
   if (strcmp("public", ln->tenant) == 0)
@@ -618,15 +1208,19 @@ static void s_cb_pub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
     name = ln->name;
   }
 
+  s_retain(self, pubtopic, name, topic, payload);
+  zmsg_t *logged = s_log(self, pubtopic, name, topic, payload);
+
   if (self->pubN) {
     dd_debug("publishing north %s %s ", pubtopic, name);
-    zsock_send(self->pubN, "ssfm", pubtopic, name, self->broker_id, msg);
+    zsock_send(self->pubN, "ssfm", pubtopic, name, self->broker_id, payload);
   }
 
   if (self->pubS) {
     dd_debug("publishing south %s %s", pubtopic, name);
 
-    zsock_send(self->pubS, "ssfm", pubtopic, name, self->broker_id_null, msg);
+    zsock_send(self->pubS, "ssfm", pubtopic, name, self->broker_id_null,
+               payload);
   }
 
   zlist_t *socks = nn_trie_tree(&self->topics_trie, (const uint8_t *)pubtopic,
@@ -637,16 +1231,32 @@ static void s_cb_pub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
     dd_debug("Local sockids to send to: ");
     while (s) {
       print_zframe(s);
-      zsock_send(self->rsock, "fbbssm", s, &dd_version, 4, &dd_cmd_pub, 4, name,
-                 topic, msg);
+      flow_send(self, s, &dd_cmd_pub, name, topic, logged ? logged : payload);
       s = zlist_next(socks);
     }
     zlist_destroy(&socks);
   } else {
     dd_debug("No matching nodes found by nn_trie_tree");
   }
-  free(topic);
-  zframe_destroy(&pathv);
+  zmsg_destroy(&logged);
+  zmsg_destroy(&payload);
+}
+
+static void s_cb_credit(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
+                        zmsg_t *msg) {
+  local_client *ln = hashtable_has_local_node(self, sockid, cookie, 1);
+  if (!ln) {
+    dd_warning("Unregistered client sending CREDIT");
+    return;
+  }
+  zframe_t *consumed = zmsg_pop(msg);
+  if (consumed == NULL || zframe_size(consumed) != sizeof(uint32_t)) {
+    dd_error("DD_CMD_CREDIT: misformed message!");
+    zframe_destroy(&consumed);
+    return;
+  }
+  flow_credit(self, sockid, ln, *(uint32_t *)zframe_data(consumed));
+  zframe_destroy(&consumed);
 }
 
 static void s_cb_ping(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie) {
@@ -678,10 +1288,20 @@ static void s_cb_regok(dd_broker_t *self, zmsg_t *msg) {
 #endif
 
   self->state = DD_STATE_REGISTERED;
+  self->reg_attempts = 0;
+  // a new parent may know more than the last one
+  hashtable_expire_nodst(self, 1);
 
   // stop trying to register
   zloop_timer_end(self->loop, self->reg_loop);
-  self->heartbeat_loop = zloop_timer(self->loop, 1000, 0, s_heartbeat, self);
+  self->heartbeat_loop =
+      zloop_timer(self->loop, DD_PARENT_PROBE, 0, s_heartbeat, self);
+
+  if (self->num_shards > 0) {
+    // only our share of the namespace goes to shard 0
+    s_shard_move(self, 0, 1);
+    goto pubsub;
+  }
 
   // iterate through local clients and add_cli_up to transmit to next
   // broker
@@ -718,6 +1338,7 @@ static void s_cb_regok(dd_broker_t *self, zmsg_t *msg) {
   };
   rcu_read_unlock();
 
+pubsub:
   if (3 == zmsg_size(msg)) {
     zframe_t *cook = zmsg_pop(msg);
     connect_pubsubN(self);
@@ -725,17 +1346,47 @@ static void s_cb_regok(dd_broker_t *self, zmsg_t *msg) {
   } else {
     dd_warning("No PUB/SUB interface configured");
   }
+
+  s_standby_start(self);
+}
+
+// DATASHM to a local client that maps the sender's ring itself,
+// [source, ring, offset, length, plaintext]
+static int s_forward_shm(dd_broker_t *self, zframe_t *dest_sockid, char *src,
+                         shmring_t *ring, uint64_t off, uint32_t len,
+                         uint32_t pt) {
+  zmsg_t *desc = zmsg_new();
+  zmsg_addmem(desc, &off, sizeof(off));
+  zmsg_addmem(desc, &len, sizeof(len));
+  zmsg_addmem(desc, &pt, sizeof(pt));
+  int rc = flow_send(self, dest_sockid, &dd_cmd_datashm, src, ring->name, desc);
+  zmsg_destroy(&desc);
+  return rc;
+}
+
+// The payload of a SEND, or a copy of it from the sender's ring for SENDSHM
+static zmsg_t *s_send_payload(dd_rmsg_t *msg, void *shm_data,
+                              uint32_t shm_len) {
+  if (shm_data == NULL)
+    return rmsg_zmsg(msg, 5);
+  zmsg_t *payload = zmsg_new();
+  zmsg_addmem(payload, shm_data, shm_len);
+  return payload;
 }
 
-static void s_cb_send(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
-                      zmsg_t *msg) {
+// [sockid, version, SEND, cookie, destination, payload..]
+// SEND or, with pt, SENDPT from a local client. With shm it is a SENDSHM,
+// [sockid, version, SENDSHM, cookie, destination, offset, length, plaintext]
+// with the payload in the sender's ring.
+static void s_cb_send(dd_broker_t *self, dd_rmsg_t *msg, int pt, int shm) {
 #ifdef DEBUG
   dd_debug("s_cb_send called");
-  zframe_print(sockid, "sockid");
-  zframe_print(cookie, "cookie");
-  zmsg_print(msg);
 #endif
-  char *dest = zmsg_popstr(msg);
+  char dest[MAXTENANTNAME];
+  if (!rmsg_str(msg, 4, dest, sizeof dest)) {
+    dd_error("DD_CMD_SEND: misformed message!");
+    return;
+  }
 
   int srcpublic = 0;
   int dstpublic = 0;
@@ -747,17 +1398,51 @@ static void s_cb_send(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
   char *src_string;
 
   local_client *ln;
-  ln = hashtable_has_local_node(self, sockid, cookie, 1);
+  uint64_t *cookie = (uint64_t *)rmsg_data(msg, 3);
+  ln = hashtable_find_local_node(self, rmsg_data(msg, 0), rmsg_size(msg, 0),
+                                 *cookie, 1);
   if (!ln) {
     dd_error("Unregistered client trying to send!");
-    // TODO
-    // free some stuff here..
     return;
   }
+  zframe_t *sockid = ln->sockid;
+  shmring_t *ring = NULL;
+  void *shm_data = NULL;
+  uint64_t shm_off = 0;
+  uint32_t shm_len = 0;
+  if (shm) {
+    if (rmsg_size(msg, 5) != sizeof(shm_off) ||
+        rmsg_size(msg, 6) != sizeof(shm_len) ||
+        rmsg_size(msg, 7) != sizeof(uint32_t)) {
+      dd_error("DD_CMD_SENDSHM: misformed message!");
+      return;
+    }
+    memcpy(&shm_off, rmsg_data(msg, 5), sizeof(shm_off));
+    memcpy(&shm_len, rmsg_data(msg, 6), sizeof(shm_len));
+    pt = *(uint32_t *)rmsg_data(msg, 7) != 0;
+    ring = ln->shm;
+    if (ring == NULL ||
+        (shm_data = shmring_get(ring, shm_off, shm_len)) == NULL) {
+      dd_warning("%s sent a payload that isn't in its ring", ln->prefix_name);
+      return;
+    }
+  }
   if (strcmp(ln->tenant, "public") == 0)
     srcpublic = 1;
   if (strncmp(dest, "public.", 7) == 0)
     dstpublic = 1;
+  if (pt && (!ln->plaintext || srcpublic || dstpublic)) {
+    dd_warning("%s is not allowed to send plaintext to %s", ln->prefix_name,
+               dest);
+    zsock_send(self->rsock, "fbbbss", sockid, &dd_version, 4, &dd_cmd_error,
+               4, &dd_error_nodst, 4, dest, ln->name);
+    if (ring)
+      shmring_release(ring, shm_off, shm_len);
+    return;
+  }
+  zmsg_t *payload = NULL;
+  // the slot stays taken while a DATASHM to the destination is underway
+  int handed_over = 0;
 
   dd_debug("s_cb_send, srcpublic %d, dstpublic %d", srcpublic, dstpublic);
 
@@ -822,19 +1507,45 @@ static void s_cb_send(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
 #endif
   dist_client *dn;
   if ((ln = hashtable_has_rev_local_node(self, dst_string, 0))) {
-    if ((!srcpublic && !dstpublic) || (srcpublic && dstpublic)) {
-      char *dot = strchr(src_string, '.');
-      forward_locally(self, ln->sockid, dot + 1, msg);
+    int rc;
+    char *from = src_string;
+    if ((!srcpublic && !dstpublic) || (srcpublic && dstpublic))
+      from = strchr(src_string, '.') + 1;
+    if (s_pt_refused(pt, ln, srcpublic, dstpublic)) {
+      dest_invalid_rsock(self, sockid, strchr(src_string, '.') + 1, dest);
+      rc = 0;
+    } else if (ring && ln->shm && shmring_shared(ring, ln->shm)) {
+      // the destination can map the sender's ring
+      rc = s_forward_shm(self, ln->sockid, from, ring, shm_off, shm_len, pt);
+      handed_over = rc == 0;
     } else {
-      forward_locally(self, ln->sockid, src_string, msg);
+      payload = s_send_payload(msg, shm_data, shm_len);
+      rc = forward_locally(self, ln->sockid, from, payload, pt);
     }
+    // destination is full and the policy is to push back on the sender
+    if (rc == -1)
+      zsock_send(self->rsock, "fbbbs", sockid, &dd_version, 4, &dd_cmd_error,
+                 4, &dd_error_busy, 4, dest);
+  } else if (pt) {
+    // not a client of ours, see s_pt_refused
+    dd_warning("Not forwarding plaintext from %s to %s", src_string,
+               dst_string);
+    dest_invalid_rsock(self, sockid, strchr(src_string, '.') + 1, dest);
   } else if ((dn = hashtable_has_dist_node(self, dst_string))) {
 #ifdef DEBUG
     dd_debug("calling forward down");
 #endif
-    forward_down(self, src_string, dst_string, dn->broker, msg);
-  } else if (self->state == DD_STATE_ROOT) {
-    if ((!srcpublic && !dstpublic) || (srcpublic && dstpublic)) {
+    payload = s_send_payload(msg, shm_data, shm_len);
+    forward_down(self, src_string, dst_string, dn->broker, payload);
+  } else if (s_is_root(self) || hashtable_has_nodst(self, dst_string)) {
+    int queued = 0;
+    if (s_is_root(self) && self->sfq) {
+      payload = s_send_payload(msg, shm_data, shm_len);
+      queued = s_queue(self, src_string, dst_string, payload) == 0;
+    }
+    if (queued) {
+      // held until the destination registers, see s_drain_queued
+    } else if ((!srcpublic && !dstpublic) || (srcpublic && dstpublic)) {
       char *src_dot = strchr(src_string, '.');
       char *dst_dot = strchr(dst_string, '.');
       dest_invalid_rsock(self, sockid, src_dot + 1, dst_dot + 1);
@@ -842,10 +1553,12 @@ static void s_cb_send(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
       dest_invalid_rsock(self, sockid, src_string, dst_string);
     }
   } else {
-    forward_up(self, src_string, dst_string, msg);
+    payload = s_send_payload(msg, shm_data, shm_len);
+    forward_up(self, src_string, dst_string, payload);
   }
-
-  free(dest);
+  zmsg_destroy(&payload);
+  if (ring && !handed_over)
+    shmring_release(ring, shm_off, shm_len);
 }
 
 static void s_cb_sub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
@@ -868,35 +1581,283 @@ static void s_cb_sub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
     free(scopestr);
     return;
   }
+  zmsg_t *subok = zmsg_new();
+  zlist_t *fresh = zlist_new();
+  zlist_autofree(fresh);
+  s_subscribe(self, sockid, ln, topic, scopestr, subok, fresh);
+  if (zmsg_size(subok) > 0)
+    zsock_send(self->rsock, "fbbm", sockid, &dd_version, 4, &dd_cmd_subok, 4,
+               subok);
+  zmsg_destroy(&subok);
+  s_send_retained(self, sockid, fresh);
+  zlist_destroy(&fresh);
+}
 
-  if (strcmp(topic, "public") == 0) {
-    zsock_send(self->rsock, "fbbss", sockid, &dd_version, 4, &dd_cmd_data, 4,
-               "ERROR: protected topic");
-    free(topic);
-    free(scopestr);
+// SUBMANY carries topic/scope pairs, all of them are confirmed in a single
+// SUBOK
+static void s_cb_submany(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
+                         zmsg_t *msg) {
+#ifdef DEBUG
+  dd_debug("s_cb_submany called");
+  zframe_print(sockid, "sockid");
+  zframe_print(cookie, "cookie");
+  zmsg_print(msg);
+#endif
+  local_client *ln;
+  ln = hashtable_has_local_node(self, sockid, cookie, 1);
+  if (!ln) {
+    dd_warning("DD: Unregistered client trying to send!");
     return;
   }
+  zmsg_t *subok = zmsg_new();
+  zlist_t *fresh = zlist_new();
+  zlist_autofree(fresh);
+  while (zmsg_size(msg) >= 2) {
+    char *topic = zmsg_popstr(msg);
+    char *scopestr = zmsg_popstr(msg);
+    s_subscribe(self, sockid, ln, topic, scopestr, subok, fresh);
+  }
+  if (zmsg_size(subok) > 0)
+    zsock_send(self->rsock, "fbbm", sockid, &dd_version, 4, &dd_cmd_subok, 4,
+               subok);
+  zmsg_destroy(&subok);
+  s_send_retained(self, sockid, fresh);
+  zlist_destroy(&fresh);
+}
 
-  // scopestr = "/*/*/*/"
-  // scopestr = "/43/*/"
-  // scopestr ..
-  // replace * with appropriate scope number assigned to broker
-  int j;
-  char *str1, *token, *saveptr1;
-  char *brscope;
-  char *t = zlist_first(self->scope);
-  char *scopedup = strdup(scopestr);
-  char newtopic[257];
-  char *ntptr = &newtopic[1];
-  char newscope[128];
-  char *nsptr = &newscope[0];
-  int len = 128;
-  int retval;
-  if (strcmp(scopestr, "noscope") == 0) {
-    retval = snprintf(nsptr, len, "");
-    len -= retval;
-    nsptr += retval;
-  } else {
+// Retained publications matching subscriptions that were just confirmed
+static void s_send_retained(dd_broker_t *self, zframe_t *sockid,
+                            zlist_t *fresh) {
+  if (self->retain == NULL)
+    return;
+  char *sub = zlist_first(fresh);
+  while (sub) {
+    zlist_t *found = retain_match(self->retain, sub);
+    retained_t *r = zlist_first(found);
+    while (r) {
+      flow_send(self, sockid, &dd_cmd_pub, r->source, r->topic, r->payload);
+      r = zlist_next(found);
+    }
+    zlist_destroy(&found);
+    sub = zlist_next(fresh);
+  }
+}
+
+// The topic a pubtopic was published on, without tenant and scope
+static char *s_pubtopic_topic(const char *pubtopic, char *buf, size_t len) {
+  const char *dot = strchr(pubtopic, '.');
+  snprintf(buf, len, "%s", dot ? dot + 1 : pubtopic);
+  char *slash = strchr(buf, '/');
+  if (slash)
+    *slash = '\0';
+  return buf;
+}
+
+// Keeps a publication flagged DD_PAYLOAD_RETAIN, payload is what goes to
+// subscribers. Without a topic it is taken from the pubtopic. Returns 0 if
+// it is the one retained already, which subscribers here and below got.
+static int s_retain(dd_broker_t *self, char *pubtopic, char *source,
+                    char *topic, zmsg_t *payload) {
+  if (self->retain == NULL || zmsg_size(payload) < 2)
+    return 1;
+  zframe_t *frame = zmsg_last(payload);
+  uint32_t flags;
+  if (zframe_size(frame) != sizeof(flags))
+    return 1;
+  memcpy(&flags, zframe_data(frame), sizeof(flags));
+  if (!(flags & DD_PAYLOAD_RETAIN))
+    return 1;
+  char buf[MAXTENANTNAME];
+  if (topic == NULL)
+    topic = s_pubtopic_topic(pubtopic, buf, sizeof(buf));
+  return retain_put(self->retain, pubtopic, source, topic, payload);
+}
+
+// A broker subscribed through pub, which only carried the publications that
+// matched earlier subscriptions. Publishes what we retained for the topic
+// on it again, brokers that have it already drop it.
+static void s_pass_retained(dd_broker_t *self, zsock_t *pub, zframe_t *pathv,
+                            zframe_t *topic_frame) {
+  if (self->retain == NULL || pub == NULL)
+    return;
+  char *sub = strndup((char *)zframe_data(topic_frame) + 1,
+                      zframe_size(topic_frame) - 1);
+  zlist_t *found = retain_match(self->retain, sub);
+  retained_t *r = zlist_first(found);
+  while (r) {
+    zmsg_t *payload = zmsg_dup(r->payload);
+    zsock_send(pub, "ssfm", r->pubtopic, r->source, pathv, payload);
+    zmsg_destroy(&payload);
+    r = zlist_next(found);
+  }
+  zlist_destroy(&found);
+  free(sub);
+}
+
+// Payload with DD_PAYLOAD_SEQ and its number in the log added to the flags
+// frame, which is created if it wasn't there
+static zmsg_t *s_seq_payload(zmsg_t *payload, uint64_t seq, uint32_t extra) {
+  zmsg_t *out = zmsg_new();
+  uint32_t flags = 0;
+  zframe_t *frame = zmsg_first(payload);
+  if (frame)
+    zmsg_addmem(out, zframe_data(frame), zframe_size(frame));
+  frame = zmsg_next(payload);
+  if (frame && zframe_size(frame) == sizeof(flags))
+    memcpy(&flags, zframe_data(frame), sizeof(flags));
+  flags |= DD_PAYLOAD_SEQ | extra;
+  zmsg_addmem(out, &flags, sizeof(flags));
+  zmsg_addmem(out, &seq, sizeof(seq));
+  return out;
+}
+
+// Appends a publication to the log. Returns what local subscribers get,
+// the payload with its number in the log, or NULL to send payload as it is.
+static zmsg_t *s_log(dd_broker_t *self, char *pubtopic, char *source,
+                     char *topic, zmsg_t *payload) {
+  if (self->publog == NULL)
+    return NULL;
+  char buf[MAXTENANTNAME];
+  if (topic == NULL)
+    topic = s_pubtopic_topic(pubtopic, buf, sizeof(buf));
+  uint64_t refused = self->publog->refused;
+  uint64_t seq = publog_append(self->publog, pubtopic, source, topic, payload);
+  if (seq == 0) {
+    // counted in the stats, it would be logged for every publication
+    if (self->publog->refused == refused)
+      dd_warning("Couldn't log publication on %s from %s", pubtopic, source);
+    return NULL;
+  }
+  return s_seq_payload(payload, seq, 0);
+}
+
+struct _replay {
+  dd_broker_t *self;
+  zframe_t *sockid;
+};
+
+static int s_replay_one(void *arg, uint64_t seq, const char *source,
+                        const char *topic, zmsg_t *payload) {
+  struct _replay *r = arg;
+  zmsg_t *out = s_seq_payload(payload, seq, DD_PAYLOAD_REPLAY);
+  int rc = flow_send(r->self, r->sockid, &dd_cmd_pub, (char *)source,
+                     (char *)topic, out);
+  zmsg_destroy(&out);
+  return rc == 0 ? 0 : -1;
+}
+
+// [topic, scope, from, until] subscribes like SUB and sends the logged
+// publications numbered after from, DD_REPLAY_BATCH at a time. Until is 0
+// in the first request, and set to the last number logged by then in the
+// REPLAY that tells the client where to continue. The REPLAY goes through
+// flow control after the publications, so the client only asks for more
+// once it has read them, and is never dropped.
+static void s_cb_replay(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
+                        zmsg_t *msg) {
+  char *topic = zmsg_popstr(msg);
+  char *scopestr = zmsg_popstr(msg);
+  zframe_t *from_frame = zmsg_pop(msg);
+  zframe_t *until_frame = zmsg_pop(msg);
+  if (topic == NULL || scopestr == NULL || from_frame == NULL ||
+      zframe_size(from_frame) != sizeof(uint64_t) || until_frame == NULL ||
+      zframe_size(until_frame) != sizeof(uint64_t)) {
+    dd_error("DD_CMD_REPLAY: misformed message!");
+    free(topic);
+    free(scopestr);
+    goto cleanup;
+  }
+  local_client *ln = hashtable_has_local_node(self, sockid, cookie, 1);
+  if (!ln) {
+    dd_warning("DD: Unregistered client trying to send!");
+    free(topic);
+    free(scopestr);
+    goto cleanup;
+  }
+  uint64_t from, until;
+  memcpy(&from, zframe_data(from_frame), sizeof(from));
+  memcpy(&until, zframe_data(until_frame), sizeof(until));
+  char *reply_topic = strdup(topic);
+  char *reply_scope = strdup(scopestr);
+
+  zmsg_t *subok = zmsg_new();
+  zlist_t *keys = zlist_new();
+  zlist_autofree(keys);
+  s_subscribe(self, sockid, ln, topic, scopestr, subok, keys);
+  if (zmsg_size(subok) > 0)
+    zsock_send(self->rsock, "fbbm", sockid, &dd_version, 4, &dd_cmd_subok, 4,
+               subok);
+  zmsg_destroy(&subok);
+
+  // a refused subscription or a broker without a log ends the replay
+  int done = 1;
+  char *key = zlist_first(keys);
+  if (key && self->publog) {
+    if (until == 0)
+      until = self->publog->seq;
+    struct _replay r = {self, sockid};
+    from = publog_replay(self->publog, key, from, until, DD_REPLAY_BATCH,
+                         s_replay_one, &r, &done);
+  }
+  // from == until tells the client the replay is complete
+  if (done)
+    from = until;
+  zmsg_t *cont = zmsg_new();
+  zmsg_addmem(cont, &from, sizeof(from));
+  zmsg_addmem(cont, &until, sizeof(until));
+  flow_send_control(self, sockid, &dd_cmd_replay, reply_topic, reply_scope,
+                    cont);
+  zmsg_destroy(&cont);
+  zlist_destroy(&keys);
+  free(reply_topic);
+  free(reply_scope);
+cleanup:
+  zframe_destroy(&from_frame);
+  zframe_destroy(&until_frame);
+}
+
+// Tells a client it can't (un)subscribe to "public", as DATA it counts in
+// its credit
+static void s_protected(dd_broker_t *self, zframe_t *sockid) {
+  zmsg_t *empty = zmsg_new();
+  flow_send_control(self, sockid, &dd_cmd_data, "ERROR: protected topic",
+                    NULL, empty);
+  zmsg_destroy(&empty);
+}
+
+// Add a subscription for a local client, takes ownership of topic and
+// scopestr. The topic and scope to confirm are appended to subok.
+// The subscription is added to fresh, to send it retained or logged
+// publications
+static void s_subscribe(dd_broker_t *self, zframe_t *sockid, local_client *ln,
+                        char *topic, char *scopestr, zmsg_t *subok,
+                        zlist_t *fresh) {
+  if (strcmp(topic, "public") == 0) {
+    s_protected(self, sockid);
+    free(topic);
+    free(scopestr);
+    return;
+  }
+
+  // scopestr = "/*/*/*/"
+  // scopestr = "/43/*/"
+  // scopestr ..
+  // replace * with appropriate scope number assigned to broker
+  int j;
+  char *str1, *token, *saveptr1;
+  char *brscope;
+  char *t = zlist_first(self->scope);
+  char *scopedup = strdup(scopestr);
+  char newtopic[257];
+  char *ntptr = &newtopic[1];
+  char newscope[128];
+  char *nsptr = &newscope[0];
+  int len = 128;
+  int retval;
+  if (strcmp(scopestr, "noscope") == 0) {
+    retval = snprintf(nsptr, len, "");
+    len -= retval;
+    nsptr += retval;
+  } else {
     for (j = 1, str1 = scopestr;; j++, str1 = NULL) {
       token = strtok_r(str1, "/", &saveptr1);
       if (token == NULL)
@@ -922,27 +1883,44 @@ static void s_cb_sub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
         free(scopedup);
         free(scopestr);
         free(topic);
+        return;
       }
     }
     retval = snprintf(nsptr, len, "/");
     len -= retval;
     nsptr += retval;
   }
-  zsock_send(self->rsock, "fbbss", sockid, &dd_version, 4, &dd_cmd_subok, 4,
-             topic, scopedup);
-  free(scopedup);
-
   retval =
       snprintf(ntptr, 256, "%s.%s%s", ln->tenant, topic, (char *)&newscope[0]);
   //  dd_debug("newtopic = %s, len = %d\n", ntptr, retval);
 
+  // a tenant at its quota can still repeat subscriptions it already has
+  if (self->tenant_max_subs > 0 &&
+      ln->ten->subscriptions >= self->tenant_max_subs &&
+      !has_subscription(self, sockid, ntptr)) {
+    dd_warning("Tenant %s is at its subscription quota, refusing %s",
+               ln->tenant, ntptr);
+    zsock_send(self->rsock, "fbbbs", sockid, &dd_version, 4, &dd_cmd_error, 4,
+               &dd_error_quota, 4, topic);
+    free(scopedup);
+    free(scopestr);
+    free(topic);
+    return;
+  }
+  zmsg_addstr(subok, topic);
+  zmsg_addstr(subok, scopedup);
+  free(scopedup);
+
   int new = 0;
   // Hashtable
   // subscriptions[sockid(5byte array)] = [topic,topic,topic]
   retval = insert_subscription(self, sockid, ntptr);
 
-  if (retval != 0)
+  if (retval != 0) {
     new += 1;
+    ln->ten->subscriptions++;
+  }
+  zlist_append(fresh, strdup(ntptr));
 
 #ifdef DEBUG
   print_sub_ht();
@@ -1017,14 +1995,14 @@ static void s_cb_unreg_cli(dd_broker_t *self, zframe_t *sockid,
   if ((ln = hashtable_has_local_node(self, sockid, cookie, 0))) {
     dd_info(" - Removed local client: %s", ln->prefix_name);
     del_cli_up(self, ln->prefix_name);
+    queue_gone(self, ln->prefix_name);
     int a = remove_subscriptions(self, sockid);
+    ln->ten->subscriptions -= a;
     dd_info("   - Removed %d subscriptions", a);
+    flow_remove(self, sockid);
     hashtable_unlink_local_node(self, ln->sockid, ln->cookie);
     hashtable_unlink_rev_local_node(self, ln->prefix_name);
-    zframe_destroy(&ln->sockid);
-    free(ln->prefix_name);
-    free(ln->name);
-    free(ln);
+    hashtable_free_local_node(self, ln);
 #ifdef DEBUG
     print_local_ht(self);
 #endif
@@ -1043,7 +2021,8 @@ static void s_cb_unreg_dist_cli(dd_broker_t *self, zframe_t *sockid,
 #endif
 
   uint64_t *cook = (uint64_t *)zframe_data(cookie_frame);
-  if (!hashtable_has_local_broker(self, sockid, *cook, 0)) {
+  local_broker *br = hashtable_has_local_broker(self, sockid, *cook, 0);
+  if (!br) {
     dd_error("Unregistered broker trying to remove clients!");
     return;
   }
@@ -1052,10 +2031,17 @@ static void s_cb_unreg_dist_cli(dd_broker_t *self, zframe_t *sockid,
   char *name = zmsg_popstr(msg);
   dd_debug("trying to remove distant client: %s", name);
 
-  if ((dn = hashtable_has_dist_node(self, name))) {
+  if ((dn = hashtable_has_dist_node(self, name)) &&
+      !zframe_eq(dn->broker, sockid)) {
+    // moved to another broker in a failover, the one it left doesn't
+    // speak for it any more
+    dd_debug("%s is not reached through that broker, keeping it", name);
+  } else if (dn) {
     dd_info(" - Removed distant client: %s", name);
     hashtable_remove_dist_node(self, name);
-    del_cli_up(self, name);
+    if (!br->standby)
+      del_cli_up(self, name);
+    queue_gone(self, name);
   }
   free(name);
 }
@@ -1080,10 +2066,36 @@ static void s_cb_unsub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
     free(scopestr);
     return;
   }
+  s_unsubscribe(self, sockid, ln, topic, scopestr);
+}
 
+static void s_cb_unsubmany(dd_broker_t *self, zframe_t *sockid,
+                           zframe_t *cookie, zmsg_t *msg) {
+#ifdef DEBUG
+  dd_debug("s_cb_unsubmany called");
+  zframe_print(sockid, "sockid");
+  zframe_print(cookie, "cookie");
+  zmsg_print(msg);
+#endif
+  local_client *ln;
+  ln = hashtable_has_local_node(self, sockid, cookie, 1);
+  if (!ln) {
+    dd_warning("Unregistered client trying to send!\n");
+    return;
+  }
+  while (zmsg_size(msg) >= 2) {
+    char *topic = zmsg_popstr(msg);
+    char *scopestr = zmsg_popstr(msg);
+    s_unsubscribe(self, sockid, ln, topic, scopestr);
+  }
+}
+
+// Remove a subscription of a local client, takes ownership of topic and
+// scopestr
+static void s_unsubscribe(dd_broker_t *self, zframe_t *sockid,
+                          local_client *ln, char *topic, char *scopestr) {
   if (strcmp(topic, "public") == 0) {
-    zsock_send(self->rsock, "fbbss", sockid, &dd_version, 4, &dd_cmd_data, 4,
-               "ERROR: protected topic");
+    s_protected(self, sockid);
     free(topic);
     free(scopestr);
     return;
@@ -1134,6 +2146,7 @@ static void s_cb_unsub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
         free(scopedup);
         free(scopestr);
         free(topic);
+        return;
       }
     }
     retval = snprintf(nsptr, len, "/");
@@ -1145,8 +2158,9 @@ static void s_cb_unsub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
   retval =
       snprintf(ntptr, 256, "%s.%s%s", ln->tenant, topic, (char *)&newscope[0]);
   dd_info("deltopic = %s, len = %d\n", ntptr, retval);
+  free(scopestr);
+  free(topic);
 
-  int new = 0;
   retval = remove_subscription(self, sockid, ntptr);
 
   // only delete a subscription if something was actually removed
@@ -1155,6 +2169,7 @@ static void s_cb_unsub(dd_broker_t *self, zframe_t *sockid, zframe_t *cookie,
 
   if (retval == 0)
     return;
+  ln->ten->subscriptions--;
 
   newtopic[0] = 0;
   ntptr = &newtopic[0];
@@ -1184,12 +2199,18 @@ static int s_on_subN_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   char *pubtopic = zmsg_popstr(msg);
   char *name = zmsg_popstr(msg);
   zframe_t *pathv = zmsg_pop(msg);
+  zmsg_t *logged = NULL;
 
   if (zframe_eq(pathv, self->broker_id)) {
     goto cleanup;
   }
 
   dd_debug("pubtopic: %s source: %s", pubtopic, name);
+  if (!s_retain(self, pubtopic, name, NULL, msg)) {
+    dd_debug("%s is retained already", pubtopic);
+    goto cleanup;
+  }
+  logged = s_log(self, pubtopic, name, NULL, msg);
   // zframe_print(pathv, "pathv: ");
   zlist_t *socks = nn_trie_tree(&self->topics_trie, (const uint8_t *)pubtopic,
                                 strlen(pubtopic));
@@ -1205,8 +2226,7 @@ static int s_on_subN_msg(zloop_t *loop, zsock_t *handle, void *arg) {
 
     while (s) {
       print_zframe(s);
-      zsock_send(self->rsock, "fbbssm", s, &dd_version, 4, &dd_cmd_pub, 4, name,
-                 dot, msg);
+      flow_send(self, s, &dd_cmd_pub, name, dot, logged ? logged : msg);
       s = zlist_next(socks);
     }
     *slash = '/';
@@ -1223,6 +2243,7 @@ cleanup:
   free(pubtopic);
   free(name);
   zframe_destroy(&pathv);
+  zmsg_destroy(&logged);
   zmsg_destroy(&msg);
   return 0;
 }
@@ -1238,8 +2259,14 @@ static int s_on_subS_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   char *pubtopic = zmsg_popstr(msg);
   char *name = zmsg_popstr(msg);
   zframe_t *pathv = zmsg_pop(msg);
+  zmsg_t *logged = NULL;
 
   dd_debug("pubtopic: %s source: %s", pubtopic, name);
+  if (!s_retain(self, pubtopic, name, NULL, msg)) {
+    dd_debug("%s is retained already", pubtopic);
+    goto cleanup;
+  }
+  logged = s_log(self, pubtopic, name, NULL, msg);
   // zframe_print(pathv, "pathv: ");
   zlist_t *socks = nn_trie_tree(&self->topics_trie, (const uint8_t *)pubtopic,
                                 strlen(pubtopic));
@@ -1258,8 +2285,7 @@ static int s_on_subS_msg(zloop_t *loop, zsock_t *handle, void *arg) {
 
     while (s) {
       print_zframe(s);
-      zsock_send(self->rsock, "fbbssm", s, &dd_version, 4, &dd_cmd_pub, 4, name,
-                 dot, msg);
+      flow_send(self, s, &dd_cmd_pub, name, dot, logged ? logged : msg);
       s = zlist_next(socks);
     }
     *slash = '/';
@@ -1278,6 +2304,7 @@ cleanup:
   free(pubtopic);
   free(name);
   zframe_destroy(&pathv);
+  zmsg_destroy(&logged);
   zmsg_destroy(&msg);
   return 0;
 }
@@ -1296,6 +2323,7 @@ static int s_on_pubN_msg(zloop_t *loop, zsock_t *handle, void *arg) {
     dd_info(" + Got subscription for: %s", &topic[1]);
     nn_trie_add_sub_north(&self->topics_trie, (const uint8_t *)&topic[1],
                           zframe_size(topic_frame) - 1);
+    s_pass_retained(self, self->pubN, self->broker_id, topic_frame);
   }
   if (topic[0] == 0) {
     dd_info(" - Got unsubscription for: %s", &topic[1]);
@@ -1322,16 +2350,22 @@ static int s_on_pubS_msg(zloop_t *loop, zsock_t *handle, void *arg) {
 
   zframe_t *topic_frame = zmsg_pop(msg);
   char *topic = (char *)zframe_data(topic_frame);
+  char *key = strndup(&topic[1], zframe_size(topic_frame) - 1);
 
   if (topic[0] == 1) {
     dd_info(" + Got subscription for: %s", &topic[1]);
     nn_trie_add_sub_south(&self->topics_trie, (const uint8_t *)&topic[1],
                           zframe_size(topic_frame) - 1);
+    s_pass_retained(self, self->pubS, self->broker_id_null, topic_frame);
+    // pubS reports every subscription, the others are already passed on
+    if (zhash_insert(self->south_topics, key, "") != 0)
+      goto cleanup;
   }
   if (topic[0] == 0) {
     dd_info(" - Got unsubscription for: %s", &topic[1]);
     nn_trie_del_sub_south(&self->topics_trie, (const uint8_t *)&topic[1],
                           zframe_size(topic_frame) - 1);
+    zhash_delete(self->south_topics, key);
   }
 
   // subs from north should continue down
@@ -1340,28 +2374,23 @@ static int s_on_pubS_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   if (self->subN)
     zsock_send(self->subN, "f", topic_frame);
 
+cleanup:
+  free(key);
   zframe_destroy(&topic_frame);
   zmsg_destroy(&msg);
   return 0;
 }
 
-static int s_on_router_msg(zloop_t *loop, zsock_t *handle, void *arg) {
-  dd_broker_t *self = arg;
-  zmsg_t *msg = zmsg_recv(handle);
-
+static void s_router_dispatch(dd_broker_t *self, zmsg_t *msg) {
 #ifdef DEBUG
-  dd_debug("s_on_router_msg called");
+  dd_debug("s_router_dispatch called");
   zmsg_print(msg);
 #endif
 
-  if (msg == NULL) {
-    dd_error("zmsg_recv returned NULL");
-    return 0;
-  }
   if (zmsg_size(msg) < 3) {
     dd_error("message less than 3, error!");
     zmsg_destroy(&msg);
-    return 0;
+    return;
   }
   zframe_t *source_frame = NULL;
   zframe_t *proto_frame = NULL;
@@ -1390,40 +2419,49 @@ static int s_on_router_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   uint32_t cmd = *((uint32_t *)zframe_data(cmd_frame));
 
   switch (cmd) {
-  case DD_CMD_SEND:
+  case DD_CMD_PING:
     cookie_frame = zmsg_pop(msg);
     if (cookie_frame == NULL) {
-      dd_error("Malformed SEND, missing COOKIE");
+      dd_error("Malformed PING, missing COOKIE");
       goto cleanup;
     }
-    s_cb_send(self, source_frame, cookie_frame, msg);
+    s_cb_ping(self, source_frame, cookie_frame);
     break;
 
-  case DD_CMD_FORWARD:
+  case DD_CMD_CREDIT:
     cookie_frame = zmsg_pop(msg);
     if (cookie_frame == NULL) {
-      dd_error("Malformed FORWARD, missing COOKIE");
+      dd_error("Malformed CREDIT, missing COOKIE");
       goto cleanup;
     }
-    s_cb_forward_rsock(self, source_frame, cookie_frame, msg);
+    s_cb_credit(self, source_frame, cookie_frame, msg);
     break;
 
-  case DD_CMD_PING:
+  case DD_CMD_SUB:
     cookie_frame = zmsg_pop(msg);
     if (cookie_frame == NULL) {
-      dd_error("Malformed PING, missing COOKIE");
+      dd_error("Malformed SUB, missing COOKIE");
       goto cleanup;
     }
-    s_cb_ping(self, source_frame, cookie_frame);
+    s_cb_sub(self, source_frame, cookie_frame, msg);
     break;
 
-  case DD_CMD_SUB:
+  case DD_CMD_SUBMANY:
     cookie_frame = zmsg_pop(msg);
     if (cookie_frame == NULL) {
-      dd_error("Malformed SUB, missing COOKIE");
+      dd_error("Malformed SUBMANY, missing COOKIE");
       goto cleanup;
     }
-    s_cb_sub(self, source_frame, cookie_frame, msg);
+    s_cb_submany(self, source_frame, cookie_frame, msg);
+    break;
+
+  case DD_CMD_REPLAY:
+    cookie_frame = zmsg_pop(msg);
+    if (cookie_frame == NULL) {
+      dd_error("Malformed REPLAY, missing COOKIE");
+      goto cleanup;
+    }
+    s_cb_replay(self, source_frame, cookie_frame, msg);
     break;
 
   case DD_CMD_UNSUB:
@@ -1435,19 +2473,23 @@ static int s_on_router_msg(zloop_t *loop, zsock_t *handle, void *arg) {
     s_cb_unsub(self, source_frame, cookie_frame, msg);
     break;
 
-  case DD_CMD_PUB:
+  case DD_CMD_UNSUBMANY:
     cookie_frame = zmsg_pop(msg);
     if (cookie_frame == NULL) {
-      dd_error("Malformed PUB, missing COOKIE");
+      dd_error("Malformed UNSUBMANY, missing COOKIE");
       goto cleanup;
     }
-    s_cb_pub(self, source_frame, cookie_frame, msg);
+    s_cb_unsubmany(self, source_frame, cookie_frame, msg);
     break;
 
   case DD_CMD_ADDLCL:
     s_cb_addlcl(self, source_frame, msg);
     break;
 
+  case DD_CMD_RESUME:
+    s_cb_resume(self, source_frame, msg);
+    break;
+
   case DD_CMD_ADDDCL:
     cookie_frame = zmsg_pop(msg);
     if (cookie_frame == NULL) {
@@ -1487,6 +2529,15 @@ static int s_on_router_msg(zloop_t *loop, zsock_t *handle, void *arg) {
     s_cb_challok(self, source_frame, msg);
     break;
 
+  case DD_CMD_ACTIVATE:
+    cookie_frame = zmsg_pop(msg);
+    if (cookie_frame == NULL) {
+      dd_error("Malformed ACTIVATE, missing COOKIE");
+      goto cleanup;
+    }
+    s_cb_activate(self, source_frame, cookie_frame);
+    break;
+
   case DD_CMD_ERROR:
     // TODO implment
     dd_error("Recived CMD_ERROR from a client!");
@@ -1508,16 +2559,646 @@ cleanup:
     zframe_destroy(&cookie_frame);
   if (msg)
     zmsg_destroy(&msg);
+}
+
+// SEND, FORWARD, SENDPT, SENDSHM and PUB make up the data plane, everything
+// else is control traffic
+static int s_is_data(dd_rmsg_t *msg) {
+  if (msg->size < 3 || rmsg_size(msg, 2) != sizeof(uint32_t))
+    return 0;
+  uint32_t cmd = *((uint32_t *)rmsg_data(msg, 2));
+  return cmd == DD_CMD_SEND || cmd == DD_CMD_FORWARD || cmd == DD_CMD_PUB ||
+         cmd == DD_CMD_SENDPT || cmd == DD_CMD_SENDSHM;
+}
+
+// Data plane messages are parsed straight from the received parts, only
+// the payload is copied when it is sent on
+static void s_data_dispatch(dd_broker_t *self, dd_rmsg_t *msg) {
+  uint32_t *pver = (uint32_t *)rmsg_data(msg, 1);
+  if (rmsg_size(msg, 1) != sizeof(uint32_t) || *pver != DD_VERSION) {
+    dd_error("Wrong version, expected 0x%x", DD_VERSION);
+    zsock_send(self->rsock, "bbbbs", rmsg_data(msg, 0), rmsg_size(msg, 0),
+               &dd_version, 4, &dd_cmd_error, 4, &dd_error_version, 4,
+               "Different versions in use");
+    goto cleanup;
+  }
+  if (rmsg_size(msg, 3) != sizeof(uint64_t)) {
+    dd_error("Malformed message, missing COOKIE");
+    goto cleanup;
+  }
+
+  uint32_t cmd = *((uint32_t *)rmsg_data(msg, 2));
+  switch (cmd) {
+  case DD_CMD_SEND:
+    s_cb_send(self, msg, 0, 0);
+    break;
+  case DD_CMD_FORWARD:
+    s_cb_forward_rsock(self, msg);
+    break;
+  case DD_CMD_SENDPT:
+    s_cb_send(self, msg, 1, 0);
+    break;
+  case DD_CMD_SENDSHM:
+    s_cb_send(self, msg, 0, 1);
+    break;
+  case DD_CMD_PUB:
+    s_cb_pub(self, msg);
+    break;
+  }
+
+cleanup:
+  msgpool_release(self->msgpool, &msg);
+}
+
+static void s_lane_push(dd_broker_t *self, dd_rmsg_t *msg) {
+  int tail = (self->lane_head + self->lane_count) % DD_DATA_LANE_MAX;
+  self->data_lane[tail] = msg;
+  self->lane_count++;
+}
+
+static dd_rmsg_t *s_lane_pop(dd_broker_t *self) {
+  if (self->lane_count == 0)
+    return NULL;
+  dd_rmsg_t *msg = self->data_lane[self->lane_head];
+  self->lane_head = (self->lane_head + 1) % DD_DATA_LANE_MAX;
+  self->lane_count--;
+  return msg;
+}
+
+static int s_on_data_lane(zloop_t *loop, int timer_id, void *arg);
+
+// Departures of clients and brokers are control traffic, but must not
+// overtake data their sender queued before them
+static int s_is_departure(dd_rmsg_t *msg) {
+  if (msg->size < 3 || rmsg_size(msg, 2) != sizeof(uint32_t))
+    return 0;
+  uint32_t cmd = *((uint32_t *)rmsg_data(msg, 2));
+  return cmd == DD_CMD_UNREG || cmd == DD_CMD_UNREGDCLI ||
+         cmd == DD_CMD_UNREGBR;
+}
+
+// Handles the data lane up to the last message from the sender of msg,
+// in order, so that nothing it sent before is left behind
+static void s_drain_peer(dd_broker_t *self, dd_rmsg_t *msg) {
+  int i, last = -1;
+  for (i = 0; i < self->lane_count; i++) {
+    dd_rmsg_t *queued =
+        self->data_lane[(self->lane_head + i) % DD_DATA_LANE_MAX];
+    if (rmsg_size(queued, 0) == rmsg_size(msg, 0) &&
+        memcmp(rmsg_data(queued, 0), rmsg_data(msg, 0),
+               rmsg_size(msg, 0)) == 0)
+      last = i;
+  }
+  while (last-- >= 0)
+    s_data_dispatch(self, s_lane_pop(self));
+}
+
+// Handle at most DD_DATA_BUDGET data messages, then give the loop a chance
+// to look at the sockets again
+static void s_drain_data_lane(dd_broker_t *self) {
+  int n = 0;
+  dd_rmsg_t *msg;
+  while (n++ < DD_DATA_BUDGET && (msg = s_lane_pop(self)))
+    s_data_dispatch(self, msg);
+  if (self->lane_count > 0 && self->data_timer == -1)
+    self->data_timer = zloop_timer(self->loop, 0, 1, s_on_data_lane, self);
+}
+
+static int s_on_data_lane(zloop_t *loop, int timer_id, void *arg) {
+  dd_broker_t *self = arg;
+  self->data_timer = -1;
+  s_drain_data_lane(self);
+  return 0;
+}
+
+// Reads what is queued on the router socket in one go. Control messages
+// are handled right away, data messages go through the data lane so that
+// heartbeats and registrations don't wait behind bulk traffic. Only
+// departures wait for the data their sender queued before them.
+static int s_on_router_msg(zloop_t *loop, zsock_t *handle, void *arg) {
+  dd_broker_t *self = arg;
+  int n = 0;
+  do {
+    dd_rmsg_t *msg = msgpool_recv(self->msgpool, zsock_resolve(handle));
+    if (msg == NULL) {
+      dd_error("msgpool_recv returned NULL");
+      break;
+    }
+    if (!s_is_data(msg)) {
+      if (self->lane_count > 0 && s_is_departure(msg))
+        s_drain_peer(self, msg);
+      zmsg_t *zmsg = rmsg_zmsg(msg, 0);
+      msgpool_release(self->msgpool, &msg);
+      s_router_dispatch(self, zmsg);
+      continue;
+    }
+    // keep data in order when the lane is full
+    if (self->lane_count >= DD_DATA_LANE_MAX)
+      s_data_dispatch(self, s_lane_pop(self));
+    s_lane_push(self, msg);
+  } while (++n < DD_ROUTER_BATCH && (zsock_events(handle) & ZMQ_POLLIN));
+
+  s_drain_data_lane(self);
+  return 0;
+}
+
+static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *arg) {
+  dd_broker_t *self = arg;
+  self->timeout = 0;
+  zmsg_t *msg = zmsg_recv(handle);
+#ifdef DEBUG
+  dd_debug("s_on_dealer_msg called");
+  zmsg_print(msg);
+#endif
+
+  if (msg == NULL) {
+    dd_error("zmsg_recv returned NULL");
+    return 0;
+  }
+  if (zmsg_size(msg) < 2) {
+    dd_error("message less than 2, error!");
+    zmsg_destroy(&msg);
+    return 0;
+  }
+
+  zframe_t *proto_frame = zmsg_pop(msg);
+
+  if (*((uint32_t *)zframe_data(proto_frame)) != DD_VERSION) {
+    dd_error("Wrong version, expected 0x%x, got 0x%x", DD_VERSION,
+             *zframe_data(proto_frame));
+    zframe_destroy(&proto_frame);
+    zmsg_destroy(&msg);
+    return 0;
+  }
+  zframe_t *cmd_frame = zmsg_pop(msg);
+  uint32_t cmd = *((uint32_t *)zframe_data(cmd_frame));
+  zframe_destroy(&cmd_frame);
+  switch (cmd) {
+  case DD_CMD_REGOK:
+    s_cb_regok(self, msg);
+    break;
+  case DD_CMD_FORWARD:
+    s_cb_forward_dsock(self, msg);
+    break;
+  case DD_CMD_CHALL:
+    s_cb_chall(self, self->dsock, &self->broker_id, "broker", msg);
+    break;
+  case DD_CMD_PONG:
+    break;
+  case DD_CMD_ERROR:
+    s_cb_high_error(self, msg);
+    break;
+  case DD_CMD_ROUTE:
+    s_cb_route(self, msg);
+    break;
+  default:
+    dd_error("Unknown command, value: 0x%x", cmd);
+    break;
+  }
+  zmsg_destroy(&msg);
+  zframe_destroy(&proto_frame);
+  return 0;
+}
+
+static int s_on_shard_msg(zloop_t *loop, zsock_t *handle, void *arg) {
+  dd_broker_t *self = arg;
+  zmsg_t *msg = zmsg_recv(handle);
+#ifdef DEBUG
+  dd_debug("s_on_shard_msg called");
+  zmsg_print(msg);
+#endif
+
+  if (msg == NULL) {
+    dd_error("zmsg_recv returned NULL");
+    return 0;
+  }
+  int i;
+  parent_link *link = NULL;
+  for (i = 1; i < self->num_shards; i++) {
+    if (self->shards[i]->sock == handle) {
+      link = self->shards[i];
+      break;
+    }
+  }
+  if (link == NULL || zmsg_size(msg) < 2) {
+    zmsg_destroy(&msg);
+    return 0;
+  }
+  link->timeout = 0;
+
+  zframe_t *proto_frame = zmsg_pop(msg);
+  if (*((uint32_t *)zframe_data(proto_frame)) != DD_VERSION) {
+    dd_error("Wrong version from shard %s", link->endpoint);
+    zframe_destroy(&proto_frame);
+    zmsg_destroy(&msg);
+    return 0;
+  }
+  zframe_t *cmd_frame = zmsg_pop(msg);
+  uint32_t cmd = *((uint32_t *)zframe_data(cmd_frame));
+  zframe_destroy(&cmd_frame);
+  switch (cmd) {
+  case DD_CMD_CHALL:
+    s_cb_chall(self, link->sock, &link->broker_id, "broker", msg);
+    break;
+  case DD_CMD_REGOK:
+    dd_info("Registered with shard %s", link->endpoint);
+    link->state = DD_STATE_REGISTERED;
+    s_shard_move(self, i, 1);
+    break;
+  case DD_CMD_FORWARD:
+    s_cb_forward_dsock(self, msg);
+    break;
+  case DD_CMD_PONG:
+    break;
+  case DD_CMD_ERROR:
+    s_cb_high_error(self, msg);
+    break;
+  default:
+    dd_error("Unknown command from shard, value: 0x%x", cmd);
+    break;
+  }
+  zmsg_destroy(&msg);
+  zframe_destroy(&proto_frame);
+  return 0;
+}
+
+static int s_on_standby_msg(zloop_t *loop, zsock_t *handle, void *arg) {
+  dd_broker_t *self = arg;
+  parent_link *link = self->standby;
+  zmsg_t *msg = zmsg_recv(handle);
+#ifdef DEBUG
+  dd_debug("s_on_standby_msg called");
+  zmsg_print(msg);
+#endif
+
+  if (msg == NULL) {
+    dd_error("zmsg_recv returned NULL");
+    return 0;
+  }
+  if (link == NULL || link->sock != handle || zmsg_size(msg) < 2) {
+    zmsg_destroy(&msg);
+    return 0;
+  }
+  link->timeout = 0;
+
+  zframe_t *proto_frame = zmsg_pop(msg);
+  if (*((uint32_t *)zframe_data(proto_frame)) != DD_VERSION) {
+    dd_error("Wrong version from standby parent %s", link->endpoint);
+    zframe_destroy(&proto_frame);
+    zmsg_destroy(&msg);
+    return 0;
+  }
+  zframe_t *cmd_frame = zmsg_pop(msg);
+  uint32_t cmd = *((uint32_t *)zframe_data(cmd_frame));
+  zframe_destroy(&cmd_frame);
+  switch (cmd) {
+  case DD_CMD_CHALL:
+    s_cb_chall(self, link->sock, &link->broker_id, "standby", msg);
+    break;
+  case DD_CMD_REGOK:
+    dd_info("Registered as standby with %s", link->endpoint);
+    link->state = DD_STATE_REGISTERED;
+    // mirror our clients so that a failover doesn't have to
+    local_client *np;
+    dist_client *nd;
+    struct cds_lfht_iter iter;
+    struct cds_lfht_node *ht_node;
+    rcu_read_lock();
+    cds_lfht_first(self->lcl_cli_ht, &iter);
+    while ((ht_node = cds_lfht_iter_get_node(&iter)) != NULL) {
+      np = caa_container_of(ht_node, local_client, lcl_node);
+      int distance = 0;
+      zsock_send(link->sock, "bbbsb", &dd_version, 4, &dd_cmd_adddcl, 4,
+                 &self->keys->cookie, sizeof(self->keys->cookie),
+                 np->prefix_name, &distance, sizeof(distance));
+      cds_lfht_next(self->lcl_cli_ht, &iter);
+    }
+    cds_lfht_first(self->dist_cli_ht, &iter);
+    while ((ht_node = cds_lfht_iter_get_node(&iter)) != NULL) {
+      nd = caa_container_of(ht_node, dist_client, node);
+      zsock_send(link->sock, "bbbsb", &dd_version, 4, &dd_cmd_adddcl, 4,
+                 &self->keys->cookie, sizeof(self->keys->cookie), nd->name,
+                 &nd->distance, sizeof(nd->distance));
+      cds_lfht_next(self->dist_cli_ht, &iter);
+    }
+    rcu_read_unlock();
+    break;
+  case DD_CMD_FORWARD:
+    s_cb_forward_dsock(self, msg);
+    break;
+  case DD_CMD_PONG:
+    break;
+  case DD_CMD_ERROR:
+    // don't act on errors from a parent we aren't using yet
+    dd_warning("Got ERROR from standby parent %s", link->endpoint);
+    break;
+  default:
+    dd_error("Unknown command from standby, value: 0x%x", cmd);
+    break;
+  }
+  zmsg_destroy(&msg);
+  zframe_destroy(&proto_frame);
+  return 0;
+}
+
+// Returns the parent following 'current' in the configured list
+static char *s_next_dealer(dd_broker_t *self, char *current) {
+  char *t = zlist_first(self->dealer_strings);
+  char *first = t;
+  while (t != NULL) {
+    if (current && streq(t, current)) {
+      t = zlist_next(self->dealer_strings);
+      return t ? t : first;
+    }
+    t = zlist_next(self->dealer_strings);
+  }
+  return first;
+}
+
+static void s_standby_start(dd_broker_t *self) {
+  if (self->standby || zlist_size(self->dealer_strings) < 2)
+    return;
+
+  parent_link *link = calloc(1, sizeof(parent_link));
+  link->endpoint = strdup(s_next_dealer(self, self->dealer_connect));
+  link->state = DD_STATE_UNREG;
+  link->sock = zsock_new_dealer(NULL);
+  if (!link->sock || zsock_connect(link->sock, link->endpoint) != 0) {
+    dd_error("Error connecting standby dealer to %s", link->endpoint);
+    zsock_destroy(&link->sock);
+    free(link->endpoint);
+    free(link);
+    return;
+  }
+  zsock_set_linger(link->sock, 0);
+  self->standby = link;
+  zloop_reader(self->loop, link->sock, s_on_standby_msg, self);
+  zloop_reader_set_tolerant(self->loop, link->sock);
+  zsock_send(link->sock, "bbs", &dd_version, 4, &dd_cmd_addbr, 4,
+             self->keys->hash);
+}
+
+static void s_standby_stop(dd_broker_t *self) {
+  parent_link *link = self->standby;
+  if (link == NULL)
+    return;
+  if (link->sock) {
+    zloop_reader_end(self->loop, link->sock);
+    zsock_destroy(&link->sock);
+  }
+  if (link->broker_id)
+    zframe_destroy(&link->broker_id);
+  free(link->endpoint);
+  free(link);
+  self->standby = NULL;
+}
+
+// Promote the standby registration to the active parent. The standby
+// already knows our clients, so only the ACTIVATE has to be sent.
+static void s_failover(dd_broker_t *self) {
+  parent_link *link = self->standby;
+  dd_warning("Parent %s timed out, failing over to %s", self->dealer_connect,
+             link->endpoint);
+  zsock_send(link->sock, "bbb", &dd_version, 4, &dd_cmd_activate, 4,
+             &self->keys->cookie, sizeof(self->keys->cookie));
+
+  zloop_reader_end(self->loop, self->dsock);
+  zsock_set_linger(self->dsock, 0);
+  zsock_destroy(&self->dsock);
+  zloop_reader_end(self->loop, link->sock);
+  self->dsock = link->sock;
+  zloop_reader(self->loop, self->dsock, s_on_dealer_msg, self);
+  zloop_reader_set_tolerant(self->loop, self->dsock);
+
+  zframe_destroy(&self->broker_id);
+  self->broker_id = link->broker_id;
+  free(self->dealer_connect);
+  self->dealer_connect = link->endpoint;
+  free(link);
+  self->standby = NULL;
+  self->timeout = 0;
+
+  if (self->pubN)
+    connect_pubsubN(self);
+  s_standby_start(self);
+}
+
+static int s_shard_alive(dd_broker_t *self, int shard) {
+  if (shard == 0)
+    return self->state == DD_STATE_REGISTERED;
+  return self->shards[shard]->state == DD_STATE_REGISTERED;
+}
+
+// Walk the ring clockwise from the hash of name to the first live shard,
+// optionally pretending that 'skip' is down. Returns -1 if none is live.
+static int s_shard_owner(dd_broker_t *self, char *name, int skip) {
+  uint32_t hash = XXH32(name, strlen(name), XXHSEED);
+  int lo = 0, hi = self->shard_ring_len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (self->shard_ring[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int i;
+  for (i = 0; i < self->shard_ring_len; i++) {
+    int shard = self->shard_ring[(lo + i) % self->shard_ring_len].shard;
+    if (shard != skip && s_shard_alive(self, shard))
+      return shard;
+  }
+  return -1;
+}
+
+static zsock_t *s_shard_sock(dd_broker_t *self, char *name) {
+  if (self->num_shards == 0)
+    return self->state == DD_STATE_REGISTERED ? self->dsock : NULL;
+  int shard = s_shard_owner(self, name, -1);
+  if (shard < 0)
+    return NULL;
+  return shard == 0 ? self->dsock : self->shards[shard]->sock;
+}
+
+static int s_is_root(dd_broker_t *self) {
+  if (self->state != DD_STATE_ROOT)
+    return 0;
+  int i;
+  for (i = 1; i < self->num_shards; i++)
+    if (self->shards[i]->state == DD_STATE_REGISTERED)
+      return 0;
+  return 1;
+}
+
+static void s_shard_move_name(dd_broker_t *self, int shard, int up, char *name,
+                              int distance) {
+  // nothing to do unless shard owns the name when it is live
+  if (s_shard_owner(self, name, -1) != shard)
+    return;
+  int other = s_shard_owner(self, name, shard);
+  zsock_t *shard_sock = shard == 0 ? self->dsock : self->shards[shard]->sock;
+  zsock_t *other_sock = NULL;
+  if (other >= 0)
+    other_sock = other == 0 ? self->dsock : self->shards[other]->sock;
+
+  if (up) {
+    if (other_sock)
+      zsock_send(other_sock, "bbbs", &dd_version, 4, &dd_cmd_unregdcli, 4,
+                 &self->keys->cookie, sizeof(self->keys->cookie), name);
+    zsock_send(shard_sock, "bbbsb", &dd_version, 4, &dd_cmd_adddcl, 4,
+               &self->keys->cookie, sizeof(self->keys->cookie), name,
+               &distance, sizeof(distance));
+  } else if (other_sock) {
+    zsock_send(other_sock, "bbbsb", &dd_version, 4, &dd_cmd_adddcl, 4,
+               &self->keys->cookie, sizeof(self->keys->cookie), name,
+               &distance, sizeof(distance));
+  }
+}
+
+// Re-home the clients owned by a shard that just came up (after it is
+// marked live) or is about to go down (before it is marked dead)
+static void s_shard_move(dd_broker_t *self, int shard, int up) {
+  local_client *np;
+  dist_client *nd;
+  struct cds_lfht_iter iter;
+  struct cds_lfht_node *ht_node;
+  rcu_read_lock();
+  cds_lfht_first(self->lcl_cli_ht, &iter);
+  while ((ht_node = cds_lfht_iter_get_node(&iter)) != NULL) {
+    np = caa_container_of(ht_node, local_client, lcl_node);
+    s_shard_move_name(self, shard, up, np->prefix_name, 0);
+    cds_lfht_next(self->lcl_cli_ht, &iter);
+  }
+  cds_lfht_first(self->dist_cli_ht, &iter);
+  while ((ht_node = cds_lfht_iter_get_node(&iter)) != NULL) {
+    nd = caa_container_of(ht_node, dist_client, node);
+    s_shard_move_name(self, shard, up, nd->name, nd->distance);
+    cds_lfht_next(self->dist_cli_ht, &iter);
+  }
+  rcu_read_unlock();
+}
+
+static int s_shard_point_cmp(const void *a, const void *b) {
+  const shard_point *pa = a, *pb = b;
+  if (pa->hash == pb->hash)
+    return pa->shard - pb->shard;
+  return pa->hash < pb->hash ? -1 : 1;
+}
+
+static void s_shard_connect(dd_broker_t *self, parent_link *link) {
+  if (link->sock) {
+    zloop_reader_end(self->loop, link->sock);
+    zsock_set_linger(link->sock, 0);
+    zsock_destroy(&link->sock);
+  }
+  link->state = DD_STATE_UNREG;
+  link->timeout = 0;
+  link->sock = zsock_new_dealer(NULL);
+  if (!link->sock || zsock_connect(link->sock, link->endpoint) != 0) {
+    dd_error("Error connecting shard dealer to %s", link->endpoint);
+    zsock_destroy(&link->sock);
+    return;
+  }
+  zloop_reader(self->loop, link->sock, s_on_shard_msg, self);
+  zloop_reader_set_tolerant(self->loop, link->sock);
+  zsock_send(link->sock, "bbs", &dd_version, 4, &dd_cmd_addbr, 4,
+             self->keys->hash);
+}
+
+static int s_shard_heartbeat(zloop_t *loop, int timer_id, void *arg) {
+  dd_broker_t *self = arg;
+  int i;
+  for (i = 1; i < self->num_shards; i++) {
+    parent_link *link = self->shards[i];
+    if (link->state != DD_STATE_REGISTERED) {
+      // retry registration
+      if (++link->timeout > 3 || link->sock == NULL)
+        s_shard_connect(self, link);
+      continue;
+    }
+    if (++link->timeout > 3) {
+      dd_warning("Shard %s timed out", link->endpoint);
+      s_shard_move(self, i, 0);
+      s_shard_connect(self, link);
+      continue;
+    }
+    zsock_send(link->sock, "bbb", &dd_version, 4, &dd_cmd_ping, 4,
+               &self->keys->cookie, sizeof(self->keys->cookie));
+  }
+  return 0;
+}
+
+// Build the hash ring over the dealer and the additional shards and
+// start registering with the latter
+static void s_shard_start(dd_broker_t *self) {
+  if (zlist_size(self->shard_strings) < 2)
+    return;
+
+  self->num_shards = zlist_size(self->shard_strings);
+  self->shards = calloc(self->num_shards, sizeof(parent_link *));
+  self->shard_ring_len = self->num_shards * DD_SHARD_VNODES;
+  self->shard_ring = calloc(self->shard_ring_len, sizeof(shard_point));
+
+  char buf[256];
+  int i = 0, v;
+  char *t = zlist_first(self->shard_strings);
+  while (t) {
+    // the ring is built from the shard's position, not its address, so all
+    // children agree as long as they list the shards in the same order
+    for (v = 0; v < DD_SHARD_VNODES; v++) {
+      int len = snprintf(buf, sizeof(buf), "shard-%d#%d", i, v);
+      self->shard_ring[i * DD_SHARD_VNODES + v].hash =
+          XXH32(buf, len, XXHSEED);
+      self->shard_ring[i * DD_SHARD_VNODES + v].shard = i;
+    }
+    if (i > 0) {
+      self->shards[i] = calloc(1, sizeof(parent_link));
+      self->shards[i]->endpoint = strdup(t);
+      s_shard_connect(self, self->shards[i]);
+    }
+    i++;
+    t = zlist_next(self->shard_strings);
+  }
+  qsort(self->shard_ring, self->shard_ring_len, sizeof(shard_point),
+        s_shard_point_cmp);
+  dd_info("Root tier of %d shards", self->num_shards);
+  self->shard_loop = zloop_timer(self->loop, 1000, 0, s_shard_heartbeat, self);
+}
+
+// Tell a child broker that talks a lot to a client under one of its
+// siblings where that sibling can be reached directly
+static void s_shortcut_hint(dd_broker_t *self, zframe_t *sockid,
+                            char *dst_string, dist_client *dn) {
+  if (++dn->forwards % DD_SHORTCUT_THRESHOLD != 0)
+    return;
+  if (zframe_eq(sockid, dn->broker))
+    return;
+  local_broker *src_br =
+      hashtable_has_local_broker(self, sockid, self->keys->cookie, 0);
+  local_broker *dst_br =
+      hashtable_has_local_broker(self, dn->broker, self->keys->cookie, 0);
+  // both ends have to offer shortcuts
+  if (!src_br || !src_br->endpoint || !dst_br || !dst_br->endpoint)
+    return;
+  dd_debug("Suggesting shortcut to %s via %s", dst_string, dst_br->endpoint);
+  zsock_send(self->rsock, "fbbss", sockid, &dd_version, 4, &dd_cmd_route, 4,
+             dst_string, dst_br->endpoint);
+}
 
-  return 0;
+static parent_link *s_shortcut_find(dd_broker_t *self, zsock_t *sock) {
+  parent_link *link = zhash_first(self->shortcut_links);
+  while (link) {
+    if (link->sock == sock)
+      return link;
+    link = zhash_next(self->shortcut_links);
+  }
+  return NULL;
 }
 
-static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *arg) {
+static int s_on_shortcut_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   dd_broker_t *self = arg;
-  self->timeout = 0;
   zmsg_t *msg = zmsg_recv(handle);
 #ifdef DEBUG
-  dd_debug("s_on_dealer_msg called");
+  dd_debug("s_on_shortcut_msg called");
   zmsg_print(msg);
 #endif
 
@@ -1525,17 +3206,16 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *arg) {
     dd_error("zmsg_recv returned NULL");
     return 0;
   }
-  if (zmsg_size(msg) < 2) {
-    dd_error("message less than 2, error!");
+  parent_link *link = s_shortcut_find(self, handle);
+  if (link == NULL || zmsg_size(msg) < 2) {
     zmsg_destroy(&msg);
     return 0;
   }
+  link->timeout = 0;
 
   zframe_t *proto_frame = zmsg_pop(msg);
-
   if (*((uint32_t *)zframe_data(proto_frame)) != DD_VERSION) {
-    dd_error("Wrong version, expected 0x%x, got 0x%x", DD_VERSION,
-             *zframe_data(proto_frame));
+    dd_error("Wrong version from shortcut %s", link->endpoint);
     zframe_destroy(&proto_frame);
     zmsg_destroy(&msg);
     return 0;
@@ -1544,22 +3224,23 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   uint32_t cmd = *((uint32_t *)zframe_data(cmd_frame));
   zframe_destroy(&cmd_frame);
   switch (cmd) {
+  case DD_CMD_CHALL:
+    s_cb_chall(self, link->sock, &link->broker_id, "shortcut", msg);
+    break;
   case DD_CMD_REGOK:
-    s_cb_regok(self, msg);
+    dd_info("Shortcut to %s established", link->endpoint);
+    link->state = DD_STATE_REGISTERED;
     break;
   case DD_CMD_FORWARD:
     s_cb_forward_dsock(self, msg);
     break;
-  case DD_CMD_CHALL:
-    s_cb_chall(self, msg);
-    break;
   case DD_CMD_PONG:
     break;
   case DD_CMD_ERROR:
     s_cb_high_error(self, msg);
     break;
   default:
-    dd_error("Unknown command, value: 0x%x", cmd);
+    dd_error("Unknown command from shortcut, value: 0x%x", cmd);
     break;
   }
   zmsg_destroy(&msg);
@@ -1567,9 +3248,96 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *arg) {
   return 0;
 }
 
+static void s_shortcut_drop(dd_broker_t *self, parent_link *link) {
+  // routes through the link fall back to the tree
+  zlist_t *keys = zhash_keys(self->shortcut_routes);
+  char *dst = zlist_first(keys);
+  while (dst) {
+    if (zhash_lookup(self->shortcut_routes, dst) == link)
+      zhash_delete(self->shortcut_routes, dst);
+    dst = zlist_next(keys);
+  }
+  zlist_destroy(&keys);
+
+  zloop_reader_end(self->loop, link->sock);
+  zsock_set_linger(link->sock, 0);
+  zsock_destroy(&link->sock);
+  if (link->broker_id)
+    zframe_destroy(&link->broker_id);
+  zhash_delete(self->shortcut_links, link->endpoint);
+  free(link->endpoint);
+  free(link);
+}
+
+static void s_shortcut_heartbeat(dd_broker_t *self) {
+  zlist_t *dead = zlist_new();
+  parent_link *link = zhash_first(self->shortcut_links);
+  while (link) {
+    if (++link->timeout > 3)
+      zlist_append(dead, link);
+    else if (link->state == DD_STATE_REGISTERED)
+      zsock_send(link->sock, "bbb", &dd_version, 4, &dd_cmd_ping, 4,
+                 &self->keys->cookie, sizeof(self->keys->cookie));
+    link = zhash_next(self->shortcut_links);
+  }
+  link = zlist_first(dead);
+  while (link) {
+    dd_warning("Shortcut to %s timed out", link->endpoint);
+    s_shortcut_drop(self, link);
+    link = zlist_next(dead);
+  }
+  zlist_destroy(&dead);
+}
+
+static void s_cb_route(dd_broker_t *self, zmsg_t *msg) {
+  char *dst = zmsg_popstr(msg);
+  char *endpoint = zmsg_popstr(msg);
+  if (dst == NULL || endpoint == NULL) {
+    dd_error("DD_CMD_ROUTE: misformed message!");
+    goto cleanup;
+  }
+  if (self->shortcut_connect == NULL || streq(endpoint, self->shortcut_connect))
+    goto cleanup;
+  if (zhash_size(self->shortcut_routes) >= DD_SHORTCUT_MAX_ROUTES &&
+      zhash_lookup(self->shortcut_routes, dst) == NULL)
+    goto cleanup;
+
+  parent_link *link = zhash_lookup(self->shortcut_links, endpoint);
+  if (link == NULL) {
+    link = calloc(1, sizeof(parent_link));
+    link->endpoint = strdup(endpoint);
+    link->state = DD_STATE_UNREG;
+    link->sock = zsock_new_dealer(NULL);
+    if (!link->sock || zsock_connect(link->sock, "%s", endpoint) != 0) {
+      dd_error("Error connecting shortcut to %s", endpoint);
+      zsock_destroy(&link->sock);
+      free(link->endpoint);
+      free(link);
+      goto cleanup;
+    }
+    zhash_insert(self->shortcut_links, endpoint, link);
+    zloop_reader(self->loop, link->sock, s_on_shortcut_msg, self);
+    zloop_reader_set_tolerant(self->loop, link->sock);
+    zsock_send(link->sock, "bbs", &dd_version, 4, &dd_cmd_addbr, 4,
+               self->keys->hash);
+  }
+  dd_debug("Routing %s via shortcut %s", dst, endpoint);
+  zhash_update(self->shortcut_routes, dst, link);
+cleanup:
+  free(dst);
+  free(endpoint);
+}
+
 static int s_register(zloop_t *loop, int timer_id, void *arg) {
   dd_broker_t *self = arg;
   if (self->state == DD_STATE_UNREG || self->state == DD_STATE_ROOT) {
+    // try the next parent in the list if the last attempt failed
+    if (self->reg_attempts++ > 0 && zlist_size(self->dealer_strings) > 1) {
+      char *next = strdup(s_next_dealer(self, self->dealer_connect));
+      free(self->dealer_connect);
+      self->dealer_connect = next;
+      dd_info("Trying to register with %s", self->dealer_connect);
+    }
     if (self->dsock) {
       zsock_set_linger(self->dsock, 0);
       zloop_reader_end(self->loop, self->dsock);
@@ -1590,22 +3358,53 @@ static int s_register(zloop_t *loop, int timer_id, void *arg) {
 
     zsock_send(self->dsock, "bbs", &dd_version, 4, &dd_cmd_addbr, 4,
                self->keys->hash);
+    self->reg_loop = zloop_timer(self->loop, dd_backoff(self->reg_attempts), 1,
+                                 s_register, self);
   }
   return 0;
 }
 
+// Pings the active parent every DD_PARENT_PROBE ms so that a standby can
+// take over within a second, the rest only every DD_HEARTBEAT ms
 static int s_heartbeat(zloop_t *loop, int timer_id, void *arg) {
   dd_broker_t *self = arg;
-  // how to pass self? socket = dsock
+  int ticks = DD_HEARTBEAT / DD_PARENT_PROBE;
+  int beat = (++self->heartbeat_ticks % ticks) == 0;
   self->timeout += 1;
-  if (self->timeout > 3) {
+  if (self->standby && beat) {
+    self->standby->timeout += 1;
+    if (self->standby->timeout > 3) {
+      dd_warning("Standby parent %s timed out", self->standby->endpoint);
+      s_standby_stop(self);
+    }
+  }
+  if (self->timeout > DD_PARENT_MISSES && self->standby &&
+      self->standby->state == DD_STATE_REGISTERED) {
+    s_failover(self);
+  } else if (self->timeout > 3 * ticks) {
+    s_standby_stop(self);
+    if (self->num_shards > 0)
+      s_shard_move(self, 0, 0);
     self->state = DD_STATE_ROOT;
+    self->reg_attempts = 1;
     zloop_timer_end(self->loop, self->heartbeat_loop);
-    self->reg_loop = zloop_timer(self->loop, 1000, 0, s_register, self);
+    self->reg_loop =
+        zloop_timer(self->loop, dd_backoff(0), 1, s_register, self);
   }
   zsock_send(self->dsock, "bbb", &dd_version, sizeof(dd_version), &dd_cmd_ping,
              sizeof(dd_cmd_ping), &self->keys->cookie,
              sizeof(self->keys->cookie));
+  if (!beat)
+    return 0;
+  if (self->standby) {
+    zsock_send(self->standby->sock, "bbb", &dd_version, sizeof(dd_version),
+               &dd_cmd_ping, sizeof(dd_cmd_ping), &self->keys->cookie,
+               sizeof(self->keys->cookie));
+  } else if (self->state == DD_STATE_REGISTERED) {
+    s_standby_start(self);
+  }
+  if (self->shortcut_links)
+    s_shortcut_heartbeat(self);
   return 0;
 }
 
@@ -1622,36 +3421,52 @@ static int s_check_cli_timeout(zloop_t *loop, int timer_fd, void *arg) {
   cds_lfht_first(self->lcl_cli_ht, &iter);
   struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
   while (ht_node != NULL) {
-    rcu_read_unlock();
     np = caa_container_of(ht_node, local_client, lcl_node);
+    // step past the node before it is deleted
+    cds_lfht_next(self->lcl_cli_ht, &iter);
     if (np->timeout < 3) {
       np->timeout += 1;
     } else {
       dd_debug("deleting local client %s", np->prefix_name);
+      // freed after the grace period, so np stays valid until we unlock
       unreg_cli(self, np->sockid, np->cookie);
     }
-    rcu_read_lock();
-    cds_lfht_next(self->lcl_cli_ht, &iter);
     ht_node = cds_lfht_iter_get_node(&iter);
-  };
+  }
   rcu_read_unlock();
   return 0;
 }
+static int s_expire_nodst(zloop_t *loop, int timer_fd, void *arg) {
+  dd_broker_t *self = arg;
+  hashtable_expire_nodst(self, 0);
+  return 0;
+}
+
+static int s_expire_queued(zloop_t *loop, int timer_fd, void *arg) {
+  dd_broker_t *self = arg;
+  int dropped = sfqueue_expire(self->sfq, zclock_mono());
+  if (dropped > 0)
+    dd_info("Dropped %d queued notifications that expired", dropped);
+  return 0;
+}
+
 // The delete_dist_clients sends on a socket that is being polled in the main thread
 // this can cause an assert in src/signal.cpp:282
 // Either lock the socket, or skip the separate thread, or have some signaling thread
 // between them.
 static int s_check_br_timeout(zloop_t *loop, int timer_fd, void *arg) {
   dd_broker_t *self = arg;
+  hashtable_slabs_flush(self);
   // iterate through local brokers and check if they should time out
   struct cds_lfht_iter iter;
   local_broker *np;
   rcu_read_lock();
   cds_lfht_first(self->lcl_br_ht, &iter);
   struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
-  rcu_read_unlock();
   while (ht_node != NULL) {
     np = caa_container_of(ht_node, local_broker, node);
+    // step past the node before it is deleted
+    cds_lfht_next(self->lcl_br_ht, &iter);
     if (np->timeout < 3) {
       np->timeout += 1;
     } else {
@@ -1660,57 +3475,72 @@ static int s_check_br_timeout(zloop_t *loop, int timer_fd, void *arg) {
 
       delete_dist_clients(self, np);
 
-      rcu_read_lock();
       int ret = cds_lfht_del(self->lcl_br_ht, ht_node);
-      rcu_read_unlock();
       if (ret) {
         dd_info(" - Local broker %s removed (concurrently)",
                 zframe_tostr(np->sockid, buf));
-        free(np);
       } else {
-        synchronize_rcu();
         dd_info(" - Local broker %s removed", zframe_tostr(np->sockid, buf));
-        free(np);
+        // reclaimed after the grace period, the iterator may still see it
+        slab_free_rcu(self->lcl_br_slab, np);
       }
     }
-    rcu_read_lock();
-    cds_lfht_next(self->lcl_cli_ht, &iter);
     ht_node = cds_lfht_iter_get_node(&iter);
-    rcu_read_unlock();
   }
+  rcu_read_unlock();
   return 0;
 }
 
 /* helper functions */
 
 void add_cli_up(dd_broker_t *self, char *prefix_name, int distance) {
-  if (self->state != DD_STATE_REGISTERED)
+  s_cli_up(self, prefix_name, distance, 0);
+}
+
+// ADDDCL to the parent and its standby, with takeover set the client may
+// already be known above through a broker that failed
+static void s_cli_up(dd_broker_t *self, char *prefix_name, int distance,
+                     uint32_t takeover) {
+  zsock_t *sock = s_shard_sock(self, prefix_name);
+  if (sock == NULL)
     return;
 
   dd_debug("add_cli_up(%s,%d), state = %d", prefix_name, distance, self->state);
-  zsock_send(self->dsock, "bbbsb", &dd_version, 4, &dd_cmd_adddcl, 4,
+  zsock_send(sock, "bbbsbb", &dd_version, 4, &dd_cmd_adddcl, 4,
              &self->keys->cookie, sizeof(self->keys->cookie), prefix_name,
-             &distance, sizeof(distance));
+             &distance, sizeof(distance), &takeover, sizeof(takeover));
+  if (self->standby && self->standby->state == DD_STATE_REGISTERED)
+    zsock_send(self->standby->sock, "bbbsbb", &dd_version, 4,
+               &dd_cmd_adddcl, 4, &self->keys->cookie,
+               sizeof(self->keys->cookie), prefix_name, &distance,
+               sizeof(distance), &takeover, sizeof(takeover));
 }
 
 void del_cli_up(dd_broker_t *self, char *prefix_name) {
-  if (self->state != DD_STATE_ROOT) {
+  // only a registered link is returned, shard 0 may be down while the
+  // shard that took over its names is not
+  zsock_t *sock = s_shard_sock(self, prefix_name);
+  if (sock) {
     dd_debug("del_cli_up %s", prefix_name);
-    zsock_send(self->dsock, "bbbs", &dd_version, 4, &dd_cmd_unregdcli, 4,
+    zsock_send(sock, "bbbs", &dd_version, 4, &dd_cmd_unregdcli, 4,
                &self->keys->cookie, sizeof(self->keys->cookie), prefix_name);
+    if (self->standby && self->standby->state == DD_STATE_REGISTERED)
+      zsock_send(self->standby->sock, "bbbs", &dd_version, 4,
+                 &dd_cmd_unregdcli, 4, &self->keys->cookie,
+                 sizeof(self->keys->cookie), prefix_name);
   }
 }
 
-void forward_locally(dd_broker_t *self, zframe_t *dest_sockid, char *src_string,
-                     zmsg_t *msg) {
+int forward_locally(dd_broker_t *self, zframe_t *dest_sockid, char *src_string,
+                    zmsg_t *msg, int plaintext) {
 #ifdef DEBUG
   dd_debug("forward_locally: src: %s", src_string);
   zframe_print(dest_sockid, "dest_sockid");
   zmsg_print(msg);
 #endif
 
-  zsock_send(self->rsock, "fbbsm", dest_sockid, &dd_version, 4, &dd_cmd_data, 4,
-             src_string, msg);
+  return flow_send(self, dest_sockid, plaintext ? &dd_cmd_datapt : &dd_cmd_data,
+                   src_string, NULL, msg);
 }
 
 void forward_down(dd_broker_t *self, char *src_string, char *dst_string,
@@ -1719,8 +3549,8 @@ void forward_down(dd_broker_t *self, char *src_string, char *dst_string,
   dd_info("Sending CMD_FORWARD to broker with sockid");
   print_zframe(br_sockid);
 #endif
-  zsock_send(self->rsock, "fbbssm", br_sockid, &dd_version, 4, &dd_cmd_forward,
-             4, src_string, dst_string, msg);
+  zsock_send(self->rsock, "fbbssm", br_sockid, &dd_version, 4,
+             &dd_cmd_forward, 4, src_string, dst_string, msg);
 }
 void forward_up(dd_broker_t *self, char *src_string, char *dst_string,
                 zmsg_t *msg) {
@@ -1728,8 +3558,14 @@ void forward_up(dd_broker_t *self, char *src_string, char *dst_string,
   dd_debug("forward_up called s: %s d: %s", src_string, dst_string);
   zmsg_print(msg);
 #endif
-  if (self->state == DD_STATE_REGISTERED)
-    zsock_send(self->dsock, "bbbssm", &dd_version, 4, &dd_cmd_forward, 4,
+  zsock_t *sock = s_shard_sock(self, dst_string);
+  parent_link *link;
+  if (self->shortcut_routes &&
+      (link = zhash_lookup(self->shortcut_routes, dst_string)) &&
+      link->state == DD_STATE_REGISTERED)
+    sock = link->sock;
+  if (sock)
+    zsock_send(sock, "bbbssm", &dd_version, 4, &dd_cmd_forward, 4,
                &self->keys->cookie, sizeof(self->keys->cookie), src_string,
                dst_string, msg);
 }
@@ -1762,6 +3598,15 @@ void connect_pubsubN(dd_broker_t *self) {
   assert(zrex_valid(rexipc));
   zrex_t *rextcp = zrex_new(TCP_REGEX);
   assert(zrex_valid(rextcp));
+
+  // after a failover, move the existing sockets to the new parent so that
+  // XSUB resends our subscriptions
+  if (self->pubN && self->pub_connect) {
+    zsock_disconnect(self->pubN, "%s", self->pub_connect);
+    zsock_disconnect(self->subN, "%s", self->sub_connect);
+    free(self->pub_connect);
+    free(self->sub_connect);
+  }
   self->sub_connect = malloc(strlen(self->dealer_connect) + 5);
   self->pub_connect = malloc(strlen(self->dealer_connect) + 5);
 
@@ -1783,8 +3628,11 @@ void connect_pubsubN(dd_broker_t *self) {
 
   dd_info("pub_connect: %s sub_connect: %s", self->pub_connect,
           self->sub_connect);
-  self->pubN = zsock_new(ZMQ_XPUB);
-  self->subN = zsock_new(ZMQ_XSUB);
+  int first = (self->pubN == NULL);
+  if (first) {
+    self->pubN = zsock_new(ZMQ_XPUB);
+    self->subN = zsock_new(ZMQ_XSUB);
+  }
   int rc = zsock_connect(self->pubN, self->pub_connect);
   if (rc < 0) {
     dd_error("Unable to connect pubN to %s", self->pub_connect);
@@ -1798,6 +3646,9 @@ void connect_pubsubN(dd_broker_t *self) {
     perror("Error: ");
     exit(EXIT_FAILURE);
   }
+  if (!first)
+    return;
+
   rc = zloop_reader(self->loop, self->pubN, s_on_pubN_msg, self);
   assert(rc == 0);
   zloop_reader_set_tolerant(self->loop, self->pubN);
@@ -1988,6 +3839,9 @@ void start_pubsub(dd_broker_t *self) {
 
   self->pubS = zsock_new(ZMQ_XPUB);
   self->subS = zsock_new(ZMQ_XSUB);
+  // every subscription, a broker subscribing after another one for the
+  // same topic needs the retained publications as well
+  zsock_set_xpub_verbose(self->pubS, 1);
   int rc = zsock_attach(self->pubS, self->pub_bind, true);
   if (rc < 0) {
     dd_error("Unable to attach pubS to %s", self->pub_bind);
@@ -2079,10 +3933,11 @@ static json_object *json_get_stats(dd_broker_t *self) {
     sn = caa_container_of(ht_node, subscribe_node, node);
     json_object *jsub_array = json_object_new_array();
     if (sn->topics) {
-      char *str = zlist_first(sn->topics);
-      while (str) {
-        json_object_array_add(jsub_array, json_object_new_string(str));
-        str = zlist_next(sn->topics);
+      void *item = zhash_first(sn->topics);
+      while (item) {
+        json_object_array_add(
+            jsub_array, json_object_new_string(zhash_cursor(sn->topics)));
+        item = zhash_next(sn->topics);
       }
     } else {
       json_object_array_add(jsub_array, json_object_new_string("empty!"));
@@ -2098,6 +3953,54 @@ static json_object *json_get_stats(dd_broker_t *self) {
   json_object_object_add(jobj, "local", jlocal_obj);
   json_object_object_add(jobj, "distant", jdist_array);
   json_object_object_add(jobj, "subs", jsub_dict);
+
+  // flow control counters
+  json_object *jflow = json_object_new_object();
+  json_object_object_add(jflow, "clients",
+                         json_object_new_int(self->flow_count));
+  json_object_object_add(jflow, "drops",
+                         json_object_new_int64(self->flow_drops));
+  json_object *jten = json_object_new_object();
+  ddtenant_t *ten = zhash_first(self->keys->tenantkeys);
+  while (ten) {
+    json_object *jt = json_object_new_object();
+    json_object_object_add(jt, "queued", json_object_new_int(ten->queued));
+    json_object_object_add(jt, "drops", json_object_new_int64(ten->drops));
+    json_object_object_add(jt, "clients", json_object_new_int(ten->clients));
+    json_object_object_add(jt, "subscriptions",
+                           json_object_new_int(ten->subscriptions));
+    json_object_object_add(jt, "queued_bytes",
+                           json_object_new_int64(ten->queued_bytes));
+    json_object_object_add(jten, ten->name, jt);
+    ten = zhash_next(self->keys->tenantkeys);
+  }
+  json_object_object_add(jflow, "tenants", jten);
+  json_object_object_add(jobj, "flow", jflow);
+  json_object *jadmit = json_object_new_object();
+  json_object_object_add(jadmit, "pending",
+                         json_object_new_int(zhash_size(self->chall_pending)));
+  json_object_object_add(jadmit, "queued",
+                         json_object_new_int(zlist_size(self->admit_queue)));
+  json_object_object_add(jadmit, "drops",
+                         json_object_new_int64(self->admit_drops));
+  json_object_object_add(jobj, "admission", jadmit);
+  if (self->publog) {
+    json_object *jlog = json_object_new_object();
+    json_object_object_add(
+        jlog, "topics", json_object_new_int(zhash_size(self->publog->topics)));
+    json_object_object_add(jlog, "refused",
+                           json_object_new_int64(self->publog->refused));
+    json_object_object_add(jobj, "log", jlog);
+  }
+  // receive buffer reuse on the router socket
+  json_object *jpool = json_object_new_object();
+  json_object_object_add(jpool, "received",
+                         json_object_new_int64(self->msgpool->recvs));
+  json_object_object_add(jpool, "allocated",
+                         json_object_new_int64(self->msgpool->misses));
+  json_object_object_add(jpool, "free",
+                         json_object_new_int(self->msgpool->nfree));
+  json_object_object_add(jobj, "msgpool", jpool);
   json_object_object_add(jobj, "version",
                          json_object_new_string(PACKAGE_VERSION));
   return jobj;
@@ -2317,6 +4220,35 @@ void broker_gc_rest(zsock_t *pipe, void *args) {
   zloop_destroy(&gc_loop);
 }
 
+static void s_open_log(dd_broker_t *self) {
+  if (self->log_dir == NULL)
+    return;
+  self->publog =
+      publog_new(self->log_dir, self->log_segment, self->log_segments);
+  if (self->publog == NULL) {
+    dd_error("Couldn't open the publication log in %s", self->log_dir);
+  } else {
+    self->publog->max_topics = self->log_topics;
+    self->publog->tenant_max_topics = self->tenant_max_log_topics;
+    dd_info("Logging publications to %s, last number %llu", self->log_dir,
+            (unsigned long long)self->publog->seq);
+  }
+}
+
+static void s_open_queue(dd_broker_t *self) {
+  if (self->queue_max <= 0)
+    return;
+  self->sfq = sfqueue_new(self->queue_max);
+  self->sfq->max_bytes = self->queue_bytes;
+  self->sfq->ttl = self->queue_ttl;
+  self->sfq->tenant_max_dests = self->queue_dests;
+  if (self->queue_spill)
+    self->sfq->spill_dir = strdup(self->queue_spill);
+  zloop_timer(self->loop, 1000, 0, s_expire_queued, self);
+  dd_info("Queueing up to %d notifications for offline clients for %d ms",
+          self->queue_max, self->queue_ttl);
+}
+
 void broker_actor(zsock_t *pipe, void *args) {
   dd_broker_t *self = args;
   assert(self);
@@ -2344,7 +4276,8 @@ void broker_actor(zsock_t *pipe, void *args) {
     rc = zloop_reader(self->loop, self->dsock, s_on_dealer_msg, self);
     assert(rc == 0);
     zloop_reader_set_tolerant(self->loop, self->dsock);
-    self->reg_loop = zloop_timer(self->loop, 1000, 0, s_register, self);
+    self->reg_loop = zloop_timer(self->loop, dd_backoff(0), 1, s_register, self);
+    s_shard_start(self);
   } else {
     dd_info("Will act as ROOT broker");
     self->state = DD_STATE_ROOT;
@@ -2359,6 +4292,11 @@ void broker_actor(zsock_t *pipe, void *args) {
       zloop_timer(self->loop, 3000, 0, s_check_cli_timeout, self);
   self->br_timeout_loop =
       zloop_timer(self->loop, 1000, 0, s_check_br_timeout, self);
+  if (self->nodst_ttl > 0)
+    self->nodst_loop =
+        zloop_timer(self->loop, self->nodst_ttl, 0, s_expire_nodst, self);
+  s_open_log(self);
+  s_open_queue(self);
 
   // create and attach the pubsub southbound sockets
   start_pubsub(self);
@@ -2424,7 +4362,8 @@ int dd_broker_start(dd_broker_t *self) {
     rc = zloop_reader(self->loop, self->dsock, s_on_dealer_msg, self);
     assert(rc == 0);
     zloop_reader_set_tolerant(self->loop, self->dsock);
-    self->reg_loop = zloop_timer(self->loop, 1000, 0, s_register, self);
+    self->reg_loop = zloop_timer(self->loop, dd_backoff(0), 1, s_register, self);
+    s_shard_start(self);
   } else {
     dd_info("No dealer defined, the broker will act as the root");
     self->state = DD_STATE_ROOT;
@@ -2434,6 +4373,11 @@ int dd_broker_start(dd_broker_t *self) {
       zloop_timer(self->loop, 3000, 0, s_check_cli_timeout, self);
   self->br_timeout_loop =
       zloop_timer(self->loop, 1000, 0, s_check_br_timeout, self);
+  if (self->nodst_ttl > 0)
+    self->nodst_loop =
+        zloop_timer(self->loop, self->nodst_ttl, 0, s_expire_nodst, self);
+  s_open_log(self);
+  s_open_queue(self);
 
   // create and attach the pubsub southbound sockets
   start_pubsub(self);
@@ -2458,6 +4402,12 @@ int dd_broker_start(dd_broker_t *self) {
     zsock_set_linger(self->dsock, 0);
   if (self->rsock)
     zsock_set_linger(self->rsock, 0);
+  if (self->standby)
+    zsock_set_linger(self->standby->sock, 0);
+  int i;
+  for (i = 1; i < self->num_shards; i++)
+    if (self->shards[i]->sock)
+      zsock_set_linger(self->shards[i]->sock, 0);
 
   zsock_destroy(&self->http);
   zsock_destroy(&self->pubS);
@@ -2484,7 +4434,26 @@ int dd_broker_set_dealer(dd_broker_t *self, char *dealerstr) {
     free(self->dealer_connect);
   if (self->dsock)
     zsock_destroy(&self->dsock);
-  self->dealer_connect = strdup(dealerstr);
+
+  // a comma separated list gives the parents in order of preference
+  char *t = zlist_first(self->dealer_strings);
+  while (t != NULL) {
+    free(t);
+    t = zlist_next(self->dealer_strings);
+  }
+  zlist_purge(self->dealer_strings);
+  char *copy = strdup(dealerstr);
+  char *saveptr = NULL;
+  for (t = strtok_r(copy, ",", &saveptr); t != NULL;
+       t = strtok_r(NULL, ",", &saveptr))
+    zlist_append(self->dealer_strings, strdup(t));
+  free(copy);
+  if (zlist_size(self->dealer_strings) < 1) {
+    dd_error("No dealer in \"%s\"", dealerstr);
+    return -1;
+  }
+
+  self->dealer_connect = strdup(zlist_first(self->dealer_strings));
   self->dsock = zsock_new(ZMQ_DEALER);
   zsock_connect(self->dsock, self->dealer_connect);
   if (self->dsock == NULL) {
@@ -2494,6 +4463,196 @@ int dd_broker_set_dealer(dd_broker_t *self, char *dealerstr) {
   }
   return 0;
 }
+
+int dd_broker_set_flow_window(dd_broker_t *self, char *windowstr) {
+  if (!is_int(windowstr)) {
+    dd_error("flow_window has to be a number of messages");
+    return -1;
+  }
+  self->flow_window = atoi(windowstr);
+  return 0;
+}
+
+int dd_broker_set_flow_backlog(dd_broker_t *self, char *backlogstr) {
+  if (!is_int(backlogstr)) {
+    dd_error("flow_backlog has to be a number of messages");
+    return -1;
+  }
+  self->flow_backlog = atoi(backlogstr);
+  return 0;
+}
+
+int dd_broker_set_flow_tenant_backlog(dd_broker_t *self, char *backlogstr) {
+  if (!is_int(backlogstr)) {
+    dd_error("flow_tenant_backlog has to be a number of messages");
+    return -1;
+  }
+  self->flow_tenant_backlog = atoi(backlogstr);
+  return 0;
+}
+
+int dd_broker_set_flow_policy(dd_broker_t *self, char *policystr) {
+  int policy = flow_policy_from_str(policystr);
+  if (policy < 0) {
+    dd_error("Unknown flow_policy \"%s\"", policystr);
+    return -1;
+  }
+  self->flow_policy = policy;
+  dd_info("Flow control policy: %s", policystr);
+  return 0;
+}
+
+int dd_broker_set_nodst_ttl(dd_broker_t *self, char *ttlstr) {
+  if (!is_int(ttlstr)) {
+    dd_error("nodst_ttl has to be a number of milliseconds");
+    return -1;
+  }
+  self->nodst_ttl = atoi(ttlstr);
+  dd_info("Caching unknown destinations for %d ms", self->nodst_ttl);
+  return 0;
+}
+
+int dd_broker_set_nodst_max(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("nodst_max has to be a number");
+    return -1;
+  }
+  self->nodst_max = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_ticket_lifetime(dd_broker_t *self, char *lifetimestr) {
+  if (!is_int(lifetimestr)) {
+    dd_error("ticket_lifetime has to be a number of seconds");
+    return -1;
+  }
+  self->ticket_lifetime = atoi(lifetimestr);
+  return 0;
+}
+
+int dd_broker_set_admit_max(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("admit_max has to be a number");
+    return -1;
+  }
+  self->admit_max = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_admit_rate(dd_broker_t *self, char *ratestr) {
+  if (!is_int(ratestr) || atoi(ratestr) == 0) {
+    dd_error("admit_rate has to be a positive number per second");
+    return -1;
+  }
+  self->admit_rate = atoi(ratestr);
+  return 0;
+}
+
+int dd_broker_set_admit_queue(dd_broker_t *self, char *queuestr) {
+  if (!is_int(queuestr)) {
+    dd_error("admit_queue has to be a number");
+    return -1;
+  }
+  self->admit_queue_max = atoi(queuestr);
+  return 0;
+}
+
+int dd_broker_set_tenant_max_clients(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("tenant_max_clients has to be a number");
+    return -1;
+  }
+  self->tenant_max_clients = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_tenant_max_subs(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("tenant_max_subs has to be a number");
+    return -1;
+  }
+  self->tenant_max_subs = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_tenant_max_bytes(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("tenant_max_bytes has to be a number of bytes");
+    return -1;
+  }
+  self->tenant_max_bytes = strtoull(maxstr, NULL, 10);
+  return 0;
+}
+
+int dd_broker_set_plaintext(dd_broker_t *self, char *tenantstr) {
+  zhash_destroy(&self->plaintext_tenants);
+  self->plaintext_tenants = zhash_new();
+  char *copy = strdup(tenantstr);
+  char *save = NULL;
+  char *name = strtok_r(copy, ", ", &save);
+  while (name) {
+    if (streq(name, "public")) {
+      dd_warning("The public tenant cannot use plaintext, ignoring it");
+    } else {
+      zhash_insert(self->plaintext_tenants, name, self);
+    }
+    name = strtok_r(NULL, ", ", &save);
+  }
+  free(copy);
+  return 0;
+}
+
+int dd_broker_set_shm_group(dd_broker_t *self, char *group) {
+  struct group *gr = getgrnam(group);
+  if (gr == NULL) {
+    dd_error("shm_group %s doesn't exist", group);
+    return -1;
+  }
+  self->shm_gid = gr->gr_gid;
+  return 0;
+}
+
+int dd_broker_set_retain(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("retain has to be a number of topics");
+    return -1;
+  }
+  retain_destroy(&self->retain);
+  if (atoi(maxstr) > 0)
+    self->retain = retain_new(atoi(maxstr));
+  return 0;
+}
+
+int dd_broker_set_shortcut(dd_broker_t *self, char *shortcutstr) {
+  dd_info("Offering shortcuts at %s", shortcutstr);
+  if (self->shortcut_connect)
+    free(self->shortcut_connect);
+  self->shortcut_connect = strdup(shortcutstr);
+  if (self->shortcut_links == NULL) {
+    self->shortcut_links = zhash_new();
+    self->shortcut_routes = zhash_new();
+  }
+  return 0;
+}
+
+int dd_broker_add_shard(dd_broker_t *self, char *shardstr) {
+  dd_info("Adding root shard: %s", shardstr);
+  // the first shard doubles as the parent for registration and pub/sub
+  if (zlist_size(self->shard_strings) == 0 &&
+      dd_broker_set_dealer(self, shardstr) != 0)
+    return -1;
+  zlist_append(self->shard_strings, strdup(shardstr));
+  return 0;
+}
+
+int dd_broker_add_dealer(dd_broker_t *self, char *dealerstr) {
+  if (self->dealer_connect == NULL)
+    return dd_broker_set_dealer(self, dealerstr);
+  dd_info("Adding standby dealer: %s", dealerstr);
+  zlist_append(self->dealer_strings, strdup(dealerstr));
+  return 0;
+}
+
 int dd_broker_set_keyfile(dd_broker_t *self, char *keyfile) {
   dd_info("Setting keys from %s", keyfile);
 
@@ -2504,8 +4663,95 @@ int dd_broker_set_keyfile(dd_broker_t *self, char *keyfile) {
   self->keys = read_ddbrokerkeys(keyfile);
   assert(self->keys);
   print_ddbrokerkeys(self->keys);
+  crypto_generichash(self->ticket_key, sizeof(self->ticket_key),
+                     (const unsigned char *)"ddticket", 8, self->keys->privkey,
+                     crypto_box_SECRETKEYBYTES);
+  return 0;
+}
+int dd_broker_set_log_dir(dd_broker_t *self, char *dir) {
+  free(self->log_dir);
+  self->log_dir = strdup(dir);
+  return 0;
+}
+
+int dd_broker_set_log_segment(dd_broker_t *self, char *sizestr) {
+  if (!is_int(sizestr) || atoi(sizestr) <= 0) {
+    dd_error("log_segment has to be a size in bytes");
+    return -1;
+  }
+  self->log_segment = atoi(sizestr);
+  return 0;
+}
+
+int dd_broker_set_log_segments(dd_broker_t *self, char *countstr) {
+  if (!is_int(countstr) || atoi(countstr) <= 0) {
+    dd_error("log_segments has to be a number of segments");
+    return -1;
+  }
+  self->log_segments = atoi(countstr);
+  return 0;
+}
+
+int dd_broker_set_log_topics(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("log_topics has to be a number of topics");
+    return -1;
+  }
+  self->log_topics = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_tenant_max_log_topics(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("tenant_max_log_topics has to be a number of topics");
+    return -1;
+  }
+  self->tenant_max_log_topics = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_queue_max(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("queue_max has to be a number of notifications");
+    return -1;
+  }
+  self->queue_max = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_queue_bytes(dd_broker_t *self, char *sizestr) {
+  if (!is_int(sizestr) || atoi(sizestr) <= 0) {
+    dd_error("queue_bytes has to be a size in bytes");
+    return -1;
+  }
+  self->queue_bytes = atoi(sizestr);
+  return 0;
+}
+
+int dd_broker_set_queue_ttl(dd_broker_t *self, char *ttlstr) {
+  if (!is_int(ttlstr) || atoi(ttlstr) <= 0) {
+    dd_error("queue_ttl has to be a number of milliseconds");
+    return -1;
+  }
+  self->queue_ttl = atoi(ttlstr);
   return 0;
 }
+
+int dd_broker_set_queue_dests(dd_broker_t *self, char *maxstr) {
+  if (!is_int(maxstr)) {
+    dd_error("queue_dests has to be a number of clients");
+    return -1;
+  }
+  self->queue_dests = atoi(maxstr);
+  return 0;
+}
+
+int dd_broker_set_queue_spill(dd_broker_t *self, char *dir) {
+  free(self->queue_spill);
+  self->queue_spill = strdup(dir);
+  return 0;
+}
+
 int dd_broker_add_router(dd_broker_t *self, char *routerstr) {
   if (self->router_bind == NULL) {
     self->router_bind = strdup(routerstr);
@@ -2581,6 +4827,20 @@ void bind_router(dd_broker_t *self) {
     }
     t = zlist_next(self->rstrings);
   }
+
+  // clients that say they connected over ipc:// could still have come in
+  // over another endpoint, plaintext needs them all to be local
+  self->router_ipc_only = zlist_size(self->rstrings) > 0;
+  t = zlist_first(self->rstrings);
+  while (t != NULL) {
+    if (strncasecmp(t, "ipc://", 6) != 0)
+      self->router_ipc_only = 0;
+    t = zlist_next(self->rstrings);
+  }
+  if (self->plaintext_tenants && !self->router_ipc_only)
+    dd_warning("Plaintext needs a router bound to ipc:// only, not granting "
+               "it on %s",
+               self->router_bind);
 }
 
 int dd_broker_set_scope(dd_broker_t *self, char *scopestr) {
@@ -2672,6 +4932,20 @@ dd_broker_t *dd_broker_new() {
   self->reg_loop = -1;
   self->state = DD_STATE_UNREG;
   self->timeout = 0;
+  self->reg_attempts = 0;
+  self->dealer_strings = zlist_new();
+  assert(self->dealer_strings);
+  self->standby = NULL;
+  self->shard_strings = zlist_new();
+  assert(self->shard_strings);
+  self->shards = NULL;
+  self->num_shards = 0;
+  self->shard_ring = NULL;
+  self->shard_ring_len = 0;
+  self->shard_loop = -1;
+  self->shortcut_connect = NULL;
+  self->shortcut_links = NULL;
+  self->shortcut_routes = NULL;
 
   nn_trie_init(&self->topics_trie);
 
@@ -2701,7 +4975,51 @@ dd_broker_t *dd_broker_new() {
   self->lcl_cli_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
   self->rev_lcl_cli_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
   self->dist_cli_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
+  self->nodst_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
+  self->nodst_ttl = DD_NODST_TTL;
+  self->nodst_max = DD_NODST_MAX;
+  self->nodst_count = 0;
+  self->nodst_loop = -1;
+  self->flow_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
+  self->flow_count = 0;
+  self->flow_window = DD_FLOW_WINDOW;
+  self->flow_backlog = DD_FLOW_BACKLOG;
+  self->flow_tenant_backlog = DD_FLOW_TENANT_BACKLOG;
+  self->flow_policy = DD_FLOW_DROP_OLDEST;
+  self->flow_drops = 0;
+  self->data_lane = calloc(DD_DATA_LANE_MAX, sizeof(dd_rmsg_t *));
+  self->msgpool = msgpool_new(DD_DATA_LANE_MAX + DD_ROUTER_BATCH);
+  self->data_timer = -1;
+  self->ticket_lifetime = DD_TICKET_LIFETIME;
+  self->resume_seen = zhash_new();
+  self->chall_pending = zhash_new();
+  self->admit_queue = zlist_new();
+  self->admit_max = DD_ADMIT_MAX;
+  self->admit_rate = DD_ADMIT_RATE;
+  self->admit_queue_max = DD_ADMIT_QUEUE;
+  self->admit_loop = -1;
+  self->admit_drops = 0;
+  self->tenant_max_clients = 0;
+  self->tenant_max_subs = 0;
+  self->tenant_max_bytes = 0;
+  self->plaintext_tenants = NULL;
+  self->shm_gid = -1;
+  self->retain = NULL;
+  self->south_topics = zhash_new();
+  self->log_dir = NULL;
+  self->log_segment = DD_LOG_SEGMENT;
+  self->log_segments = DD_LOG_SEGMENTS;
+  self->log_topics = DD_LOG_TOPICS;
+  self->tenant_max_log_topics = 0;
+  self->publog = NULL;
+  self->queue_max = 0;
+  self->queue_ttl = DD_SFQ_TTL;
+  self->queue_dests = DD_SFQ_TENANT_DESTS;
+  self->queue_bytes = DD_SFQ_BYTES;
+  self->queue_spill = NULL;
+  self->sfq = NULL;
   self->lcl_br_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
+  hashtable_slabs_new(self);
   // subscriptions
   self->subscribe_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
   self->top_north_ht = cds_lfht_new(1, 1, 0, CDS_LFHT_AUTO_RESIZE, NULL);
@@ -2793,9 +5111,66 @@ static void s_self_destroy(dd_broker_t **self_p) {
       zlist_destroy(&self->sub_strings);
       self->sub_strings = NULL;
     }
+    if (self->dealer_strings) {
+      char *t = zlist_first(self->dealer_strings);
+      while (t) {
+        free(t);
+        t = zlist_next(self->dealer_strings);
+      }
+      zlist_destroy(&self->dealer_strings);
+      self->dealer_strings = NULL;
+    }
 
     zloop_destroy(&self->loop);
 
+    if (self->standby) {
+      zsock_destroy(&self->standby->sock);
+      if (self->standby->broker_id)
+        zframe_destroy(&self->standby->broker_id);
+      free(self->standby->endpoint);
+      free(self->standby);
+      self->standby = NULL;
+    }
+    if (self->shard_strings) {
+      char *t = zlist_first(self->shard_strings);
+      while (t) {
+        free(t);
+        t = zlist_next(self->shard_strings);
+      }
+      zlist_destroy(&self->shard_strings);
+      self->shard_strings = NULL;
+    }
+    int i;
+    for (i = 1; i < self->num_shards; i++) {
+      zsock_destroy(&self->shards[i]->sock);
+      if (self->shards[i]->broker_id)
+        zframe_destroy(&self->shards[i]->broker_id);
+      free(self->shards[i]->endpoint);
+      free(self->shards[i]);
+    }
+    free(self->shards);
+    self->shards = NULL;
+    free(self->shard_ring);
+    self->shard_ring = NULL;
+    self->num_shards = 0;
+    if (self->shortcut_links) {
+      parent_link *link = zhash_first(self->shortcut_links);
+      while (link) {
+        zsock_destroy(&link->sock);
+        if (link->broker_id)
+          zframe_destroy(&link->broker_id);
+        free(link->endpoint);
+        free(link);
+        link = zhash_next(self->shortcut_links);
+      }
+      zhash_destroy(&self->shortcut_links);
+      zhash_destroy(&self->shortcut_routes);
+    }
+    if (self->shortcut_connect) {
+      free(self->shortcut_connect);
+      self->shortcut_connect = NULL;
+    }
+
     zsock_destroy(&self->http);
     zsock_destroy(&self->pubS);
     zsock_destroy(&self->pubN);
@@ -2821,6 +5196,39 @@ static void s_self_destroy(dd_broker_t **self_p) {
        * rc); */
       self->dist_cli_ht = NULL;
     }
+    if (self->data_lane) {
+      dd_rmsg_t *m;
+      while ((m = s_lane_pop(self)))
+        msgpool_release(self->msgpool, &m);
+      free(self->data_lane);
+      self->data_lane = NULL;
+    }
+    msgpool_destroy(&self->msgpool);
+    if (self->admit_queue) {
+      zmsg_t *m;
+      while ((m = zlist_pop(self->admit_queue)))
+        zmsg_destroy(&m);
+      zlist_destroy(&self->admit_queue);
+    }
+    zhash_destroy(&self->chall_pending);
+    zhash_destroy(&self->resume_seen);
+    zhash_destroy(&self->plaintext_tenants);
+    retain_destroy(&self->retain);
+    zhash_destroy(&self->south_topics);
+    publog_destroy(&self->publog);
+    free(self->log_dir);
+    sfqueue_destroy(&self->sfq);
+    free(self->queue_spill);
+    if (self->flow_ht) {
+      flow_destroy(self);
+      cds_lfht_destroy(self->flow_ht, NULL);
+      self->flow_ht = NULL;
+    }
+    if (self->nodst_ht) {
+      hashtable_expire_nodst(self, 1);
+      cds_lfht_destroy(self->nodst_ht, NULL);
+      self->nodst_ht = NULL;
+    }
     if (self->lcl_br_ht) {
       int rc = cds_lfht_destroy(self->lcl_br_ht, NULL);
       /* dd_error("s_self_destroy, cds_lfht_destroy(self->lcl_br_ht) -> %d",
@@ -2831,6 +5239,7 @@ static void s_self_destroy(dd_broker_t **self_p) {
     if (self->subscribe_ht) {
       hashtable_subscribe_destroy(&self->subscribe_ht);
     }
+    hashtable_slabs_destroy(self);
 
     if (self->top_north_ht) {
       cds_lfht_destroy(self->top_north_ht, NULL);
@@ -11,10 +11,15 @@ struct _dd_t {
   int timeout;                // Incremental timeout (trigger > 3)
   int state;                  // Internal state
   int registration_loop;      // Timer ID for registration loop
+  int reg_attempts;           // Registration attempts since disconnect
   int heartbeat_loop;         // Timer ID for heartbeat loop
   uint64_t cookie;            // Cookie from authentication
+  uint32_t consumed;          // DATA and PUB handled, reported as credit
+  zframe_t *ticket;           // Session ticket from the broker, if any
+  unsigned char ticket_key[crypto_auth_KEYBYTES]; // Proves the ticket is ours
   dd_keys_t *keys;            // Encryption keys loaded from JSON file
   zlistx_t *sublist;          // List of subscriptions, and if they're active
+  zhashx_t *subindex;         // Handles into sublist by topic and scope
   zloop_t *loop;
   int style;
   unsigned char nonce[crypto_box_NONCEBYTES];
@@ -23,6 +28,48 @@ struct _dd_t {
   dd_on_data(*on_data);
   dd_on_pub(*on_pub);
   dd_on_error(*on_error);
+  dd_on_chunk(*on_chunk);
+  dd_on_ack(*on_ack);
+  cryptpool_t *crypto;        // Workers for batches of messages
+  compressor_t *compress;     // Payload compression rules and dictionaries
+  int suite;                  // Cipher suite within the tenant, -1 if untagged
+  int plaintext;              // Notifications within the tenant unencrypted
+  shmring_t *shm;             // Ring for large notifications over ipc://
+  int shm_ok;                 // The broker mapped our ring
+  int shm_gid;                // Group that may map our ring, -1 for none
+  zhash_t *peer_rings;        // Rings of local clients that sent us DATASHM
+  reliable_t *reliable;       // Reliable notifications, sent and received
+  uint64_t pub_seq;           // Logged publications handled up to this one
+  uint64_t pub_cur;           // Number of the publication in on_pub
+  int replays;                // REPLAYs the broker hasn't completed
+  uint64_t live_seq;          // Highest live and replayed numbers seen while
+  uint64_t replay_until;      // replays are running
+  // DATA and PUB received but not yet decrypted
+  struct _dd_inbox {
+    zmsg_t *msg;
+    char *source;
+    char *topic;
+  } inbox[DD_RECV_BATCH];
+  int inbox_size;
+  // Held by the loop thread while it handles an event and by the calls an
+  // application thread makes, around everything that touches the socket,
+  // the nonce or the reliable state. Recursive, as callbacks may send.
+  pthread_mutex_t lock;
+};
+
+// Chunks are filled up to DD_CHUNK_SIZE before they are sent, so a stream
+// only ever holds one of them. They are sent as reliable notifications,
+// the numbers of those not acknowledged yet are kept in a ring.
+struct _dd_stream_t {
+  dd_t *dd;
+  char *target;
+  uint64_t id;
+  uint64_t offset; // of the chunk being filled
+  int fill;
+  unsigned char *chunk; // DD_CHUNK_HDR followed by the data
+  uint64_t session; // of the reliable notifications in unacked
+  uint64_t unacked[DD_STREAM_WINDOW];
+  int head, inflight;
 };
 
 static void sublist_resubscribe(dd_t *self);
@@ -32,20 +79,92 @@ static int s_ask_registration(zloop_t *loop, int timerid, void *args);
 static void cb_regok(dd_t *self, zmsg_t *msg, zloop_t *loop);
 static void cb_pong(dd_t *self, zmsg_t *msg, zloop_t *loop);
 static void cb_chall(dd_t *self, zmsg_t *msg);
-static void cb_data(dd_t *self, zmsg_t *msg);
-static void cb_pub(dd_t *self, zmsg_t *msg);
+static void s_inbox_add(dd_t *self, zmsg_t *msg, int pub);
+static void s_inbox_flush(dd_t *self);
+static int s_rel_tick(zloop_t *loop, int timerid, void *args);
+static void cb_datapt(dd_t *self, zmsg_t *msg);
+static void cb_datashm(dd_t *self, zmsg_t *msg);
 static void cb_subok(dd_t *self, zmsg_t *msg);
+static void cb_replay(dd_t *self, zmsg_t *msg);
 static void cb_error(dd_t *self, zmsg_t *msg);
 static int s_on_pipe_msg(zloop_t *loop, zsock_t *handle, void *args);
 static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args);
+static void s_dealer_dispatch(dd_t *self, zmsg_t *msg, zloop_t *loop);
 static void dd_keys_print(dd_keys_t *keys);
+static zmsg_t *s_many_msg(dd_t *self, const uint32_t *cmd);
+
+// Cipher suites offered to the broker. Over ipc:// the broker and the other
+// local clients are on the same host, so offer to skip encryption, which the
+// broker only accepts for tenants configured for it.
+static uint32_t s_offer(dd_t *self) {
+  uint32_t suites = dd_keys_suites(self->keys);
+  if (!dd_keys_ispublic(self->keys) &&
+      strncmp((char *)self->endpoint, "ipc://", strlen("ipc://")) == 0)
+    suites |= DD_OFFER_PLAINTEXT;
+  return suites;
+}
+
+// Over ipc:// large notifications go through a shared memory ring, offered
+// to the broker by name after the cipher suites. Empty if there is none.
+static const char *s_ring_name(dd_t *self) {
+  if (self->shm == NULL &&
+      strncmp((char *)self->endpoint, "ipc://", strlen("ipc://")) == 0) {
+    char name[DD_SHM_NAME];
+    snprintf(name, sizeof(name), "/dd-%d-%08x", (int)getpid(),
+             randombytes_random());
+    self->shm = shmring_create(name, DD_SHM_SIZE, self->shm_gid);
+  }
+  return self->shm ? self->shm->name : "";
+}
+
+// SENDSHM for a record in our ring, the broker releases it once it has
+// been delivered or copied
+static void s_send_shm(dd_t *self, char *dst, uint64_t off, uint32_t len,
+                       uint32_t pt) {
+  zsock_send(self->socket, "bbbsbbb", &dd_version, 4, &dd_cmd_sendshm, 4,
+             &self->cookie, sizeof(self->cookie), dst, &off, sizeof(off),
+             &len, sizeof(len), &pt, sizeof(pt));
+}
+
+// REPLAY of the publications on topic numbered after from, until is 0 to
+// let the broker pick the last one logged
+static void s_replay(dd_t *self, const char *topic, const char *scopestr,
+                     uint64_t from, uint64_t until) {
+  zsock_send(self->socket, "bbbssbb", &dd_version, 4, &dd_cmd_replay, 4,
+             &self->cookie, sizeof(self->cookie), topic, scopestr, &from,
+             sizeof(from), &until, sizeof(until));
+}
 
+static void s_replay_start(dd_t *self) {
+  if (self->replays++ == 0) {
+    self->live_seq = 0;
+    self->replay_until = 0;
+  }
+}
+
+// Resubscribe to everything with a single SUBMANY, and if the broker logs
+// publications, replay what was published while we were away
 static void sublist_resubscribe(dd_t *self) {
-  ddtopic_t *item;
-  while ((item = zlistx_next((zlistx_t *)dd_get_subscriptions(self)))) {
-    zsock_send(self->socket, "bbbss", &dd_version, 4, &dd_cmd_sub, 4,
-               &self->cookie, sizeof(self->cookie), dd_sub_get_topic(item),
-               dd_sub_get_scope(item));
+  zlistx_t *sublist = (zlistx_t *)dd_get_subscriptions(self);
+  self->replays = 0;
+  if (zlistx_size(sublist) == 0)
+    return;
+  zmsg_t *msg = s_many_msg(self, &dd_cmd_submany);
+  ddtopic_t *item = zlistx_first(sublist);
+  while (item) {
+    zmsg_addstr(msg, dd_sub_get_topic(item));
+    zmsg_addstr(msg, dd_sub_get_scope(item));
+    item = zlistx_next(sublist);
+  }
+  zmsg_send(&msg, self->socket);
+  if (self->pub_seq == 0)
+    return;
+  item = zlistx_first(sublist);
+  while (item) {
+    s_replay_start(self);
+    s_replay(self, dd_sub_get_topic(item), dd_sub_get_scope(item),
+             self->pub_seq, 0);
+    item = zlistx_next(sublist);
   }
 }
 
@@ -83,173 +202,652 @@ char *dd_get_publickey(dd_t *self) {
 
 const zlistx_t *dd_get_subscriptions(dd_t *self) { return self->sublist; }
 
+zhashx_t *dd_get_subindex(dd_t *self) { return self->subindex; }
+
+static char *s_scope_str(char *scope) {
+  if (strcmp(scope, "all") == 0)
+    return "/";
+  if (strcmp(scope, "region") == 0)
+    return "/*/";
+  if (strcmp(scope, "cluster") == 0)
+    return "/*/*/";
+  if (strcmp(scope, "node") == 0)
+    return "/*/*/*/";
+  if (strcmp(scope, "noscope") == 0)
+    return "noscope";
+  // TODO: Check rexscope in broker.c
+  // check that scope follows re.fullmatch("/((\d)+/)+", scope):
+  return scope;
+}
+
 int dd_subscribe(dd_t *self, char *topic, char *scope) {
-  char *scopestr;
-  if (strcmp(scope, "all") == 0) {
-    scopestr = "/";
-  } else if (strcmp(scope, "region") == 0) {
-    scopestr = "/*/";
-  } else if (strcmp(scope, "cluster") == 0) {
-    scopestr = "/*/*/";
-  } else if (strcmp(scope, "node") == 0) {
-    scopestr = "/*/*/*/";
-  } else if (strcmp(scope, "noscope") == 0) {
-    scopestr = "noscope";
-  } else {
-    // TODO: Check rexscope in broker.c
-    // check that scope follows re.fullmatch("/((\d)+/)+", scope):
-    scopestr = scope;
-  }
+  char *scopestr = s_scope_str(scope);
+  int rc = -1;
+  pthread_mutex_lock(&self->lock);
   sublist_add(self, topic, scopestr, 0);
   if (self->state == DD_STATE_REGISTERED) {
     zsock_send(self->socket, "bbbss", &dd_version, 4, &dd_cmd_sub, 4,
                &self->cookie, sizeof(self->cookie), topic, scopestr);
-    return 0;
+    rc = 0;
   }
-  return -1;
+  pthread_mutex_unlock(&self->lock);
+  return rc;
 }
 
-int dd_unsubscribe(dd_t *self, char *topic, char *scope) {
-  char *scopestr;
-  if (strcmp(scope, "all") == 0) {
-    scopestr = "/";
-  } else if (strcmp(scope, "region") == 0) {
-    scopestr = "/*/";
-  } else if (strcmp(scope, "cluster") == 0) {
-    scopestr = "/*/*/";
-  } else if (strcmp(scope, "node") == 0) {
-    scopestr = "/*/*/*/";
-  } else if (strcmp(scope, "noscope") == 0) {
-    scopestr = "noscope";
-  } else {
-    // TODO: check rexscope in broker.c
-    // check that scope follows re.fullmatch("/((\d)+/)+", scope):
-    scopestr = scope;
+int dd_subscribe_from(dd_t *self, char *topic, char *scope, uint64_t seq) {
+  char *scopestr = s_scope_str(scope);
+  int rc = -1;
+  pthread_mutex_lock(&self->lock);
+  sublist_add(self, topic, scopestr, 0);
+  if (self->state == DD_STATE_REGISTERED) {
+    s_replay_start(self);
+    s_replay(self, topic, scopestr, seq, 0);
+    rc = 0;
   }
+  pthread_mutex_unlock(&self->lock);
+  return rc;
+}
+
+uint64_t dd_get_pub_seq(dd_t *self) { return self->pub_cur; }
+
+int dd_unsubscribe(dd_t *self, char *topic, char *scope) {
+  char *scopestr = s_scope_str(scope);
+  pthread_mutex_lock(&self->lock);
   sublist_delete(self, topic, scopestr);
   if (self->state == DD_STATE_REGISTERED)
     zsock_send(self->socket, "bbbss", &dd_version, 4, &dd_cmd_unsub, 4,
                &self->cookie, sizeof(self->cookie), topic, scopestr);
+  pthread_mutex_unlock(&self->lock);
   return 0;
 }
 
-int dd_publish(dd_t *self, char *topic, char *message, int mlen) {
-  const unsigned char *precalck = NULL;
-  int srcpublic = 0;
-  int dstpublic = 0;
-  int retval;
+// One SUBMANY / UNSUBMANY for all the topics
+static zmsg_t *s_many_msg(dd_t *self, const uint32_t *cmd) {
+  zmsg_t *msg = zmsg_new();
+  zmsg_addmem(msg, &dd_version, 4);
+  zmsg_addmem(msg, cmd, 4);
+  zmsg_addmem(msg, &self->cookie, sizeof(self->cookie));
+  return msg;
+}
 
-  if (dd_keys_ispublic(self->keys)) {
-    srcpublic = 1;
+int dd_subscribe_many(dd_t *self, char **topics, char **scopes, int count) {
+  if (count <= 0)
+    return 0;
+  pthread_mutex_lock(&self->lock);
+  zmsg_t *msg = s_many_msg(self, &dd_cmd_submany);
+  int i, rc = -1;
+  for (i = 0; i < count; i++) {
+    char *scopestr = s_scope_str(scopes[i]);
+    sublist_add(self, topics[i], scopestr, 0);
+    zmsg_addstr(msg, topics[i]);
+    zmsg_addstr(msg, scopestr);
   }
-  if (strncmp("public.", topic, strlen("public.")) == 0) {
-    dstpublic = 1;
+  // like dd_subscribe, the topics are sent once we are registered
+  if (self->state == DD_STATE_REGISTERED) {
+    zmsg_send(&msg, self->socket);
+    rc = 0;
   }
+  zmsg_destroy(&msg);
+  pthread_mutex_unlock(&self->lock);
+  return rc;
+}
 
-  char *dot = strchr(topic, '.');
+int dd_unsubscribe_many(dd_t *self, char **topics, char **scopes, int count) {
+  pthread_mutex_lock(&self->lock);
+  zmsg_t *msg = s_many_msg(self, &dd_cmd_unsubmany);
+  int i;
+  for (i = 0; i < count; i++) {
+    char *scopestr = s_scope_str(scopes[i]);
+    sublist_delete(self, topics[i], scopestr);
+    zmsg_addstr(msg, topics[i]);
+    zmsg_addstr(msg, scopestr);
+  }
+  if (self->state == DD_STATE_REGISTERED && count > 0)
+    zmsg_send(&msg, self->socket);
+  zmsg_destroy(&msg);
+  pthread_mutex_unlock(&self->lock);
+  return 0;
+}
+
+// Key for messages to a topic or client. A public client can notify but not
+// publish to a tenant.
+static const unsigned char *s_dst_key(dd_t *self, char *dst, int publish) {
+  const unsigned char *precalck = NULL;
+  int srcpublic = dd_keys_ispublic(self->keys);
+  int dstpublic = strncmp("public.", dst, strlen("public.")) == 0;
+
+  char *dot = strchr(dst, '.');
   if (dot && srcpublic) {
     *dot = '\0';
-    precalck = zhash_lookup(dd_keys_clients(self->keys), topic);
-    if (precalck) {
+    precalck = zhash_lookup(dd_keys_clients(self->keys), dst);
+    *dot = '.';
+    if (precalck && publish) {
       // TODO: This is not allowed by the broker
       // We should return an error if this is happening
       fprintf(stderr, "Public client cannot publish to tenants!\n");
-      return -1;
+      return NULL;
     }
-    *dot = '.';
   }
   if (!precalck && !dstpublic) {
     precalck = dd_keys_custboxk(self->keys);
   } else if (dstpublic) {
     precalck = dd_keys_pubboxk(self->keys);
   }
+  return precalck;
+}
 
-  int enclen = mlen + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
-  unsigned char *dest = calloc(1, enclen);
-  unsigned char *ciphertext = dest; // dest+crypto_box_NONCEBYTES;
-
-  // increment nonce
-  nonce_increment(self->nonce, crypto_box_NONCEBYTES);
-  memcpy(dest, self->nonce, crypto_box_NONCEBYTES);
+static int s_seal_batch(dd_t *self, const uint32_t *cmd, char *dst,
+                        char **messages, int *lengths, int count,
+                        uint32_t flags);
 
-  dest += crypto_box_NONCEBYTES;
-  retval = crypto_box_easy_afternm(dest, (const unsigned char *)message, mlen,
-                                   self->nonce, precalck);
+static void s_send_dict(dd_t *self, char *dst, comp_rule_t *rule) {
+  char *message = rule->dict;
+  int len = rule->dictlen;
+  s_seal_batch(self, &dd_cmd_send, dst, &message, &len, 1, DD_PAYLOAD_DICT);
+}
 
-  if (retval != 0) {
-    fprintf(stderr, "DD: Unable to encrypt %d bytes!\n", mlen);
-    free(ciphertext);
+// Encrypts count messages to the same destination as one batch, each with
+// the next nonce, and sends them with cmd. Messages are compressed first if
+// a rule covers dst. DD_PAYLOAD_* flags, from the caller or for compressed
+// messages, go in a frame after the payload. Called with the lock held.
+static int s_seal_batch(dd_t *self, const uint32_t *cmd, char *dst,
+                        char **messages, int *lengths, int count,
+                        uint32_t flags) {
+  int publish = cmd == &dd_cmd_pub;
+  const unsigned char *precalck = s_dst_key(self, dst, publish);
+  if (precalck == NULL)
     return -1;
+  if (count <= 0)
+    return 0;
+
+  int i;
+  // large notifications go through our ring if the broker mapped it
+  int shm = !publish && !flags && self->shm_ok && self->shm;
+  if (!publish && !flags && self->plaintext &&
+      precalck == dd_keys_custboxk(self->keys)) {
+    if (self->state != DD_STATE_REGISTERED)
+      return -1;
+    for (i = 0; i < count; i++) {
+      uint64_t off;
+      void *slot = NULL;
+      if (shm && lengths[i] >= DD_SHM_MIN)
+        slot = shmring_reserve(self->shm, lengths[i], &off);
+      if (slot) {
+        memcpy(slot, messages[i], lengths[i]);
+        s_send_shm(self, dst, off, lengths[i], 1);
+      } else {
+        zsock_send(self->socket, "bbbsb", &dd_version, 4, &dd_cmd_sendpt, 4,
+                   &self->cookie, sizeof(self->cookie), dst, messages[i],
+                   lengths[i]);
+      }
+    }
+    return 0;
   }
-  if (self->state == DD_STATE_REGISTERED) {
-    zsock_send(self->socket, "bbbszb", &dd_version, 4, &dd_cmd_pub, 4,
-               &self->cookie, sizeof(self->cookie), topic, ciphertext, enclen);
+
+  uint32_t *pflags = calloc(count, sizeof(uint32_t));
+  for (i = 0; i < count; i++)
+    pflags[i] = flags;
+  // compressed messages that shrank replace the originals, the others are
+  // sent as they are
+  unsigned char *packed = NULL;
+  comp_rule_t *rule = NULL;
+  if (!(flags & (DD_PAYLOAD_DICT | DD_PAYLOAD_DICTREQ)))
+    rule = compressor_rule(self->compress, dst);
+  if (rule && !publish && zhash_lookup(self->compress->plain, dst))
+    rule = NULL;
+  // a notified target gets the dictionary before what is compressed with it
+  if (rule && rule->dict && !publish &&
+      !compressor_sent(self->compress, dst, rule))
+    s_send_dict(self, dst, rule);
+  if (rule) {
+    size_t cap = 0;
+    for (i = 0; i < count; i++)
+      cap += compressor_bound(lengths[i]);
+    packed = malloc(cap > 0 ? cap : 1);
+    char **packed_msgs = malloc(count * sizeof(char *));
+    int *packed_lens = malloc(count * sizeof(int));
+    unsigned char *p = packed;
+    for (i = 0; i < count; i++) {
+      size_t n = 0;
+      if (lengths[i] >= DD_COMP_MIN)
+        n = compressor_pack(self->compress, rule, p,
+                            compressor_bound(lengths[i]), messages[i],
+                            lengths[i]);
+      if (n > 0 && n < (size_t)lengths[i]) {
+        packed_msgs[i] = (char *)p;
+        packed_lens[i] = n;
+        pflags[i] |= DD_PAYLOAD_ZSTD;
+        p += n;
+      } else {
+        packed_msgs[i] = messages[i];
+        packed_lens[i] = lengths[i];
+      }
+    }
+    messages = packed_msgs;
+    lengths = packed_lens;
+  }
+
+  // within the tenant, messages start with the negotiated suite
+  int tagged = self->suite >= 0 && precalck == dd_keys_custboxk(self->keys);
+  int suite = tagged ? self->suite : DD_SUITE_BOX;
+  if (tagged)
+    precalck = dd_keys_suitek(self->keys, suite);
+
+  crypt_job_t *jobs = calloc(count, sizeof(crypt_job_t));
+  // where each message was sealed into our ring, UINT64_MAX if it wasn't
+  uint64_t *offs = shm ? calloc(count, sizeof(uint64_t)) : NULL;
+  size_t total = 0;
+  for (i = 0; i < count; i++)
+    total += tagged + lengths[i] + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
+  unsigned char *ciphertext = malloc(total);
+  unsigned char *dest = ciphertext;
+  for (i = 0; i < count; i++) {
+    size_t enclen =
+        tagged + lengths[i] + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
+    unsigned char *out = NULL;
+    if (shm) {
+      offs[i] = UINT64_MAX;
+      if (enclen >= DD_SHM_MIN && pflags[i] == 0)
+        out = shmring_reserve(self->shm, enclen, &offs[i]);
+    }
+    if (out == NULL) {
+      out = dest;
+      dest += enclen;
+    }
+    if (tagged)
+      *out++ = suite;
+    nonce_increment(self->nonce, crypto_box_NONCEBYTES);
+    memcpy(out, self->nonce, crypto_box_NONCEBYTES);
+    jobs[i].suite = suite;
+    jobs[i].key = precalck;
+    jobs[i].in = (const unsigned char *)messages[i];
+    jobs[i].inlen = lengths[i];
+    jobs[i].out = out;
+  }
+  cryptpool_seal(self->crypto, jobs, count);
+
+  int retval = 0;
+  for (i = 0; i < count; i++) {
+    int enclen = lengths[i] + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
+    int inring = shm && offs[i] != UINT64_MAX;
+    if (jobs[i].rc != 0 || self->state != DD_STATE_REGISTERED) {
+      if (jobs[i].rc != 0)
+        fprintf(stderr, "DD: Unable to encrypt %d bytes!\n", lengths[i]);
+      retval = -1;
+      if (inring)
+        shmring_release(self->shm, offs[i], enclen + tagged);
+      continue;
+    }
+    if (inring)
+      s_send_shm(self, dst, offs[i], enclen + tagged, 0);
+    else if (publish && pflags[i])
+      zsock_send(self->socket, "bbbszbb", &dd_version, 4, cmd, 4,
+                 &self->cookie, sizeof(self->cookie), dst,
+                 jobs[i].out - tagged, enclen + tagged, &pflags[i],
+                 sizeof(pflags[i]));
+    else if (publish)
+      zsock_send(self->socket, "bbbszb", &dd_version, 4, cmd, 4,
+                 &self->cookie, sizeof(self->cookie), dst,
+                 jobs[i].out - tagged, enclen + tagged);
+    else if (pflags[i])
+      zsock_send(self->socket, "bbbsbb", &dd_version, 4, cmd, 4,
+                 &self->cookie, sizeof(self->cookie), dst,
+                 jobs[i].out - tagged, enclen + tagged, &pflags[i],
+                 sizeof(pflags[i]));
+    else
+      zsock_send(self->socket, "bbbsb", &dd_version, 4, cmd, 4,
+                 &self->cookie, sizeof(self->cookie), dst,
+                 jobs[i].out - tagged, enclen + tagged);
   }
   free(ciphertext);
-  return 0;
+  free(offs);
+  free(jobs);
+  free(pflags);
+  if (rule) {
+    free(messages);
+    free(lengths);
+    free(packed);
+  }
+  return retval;
+}
+
+static int s_seal_send(dd_t *self, const uint32_t *cmd, char *dst,
+                       char **messages, int *lengths, int count,
+                       uint32_t flags) {
+  pthread_mutex_lock(&self->lock);
+  int rc = s_seal_batch(self, cmd, dst, messages, lengths, count, flags);
+  pthread_mutex_unlock(&self->lock);
+  return rc;
+}
+
+int dd_publish(dd_t *self, char *topic, char *message, int mlen) {
+  return s_seal_send(self, &dd_cmd_pub, topic, &message, &mlen, 1, 0);
+}
+
+int dd_publish_retained(dd_t *self, char *topic, char *message, int mlen) {
+  return s_seal_send(self, &dd_cmd_pub, topic, &message, &mlen, 1,
+                     DD_PAYLOAD_RETAIN);
+}
+
+int dd_publish_many(dd_t *self, char *topic, char **messages, int *lengths,
+                    int count) {
+  return s_seal_send(self, &dd_cmd_pub, topic, messages, lengths, count, 0);
 }
 
 int dd_notify(dd_t *self, char *target, char *message, int mlen) {
-  const uint8_t *precalck = NULL;
-  int srcpublic = 0;
-  int dstpublic = 0;
+  return s_seal_send(self, &dd_cmd_send, target, &message, &mlen, 1, 0);
+}
 
-  if (dd_keys_ispublic(self->keys)) {
-    srcpublic = 1;
-  }
-  if (strncmp("public.", target, strlen("public.")) == 0) {
-    dstpublic = 1;
+int dd_notify_many(dd_t *self, char *target, char **messages, int *lengths,
+                   int count) {
+  return s_seal_send(self, &dd_cmd_send, target, messages, lengths, count, 0);
+}
+
+void dd_set_on_chunk(dd_t *self, dd_on_chunk chunk) { self->on_chunk = chunk; }
+
+void dd_set_on_ack(dd_t *self, dd_on_ack ack) { self->on_ack = ack; }
+
+// Seals messages[from..n) as one batch
+static void s_rel_batch(dd_t *self, rel_out_t *out, char **messages,
+                        int *lengths, int from, int n, uint32_t flags) {
+  if (n > from)
+    s_seal_batch(self, &dd_cmd_send, out->target, messages + from,
+                 lengths + from, n - from, DD_PAYLOAD_RELIABLE | flags);
+}
+
+// Sends the notifications to out's target that fit in the window, from the
+// oldest unacknowledged one to go back, or else the ones not sent yet. They
+// are sealed in as few batches as their flags allow, stream chunks and
+// plain notifications go in separate ones.
+static void s_rel_send(dd_t *self, rel_out_t *out, int again) {
+  if (self->state != DD_STATE_REGISTERED)
+    return;
+  uint64_t from = again ? out->base : out->sent + 1;
+  uint64_t until = out->base + DD_REL_WINDOW;
+  char *messages[DD_REL_WINDOW];
+  int lengths[DD_REL_WINDOW];
+  int n = 0, batch = 0;
+  uint32_t flags = 0;
+  uint64_t last = 0;
+  rel_msg_t *msg = zlist_first(out->msgs);
+  while (msg && msg->seq < until) {
+    if (msg->seq >= from) {
+      if (n > batch && msg->flags != flags) {
+        s_rel_batch(self, out, messages, lengths, batch, n, flags);
+        batch = n;
+      }
+      flags = msg->flags;
+      char *buf = malloc(DD_REL_HDR + msg->len);
+      memcpy(buf, &out->session, sizeof(uint64_t));
+      memcpy(buf + 8, &msg->seq, sizeof(uint64_t));
+      memcpy(buf + 16, &out->base, sizeof(uint64_t));
+      memcpy(buf + DD_REL_HDR, msg->data, msg->len);
+      messages[n] = buf;
+      lengths[n++] = DD_REL_HDR + msg->len;
+      last = msg->seq;
+    }
+    msg = zlist_next(out->msgs);
   }
+  if (n == 0)
+    return;
+  s_rel_batch(self, out, messages, lengths, batch, n, flags);
+  while (n > 0)
+    free(messages[--n]);
+  if (last > out->sent)
+    out->sent = last;
+  out->progress = zclock_mono();
+}
 
-  /* printf ("self->sendmsg called t: %s m: %s l: %d\n", target, message,
-   * mlen);
-   */
-  char *dot = strchr(target, '.');
+int dd_notify_reliable(dd_t *self, char *target, char *message, int mlen,
+                       uint64_t *seq) {
+  if (s_dst_key(self, target, 0) == NULL)
+    return -1;
+  int rc = -1;
+  pthread_mutex_lock(&self->lock);
+  rel_out_t *out = reliable_out(self->reliable, target);
+  if (reliable_queue(out, message, mlen, 0, seq) == 0) {
+    s_rel_send(self, out, 0);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&self->lock);
+  return rc;
+}
 
-  int retval;
-  if (dot && srcpublic) {
-    *dot = '\0';
-    precalck = zhash_lookup(dd_keys_clients(self->keys), target);
-    if (precalck) {
-      /* printf("encrypting with tenant key: %s\n",target); */
+// Goes back to the oldest unacknowledged notification of targets whose
+// ACKs stopped moving, backing off each time, sends what was queued while
+// we were disconnected and forgets targets that are done
+static int s_rel_tick(zloop_t *loop, int timerid, void *args) {
+  dd_t *self = args;
+  int64_t now = zclock_mono();
+  pthread_mutex_lock(&self->lock);
+  reliable_expire(self->reliable, now, DD_REL_IDLE);
+  rel_out_t *out = zhash_first(self->reliable->out);
+  while (out) {
+    if (out->base <= out->sent && now - out->progress >= out->rto) {
+      s_rel_send(self, out, 1);
+      out->rto = out->rto * 2 > DD_REL_RTO_MAX ? DD_REL_RTO_MAX : out->rto * 2;
+    } else if (out->sent + 1 < out->next) {
+      s_rel_send(self, out, 0);
     }
-    *dot = '.';
+    out = zhash_next(self->reliable->out);
   }
-  if (!precalck && !dstpublic) {
-    precalck = dd_keys_custboxk(self->keys);
-    /* printf ("encrypting with my own key\n"); */
-  } else if (dstpublic) {
-    precalck = dd_keys_pubboxk(self->keys);
-    /* printf("encrypting with public key\n"); */
+  pthread_mutex_unlock(&self->lock);
+  return 0;
+}
+
+static void s_on_chunk(dd_t *self, char *source, unsigned char *data,
+                       int len);
+
+// A reliable notification was read, deliver it if it is the next one, to
+// on_chunk if it is a chunk of a stream
+static void s_rel_data(dd_t *self, char *source, unsigned char *data, int len,
+                       uint32_t flags) {
+  if (len < DD_REL_HDR) {
+    fprintf(stderr, "DD: Dropping short reliable notification from %s\n",
+            source);
+    return;
   }
+  uint64_t session, seq, base;
+  memcpy(&session, data, sizeof(session));
+  memcpy(&seq, data + 8, sizeof(seq));
+  memcpy(&base, data + 16, sizeof(base));
+  if (!reliable_accept(self->reliable, source, session, seq, base))
+    return;
+  if (flags & DD_PAYLOAD_CHUNK)
+    s_on_chunk(self, source, data + DD_REL_HDR, len - DD_REL_HDR);
+  else
+    self->on_data(source, data + DD_REL_HDR, len - DD_REL_HDR, self);
+}
 
-  int enclen = mlen + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
-  unsigned char *dest = calloc(1, enclen);
-  unsigned char *ciphertext = dest; // dest+crypto_box_NONCEBYTES;
+static void s_rel_ack(dd_t *self, unsigned char *data, int len) {
+  if (len != DD_REL_ACK)
+    return;
+  uint64_t session, ack;
+  memcpy(&session, data, sizeof(session));
+  memcpy(&ack, data + 8, sizeof(ack));
+  int acked;
+  rel_out_t *out = reliable_ack(self->reliable, session, ack, &acked);
+  if (out == NULL)
+    return;
+  if (out->dupacks >= DD_REL_DUPACKS) {
+    out->dupacks = 0;
+    s_rel_send(self, out, 1);
+  } else if (acked > 0) {
+    // the window moved
+    s_rel_send(self, out, 0);
+  }
+  if (acked > 0 && self->on_ack)
+    self->on_ack(out->target, out->base - 1, self);
+}
 
-  // increment nonce
-  nonce_increment(self->nonce, crypto_box_NONCEBYTES);
-  memcpy(dest, self->nonce, crypto_box_NONCEBYTES);
+// One cumulative ACK for each sender we read reliable notifications from
+static void s_rel_acks(dd_t *self) {
+  if (self->reliable->acks_due == 0)
+    return;
+  self->reliable->acks_due = 0;
+  rel_in_t *in = zhash_first(self->reliable->in);
+  while (in) {
+    if (in->ack_due) {
+      in->ack_due = 0;
+      unsigned char buf[DD_REL_ACK];
+      uint64_t ack = in->expected - 1;
+      memcpy(buf, &in->session, sizeof(uint64_t));
+      memcpy(buf + 8, &ack, sizeof(uint64_t));
+      char *message = (char *)buf;
+      int len = sizeof(buf);
+      s_seal_batch(self, &dd_cmd_send, in->source, &message, &len, 1,
+                   DD_PAYLOAD_ACK);
+    }
+    in = zhash_next(self->reliable->in);
+  }
+}
 
-  dest += crypto_box_NONCEBYTES;
-  retval = crypto_box_easy_afternm(dest, (const unsigned char *)message, mlen,
-                                   self->nonce, precalck);
-  /* char *hex = calloc (1, 1000); */
-  /* sodium_bin2hex (hex, 1000, ciphertext, enclen); */
-  /* printf ("ciphertext size %d: %s\n", enclen, hex); */
-  /* free (hex); */
+dd_stream_t *dd_stream_new(dd_t *self, char *target) {
+  if (target == NULL)
+    return NULL;
+  dd_stream_t *stream = calloc(1, sizeof(dd_stream_t));
+  stream->dd = self;
+  stream->target = strdup(target);
+  randombytes_buf(&stream->id, sizeof(stream->id));
+  stream->chunk = malloc(DD_CHUNK_HDR + DD_CHUNK_SIZE);
+  return stream;
+}
 
-  if (retval == 0) {
-  } else {
-    fprintf(stderr, "DD: Unable to encrypt %d bytes!\n", mlen);
-    free(ciphertext);
+// Chunks of the stream still in flight, after forgetting the acknowledged
+static int s_stream_inflight(dd_stream_t *stream, rel_out_t *out) {
+  // the target was forgotten, only after it acknowledged everything
+  if (stream->session != out->session) {
+    stream->session = out->session;
+    stream->inflight = 0;
+  }
+  while (stream->inflight > 0 && stream->unacked[stream->head] < out->base) {
+    stream->head = (stream->head + 1) % DD_STREAM_WINDOW;
+    stream->inflight--;
+  }
+  return stream->inflight;
+}
+
+// Queues the chunk being filled as a reliable notification, called with the
+// lock held and room in the window. Only fails if the target is too far
+// behind on all notifications.
+static int s_stream_flush(dd_stream_t *stream, rel_out_t *out,
+                          uint32_t flags) {
+  unsigned char *hdr = stream->chunk;
+  memcpy(hdr, &stream->id, sizeof(stream->id));
+  memcpy(hdr + 8, &stream->offset, sizeof(stream->offset));
+  memcpy(hdr + 16, &flags, sizeof(flags));
+  uint64_t seq;
+  if (reliable_queue(out, (char *)stream->chunk, DD_CHUNK_HDR + stream->fill,
+                     DD_PAYLOAD_CHUNK, &seq) != 0)
     return -1;
+  // the last one isn't waited for, the stream is gone by then
+  if (!(flags & DD_CHUNK_LAST)) {
+    int tail = (stream->head + stream->inflight++) % DD_STREAM_WINDOW;
+    stream->unacked[tail] = seq;
   }
-  if (self->state == DD_STATE_REGISTERED) {
-    zsock_send(self->socket, "bbbsb", &dd_version, 4, &dd_cmd_send, 4,
-               &self->cookie, sizeof(self->cookie), target, ciphertext, enclen);
+  stream->offset += stream->fill;
+  stream->fill = 0;
+  s_rel_send(stream->dd, out, 0);
+  return 0;
+}
+
+// Takes as much of data as the window allows, like write(2)
+int dd_stream_write(dd_stream_t *stream, char *data, int len) {
+  if (s_dst_key(stream->dd, stream->target, 0) == NULL)
+    return -1;
+  int done = 0, rc = 0;
+  pthread_mutex_lock(&stream->dd->lock);
+  rel_out_t *out = reliable_out(stream->dd->reliable, stream->target);
+  for (;;) {
+    // a full chunk goes out as soon as the window has room for it
+    if (stream->fill == DD_CHUNK_SIZE) {
+      if (s_stream_inflight(stream, out) == DD_STREAM_WINDOW)
+        break;
+      if (s_stream_flush(stream, out, 0) != 0) {
+        rc = -1;
+        break;
+      }
+    }
+    if (done == len)
+      break;
+    int n = DD_CHUNK_SIZE - stream->fill;
+    if (n > len - done)
+      n = len - done;
+    memcpy(stream->chunk + DD_CHUNK_HDR + stream->fill, data + done, n);
+    stream->fill += n;
+    done += n;
   }
-  free(ciphertext);
+  pthread_mutex_unlock(&stream->dd->lock);
+  // bytes taken are in the stream even if a later chunk couldn't be queued
+  if (done > 0 || len <= 0)
+    return done;
+  if (rc == 0)
+    errno = EAGAIN;
+  return -1;
+}
+
+int dd_stream_close(dd_stream_t **stream_p) {
+  assert(stream_p);
+  dd_stream_t *stream = *stream_p;
+  if (stream == NULL)
+    return 0;
+  int rc = -1;
+  if (s_dst_key(stream->dd, stream->target, 0)) {
+    pthread_mutex_lock(&stream->dd->lock);
+    rel_out_t *out = reliable_out(stream->dd->reliable, stream->target);
+    rc = s_stream_flush(stream, out, DD_CHUNK_LAST);
+    pthread_mutex_unlock(&stream->dd->lock);
+  }
+  free(stream->chunk);
+  free(stream->target);
+  free(stream);
+  *stream_p = NULL;
+  return rc;
+}
+
+int dd_set_compression(dd_t *self, char *prefix, int level, const void *dict,
+                       size_t dictlen) {
+  if (prefix == NULL)
+    return -1;
+  pthread_mutex_lock(&self->lock);
+  int rc = compressor_add_rule(self->compress, prefix, level, dict, dictlen);
+  pthread_mutex_unlock(&self->lock);
+  return rc;
+}
+
+int dd_add_dictionary(dd_t *self, const void *dict, size_t dictlen) {
+  pthread_mutex_lock(&self->lock);
+  int rc = compressor_add_dict(self->compress, dict, dictlen);
+  pthread_mutex_unlock(&self->lock);
+  return rc;
+}
+
+int dd_train_dictionary(void *dict, size_t capacity, const void *samples,
+                        const size_t *sizes, unsigned count) {
+  return compressor_train(dict, capacity, samples, sizes, count);
+}
+
+int dd_set_crypto_workers(dd_t *self, int workers) {
+  if (workers < 0)
+    return -1;
+  // the new pool is started before taking the lock, the loop thread only
+  // waits for the old one to stop
+  cryptpool_t *crypto = cryptpool_new(workers);
+  pthread_mutex_lock(&self->lock);
+  cryptpool_t *old = self->crypto;
+  self->crypto = crypto;
+  pthread_mutex_unlock(&self->lock);
+  cryptpool_destroy(&old);
+  return 0;
+}
+
+int dd_set_shm_group(dd_t *self, const char *group) {
+  struct group *gr = group ? getgrnam(group) : NULL;
+  if (gr == NULL)
+    return -1;
+  pthread_mutex_lock(&self->lock);
+  self->shm_gid = gr->gr_gid;
+  pthread_mutex_unlock(&self->lock);
   return 0;
 }
 
@@ -257,30 +855,45 @@ int dd_notify(dd_t *self, char *target, char *message, int mlen) {
 // callbacks from zloop //
 // ////////////////////////
 
+static void s_credit(dd_t *self) {
+  zsock_send(self->socket, "bbbb", &dd_version, 4, &dd_cmd_credit, 4,
+             &self->cookie, sizeof(self->cookie), &self->consumed,
+             sizeof(self->consumed));
+}
+
 static int s_ping(zloop_t *loop, int timerid, void *args) {
   dd_t *self = (dd_t *)args;
-  if (self->state == DD_STATE_REGISTERED)
+  pthread_mutex_lock(&self->lock);
+  if (self->state == DD_STATE_REGISTERED) {
     zsock_send(self->socket, "bbb", &dd_version, 4, &dd_cmd_ping, 4,
                &self->cookie, sizeof(self->cookie));
+    s_credit(self);
+  }
+  pthread_mutex_unlock(&self->lock);
   return 0;
 }
 
 static int s_heartbeat(zloop_t *loop, int timerid, void *args) {
   dd_t *self = (dd_t *)args;
+  pthread_mutex_lock(&self->lock);
   self->timeout++;
   if (self->timeout > 3) {
     self->state = DD_STATE_UNREG;
+    self->reg_attempts = 0;
     self->registration_loop =
-        zloop_timer(loop, 1000, 0, s_ask_registration, self);
+        zloop_timer(loop, dd_backoff(0), 1, s_ask_registration, self);
     zloop_timer_end(loop, self->heartbeat_loop);
     sublist_deactivate_all(self);
     self->on_discon(self);
   }
+  pthread_mutex_unlock(&self->lock);
   return 0;
 }
 
 static int s_ask_registration(zloop_t *loop, int timerid, void *args) {
   dd_t *self = (dd_t *)args;
+  int rc = 0;
+  pthread_mutex_lock(&self->lock);
   if (self->state == DD_STATE_UNREG) {
     zsock_set_linger(self->socket, 0);
     zloop_reader_end(loop, self->socket);
@@ -289,25 +902,73 @@ static int s_ask_registration(zloop_t *loop, int timerid, void *args) {
     if (!self->socket) {
       fprintf(stderr, "DD: Error in zsock_new_dealer: %s\n",
               zmq_strerror(errno));
-      free(self);
-      return -1;
+      rc = -1;
+      goto done;
     }
-    int rc = zsock_connect(self->socket, (const char *)self->endpoint);
-    if (rc != 0) {
+    if (zsock_connect(self->socket, (const char *)self->endpoint) != 0) {
       fprintf(stderr, "DD: Error in zmq_connect: %s\n", zmq_strerror(errno));
-      free(self);
-      return -1;
+      rc = -1;
+      goto done;
     }
     zloop_reader(loop, self->socket, s_on_dealer_msg, self);
-    zsock_send(self->socket, "bbs", &dd_version, 4, &dd_cmd_addlcl, 4,
-               (char *)dd_keys_hash(self->keys));
+    // with a ticket the broker can skip the challenge, if it doesn't accept
+    // it we get a CHALL as usual
+    uint32_t suites = s_offer(self);
+    if (self->ticket) {
+      // the ticket with the time, authenticated with the ticket's key
+      int64_t now = zclock_time();
+      size_t len = sizeof(now) + zframe_size(self->ticket);
+      unsigned char *authed = malloc(len);
+      memcpy(authed, &now, sizeof(now));
+      memcpy(authed + sizeof(now), zframe_data(self->ticket),
+             zframe_size(self->ticket));
+      unsigned char mac[crypto_auth_BYTES];
+      crypto_auth(mac, authed, len, self->ticket_key);
+      free(authed);
+      zsock_send(self->socket, "bbsfbbbs", &dd_version, 4, &dd_cmd_resume, 4,
+                 (char *)dd_keys_hash(self->keys), self->ticket, &now,
+                 sizeof(now), mac, sizeof(mac), &suites, sizeof(suites),
+                 s_ring_name(self));
+    } else
+      zsock_send(self->socket, "bbs", &dd_version, 4, &dd_cmd_addlcl, 4,
+                 (char *)dd_keys_hash(self->keys));
+    self->registration_loop =
+        zloop_timer(loop, dd_backoff(++self->reg_attempts), 1,
+                    s_ask_registration, self);
   }
-  return 0;
+done:
+  pthread_mutex_unlock(&self->lock);
+  return rc;
 }
 
 // /////////////////////////////////////
 // / callbacks for different messages //
 // ////////////////////////////////////
+
+// Keeps the ticket and its key the broker boxed to us in REGOK, none if
+// there are none or they can't be opened
+static void s_ticket_open(dd_t *self, zframe_t *boxed) {
+  zframe_destroy(&self->ticket);
+  size_t overhead = crypto_box_NONCEBYTES + crypto_box_MACBYTES;
+  size_t len = zframe_size(boxed);
+  if (len <= overhead + crypto_auth_KEYBYTES)
+    return;
+  size_t plainlen = len - overhead;
+  unsigned char *plain = malloc(plainlen);
+  unsigned char *data = zframe_data(boxed);
+  if (crypto_box_open_easy_afternm(plain, data + crypto_box_NONCEBYTES,
+                                   len - crypto_box_NONCEBYTES, data,
+                                   dd_keys_ddboxk(self->keys)) == 0) {
+    size_t ticketlen = plainlen - crypto_auth_KEYBYTES;
+    self->ticket = zframe_new(plain, ticketlen);
+    memcpy(self->ticket_key, plain + ticketlen, crypto_auth_KEYBYTES);
+  } else {
+    fprintf(stderr, "DD: Unable to open the session ticket from broker\n");
+  }
+  sodium_memzero(plain, plainlen);
+  free(plain);
+}
+
 static void cb_regok(dd_t *self, zmsg_t *msg, zloop_t *loop) {
   zframe_t *cookie_frame;
   cookie_frame = zmsg_pop(msg);
@@ -318,12 +979,45 @@ static void cb_regok(dd_t *self, zmsg_t *msg, zloop_t *loop) {
   uint64_t *cookie2 = (uint64_t *)zframe_data(cookie_frame);
   self->cookie = *cookie2;
   zframe_destroy(&cookie_frame);
+  // brokers that support resumption add a ticket and its key
+  if (zmsg_size(msg) > 0) {
+    zframe_t *boxed = zmsg_pop(msg);
+    s_ticket_open(self, boxed);
+    zframe_destroy(&boxed);
+  }
+  // followed by the cipher suite if the tenant negotiates one, messages
+  // within the tenant then start with the suite they were sealed with
+  self->suite = -1;
+  zframe_t *suite_frame = zmsg_pop(msg);
+  if (suite_frame && zframe_size(suite_frame) == sizeof(int32_t)) {
+    int32_t suite;
+    memcpy(&suite, zframe_data(suite_frame), sizeof(suite));
+    if (suite >= 0 && suite < DD_SUITES)
+      self->suite = suite;
+  }
+  zframe_destroy(&suite_frame);
+  // and whether we may skip encryption within the tenant
+  self->plaintext = 0;
+  zframe_t *pt_frame = zmsg_pop(msg);
+  if (pt_frame && zframe_size(pt_frame) == sizeof(uint32_t))
+    self->plaintext = *(uint32_t *)zframe_data(pt_frame) != 0;
+  zframe_destroy(&pt_frame);
+  // and whether it mapped our ring
+  self->shm_ok = 0;
+  zframe_t *shm_frame = zmsg_pop(msg);
+  if (shm_frame && zframe_size(shm_frame) == sizeof(uint32_t))
+    self->shm_ok = *(uint32_t *)zframe_data(shm_frame) != 0;
+  zframe_destroy(&shm_frame);
   self->state = DD_STATE_REGISTERED;
   zsock_send(self->socket, "bbb", &dd_version, 4, &dd_cmd_ping, 4,
              &self->cookie, sizeof(self->cookie));
+  // opt in to flow control in the broker
+  self->consumed = 0;
+  s_credit(self);
 
   self->heartbeat_loop = zloop_timer(loop, 1500, 0, s_heartbeat, self);
   zloop_timer_end(loop, self->registration_loop);
+  self->reg_attempts = 0;
   // if this is re-registration, we should try to subscribe again
   sublist_resubscribe(self);
   self->on_reg(self);
@@ -350,31 +1044,23 @@ static void cb_chall(dd_t *self, zmsg_t *msg) {
 
   zframe_t *temp_frame = zframe_new(decrypted, enclen - crypto_box_NONCEBYTES -
                                                    crypto_box_MACBYTES);
-  zsock_send(self->socket, "bbfss", &dd_version, 4, &dd_cmd_challok, 4,
-             temp_frame, dd_keys_hash(self->keys), self->client_name);
+  uint32_t suites = s_offer(self);
+  zsock_send(self->socket, "bbfssbs", &dd_version, 4, &dd_cmd_challok, 4,
+             temp_frame, dd_keys_hash(self->keys), self->client_name, &suites,
+             sizeof(suites), s_ring_name(self));
   zframe_destroy(&temp_frame);
   free(decrypted);
 }
 
-static void cb_data(dd_t *self, zmsg_t *msg) {
-  int retval;
-  char *source = zmsg_popstr(msg);
-  /* printf("cb_data: S: %s\n", source); */
-  zframe_t *encrypted = zmsg_first(msg);
-  unsigned char *data = zframe_data(encrypted);
-  int enclen = zframe_size(encrypted);
-  unsigned char *decrypted =
-      calloc(1, enclen - crypto_box_NONCEBYTES - crypto_box_MACBYTES);
-  const uint8_t *precalck = NULL;
+// Key for messages from a client
+static const unsigned char *s_peer_key(dd_t *self, char *source) {
+  const unsigned char *precalck = NULL;
   char *dot = strchr(source, '.');
   if (dot) {
     *dot = '\0';
     precalck = zhash_lookup(dd_keys_clients(self->keys), source);
-    if (precalck) {
-    }
     *dot = '.';
   }
-
   if (!precalck) {
     if (strncmp("public.", source, strlen("public.")) == 0) {
       precalck = dd_keys_pubboxk(self->keys);
@@ -382,70 +1068,353 @@ static void cb_data(dd_t *self, zmsg_t *msg) {
       precalck = dd_keys_custboxk(self->keys);
     }
   }
-  retval = crypto_box_open_easy_afternm(decrypted, data + crypto_box_NONCEBYTES,
-                                        enclen - crypto_box_NONCEBYTES, data,
-                                        precalck);
-  if (retval == 0) {
-    self->on_data(source, decrypted,
-                  enclen - crypto_box_NONCEBYTES - crypto_box_MACBYTES, self);
-  } else {
-    fprintf(stderr, "DD: Unable to decrypt %d bytes from %s\n",
-            enclen - crypto_box_NONCEBYTES - crypto_box_MACBYTES, source);
+  return precalck;
+}
+
+// Sets up job to open a message from source, without the output buffer
+static void s_open_job(dd_t *self, crypt_job_t *job, char *source,
+                       const unsigned char *in, size_t inlen) {
+  job->in = in;
+  job->inlen = inlen;
+  job->key = source ? s_peer_key(self, source) : NULL;
+  job->suite = DD_SUITE_BOX;
+  // within the tenant, messages start with the suite they were sealed
+  // with, which may differ from ours if the sender lacks hardware AES
+  if (self->suite >= 0 && job->key == dd_keys_custboxk(self->keys) &&
+      job->inlen > 0) {
+    job->suite = job->in[0];
+    job->key = dd_keys_suitek(self->keys, job->suite);
+    job->in++;
+    job->inlen--;
   }
-  free(decrypted);
-  free(source);
 }
 
-// up to the user to free the memory!
-static void cb_pub(dd_t *self, zmsg_t *msg) {
-  int retval;
-  char *source = zmsg_popstr(msg);
-  char *topic = zmsg_popstr(msg);
-  zframe_t *encrypted = zmsg_first(msg);
-  unsigned char *data = zframe_data(encrypted);
-  int enclen = zframe_size(encrypted);
+// Queues a DATA (topic NULL) or PUB message, they are decrypted together
+// when the inbox is flushed
+static void s_inbox_add(dd_t *self, zmsg_t *msg, int pub) {
+  if (self->inbox_size == DD_RECV_BATCH)
+    s_inbox_flush(self);
+  struct _dd_inbox *in = &self->inbox[self->inbox_size++];
+  in->source = zmsg_popstr(msg);
+  in->topic = pub ? zmsg_popstr(msg) : NULL;
+  in->msg = msg;
+}
 
-  int mlen = enclen - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
-  unsigned char *decrypted = calloc(1, mlen);
+// Flags in the frame after the payload, 0 if there is none
+static uint32_t s_payload_flags(zmsg_t *msg) {
+  uint32_t flags = 0;
+  zmsg_first(msg);
+  zframe_t *frame = zmsg_next(msg);
+  if (frame && zframe_size(frame) == sizeof(flags))
+    memcpy(&flags, zframe_data(frame), sizeof(flags));
+  return flags;
+}
 
-  const unsigned char *precalck = NULL;
-  char *dot = strchr(source, '.');
-  if (dot) {
-    *dot = '\0';
-    precalck = zhash_lookup(dd_keys_clients(self->keys), source);
-    if (precalck) {
-    }
-    *dot = '.';
+// Number of a publication in the broker's log, in the frame after the
+// flags, 0 if it wasn't logged
+static uint64_t s_payload_seq(zmsg_t *msg, uint32_t flags) {
+  uint64_t seq = 0;
+  if (!(flags & DD_PAYLOAD_SEQ) || zmsg_size(msg) < 3)
+    return 0;
+  zframe_t *frame = zmsg_last(msg);
+  if (zframe_size(frame) == sizeof(seq))
+    memcpy(&seq, zframe_data(frame), sizeof(seq));
+  return seq;
+}
+
+// Replays can overlap and arrive interleaved with live publications, so
+// only when all of them are complete does pub_seq move past what they
+// covered
+static void s_pub_seen(dd_t *self, uint64_t seq, int replayed) {
+  if (self->replays > 0) {
+    if (!replayed && seq > self->live_seq)
+      self->live_seq = seq;
+  } else if (seq > self->pub_seq) {
+    self->pub_seq = seq;
   }
-  if (!precalck) {
-    if (strncmp("public.", source, strlen("public.")) == 0) {
-      precalck = dd_keys_pubboxk(self->keys);
+}
+
+// A notification flagged as a chunk of a stream, see s_stream_flush
+static void s_on_chunk(dd_t *self, char *source, unsigned char *data,
+                       int len) {
+  if (len < DD_CHUNK_HDR || self->on_chunk == NULL) {
+    fprintf(stderr, "DD: Dropping stream chunk from %s\n", source);
+    return;
+  }
+  uint64_t id, offset;
+  uint32_t flags;
+  memcpy(&id, data, sizeof(id));
+  memcpy(&offset, data + 8, sizeof(offset));
+  memcpy(&flags, data + 16, sizeof(flags));
+  self->on_chunk(source, id, offset, data + DD_CHUNK_HDR, len - DD_CHUNK_HDR,
+                 (flags & DD_CHUNK_LAST) != 0, self);
+}
+
+// A payload from source we couldn't decompress for lack of a dictionary,
+// or of zstd altogether. Asks source for it, not too often.
+static void s_comp_ask(dd_t *self, char *source, const unsigned char *data,
+                       int len) {
+  unsigned id;
+  if (!compressor_missing(self->compress, source, data, len, &id) ||
+      !compressor_ask(self->compress, source, id, zclock_mono()))
+    return;
+  uint32_t want = id;
+  char *message = (char *)&want;
+  int mlen = sizeof(want);
+  s_seal_batch(self, &dd_cmd_send, source, &message, &mlen, 1,
+               DD_PAYLOAD_DICTREQ);
+}
+
+// source asked for one of our dictionaries. Public clients only get those
+// of rules that would compress notifications to them or public topics.
+static void s_comp_req(dd_t *self, char *source, const unsigned char *data,
+                       int len) {
+  uint32_t id;
+  if (len != sizeof(id))
+    return;
+  memcpy(&id, data, sizeof(id));
+  if (id == 0) {
+    compressor_set_plain(self->compress, source);
+    return;
+  }
+  comp_rule_t *rule = compressor_rule_by_dict(self->compress, id);
+  if (rule == NULL)
+    return;
+  const char *public = "public.";
+  if (strncmp(source, public, strlen(public)) == 0 &&
+      strncmp(rule->prefix, public, strlen(public)) != 0 &&
+      compressor_rule(self->compress, source) != rule)
+    return;
+  s_send_dict(self, source, rule);
+}
+
+// Decrypts the queued messages in one batch and hands them to the user in
+// the order they arrived. The decrypted data is only valid during the
+// callback.
+static void s_inbox_flush(dd_t *self) {
+  int n = self->inbox_size;
+  if (n == 0)
+    return;
+  self->inbox_size = 0;
+
+  crypt_job_t jobs[DD_RECV_BATCH];
+  size_t total = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    zframe_t *encrypted = zmsg_first(self->inbox[i].msg);
+    s_open_job(self, &jobs[i], self->inbox[i].source,
+               encrypted ? zframe_data(encrypted) : NULL,
+               encrypted ? zframe_size(encrypted) : 0);
+    total += jobs[i].inlen;
+  }
+  unsigned char *decrypted = malloc(total > 0 ? total : 1);
+  unsigned char *dest = decrypted;
+  for (i = 0; i < n; i++) {
+    jobs[i].out = dest;
+    dest += jobs[i].inlen;
+    // missing parts fail like a short message
+    if (jobs[i].key == NULL || jobs[i].in == NULL)
+      jobs[i].inlen = 0;
+  }
+  cryptpool_open(self->crypto, jobs, n);
+
+  for (i = 0; i < n; i++) {
+    struct _dd_inbox *in = &self->inbox[i];
+    int mlen = (int)jobs[i].inlen - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
+    uint32_t flags = s_payload_flags(in->msg);
+    unsigned char *data = jobs[i].out;
+    unsigned char *unpacked = NULL;
+    if (jobs[i].rc == 0 && (flags & DD_PAYLOAD_ZSTD)) {
+      size_t n;
+      unpacked = compressor_unpack(self->compress, in->source, data, mlen, &n);
+      if (unpacked) {
+        data = unpacked;
+        mlen = n;
+      }
+    }
+    if (jobs[i].rc != 0) {
+      if (in->topic)
+        fprintf(stderr, "DD: Unable to decrypt %d bytes from %s, topic %s\n",
+                mlen, in->source, in->topic);
+      else
+        fprintf(stderr, "DD: Unable to decrypt %d bytes from %s\n", mlen,
+                in->source);
+    } else if ((flags & DD_PAYLOAD_ZSTD) && unpacked == NULL) {
+      fprintf(stderr, "DD: Unable to decompress %d bytes from %s\n", mlen,
+              in->source);
+      s_comp_ask(self, in->source, data, mlen);
+    } else if (in->topic) {
+      self->pub_cur = s_payload_seq(in->msg, flags);
+      self->on_pub(in->source, in->topic, data, mlen, self);
+      if (self->pub_cur)
+        s_pub_seen(self, self->pub_cur, (flags & DD_PAYLOAD_REPLAY) != 0);
+      self->pub_cur = 0;
+    } else if (flags & DD_PAYLOAD_DICT) {
+      if (compressor_add_peer_dict(self->compress, in->source, data, mlen) != 0)
+        fprintf(stderr, "DD: Unusable dictionary from %s\n", in->source);
+    } else if (flags & DD_PAYLOAD_DICTREQ) {
+      s_comp_req(self, in->source, data, mlen);
+    } else if (flags & DD_PAYLOAD_RELIABLE) {
+      s_rel_data(self, in->source, data, mlen, flags);
+    } else if (flags & DD_PAYLOAD_CHUNK) {
+      s_on_chunk(self, in->source, data, mlen);
+    } else if (flags & DD_PAYLOAD_ACK) {
+      s_rel_ack(self, data, mlen);
     } else {
-      precalck = dd_keys_custboxk(self->keys);
+      self->on_data(in->source, data, mlen, self);
     }
+    free(unpacked);
+    free(in->source);
+    free(in->topic);
+    zmsg_destroy(&in->msg);
+    if (++self->consumed % DD_CREDIT_BATCH == 0)
+      s_credit(self);
   }
+  free(decrypted);
+  s_rel_acks(self);
+}
 
-  retval = crypto_box_open_easy_afternm(decrypted, data + crypto_box_NONCEBYTES,
-                                        enclen - crypto_box_NONCEBYTES, data,
-                                        precalck);
+// DATAPT carries a notification from a client of our tenant that was never
+// encrypted, the broker only sends it if we are in plaintext mode
+static void cb_datapt(dd_t *self, zmsg_t *msg) {
+  char *source = zmsg_popstr(msg);
+  zframe_t *data = zmsg_first(msg);
+  if (source == NULL || data == NULL || !self->plaintext) {
+    fprintf(stderr, "DD: Dropping unexpected DATAPT\n");
+    free(source);
+    return;
+  }
+  self->on_data(source, zframe_data(data), zframe_size(data), self);
+  free(source);
+}
+
+static void s_ring_free(void *data) {
+  shmring_t *ring = data;
+  shmring_destroy(&ring);
+}
 
-  if (retval == 0) {
-    self->on_pub(source, topic, decrypted, mlen, self);
+// Rings of other local clients stay mapped after their first DATASHM,
+// only a bounded number of them
+static shmring_t *s_peer_ring(dd_t *self, const char *name) {
+  if (strncmp(name, "/dd-", 4) != 0)
+    return NULL;
+  if (self->shm && streq(name, self->shm->name))
+    return self->shm;
+  shmring_t *ring = zhash_lookup(self->peer_rings, name);
+  if (ring)
+    return ring;
+  ring = shmring_open(name, self->shm_gid);
+  if (ring == NULL)
+    return NULL;
+  if (zhash_size(self->peer_rings) >= DD_SHM_PEERS) {
+    zhash_destroy(&self->peer_rings);
+    self->peer_rings = zhash_new();
+  }
+  zhash_insert(self->peer_rings, name, ring);
+  zhash_freefn(self->peer_rings, name, s_ring_free);
+  return ring;
+}
+
+// DATASHM carries the position of a notification in the ring of the
+// sender, which is opened straight from shared memory and then released
+static void cb_datashm(dd_t *self, zmsg_t *msg) {
+  char *source = zmsg_popstr(msg);
+  char *name = zmsg_popstr(msg);
+  zframe_t *off_frame = zmsg_pop(msg);
+  zframe_t *len_frame = zmsg_pop(msg);
+  zframe_t *pt_frame = zmsg_pop(msg);
+  if (source == NULL || name == NULL || off_frame == NULL ||
+      zframe_size(off_frame) != sizeof(uint64_t) || len_frame == NULL ||
+      zframe_size(len_frame) != sizeof(uint32_t) || pt_frame == NULL ||
+      zframe_size(pt_frame) != sizeof(uint32_t)) {
+    fprintf(stderr, "DD: Misformed DATASHM message!\n");
+    goto cleanup;
+  }
+  uint64_t off;
+  uint32_t len;
+  memcpy(&off, zframe_data(off_frame), sizeof(off));
+  memcpy(&len, zframe_data(len_frame), sizeof(len));
+  int pt = *(uint32_t *)zframe_data(pt_frame) != 0;
+  shmring_t *ring = s_peer_ring(self, name);
+  unsigned char *data = ring ? shmring_get(ring, off, len) : NULL;
+  if (data == NULL) {
+    fprintf(stderr, "DD: Dropping DATASHM from %s, no such record\n", source);
+    goto cleanup;
+  }
+  if (pt) {
+    if (self->plaintext)
+      self->on_data(source, data, len, self);
+    else
+      fprintf(stderr, "DD: Dropping unexpected plaintext DATASHM\n");
   } else {
-    fprintf(stderr, "DD: Unable to decrypt %d bytes from %s, topic %s\n", mlen,
-            source, topic);
+    crypt_job_t job;
+    s_open_job(self, &job, source, data, len);
+    unsigned char *decrypted = malloc(job.inlen > 0 ? job.inlen : 1);
+    job.out = decrypted;
+    cryptpool_open(self->crypto, &job, 1);
+    int mlen = (int)job.inlen - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
+    if (job.rc != 0)
+      fprintf(stderr, "DD: Unable to decrypt %d bytes from %s\n", mlen,
+              source);
+    else
+      self->on_data(source, decrypted, mlen, self);
+    free(decrypted);
   }
-  free(decrypted);
-  free(topic);
+  shmring_release(ring, off, len);
+
+cleanup:
   free(source);
+  free(name);
+  zframe_destroy(&off_frame);
+  zframe_destroy(&len_frame);
+  zframe_destroy(&pt_frame);
 }
 
-static void cb_subok(dd_t *self, zmsg_t *msg) {
+// SUBOK confirms one or more topic/scope pairs
+// REPLAY [topic, scope, from, until] comes after a batch of replayed
+// publications, asking us to continue from the last one. From equals until
+// once the replay is complete.
+static void cb_replay(dd_t *self, zmsg_t *msg) {
   char *topic = zmsg_popstr(msg);
   char *scope = zmsg_popstr(msg);
-  sublist_activate(self, topic, scope);
+  zframe_t *from_frame = zmsg_pop(msg);
+  zframe_t *until_frame = zmsg_pop(msg);
+  if (topic == NULL || scope == NULL || from_frame == NULL ||
+      zframe_size(from_frame) != sizeof(uint64_t) || until_frame == NULL ||
+      zframe_size(until_frame) != sizeof(uint64_t)) {
+    fprintf(stderr, "DD: Misformed REPLAY message!\n");
+    goto cleanup;
+  }
+  uint64_t from, until;
+  memcpy(&from, zframe_data(from_frame), sizeof(from));
+  memcpy(&until, zframe_data(until_frame), sizeof(until));
+  if (from < until) {
+    s_replay(self, topic, scope, from, until);
+  } else if (self->replays > 0) {
+    if (until > self->replay_until)
+      self->replay_until = until;
+    if (--self->replays == 0) {
+      if (self->replay_until > self->pub_seq)
+        self->pub_seq = self->replay_until;
+      if (self->live_seq > self->pub_seq)
+        self->pub_seq = self->live_seq;
+    }
+  }
+cleanup:
   free(topic);
   free(scope);
+  zframe_destroy(&from_frame);
+  zframe_destroy(&until_frame);
+}
+
+static void cb_subok(dd_t *self, zmsg_t *msg) {
+  while (zmsg_size(msg) >= 2) {
+    char *topic = zmsg_popstr(msg);
+    char *scope = zmsg_popstr(msg);
+    sublist_activate(self, topic, scope);
+    free(topic);
+    free(scope);
+  }
 }
 
 static void cb_error(dd_t *self, zmsg_t *msg) {
@@ -543,25 +1512,45 @@ void actor_data(char *source, unsigned char *data, int length, void *args) {
   zsock_send(self->pipe, "ssbb", "data", source, &length, sizeof(length), data,
              length);
 }
+void actor_chunk(char *source, uint64_t stream, uint64_t offset,
+                 unsigned char *data, int length, int last, void *args) {
+  dd_t *self = (dd_t *)args;
+  zsock_send(self->pipe, "ssbbbb", "chunk", source, &stream, sizeof(stream),
+             &offset, sizeof(offset), &last, sizeof(last), data, length);
+}
 void actor_error(int error_code, char *error_message, void *args) {
   dd_t *self = (dd_t *)args;
   zsock_send(self->pipe, "ssb", "error", error_message, &error_code,
              sizeof(error_code));
 }
 
+// Reads up to DD_RECV_BATCH messages that are already waiting, so the
+// DATA and PUB among them can be decrypted as one batch
 static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args) {
   dd_t *self = (dd_t *)args;
+  pthread_mutex_lock(&self->lock);
   self->timeout = 0;
-  zmsg_t *msg = zmsg_recv(handle);
-
-  if (msg == NULL) {
-    fprintf(stderr, "DD: zmsg_recv returned NULL\n");
-    return 0;
+  int i;
+  for (i = 0; i < DD_RECV_BATCH; i++) {
+    if (i > 0 && !(zsock_events(handle) & ZMQ_POLLIN))
+      break;
+    zmsg_t *msg = zmsg_recv(handle);
+    if (msg == NULL) {
+      fprintf(stderr, "DD: zmsg_recv returned NULL\n");
+      break;
+    }
+    s_dealer_dispatch(self, msg, loop);
   }
+  s_inbox_flush(self);
+  pthread_mutex_unlock(&self->lock);
+  return 0;
+}
+
+static void s_dealer_dispatch(dd_t *self, zmsg_t *msg, zloop_t *loop) {
   if (zmsg_size(msg) < 2) {
     fprintf(stderr, "DD: Message length less than 2, error!\n");
     zmsg_destroy(&msg);
-    return 0;
+    return;
   }
 
   zframe_t *proto_frame = zmsg_pop(msg);
@@ -571,10 +1560,13 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args) {
             *zframe_data(proto_frame));
     zframe_destroy(&proto_frame);
     zmsg_destroy(&msg);
-    return 0;
+    return;
   }
   zframe_t *cmd_frame = zmsg_pop(msg);
   uint32_t cmd = *((uint32_t *)zframe_data(cmd_frame));
+  // keep the order of DATA and PUB relative to everything else
+  if (cmd != DD_CMD_DATA && cmd != DD_CMD_PUB)
+    s_inbox_flush(self);
   switch (cmd) {
   case DD_CMD_SEND:
     fprintf(stderr, "DD: Got command DD_CMD_SEND\n");
@@ -604,7 +1596,8 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args) {
     fprintf(stderr, "DD: Got command DD_CMD_UNREGBR\n");
     break;
   case DD_CMD_DATA:
-    cb_data(self, msg);
+    s_inbox_add(self, msg, 0);
+    msg = NULL;
     break;
   case DD_CMD_ERROR:
     cb_error(self, msg);
@@ -622,7 +1615,8 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args) {
     fprintf(stderr, "DD: Got command DD_CMD_CHALLOK\n");
     break;
   case DD_CMD_PUB:
-    cb_pub(self, msg);
+    s_inbox_add(self, msg, 1);
+    msg = NULL;
     break;
   case DD_CMD_SUB:
     fprintf(stderr, "DD: Got command DD_CMD_SUB\n");
@@ -639,15 +1633,24 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args) {
   case DD_CMD_SENDPT:
     fprintf(stderr, "DD: Got command DD_CMD_SENDPT\n");
     break;
-  case DD_CMD_FORWARDPT:
-    fprintf(stderr, "DD: Got command DD_CMD_FORWARDPT\n");
-    break;
   case DD_CMD_DATAPT:
-    fprintf(stderr, "DD: Got command DD_CMD_DATAPT\n");
+    cb_datapt(self, msg);
+    if (++self->consumed % DD_CREDIT_BATCH == 0)
+      s_credit(self);
     break;
   case DD_CMD_SUBOK:
     cb_subok(self, msg);
     break;
+  case DD_CMD_DATASHM:
+    cb_datashm(self, msg);
+    if (++self->consumed % DD_CREDIT_BATCH == 0)
+      s_credit(self);
+    break;
+  case DD_CMD_REPLAY:
+    cb_replay(self, msg);
+    if (++self->consumed % DD_CREDIT_BATCH == 0)
+      s_credit(self);
+    break;
   default:
     fprintf(stderr, "DD: Unknown command, value: 0x%x\n", cmd);
     break;
@@ -655,7 +1658,6 @@ static int s_on_dealer_msg(zloop_t *loop, zsock_t *handle, void *args) {
   zframe_destroy(&proto_frame);
   zframe_destroy(&cmd_frame);
   zmsg_destroy(&msg);
-  return 0;
 }
 
 // Threads
@@ -684,12 +1686,14 @@ void *ddthread(void *args) {
   }
 
   self->sublist = sublist_new();
+  self->subindex = zhashx_new();
 
   self->loop = zloop_new();
   assert(self->loop);
   self->registration_loop =
-      zloop_timer(self->loop, 1000, 0, s_ask_registration, self);
+      zloop_timer(self->loop, dd_backoff(0), 1, s_ask_registration, self);
   rc = zloop_reader(self->loop, self->socket, s_on_dealer_msg, self);
+  zloop_timer(self->loop, DD_REL_TICK, 0, s_rel_tick, self);
   zloop_start(self->loop);
   return self;
 }
@@ -718,9 +1722,24 @@ void dd_destroy(dd_t **self_p) {
       self->client_name = NULL;
     }
 
+    zframe_destroy(&self->ticket);
+    sodium_memzero(self->ticket_key, sizeof(self->ticket_key));
+    while (self->inbox_size > 0) {
+      struct _dd_inbox *in = &self->inbox[--self->inbox_size];
+      free(in->source);
+      free(in->topic);
+      zmsg_destroy(&in->msg);
+    }
+    cryptpool_destroy(&self->crypto);
+    compressor_destroy(&self->compress);
+    zhash_destroy(&self->peer_rings);
+    reliable_destroy(&self->reliable);
+    shmring_destroy(&self->shm);
     dd_keys_destroy(&self->keys);
     sublist_destroy(&self->sublist);
+    zhashx_destroy(&self->subindex);
     zloop_destroy(&self->loop);
+    pthread_mutex_destroy(&self->lock);
 
     free(self);
     *self_p = NULL;
@@ -756,13 +1775,15 @@ void dd_actor(zsock_t *pipe, void *args) {
   }
 
   self->sublist = sublist_new();
+  self->subindex = zhashx_new();
 //  fprintf(stderr,"Sublist initilized %p\n", self->sublist);
   
   self->loop = zloop_new();
   assert(self->loop);
   self->registration_loop =
-      zloop_timer(self->loop, 1000, 0, s_ask_registration, self);
+      zloop_timer(self->loop, dd_backoff(0), 1, s_ask_registration, self);
   rc = zloop_reader(self->loop, self->socket, s_on_dealer_msg, self);
+  zloop_timer(self->loop, DD_REL_TICK, 0, s_rel_tick, self);
   rc = zloop_reader(self->loop, pipe, s_on_pipe_msg, self);
   while (rc == 0){
     rc = zloop_start(self->loop);
@@ -778,6 +1799,14 @@ void dd_actor(zsock_t *pipe, void *args) {
    dd_destroy(&self);
 }
 
+static void s_lock_init(dd_t *self) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&self->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
 zactor_t *ddactor_new(char *client_name, char *endpoint, char *keyfile) {
   // Make sure that ZMQ doesn't affect main process signal handling
   zsys_init();
@@ -789,9 +1818,26 @@ zactor_t *ddactor_new(char *client_name, char *endpoint, char *keyfile) {
   self->keyfile = (unsigned char *)strdup(keyfile);
   self->timeout = 0;
   self->state = DD_STATE_UNREG;
+  self->reg_attempts = 0;
+  self->ticket = NULL;
+  self->crypto = cryptpool_new(-1);
+  self->compress = compressor_new();
+  self->suite = -1;
+  self->plaintext = 0;
+  self->shm = NULL;
+  self->shm_ok = 0;
+  self->shm_gid = -1;
+  self->peer_rings = zhash_new();
+  self->reliable = reliable_new();
+  self->pub_seq = self->pub_cur = 0;
+  self->replays = 0;
+  self->live_seq = self->replay_until = 0;
+  self->inbox_size = 0;
+  s_lock_init(self);
 
   self->pipe = NULL;
   self->sublist = NULL;
+  self->subindex = NULL;
   self->loop = NULL;
 
   randombytes_buf(self->nonce, crypto_box_NONCEBYTES);
@@ -800,6 +1846,8 @@ zactor_t *ddactor_new(char *client_name, char *endpoint, char *keyfile) {
   self->on_data = actor_data;
   self->on_pub = actor_pub;
   self->on_error = actor_error;
+  self->on_chunk = actor_chunk;
+  self->on_ack = NULL;
   zactor_t *actor = zactor_new(dd_actor, self);
   return actor;
 }
@@ -817,12 +1865,30 @@ dd_t *dd_new(char *client_name, char *endpoint, char *keyfile, dd_on_con con,
   self->keyfile = (unsigned char *)strdup(keyfile);
   self->timeout = 0;
   self->state = DD_STATE_UNREG;
+  self->reg_attempts = 0;
+  self->ticket = NULL;
+  self->crypto = cryptpool_new(-1);
+  self->compress = compressor_new();
+  self->suite = -1;
+  self->plaintext = 0;
+  self->shm = NULL;
+  self->shm_ok = 0;
+  self->shm_gid = -1;
+  self->peer_rings = zhash_new();
+  self->reliable = reliable_new();
+  self->pub_seq = self->pub_cur = 0;
+  self->replays = 0;
+  self->live_seq = self->replay_until = 0;
+  self->inbox_size = 0;
+  s_lock_init(self);
   randombytes_buf(self->nonce, crypto_box_NONCEBYTES);
   self->on_reg = con;
   self->on_discon = discon;
   self->on_data = data;
   self->on_pub = pub;
   self->on_error = error;
+  self->on_chunk = NULL;
+  self->on_ack = NULL;
   zthread_new(ddthread, self);
   return self;
 }
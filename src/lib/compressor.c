@@ -0,0 +1,317 @@
+/*
+ * compressor.c --- zstd compression of payloads before they are encrypted
+ *
+ * Encrypted payloads can't be compressed by the brokers, so clients
+ * compress them before sealing, for targets and topics picked by prefix.
+ * Small, repetitive messages like JSON telemetry only shrink much with a
+ * dictionary trained on samples of them, see dd_train_dictionary. zstd
+ * puts the id of the dictionary in the frame, so receivers can hold the
+ * dictionaries of several rules and pick the right one. Without libzstd
+ * nothing is compressed and compressed payloads can't be read.
+ *
+ * Dictionaries are negotiated end to end, as the brokers can't read the
+ * payloads. A notified target is sent the dictionary before the first
+ * payload compressed with it. A receiver missing a dictionary, say for a
+ * topic or after a restart, drops the payload and asks its source, which
+ * answers with the dictionary. A receiver without libzstd asks for id 0,
+ * and is no longer sent compressed notifications.
+ */
+#include "../config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../include/compressor.h"
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+// Starts peer state over once it holds DD_COMP_PEERS entries
+static void s_bounded(zhash_t **hash_p) {
+  if (zhash_size(*hash_p) < DD_COMP_PEERS)
+    return;
+  zhash_destroy(hash_p);
+  *hash_p = zhash_new();
+}
+
+#ifdef HAVE_ZSTD
+static void s_rule_free(void *data) {
+  comp_rule_t *rule = data;
+  ZSTD_freeCDict(rule->cdict);
+  free(rule->dict);
+  free(rule->prefix);
+  free(rule);
+}
+
+static void s_ddict_free(void *data) { ZSTD_freeDDict(data); }
+#endif
+
+compressor_t *compressor_new() {
+  compressor_t *self = calloc(1, sizeof(compressor_t));
+  self->rules = zlist_new();
+  self->ddicts = zhash_new();
+  self->peer_ddicts = zhash_new();
+  self->sent = zhash_new();
+  self->plain = zhash_new();
+  self->asked = zhash_new();
+  return self;
+}
+
+void compressor_destroy(compressor_t **self_p) {
+  compressor_t *self = *self_p;
+  if (self == NULL)
+    return;
+#ifdef HAVE_ZSTD
+  comp_rule_t *rule;
+  while ((rule = zlist_pop(self->rules)))
+    s_rule_free(rule);
+  ZSTD_freeCCtx(self->cctx);
+  ZSTD_freeDCtx(self->dctx);
+#endif
+  zlist_destroy(&self->rules);
+  zhash_destroy(&self->ddicts);
+  zhash_destroy(&self->peer_ddicts);
+  zhash_destroy(&self->sent);
+  zhash_destroy(&self->plain);
+  zhash_destroy(&self->asked);
+  free(self);
+  *self_p = NULL;
+}
+
+// Compress payloads to or on prefix, replacing an earlier rule for it.
+// The dictionary, if any, is also used for decompressing.
+int compressor_add_rule(compressor_t *self, const char *prefix, int level,
+                        const void *dict, size_t dictlen) {
+#ifdef HAVE_ZSTD
+  comp_rule_t *rule = calloc(1, sizeof(comp_rule_t));
+  rule->prefix = strdup(prefix);
+  rule->level = level;
+  if (dict && dictlen > 0) {
+    rule->cdict = ZSTD_createCDict(dict, dictlen, level);
+    if (rule->cdict == NULL || compressor_add_dict(self, dict, dictlen) != 0) {
+      s_rule_free(rule);
+      return -1;
+    }
+    rule->dict = malloc(dictlen);
+    memcpy(rule->dict, dict, dictlen);
+    rule->dictlen = dictlen;
+    rule->dict_id = ZSTD_getDictID_fromDict(dict, dictlen);
+  }
+  comp_rule_t *old = zlist_first(self->rules);
+  while (old) {
+    if (streq(old->prefix, prefix)) {
+      zlist_remove(self->rules, old);
+      s_rule_free(old);
+      break;
+    }
+    old = zlist_next(self->rules);
+  }
+  zlist_append(self->rules, rule);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int compressor_add_dict(compressor_t *self, const void *dict, size_t dictlen) {
+#ifdef HAVE_ZSTD
+  unsigned id = ZSTD_getDictID_fromDict(dict, dictlen);
+  if (id == 0)
+    return -1;
+  char key[16];
+  snprintf(key, sizeof(key), "%u", id);
+  if (zhash_lookup(self->ddicts, key))
+    return 0;
+  ZSTD_DDict *ddict = ZSTD_createDDict(dict, dictlen);
+  if (ddict == NULL)
+    return -1;
+  zhash_insert(self->ddicts, key, ddict);
+  zhash_freefn(self->ddicts, key, s_ddict_free);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+// A dictionary source sent when asked, only used for its payloads
+int compressor_add_peer_dict(compressor_t *self, const char *source,
+                             const void *dict, size_t dictlen) {
+#ifdef HAVE_ZSTD
+  unsigned id = ZSTD_getDictID_fromDict(dict, dictlen);
+  if (id == 0)
+    return -1;
+  char key[256];
+  snprintf(key, sizeof(key), "%s/%u", source, id);
+  if (zhash_lookup(self->peer_ddicts, key))
+    return 0;
+  ZSTD_DDict *ddict = ZSTD_createDDict(dict, dictlen);
+  if (ddict == NULL)
+    return -1;
+  s_bounded(&self->peer_ddicts);
+  zhash_insert(self->peer_ddicts, key, ddict);
+  zhash_freefn(self->peer_ddicts, key, s_ddict_free);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+// The rule with the longest prefix of dst, NULL if none applies
+comp_rule_t *compressor_rule(compressor_t *self, const char *dst) {
+  comp_rule_t *best = NULL;
+  comp_rule_t *rule = zlist_first(self->rules);
+  while (rule) {
+    size_t len = strlen(rule->prefix);
+    if (strncmp(dst, rule->prefix, len) == 0 &&
+        (best == NULL || len > strlen(best->prefix)))
+      best = rule;
+    rule = zlist_next(self->rules);
+  }
+  return best;
+}
+
+// The rule compressing with dictionary id, NULL if there is none
+comp_rule_t *compressor_rule_by_dict(compressor_t *self, unsigned id) {
+  comp_rule_t *rule = zlist_first(self->rules);
+  while (rule) {
+    if (rule->dict && rule->dict_id == id)
+      return rule;
+    rule = zlist_next(self->rules);
+  }
+  return NULL;
+}
+
+// Whether dst was already sent the dictionary of rule, which it is assumed
+// to be from now on
+int compressor_sent(compressor_t *self, const char *dst, comp_rule_t *rule) {
+  char key[256];
+  snprintf(key, sizeof(key), "%s/%u", dst, rule->dict_id);
+  if (zhash_lookup(self->sent, key))
+    return 1;
+  s_bounded(&self->sent);
+  zhash_insert(self->sent, key, self);
+  return 0;
+}
+
+// dst can't decompress, it isn't sent compressed notifications anymore
+void compressor_set_plain(compressor_t *self, const char *dst) {
+  s_bounded(&self->plain);
+  zhash_update(self->plain, dst, self);
+}
+
+// Whether a payload that couldn't be decompressed needs something we don't
+// have, in id the dictionary to ask source for, 0 if we can't decompress
+// at all
+int compressor_missing(compressor_t *self, const char *source,
+                       const void *src, size_t len, unsigned *id) {
+#ifdef HAVE_ZSTD
+  *id = ZSTD_getDictID_fromFrame(src, len);
+  if (*id == 0)
+    return 0;
+  char key[256];
+  snprintf(key, sizeof(key), "%u", *id);
+  if (zhash_lookup(self->ddicts, key))
+    return 0;
+  snprintf(key, sizeof(key), "%s/%u", source, *id);
+  return zhash_lookup(self->peer_ddicts, key) == NULL;
+#else
+  *id = 0;
+  return 1;
+#endif
+}
+
+// Whether to ask source for dictionary id now, at most every DD_COMP_ASK
+int compressor_ask(compressor_t *self, const char *source, unsigned id,
+                   int64_t now) {
+  char key[256];
+  snprintf(key, sizeof(key), "%s/%u", source, id);
+  int64_t *last = zhash_lookup(self->asked, key);
+  if (last && now - *last < DD_COMP_ASK)
+    return 0;
+  if (last == NULL) {
+    s_bounded(&self->asked);
+    last = malloc(sizeof(int64_t));
+    zhash_insert(self->asked, key, last);
+    zhash_freefn(self->asked, key, free);
+  }
+  *last = now;
+  return 1;
+}
+
+size_t compressor_bound(size_t len) {
+#ifdef HAVE_ZSTD
+  return ZSTD_compressBound(len);
+#else
+  return len;
+#endif
+}
+
+// Compresses src into dst, returns the compressed size or 0 on failure
+size_t compressor_pack(compressor_t *self, comp_rule_t *rule, void *dst,
+                       size_t cap, const void *src, size_t len) {
+#ifdef HAVE_ZSTD
+  if (self->cctx == NULL && (self->cctx = ZSTD_createCCtx()) == NULL)
+    return 0;
+  size_t n;
+  if (rule->cdict)
+    n = ZSTD_compress_usingCDict(self->cctx, dst, cap, src, len, rule->cdict);
+  else
+    n = ZSTD_compressCCtx(self->cctx, dst, cap, src, len, rule->level);
+  return ZSTD_isError(n) ? 0 : n;
+#else
+  return 0;
+#endif
+}
+
+// Decompresses src into a new buffer, NULL if it is corrupt, too large or
+// needs a dictionary we don't have
+unsigned char *compressor_unpack(compressor_t *self, const char *source,
+                                 const void *src, size_t len,
+                                 size_t *outlen) {
+#ifdef HAVE_ZSTD
+  unsigned long long size = ZSTD_getFrameContentSize(src, len);
+  if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+      size > DD_COMP_MAX)
+    return NULL;
+  if (self->dctx == NULL && (self->dctx = ZSTD_createDCtx()) == NULL)
+    return NULL;
+  ZSTD_DDict *ddict = NULL;
+  unsigned id = ZSTD_getDictID_fromFrame(src, len);
+  if (id != 0) {
+    char key[256];
+    snprintf(key, sizeof(key), "%u", id);
+    ddict = zhash_lookup(self->ddicts, key);
+    if (ddict == NULL) {
+      snprintf(key, sizeof(key), "%s/%u", source, id);
+      ddict = zhash_lookup(self->peer_ddicts, key);
+    }
+    if (ddict == NULL)
+      return NULL;
+  }
+  unsigned char *out = malloc(size > 0 ? size : 1);
+  size_t n;
+  if (ddict)
+    n = ZSTD_decompress_usingDDict(self->dctx, out, size, src, len, ddict);
+  else
+    n = ZSTD_decompressDCtx(self->dctx, out, size, src, len);
+  if (ZSTD_isError(n) || n != size) {
+    free(out);
+    return NULL;
+  }
+  *outlen = n;
+  return out;
+#else
+  return NULL;
+#endif
+}
+
+// Trains a dictionary of at most capacity bytes from count samples stored
+// back to back, returns its size or -1
+int compressor_train(void *dict, size_t capacity, const void *samples,
+                     const size_t *sizes, unsigned count) {
+#ifdef HAVE_ZSTD
+  size_t n = ZDICT_trainFromBuffer(dict, capacity, samples, sizes, count);
+  return ZDICT_isError(n) ? -1 : (int)n;
+#else
+  return -1;
+#endif
+}
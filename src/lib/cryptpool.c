@@ -0,0 +1,263 @@
+/*
+ * cryptpool.c --- batched crypto_box sealing and opening for the client
+ *
+ * The client hands over a whole batch of messages at once. Small batches
+ * are done right away by the calling thread. Larger ones are split into
+ * chunks of DD_CRYPT_CHUNK jobs that the caller and a few worker threads
+ * claim until none are left, so a busy producer or consumer uses more
+ * than one core. The sending and receiving threads of a client share a
+ * pool, so batches are handed out one at a time. The nonces are picked by
+ * the caller before the batch starts, so the order in which jobs finish
+ * doesn't matter.
+ *
+ * Besides crypto_box, tenants can negotiate AES-256-GCM on machines with
+ * hardware AES or XChaCha20-Poly1305, see dd_suites_available.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/cryptpool.h"
+
+// AES-GCM only has a 12 byte nonce, too short to pick at random for a key
+// shared by a whole tenant. The upper half of the 24 byte nonce selects a
+// subkey instead, and the lower half, which the sender counts up, is the
+// AES-GCM nonce.
+static void s_aesgcm_subkey(unsigned char *subkey, const unsigned char *nonce,
+                            const unsigned char *key) {
+  crypto_generichash(subkey, crypto_aead_aes256gcm_KEYBYTES,
+                     nonce + crypto_aead_aes256gcm_NPUBBYTES,
+                     crypto_box_NONCEBYTES - crypto_aead_aes256gcm_NPUBBYTES,
+                     key, crypto_aead_aes256gcm_KEYBYTES);
+}
+
+// The upper half only changes when a sender's counter wraps, so each
+// thread keeps the expanded AES key of the last few subkeys it used, by
+// tenant key and upper half
+#define DD_CRYPT_SUBKEYS 8
+#define DD_NONCE_UPPER (crypto_box_NONCEBYTES - crypto_aead_aes256gcm_NPUBBYTES)
+
+struct _subkey {
+  int used;
+  unsigned char key[crypto_aead_aes256gcm_KEYBYTES];
+  unsigned char upper[DD_NONCE_UPPER];
+  crypto_aead_aes256gcm_state state;
+};
+
+static __thread struct _subkey s_subkeys[DD_CRYPT_SUBKEYS];
+
+static const crypto_aead_aes256gcm_state *
+s_aesgcm_state(const unsigned char *nonce, const unsigned char *key) {
+  const unsigned char *upper = nonce + crypto_aead_aes256gcm_NPUBBYTES;
+  struct _subkey *entry = &s_subkeys[upper[0] % DD_CRYPT_SUBKEYS];
+  if (entry->used && memcmp(entry->upper, upper, DD_NONCE_UPPER) == 0 &&
+      memcmp(entry->key, key, crypto_aead_aes256gcm_KEYBYTES) == 0)
+    return &entry->state;
+  unsigned char subkey[crypto_aead_aes256gcm_KEYBYTES];
+  s_aesgcm_subkey(subkey, nonce, key);
+  crypto_aead_aes256gcm_beforenm(&entry->state, subkey);
+  sodium_memzero(subkey, sizeof(subkey));
+  memcpy(entry->key, key, crypto_aead_aes256gcm_KEYBYTES);
+  memcpy(entry->upper, upper, DD_NONCE_UPPER);
+  entry->used = 1;
+  return &entry->state;
+}
+
+static int s_seal(crypt_job_t *job) {
+  unsigned char *nonce = job->out;
+  unsigned char *cipher = job->out + crypto_box_NONCEBYTES;
+  switch (job->suite) {
+  case DD_SUITE_BOX:
+    return crypto_box_easy_afternm(cipher, job->in, job->inlen, nonce,
+                                   job->key);
+  case DD_SUITE_AESGCM:
+    return crypto_aead_aes256gcm_encrypt_afternm(
+        cipher, NULL, job->in, job->inlen, NULL, 0, NULL, nonce,
+        s_aesgcm_state(nonce, job->key));
+  case DD_SUITE_XCHACHA:
+    return crypto_aead_xchacha20poly1305_ietf_encrypt(
+        cipher, NULL, job->in, job->inlen, NULL, 0, NULL, nonce, job->key);
+  }
+  return -1;
+}
+
+static int s_open(crypt_job_t *job) {
+  const unsigned char *nonce = job->in;
+  const unsigned char *cipher = job->in + crypto_box_NONCEBYTES;
+  size_t clen = job->inlen - crypto_box_NONCEBYTES;
+  switch (job->suite) {
+  case DD_SUITE_BOX:
+    return crypto_box_open_easy_afternm(job->out, cipher, clen, nonce,
+                                        job->key);
+  case DD_SUITE_AESGCM:
+    if (!crypto_aead_aes256gcm_is_available())
+      return -1;
+    return crypto_aead_aes256gcm_decrypt_afternm(
+        job->out, NULL, NULL, cipher, clen, NULL, 0, nonce,
+        s_aesgcm_state(nonce, job->key));
+  case DD_SUITE_XCHACHA:
+    return crypto_aead_xchacha20poly1305_ietf_decrypt(
+        job->out, NULL, NULL, cipher, clen, NULL, 0, nonce, job->key);
+  }
+  return -1;
+}
+
+static void s_job(crypt_job_t *job, int open) {
+  if (job->key == NULL) {
+    job->rc = -1;
+  } else if (open) {
+    if (job->inlen < crypto_box_NONCEBYTES + crypto_box_MACBYTES)
+      job->rc = -1;
+    else
+      job->rc = s_open(job);
+  } else {
+    job->rc = s_seal(job);
+  }
+}
+
+static void s_run(cryptpool_t *self, crypt_job_t *jobs, int n, int open) {
+  int first;
+  while ((first = __sync_fetch_and_add(&self->next, DD_CRYPT_CHUNK)) < n) {
+    int last = first + DD_CRYPT_CHUNK < n ? first + DD_CRYPT_CHUNK : n;
+    int i;
+    for (i = first; i < last; i++)
+      s_job(&jobs[i], open);
+  }
+}
+
+static void *s_worker(void *arg) {
+  cryptpool_t *self = arg;
+  pthread_mutex_lock(&self->lock);
+  while (1) {
+    while (!self->stop && self->next >= self->njobs)
+      pthread_cond_wait(&self->work, &self->lock);
+    if (self->stop)
+      break;
+    // join while there is work left, the caller doesn't start another batch
+    // before busy is back to 0
+    crypt_job_t *jobs = self->jobs;
+    int n = self->njobs, open = self->open;
+    self->busy++;
+    pthread_mutex_unlock(&self->lock);
+    s_run(self, jobs, n, open);
+    pthread_mutex_lock(&self->lock);
+    if (--self->busy == 0)
+      pthread_cond_signal(&self->done);
+  }
+  pthread_mutex_unlock(&self->lock);
+  return NULL;
+}
+
+// workers < 0 picks a default from the number of cores, 0 keeps all work
+// on the calling thread
+cryptpool_t *cryptpool_new(int workers) {
+  if (workers < 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cores > 1 ? cores - 1 : 0;
+    if (workers > DD_CRYPT_WORKERS)
+      workers = DD_CRYPT_WORKERS;
+  }
+  cryptpool_t *self = calloc(1, sizeof(cryptpool_t));
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_mutex_init(&self->batch, NULL);
+  pthread_cond_init(&self->work, NULL);
+  pthread_cond_init(&self->done, NULL);
+  self->workers = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+  int i;
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&self->workers[i], NULL, s_worker, self) != 0)
+      break;
+    self->nworkers++;
+  }
+  return self;
+}
+
+void cryptpool_destroy(cryptpool_t **self_p) {
+  assert(self_p);
+  cryptpool_t *self = *self_p;
+  if (self == NULL)
+    return;
+  pthread_mutex_lock(&self->lock);
+  self->stop = 1;
+  pthread_cond_broadcast(&self->work);
+  pthread_mutex_unlock(&self->lock);
+  int i;
+  for (i = 0; i < self->nworkers; i++)
+    pthread_join(self->workers[i], NULL);
+  pthread_cond_destroy(&self->done);
+  pthread_cond_destroy(&self->work);
+  pthread_mutex_destroy(&self->batch);
+  pthread_mutex_destroy(&self->lock);
+  free(self->workers);
+  free(self);
+  *self_p = NULL;
+}
+
+static void s_batch(cryptpool_t *self, crypt_job_t *jobs, int n, int open) {
+  size_t bytes = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    bytes += jobs[i].inlen;
+  if (self == NULL || self->nworkers == 0 ||
+      (n < DD_CRYPT_PAR_JOBS && bytes < DD_CRYPT_PAR_BYTES)) {
+    for (i = 0; i < n; i++)
+      s_job(&jobs[i], open);
+    return;
+  }
+
+  pthread_mutex_lock(&self->batch);
+  pthread_mutex_lock(&self->lock);
+  self->jobs = jobs;
+  self->njobs = n;
+  self->open = open;
+  self->next = 0;
+  self->busy++;
+  pthread_cond_broadcast(&self->work);
+  pthread_mutex_unlock(&self->lock);
+
+  s_run(self, jobs, n, open);
+
+  pthread_mutex_lock(&self->lock);
+  self->busy--;
+  while (self->busy > 0)
+    pthread_cond_wait(&self->done, &self->lock);
+  pthread_mutex_unlock(&self->lock);
+  pthread_mutex_unlock(&self->batch);
+}
+
+void cryptpool_seal(cryptpool_t *self, crypt_job_t *jobs, int n) {
+  s_batch(self, jobs, n, 0);
+}
+
+void cryptpool_open(cryptpool_t *self, crypt_job_t *jobs, int n) {
+  s_batch(self, jobs, n, 1);
+}
+
+static const char *s_suite_names[DD_SUITES] = {"box", "aes256gcm",
+                                               "xchacha20poly1305"};
+
+// Suites this machine can use, as a mask of 1 << DD_SUITE_*
+uint32_t dd_suites_available() {
+  // needed for the CPU feature detection behind the AES-GCM check
+  if (sodium_init() == -1)
+    return 1 << DD_SUITE_BOX;
+  uint32_t suites = 1 << DD_SUITE_BOX | 1 << DD_SUITE_XCHACHA;
+  if (crypto_aead_aes256gcm_is_available())
+    suites |= 1 << DD_SUITE_AESGCM;
+  return suites;
+}
+
+const char *dd_suite_name(int suite) {
+  if (suite < 0 || suite >= DD_SUITES)
+    return "none";
+  return s_suite_names[suite];
+}
+
+// Suite from its name in a key file, -1 if unknown
+int dd_suite_parse(const char *name) {
+  int i;
+  for (i = 0; i < DD_SUITES; i++)
+    if (strcmp(name, s_suite_names[i]) == 0)
+      return i;
+  return -1;
+}
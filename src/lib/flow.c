@@ -0,0 +1,301 @@
+/*
+ * flow.c --- per client credit based flow control in the broker
+ *
+ * A client that sends DD_CMD_CREDIT tells the broker how many DATA and
+ * PUB messages it has consumed so far. The broker keeps at most
+ * flow_window messages in flight towards it and holds the rest in a
+ * bounded backlog, limited per client and per tenant. What happens when
+ * a backlog is full is decided by flow_policy. Clients that never send
+ * CREDIT are not tracked and are sent to directly as before.
+ *
+ * The counts wrap, so they are only ever compared by their difference. A
+ * client can't have consumed more than it was sent, so beyond that it is
+ * taken as all of it. One whose count went back started over, after REGOK,
+ * and we count from there as well.
+ */
+#include "../include/dd.h"
+#include "../include/dd_classes.h"
+
+static int match_flow_client(struct cds_lfht_node *ht_node, const void *_key) {
+  flow_client *node = caa_container_of(ht_node, flow_client, node);
+  zframe_t *key = (zframe_t *)_key;
+  return zframe_eq(node->sockid, key);
+}
+
+static flow_client *s_flow_lookup(dd_broker_t *self, zframe_t *sockid) {
+  if (self->flow_count == 0)
+    return NULL;
+  struct cds_lfht_iter iter;
+  int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
+  rcu_read_lock();
+  cds_lfht_lookup(self->flow_ht, hash, match_flow_client, sockid, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  rcu_read_unlock();
+  if (ht_node)
+    return caa_container_of(ht_node, flow_client, node);
+  return NULL;
+}
+
+static void s_flow_drop(dd_broker_t *self, flow_client *fc, zmsg_t **msg_p) {
+  if (msg_p)
+    zmsg_destroy(msg_p);
+  fc->drops++;
+  if (fc->tenant)
+    fc->tenant->drops++;
+  self->flow_drops++;
+}
+
+// Backlog in and out, keeping the tenant's message and byte counts
+static void s_flow_push(flow_client *fc, zmsg_t *m) {
+  zlist_append(fc->backlog, m);
+  if (fc->tenant) {
+    fc->tenant->queued++;
+    fc->tenant->queued_bytes += zmsg_content_size(m);
+  }
+}
+
+static zmsg_t *s_flow_pop(flow_client *fc) {
+  zmsg_t *m = zlist_pop(fc->backlog);
+  if (m && fc->tenant) {
+    fc->tenant->queued--;
+    fc->tenant->queued_bytes -= zmsg_content_size(m);
+  }
+  return m;
+}
+
+static void s_flow_free(flow_client *fc) {
+  zmsg_t *m;
+  while ((m = s_flow_pop(fc)))
+    zmsg_destroy(&m);
+  zlist_destroy(&fc->backlog);
+  zframe_destroy(&fc->sockid);
+  free(fc);
+}
+
+// Messages in flight towards a client that was sent sent and consumed acked
+int32_t flow_inflight(uint32_t sent, uint32_t acked) {
+  return (int32_t)(sent - acked);
+}
+
+// Applies a CREDIT of consumed to the counts of a client
+void flow_account(uint32_t *sent, uint32_t *acked, uint32_t consumed) {
+  if ((int32_t)(consumed - *acked) < 0)
+    *sent = consumed;
+  else if ((int32_t)(consumed - *sent) > 0)
+    consumed = *sent;
+  *acked = consumed;
+}
+
+static int s_flow_room(dd_broker_t *self, flow_client *fc) {
+  return flow_inflight(fc->sent, fc->acked) < self->flow_window;
+}
+
+// Send from the backlog while the client has credit
+static void s_flow_drain(dd_broker_t *self, flow_client *fc) {
+  zmsg_t *m;
+  while (s_flow_room(self, fc) && (m = s_flow_pop(fc))) {
+    zmsg_send(&m, self->rsock);
+    fc->sent++;
+  }
+}
+
+static int s_flow_kick(zloop_t *loop, int timer_id, void *arg) {
+  dd_broker_t *self = arg;
+  zlist_t *kick = zlist_new();
+  struct cds_lfht_iter iter;
+  rcu_read_lock();
+  cds_lfht_first(self->flow_ht, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  while (ht_node) {
+    flow_client *fc = caa_container_of(ht_node, flow_client, node);
+    if (fc->disconnect)
+      zlist_append(kick, fc);
+    cds_lfht_next(self->flow_ht, &iter);
+    ht_node = cds_lfht_iter_get_node(&iter);
+  }
+  rcu_read_unlock();
+
+  flow_client *fc;
+  while ((fc = zlist_pop(kick))) {
+    char buf[256];
+    dd_warning("Disconnecting slow client %s", zframe_tostr(fc->sockid, buf));
+    zframe_t *sockid = zframe_dup(fc->sockid);
+    uint64_t cookie = fc->cookie;
+    // removes fc as well
+    flow_remove(self, sockid);
+    unreg_cli(self, sockid, cookie);
+    zframe_destroy(&sockid);
+  }
+  zlist_destroy(&kick);
+  return 0;
+}
+
+// Returns 0 if the message was queued or dropped by policy, -1 if it was
+// refused and the sender should be told, -2 if the client was disconnected
+static int s_flow_enqueue(dd_broker_t *self, flow_client *fc, zmsg_t *out) {
+  int full = zlist_size(fc->backlog) >= (size_t)self->flow_backlog ||
+             (fc->tenant && fc->tenant->queued >= self->flow_tenant_backlog) ||
+             (fc->tenant && self->tenant_max_bytes > 0 &&
+              fc->tenant->queued_bytes + zmsg_content_size(out) >
+                  self->tenant_max_bytes);
+  if (!full) {
+    s_flow_push(fc, out);
+    return 0;
+  }
+
+  zmsg_t *old;
+  switch (self->flow_policy) {
+  case DD_FLOW_DROP_OLDEST:
+    old = s_flow_pop(fc);
+    if (old == NULL) {
+      // the tenant is full, but not because of this client
+      s_flow_drop(self, fc, &out);
+      return 0;
+    }
+    s_flow_drop(self, fc, &old);
+    s_flow_push(fc, out);
+    return 0;
+  case DD_FLOW_DROP_NEWEST:
+    s_flow_drop(self, fc, &out);
+    return 0;
+  case DD_FLOW_BLOCK:
+    s_flow_drop(self, fc, &out);
+    return -1;
+  case DD_FLOW_DISCONNECT:
+    s_flow_drop(self, fc, &out);
+    // we may be in the middle of a fan-out over the client's subscriptions,
+    // so leave the actual removal to the loop
+    if (!fc->disconnect) {
+      fc->disconnect = 1;
+      zloop_timer(self->loop, 1, 1, s_flow_kick, self);
+    }
+    return -2;
+  }
+  return 0;
+}
+
+// Sends DATA, PUB and the like within the client's window, queues them or
+// applies the policy beyond it. Control messages the client counts as well
+// are never dropped, they wait in the backlog even when it is full.
+static int s_flow_send(dd_broker_t *self, zframe_t *sockid,
+                       const uint32_t *cmd, char *str1, char *str2,
+                       zmsg_t *msg, int control) {
+  flow_client *fc = s_flow_lookup(self, sockid);
+  if (fc && fc->disconnect && !control) {
+    s_flow_drop(self, fc, NULL);
+    return -2;
+  }
+  if (fc == NULL || (zlist_size(fc->backlog) == 0 && s_flow_room(self, fc))) {
+    if (str2)
+      zsock_send(self->rsock, "fbbssm", sockid, &dd_version, 4, cmd, 4, str1,
+                 str2, msg);
+    else
+      zsock_send(self->rsock, "fbbsm", sockid, &dd_version, 4, cmd, 4, str1,
+                 msg);
+    if (fc)
+      fc->sent++;
+    return 0;
+  }
+
+  zmsg_t *out = zmsg_new();
+  zmsg_addmem(out, zframe_data(sockid), zframe_size(sockid));
+  zmsg_addmem(out, &dd_version, 4);
+  zmsg_addmem(out, cmd, 4);
+  zmsg_addstr(out, str1);
+  if (str2)
+    zmsg_addstr(out, str2);
+  zframe_t *frame = zmsg_first(msg);
+  while (frame) {
+    zmsg_addmem(out, zframe_data(frame), zframe_size(frame));
+    frame = zmsg_next(msg);
+  }
+  if (control) {
+    s_flow_push(fc, out);
+    return 0;
+  }
+  return s_flow_enqueue(self, fc, out);
+}
+
+int flow_send(dd_broker_t *self, zframe_t *sockid, const uint32_t *cmd,
+              char *str1, char *str2, zmsg_t *msg) {
+  return s_flow_send(self, sockid, cmd, str1, str2, msg, 0);
+}
+
+int flow_send_control(dd_broker_t *self, zframe_t *sockid,
+                      const uint32_t *cmd, char *str1, char *str2,
+                      zmsg_t *msg) {
+  return s_flow_send(self, sockid, cmd, str1, str2, msg, 1);
+}
+
+void flow_credit(dd_broker_t *self, zframe_t *sockid, local_client *ln,
+                 uint32_t consumed) {
+  if (self->flow_window <= 0)
+    return;
+  flow_client *fc = s_flow_lookup(self, sockid);
+  if (fc == NULL) {
+    fc = calloc(1, sizeof(flow_client));
+    cds_lfht_node_init(&fc->node);
+    fc->sockid = zframe_dup(sockid);
+    fc->cookie = ln->cookie;
+    fc->backlog = zlist_new();
+    ddtenant_t *ten = zhash_first(self->keys->tenantkeys);
+    while (ten) {
+      if (streq(ten->name, ln->tenant)) {
+        fc->tenant = ten;
+        break;
+      }
+      ten = zhash_next(self->keys->tenantkeys);
+    }
+    // start counting from what the client has already seen
+    fc->sent = fc->acked = consumed;
+    int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
+    rcu_read_lock();
+    cds_lfht_add(self->flow_ht, hash, &fc->node);
+    rcu_read_unlock();
+    self->flow_count++;
+    return;
+  }
+  flow_account(&fc->sent, &fc->acked, consumed);
+  s_flow_drain(self, fc);
+}
+
+void flow_remove(dd_broker_t *self, zframe_t *sockid) {
+  flow_client *fc = s_flow_lookup(self, sockid);
+  if (fc == NULL)
+    return;
+  rcu_read_lock();
+  int ret = cds_lfht_del(self->flow_ht, &fc->node);
+  rcu_read_unlock();
+  if (ret == 0) {
+    self->flow_count--;
+    s_flow_free(fc);
+  }
+}
+
+void flow_destroy(dd_broker_t *self) {
+  struct cds_lfht_iter iter;
+  rcu_read_lock();
+  cds_lfht_first(self->flow_ht, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  while (ht_node) {
+    flow_client *fc = caa_container_of(ht_node, flow_client, node);
+    cds_lfht_next(self->flow_ht, &iter);
+    if (cds_lfht_del(self->flow_ht, ht_node) == 0)
+      s_flow_free(fc);
+    ht_node = cds_lfht_iter_get_node(&iter);
+  }
+  rcu_read_unlock();
+  self->flow_count = 0;
+}
+
+int flow_policy_from_str(char *policy) {
+  if (streq(policy, "drop-oldest"))
+    return DD_FLOW_DROP_OLDEST;
+  if (streq(policy, "drop-newest"))
+    return DD_FLOW_DROP_NEWEST;
+  if (streq(policy, "block"))
+    return DD_FLOW_BLOCK;
+  if (streq(policy, "disconnect"))
+    return DD_FLOW_DISCONNECT;
+  return -1;
+}
@@ -21,11 +21,34 @@ static int match_lcl_broker(struct cds_lfht_node *ht_node, const void *_key) {
   return memcmp(zframe_data(node->sockid), zframe_data(key),
                 zframe_size(key)) == 0;
 }
+// sockid straight from a received message, without a zframe_t around it
+struct _raw_key {
+  const void *data;
+  size_t size;
+};
+static int match_lcl_node_raw(struct cds_lfht_node *ht_node,
+                              const void *_key) {
+  local_client *node = caa_container_of(ht_node, local_client, lcl_node);
+  const struct _raw_key *key = _key;
+  return zframe_size(node->sockid) == key->size &&
+         memcmp(zframe_data(node->sockid), key->data, key->size) == 0;
+}
+static int match_lcl_broker_raw(struct cds_lfht_node *ht_node,
+                                const void *_key) {
+  local_broker *node = caa_container_of(ht_node, local_broker, node);
+  const struct _raw_key *key = _key;
+  return zframe_size(node->sockid) == key->size &&
+         memcmp(zframe_data(node->sockid), key->data, key->size) == 0;
+}
 static int match_dist_node(struct cds_lfht_node *ht_node, const void *_key) {
   dist_client *node = caa_container_of(ht_node, dist_client, node);
   const char *key = _key;
   return (strncmp(node->name, key, strlen(key)) == 0);
 }
+static int match_nodst_node(struct cds_lfht_node *ht_node, const void *_key) {
+  nodst_node *node = caa_container_of(ht_node, nodst_node, node);
+  return strcmp(node->name, (const char *)_key) == 0;
+}
 static int match_subscribe_node(struct cds_lfht_node *ht_node,
                                 const void *_key) {
   subscribe_node *node = caa_container_of(ht_node, subscribe_node, node);
@@ -34,6 +57,75 @@ static int match_subscribe_node(struct cds_lfht_node *ht_node,
                 zframe_size(key)) == 0;
 }
 
+static char *s_name_store(char *buf, const char *name) {
+  if (strlen(name) < DD_NAME_INLINE)
+    return strcpy(buf, name);
+  return strdup(name);
+}
+
+static void s_name_release(char *buf, char *name) {
+  if (name && name != buf)
+    free(name);
+}
+
+static void s_local_client_fini(void *obj) {
+  local_client *lc = obj;
+  zframe_destroy(&lc->sockid);
+  shmring_destroy(&lc->shm);
+  s_name_release(lc->name_buf, lc->name);
+  s_name_release(lc->prefix_buf, lc->prefix_name);
+  lc->name = lc->prefix_name = NULL;
+}
+
+static void s_dist_client_fini(void *obj) {
+  dist_client *dc = obj;
+  zframe_destroy(&dc->broker);
+  s_name_release(dc->name_buf, dc->name);
+  dc->name = NULL;
+}
+
+static void s_local_broker_fini(void *obj) {
+  local_broker *lb = obj;
+  zframe_destroy(&lb->sockid);
+  free(lb->endpoint);
+  lb->endpoint = NULL;
+}
+
+static void s_nodst_fini(void *obj) {
+  nodst_node *nn = obj;
+  free(nn->name);
+  nn->name = NULL;
+}
+
+void hashtable_slabs_new(dd_broker_t *self) {
+  self->lcl_cli_slab = slab_new(sizeof(local_client), s_local_client_fini);
+  self->dist_cli_slab = slab_new(sizeof(dist_client), s_dist_client_fini);
+  self->lcl_br_slab = slab_new(sizeof(local_broker), s_local_broker_fini);
+  self->nodst_slab = slab_new(sizeof(nodst_node), s_nodst_fini);
+}
+
+// Hand partial batches of unlinked nodes over for reclamation
+void hashtable_slabs_flush(dd_broker_t *self) {
+  slab_flush(self->lcl_cli_slab);
+  slab_flush(self->dist_cli_slab);
+  slab_flush(self->lcl_br_slab);
+  slab_flush(self->nodst_slab);
+}
+
+void hashtable_slabs_destroy(dd_broker_t *self) {
+  slab_destroy(&self->lcl_cli_slab);
+  slab_destroy(&self->dist_cli_slab);
+  slab_destroy(&self->lcl_br_slab);
+  slab_destroy(&self->nodst_slab);
+}
+
+// For a client already unlinked from both lcl_cli_ht and rev_lcl_cli_ht
+void hashtable_free_local_node(dd_broker_t *self, local_client *ln) {
+  if (ln->ten)
+    ln->ten->clients--;
+  slab_free_rcu(self->lcl_cli_slab, ln);
+}
+
 // what lookups are needed?
 // sockid + cookie -> data || NULL  (local_cli / registered_client)
 // "tenant.client_name" -> data || NULL (reverse_local_cli)
@@ -44,18 +136,22 @@ int insert_local_client(dd_broker_t *self, zframe_t *sockid, ddtenant_t *ten,
   char prefix_name[MAXTENANTNAME];
   struct cds_lfht_iter iter;
   local_client *np;
-  np = malloc(sizeof(local_client));
+  np = slab_alloc(self->lcl_cli_slab);
   np->cookie = ten->cookie;
   np->timeout = 0;
+  np->plaintext = 0;
+  np->shm = NULL;
   np->sockid = zframe_dup(sockid);
   np->tenant = ten->name;
-  np->name = strdup(client_name);
+  np->ten = ten;
+  np->name = s_name_store(np->name_buf, client_name);
 
   int prelen =
       snprintf(prefix_name, MAXTENANTNAME, "%s.%s", ten->name, client_name);
 
   /* dd_debug("insert_local_client: prefix_name %s", prefix_name); */
-  np->prefix_name = strdup(prefix_name);
+  np->prefix_name = s_name_store(np->prefix_buf, prefix_name);
+  hashtable_remove_nodst(self, prefix_name);
 
   // Calculate the sockid_cookie hash
   XXH32_reset(&hash1, XXHSEED);
@@ -100,13 +196,11 @@ int insert_local_client(dd_broker_t *self, zframe_t *sockid, ddtenant_t *ten,
   cds_lfht_add(self->lcl_cli_ht, sockid_cookie, &np->lcl_node);
   cds_lfht_add(self->rev_lcl_cli_ht, prename, &np->rev_node);
   rcu_read_unlock();
+  ten->clients++;
   return 1;
 
 cleanup:
-  zframe_destroy(&np->sockid);
-  free(np->prefix_name);
-  free(np->name);
-  free(np);
+  slab_free(self->lcl_cli_slab, np);
   return -1;
 }
 
@@ -128,7 +222,7 @@ void hashtable_remove_dist_node(dd_broker_t *self, char *prefix_name) {
     } else {
       rcu_read_unlock();
       dd_debug(" - Dist client %s deleted", mp->name);
-      free(mp);
+      slab_free_rcu(self->dist_cli_slab, mp);
     }
   }
 }
@@ -155,12 +249,13 @@ dist_client *hashtable_has_dist_node(dd_broker_t *self, char *prefix_name) {
 void hashtable_insert_dist_node(dd_broker_t *self, char *prefix_name,
                                 zframe_t *sockid, int dist) {
   // add to has table
-  dist_client *mp = malloc(sizeof(dist_client));
+  dist_client *mp = slab_alloc(self->dist_cli_slab);
   int hash = XXH32(prefix_name, strlen(prefix_name), XXHSEED);
   cds_lfht_node_init(&mp->node);
-  mp->name = prefix_name;
+  mp->name = s_name_store(mp->name_buf, prefix_name);
   mp->broker = zframe_dup(sockid);
   mp->distance = dist;
+  hashtable_remove_nodst(self, prefix_name);
   rcu_read_lock();
   cds_lfht_add(self->dist_cli_ht, hash, &mp->node);
   rcu_read_unlock();
@@ -180,16 +275,109 @@ void delete_dist_clients(dd_broker_t *self, local_broker *br) {
     if (zframe_eq(mp->broker, br->sockid)) {
       char buf[256] = "";
       dd_debug("Was under missing broker %s", zframe_tostr(br->sockid, buf));
-      del_cli_up(self, mp->name);
+      if (!br->standby)
+        del_cli_up(self, mp->name);
+      queue_gone(self, mp->name);
       rcu_read_lock();
       int ret = cds_lfht_del(self->dist_cli_ht, ht_node);
       rcu_read_unlock();
+      if (ret == 0)
+        slab_free_rcu(self->dist_cli_slab, mp);
     }
     cds_lfht_next(self->dist_cli_ht, &iter);
     ht_node = cds_lfht_iter_get_node(&iter);
   }
 }
 
+/*
+ * negative cache stuff
+ */
+void hashtable_insert_nodst(dd_broker_t *self, char *prefix_name) {
+  if (self->nodst_ttl <= 0)
+    return;
+  struct cds_lfht_iter iter;
+  int hash = XXH32(prefix_name, strlen(prefix_name), XXHSEED);
+  int64_t expires = zclock_mono() + self->nodst_ttl;
+  rcu_read_lock();
+  cds_lfht_lookup(self->nodst_ht, hash, match_nodst_node, prefix_name, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  if (ht_node) {
+    caa_container_of(ht_node, nodst_node, node)->expires = expires;
+    rcu_read_unlock();
+    return;
+  }
+  if (self->nodst_count >= self->nodst_max) {
+    rcu_read_unlock();
+    return;
+  }
+  nodst_node *mp = slab_alloc(self->nodst_slab);
+  cds_lfht_node_init(&mp->node);
+  mp->name = strdup(prefix_name);
+  mp->expires = expires;
+  cds_lfht_add(self->nodst_ht, hash, &mp->node);
+  self->nodst_count++;
+  rcu_read_unlock();
+}
+
+static void s_delete_nodst(dd_broker_t *self, struct cds_lfht_node *ht_node) {
+  if (cds_lfht_del(self->nodst_ht, ht_node) == 0) {
+    // lookups may still see it until the grace period is over
+    slab_free_rcu(self->nodst_slab,
+                  caa_container_of(ht_node, nodst_node, node));
+    self->nodst_count--;
+  }
+}
+
+int hashtable_has_nodst(dd_broker_t *self, char *prefix_name) {
+  if (self->nodst_count == 0)
+    return 0;
+  struct cds_lfht_iter iter;
+  int hash = XXH32(prefix_name, strlen(prefix_name), XXHSEED);
+  int found = 0;
+  rcu_read_lock();
+  cds_lfht_lookup(self->nodst_ht, hash, match_nodst_node, prefix_name, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  if (ht_node) {
+    if (caa_container_of(ht_node, nodst_node, node)->expires > zclock_mono())
+      found = 1;
+    else
+      s_delete_nodst(self, ht_node);
+  }
+  rcu_read_unlock();
+  return found;
+}
+
+void hashtable_remove_nodst(dd_broker_t *self, char *prefix_name) {
+  if (self->nodst_count == 0)
+    return;
+  struct cds_lfht_iter iter;
+  int hash = XXH32(prefix_name, strlen(prefix_name), XXHSEED);
+  rcu_read_lock();
+  cds_lfht_lookup(self->nodst_ht, hash, match_nodst_node, prefix_name, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  if (ht_node)
+    s_delete_nodst(self, ht_node);
+  rcu_read_unlock();
+}
+
+// Drop expired entries, or all of them
+void hashtable_expire_nodst(dd_broker_t *self, int all) {
+  struct cds_lfht_iter iter;
+  int64_t now = zclock_mono();
+  rcu_read_lock();
+  cds_lfht_first(self->nodst_ht, &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  while (ht_node) {
+    nodst_node *mp = caa_container_of(ht_node, nodst_node, node);
+    // step past the node before it is deleted
+    cds_lfht_next(self->nodst_ht, &iter);
+    if (all || mp->expires <= now)
+      s_delete_nodst(self, ht_node);
+    ht_node = cds_lfht_iter_get_node(&iter);
+  }
+  rcu_read_unlock();
+}
+
 local_broker *hashtable_has_local_broker(dd_broker_t *self, zframe_t *sockid,
                                          uint64_t cookie, int update) {
   /*
@@ -219,9 +407,9 @@ local_broker *hashtable_has_local_broker(dd_broker_t *self, zframe_t *sockid,
 /*
  * local broker stuff
  */
-void hashtable_insert_local_broker(dd_broker_t *self, zframe_t *sockid,
-                                   uint64_t cookie) {
-  local_broker *mp = malloc(sizeof(local_broker));
+local_broker *hashtable_insert_local_broker(dd_broker_t *self,
+                                            zframe_t *sockid, uint64_t cookie) {
+  local_broker *mp = slab_alloc(self->lcl_br_slab);
   XXH32_state_t hash1;
   XXH32_reset(&hash1, XXHSEED);
   XXH32_update(&hash1, zframe_data(sockid), zframe_size(sockid));
@@ -230,12 +418,11 @@ void hashtable_insert_local_broker(dd_broker_t *self, zframe_t *sockid,
   cds_lfht_node_init(&mp->node);
   mp->cookie = cookie;
   mp->sockid = zframe_dup(sockid);
-  mp->distance = 0;
-  mp->timeout = 0;
 
   rcu_read_lock();
   cds_lfht_add(self->lcl_br_ht, sockid_cookie, &mp->node);
   rcu_read_unlock();
+  return mp;
 }
 
 local_client *hashtable_has_rev_local_node(dd_broker_t *self, char *prefix_name,
@@ -288,6 +475,59 @@ local_client *hashtable_has_local_node(dd_broker_t *self, zframe_t *sockid,
   }
   return NULL;
 }
+
+// Same as hashtable_has_local_node, for the data plane which parses
+// messages without building frames
+local_client *hashtable_find_local_node(dd_broker_t *self, const void *sockid,
+                                        size_t len, uint64_t cookie,
+                                        int update) {
+  struct cds_lfht_iter iter;
+  struct _raw_key key = {sockid, len};
+  XXH32_state_t hash1;
+  XXH32_reset(&hash1, XXHSEED);
+  XXH32_update(&hash1, sockid, len);
+  XXH32_update(&hash1, &cookie, sizeof(uint64_t));
+  unsigned long int sockid_cookie = XXH32_digest(&hash1);
+
+  rcu_read_lock();
+  cds_lfht_lookup(self->lcl_cli_ht, sockid_cookie, match_lcl_node_raw, &key,
+                  &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  rcu_read_unlock();
+  if (ht_node) {
+    local_client *np = caa_container_of(ht_node, local_client, lcl_node);
+    if (update)
+      np->timeout = 0;
+    return np;
+  }
+  return NULL;
+}
+
+local_broker *hashtable_find_local_broker(dd_broker_t *self,
+                                          const void *sockid, size_t len,
+                                          uint64_t cookie, int update) {
+  struct cds_lfht_iter iter;
+  struct _raw_key key = {sockid, len};
+  XXH32_state_t hash1;
+  XXH32_reset(&hash1, XXHSEED);
+  XXH32_update(&hash1, sockid, len);
+  XXH32_update(&hash1, &cookie, sizeof(uint64_t));
+  unsigned long int sockid_cookie = XXH32_digest(&hash1);
+
+  rcu_read_lock();
+  cds_lfht_lookup(self->lcl_br_ht, sockid_cookie, match_lcl_broker_raw, &key,
+                  &iter);
+  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
+  rcu_read_unlock();
+  if (ht_node) {
+    local_broker *np = caa_container_of(ht_node, local_broker, node);
+    if (update)
+      np->timeout = 0;
+    return np;
+  }
+  return NULL;
+}
+
 // Does not free the local_client pointer
 void hashtable_unlink_rev_local_node(dd_broker_t *self, char *prefix_name) {
 
@@ -318,13 +558,14 @@ void hashtable_unlink_rev_local_node(dd_broker_t *self, char *prefix_name) {
       rcu_read_unlock();
     } else {
       rcu_read_unlock();
-      synchronize_rcu();
       dd_debug("hashtable_unlink_local_node: Local key %s unlinked",
                np->prefix_name);
     }
   }
 }
-// Does not free the local_client pointer
+// Does not free the local_client pointer, once it is unlinked from both
+// tables hand it to hashtable_free_local_node, which waits for readers
+// without blocking the broker
 void hashtable_unlink_local_node(dd_broker_t *self, zframe_t *sockid,
                                  uint64_t cookie) {
   struct cds_lfht_iter iter;
@@ -354,7 +595,6 @@ void hashtable_unlink_local_node(dd_broker_t *self, zframe_t *sockid,
       rcu_read_unlock();
     } else {
       rcu_read_unlock();
-      synchronize_rcu();
       dd_debug("hashtable_unlink_local_node: Local key %s unlinked",
                np->prefix_name);
     }
@@ -367,131 +607,109 @@ void hashtable_unlink_local_node(dd_broker_t *self, zframe_t *sockid,
 void hashtable_insert_local_node(dd_broker_t *self, zframe_t *sockid,
                                  char *name) {
   // add to hash table
-  local_client *mp = malloc(sizeof(local_client));
+  local_client *mp = slab_alloc(self->lcl_cli_slab);
   int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
   cds_lfht_node_init(&mp->lcl_node);
-  mp->sockid = sockid;
-  mp->name = name;
-  mp->timeout = 0;
+  mp->sockid = zframe_dup(sockid);
+  mp->name = s_name_store(mp->name_buf, name);
   rcu_read_lock();
   cds_lfht_add(self->lcl_cli_ht, hash, &mp->lcl_node);
   rcu_read_unlock();
 }
 
-// return 0 if no subscriptions were found
-// otherwise , return how many was removed
-int remove_subscriptions(dd_broker_t *self, zframe_t *sockid) {
+static subscribe_node *s_subscribe_lookup(dd_broker_t *self, zframe_t *sockid,
+                                          int hash) {
   struct cds_lfht_iter iter;
-  int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
-  subscribe_node *sn;
-
   rcu_read_lock();
   cds_lfht_lookup(self->subscribe_ht, hash, match_subscribe_node, sockid,
                   &iter);
   struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
   rcu_read_unlock();
   if (!ht_node)
-    return 0;
-
-  sn = (subscribe_node *)caa_container_of(ht_node, subscribe_node, node);
-
-  int ntop = 0;
-  if (sn->topics) {
-    ntop = zlist_size(sn->topics);
-    char *topic = zlist_first(sn->topics);
-    char *oldtopic;
-    while (topic) {
-
-      nn_trie_unsubscribe(&self->topics_trie, (uint8_t *)topic, strlen(topic),
-                          sockid, 1);
-      oldtopic = topic;
-      topic = zlist_next(sn->topics);
-      free(oldtopic);
-    }
+    return NULL;
+  return caa_container_of(ht_node, subscribe_node, node);
+}
 
-    zlist_destroy(&sn->topics);
-    zframe_destroy(&sn->sockid);
-  }
+static void s_subscribe_free(dd_broker_t *self, subscribe_node *sn) {
   rcu_read_lock();
-  cds_lfht_del(self->subscribe_ht, ht_node);
+  cds_lfht_del(self->subscribe_ht, &sn->node);
   rcu_read_unlock();
+  zhash_destroy(&sn->topics);
+  zframe_destroy(&sn->sockid);
   free(sn);
-  return ntop;
+}
+
+static int s_topic_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
 // return 0 if no subscriptions were found
 // otherwise , return how many was removed
-int remove_subscription(dd_broker_t *self, zframe_t *sockid, char *topic) {
-  struct cds_lfht_iter iter;
+int remove_subscriptions(dd_broker_t *self, zframe_t *sockid) {
   int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
-  subscribe_node *sn;
-
-  rcu_read_lock();
-  cds_lfht_lookup(self->subscribe_ht, hash, match_subscribe_node, sockid,
-                  &iter);
-  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
-  rcu_read_unlock();
-  if (!ht_node)
+  subscribe_node *sn = s_subscribe_lookup(self, sockid, hash);
+  if (!sn)
     return 0;
 
-  sn = (subscribe_node *)caa_container_of(ht_node, subscribe_node, node);
-
-  int ntop = 0;
-  if (sn->topics) {
-    ntop = zlist_size(sn->topics);
-    char *t = zlist_first(sn->topics);
-    while (t) {
-      if (strcmp(topic, t) == 0) {
-        nn_trie_unsubscribe(&self->topics_trie, (uint8_t *)topic, strlen(topic),
-                            sockid, 1);
-        zlist_remove(sn->topics, t);
-        free(t);
-      }
-      t = zlist_next(sn->topics);
-    }
-
-    zlist_destroy(&sn->topics);
-    zframe_destroy(&sn->sockid);
+  // sorted, the trie can drop all of them in a single walk
+  int ntop = zhash_size(sn->topics);
+  char **topics = malloc(ntop * sizeof(char *));
+  int i = 0;
+  void *item = zhash_first(sn->topics);
+  while (item) {
+    topics[i++] = (char *)zhash_cursor(sn->topics);
+    item = zhash_next(sn->topics);
   }
-  rcu_read_lock();
-  cds_lfht_del(self->subscribe_ht, ht_node);
-  rcu_read_unlock();
-  free(sn);
+  qsort(topics, ntop, sizeof(char *), s_topic_cmp);
+  nn_trie_unsubscribe_many(&self->topics_trie, topics, ntop, sockid);
+  free(topics);
+
+  s_subscribe_free(self, sn);
   return ntop;
 }
 
+// return 0 if the topic wasn't subscribed to, 1 if it was removed
+int remove_subscription(dd_broker_t *self, zframe_t *sockid, char *topic) {
+  int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
+  subscribe_node *sn = s_subscribe_lookup(self, sockid, hash);
+  if (!sn || !zhash_lookup(sn->topics, topic))
+    return 0;
+
+  nn_trie_unsubscribe(&self->topics_trie, (uint8_t *)topic, strlen(topic),
+                      sockid, 1);
+  zhash_delete(sn->topics, topic);
+  if (zhash_size(sn->topics) == 0)
+    s_subscribe_free(self, sn);
+  return 1;
+}
+
+int has_subscription(dd_broker_t *self, zframe_t *sockid, char *topic) {
+  int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
+  subscribe_node *sn = s_subscribe_lookup(self, sockid, hash);
+  return sn && zhash_lookup(sn->topics, topic);
+}
+
 // add subscription for "topic" to "sockid"
 // return 0 topic already existed
 // return 1 if it was appended
 // return 2 if new entry was created
 int insert_subscription(dd_broker_t *self, zframe_t *sockid, char *topic) {
-  struct cds_lfht_iter iter;
   int hash = XXH32(zframe_data(sockid), zframe_size(sockid), XXHSEED);
-  subscribe_node *sn;
-
-  rcu_read_lock();
-  cds_lfht_lookup(self->subscribe_ht, hash, match_subscribe_node, sockid,
-                  &iter);
-  struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
-  rcu_read_unlock();
+  subscribe_node *sn = s_subscribe_lookup(self, sockid, hash);
 
-  // already there, append topic
-  if (ht_node) {
-    sn = (subscribe_node *)caa_container_of(ht_node, subscribe_node, node);
-    if (zlist_contains_str(sn->topics, topic) == 0) {
-      zlist_append(sn->topics, strdup(topic));
+  // already there, add topic
+  if (sn) {
+    if (zhash_insert(sn->topics, topic, sn) == 0)
       return 1;
-    } else {
-      // already there, return 0
-      return 0;
-    }
+    // already there, return 0
+    return 0;
   }
   // first insertion, create new node
   sn = malloc(sizeof(subscribe_node));
   cds_lfht_node_init(&sn->node);
   sn->sockid = zframe_dup(sockid);
-  sn->topics = zlist_new();
-  zlist_append(sn->topics, strdup(topic));
+  sn->topics = zhash_new();
+  zhash_insert(sn->topics, topic, sn);
   rcu_read_lock();
   cds_lfht_add(self->subscribe_ht, hash, &sn->node);
   rcu_read_unlock();
@@ -511,10 +729,7 @@ void hashtable_subscribe_destroy(struct cds_lfht **self_p) {
       sn = (subscribe_node *)caa_container_of(ht_node, subscribe_node, node);
 
       zframe_destroy(&sn->sockid);
-      if (sn->topics) {
-        zlist_autofree(sn->topics);
-        zlist_destroy(&sn->topics);
-      }
+      zhash_destroy(&sn->topics);
       cds_lfht_next(self, &iter);
       ht_node = cds_lfht_iter_get_node(&iter);
     }
@@ -535,16 +750,8 @@ void hashtable_local_client_destroy(struct cds_lfht **self_p) {
     struct cds_lfht_node *ht_node = cds_lfht_iter_get_node(&iter);
     while (ht_node) {
       lc = (local_client *)caa_container_of(ht_node, local_client, lcl_node);
-      zframe_destroy(&lc->sockid);
-
-      if (lc->name) {
-        free(lc->name);
-        lc->name = NULL;
-      }
-      if (lc->prefix_name) {
-        free(lc->prefix_name);
-        lc->prefix_name = NULL;
-      }
+      // the node memory goes with the slab
+      s_local_client_fini(lc);
       cds_lfht_next(self, &iter);
       ht_node = cds_lfht_iter_get_node(&iter);
     }
@@ -584,8 +791,10 @@ void print_sub_ht(dd_broker_t *self) {
   while (ht_node != NULL) {
     mp = caa_container_of(ht_node, subscribe_node, node);
     zframe_print(mp->sockid, "mp->sockid");
-    print_zlist_str(mp->topics);
-    cds_lfht_next(self->lcl_cli_ht, &iter);
+    zlist_t *topics = zhash_keys(mp->topics);
+    print_zlist_str(topics);
+    zlist_destroy(&topics);
+    cds_lfht_next(self->subscribe_ht, &iter);
     ht_node = cds_lfht_iter_get_node(&iter);
   }
 }
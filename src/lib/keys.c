@@ -25,6 +25,10 @@ struct _dd_keys_t {
   int ispublic;
   char *hash;
   zhash_t *clientkeys;
+  // Cipher suites offered to the broker, mask of 1 << DD_SUITE_*
+  uint32_t suites;
+  // Tenant keys for the negotiated suites, derived from custboxk
+  uint8_t *suitek[DD_SUITES];
 };
 void dd_keys_destroy(dd_keys_t **self_p) {
   assert(self_p);
@@ -37,6 +41,8 @@ void dd_keys_destroy(dd_keys_t **self_p) {
     free(self->ddboxk);
     free(self->custboxk);
     free(self->pubboxk);
+    free(self->suitek[DD_SUITE_AESGCM]);
+    free(self->suitek[DD_SUITE_XCHACHA]);
     free(self->hash);
     zhash_destroy(&self->clientkeys);
     free(self);
@@ -56,6 +62,31 @@ const uint8_t *dd_keys_ddpub(dd_keys_t *self) { return self->ddpubkey; }
 const uint8_t *dd_keys_pubboxk(dd_keys_t *self) { return self->pubboxk; }
 const uint8_t *dd_keys_publicpub(dd_keys_t *self) { return self->publicpubkey; }
 const unsigned char *dd_keys_priv(dd_keys_t *self) { return self->privkey; }
+uint32_t dd_keys_suites(dd_keys_t *self) { return self->suites; }
+const uint8_t *dd_keys_suitek(dd_keys_t *self, int suite) {
+  if (suite < 0 || suite >= DD_SUITES)
+    return NULL;
+  return self->suitek[suite];
+}
+
+// Parses a comma separated list of cipher suites, returns how many were
+// stored in suites
+static int s_parse_suites(const char *list, int *suites) {
+  char *copy = strdup(list);
+  char *save = NULL;
+  char *name = strtok_r(copy, ", ", &save);
+  int n = 0;
+  while (name && n < DD_SUITES) {
+    int suite = dd_suite_parse(name);
+    if (suite == -1)
+      fprintf(stderr, "Unknown cipher suite %s\n", name);
+    else
+      suites[n++] = suite;
+    name = strtok_r(NULL, ", ", &save);
+  }
+  free(copy);
+  return n;
+}
 
 // Read the Doubledecker keys from JSON file, for customer
 // Returns a pointer to a struct ddkeystate of successful
@@ -103,6 +134,7 @@ dd_keys_t *dd_keys_new(const char *filename) {
   base64_decodestate state_in;
   ddkeys = (dd_keys_t *)calloc(1, sizeof(dd_keys_t));
   ddkeys->clientkeys = zhash_new();
+  ddkeys->suites = dd_suites_available();
 
   json_object_object_foreach(parse_result, key, val) {
     if (streq(key, "public")) {
@@ -242,6 +274,15 @@ dd_keys_t *dd_keys_new(const char *filename) {
 
       } else if (strcmp(key2, "hash") == 0) {
         ddkeys->hash = strdup(json_object_get_string(val2));
+      } else if (strcmp(key2, "ciphers") == 0) {
+        // limit the suites offered to the broker
+        int suites[DD_SUITES];
+        int n = s_parse_suites(json_object_get_string(val2), suites);
+        ddkeys->suites = 0;
+        for (i = 0; i < n; i++)
+          ddkeys->suites |= 1 << suites[i];
+        if (ddkeys->suites == 0)
+          ddkeys->suites = 1 << DD_SUITE_BOX;
       }
     }
   }
@@ -264,6 +305,22 @@ dd_keys_t *dd_keys_new(const char *filename) {
   retval = crypto_box_beforenm(ddkeys->pubboxk, ddkeys->publicpubkey,
                                ddkeys->privkey);
 
+  // the public tenant doesn't negotiate, its clients share keys with all
+  // other tenants
+  if (ddkeys->ispublic)
+    ddkeys->suites = 0;
+  ddkeys->suites &= dd_suites_available();
+  // separate keys for the other suites, so the same key is never used with
+  // two ciphers
+  ddkeys->suitek[DD_SUITE_BOX] = ddkeys->custboxk;
+  for (i = DD_SUITE_BOX + 1; i < DD_SUITES; i++) {
+    const char *name = dd_suite_name(i);
+    ddkeys->suitek[i] = (unsigned char *)calloc(1, crypto_box_BEFORENMBYTES);
+    crypto_generichash(ddkeys->suitek[i], crypto_box_BEFORENMBYTES,
+                       (const unsigned char *)name, strlen(name),
+                       ddkeys->custboxk, crypto_box_BEFORENMBYTES);
+  }
+
   return ddkeys;
 }
 
@@ -407,8 +464,18 @@ ddbrokerkeys_t *read_ddbrokerkeys(char *filename) {
         } else if (strcmp(key4, "R") == 0) {
           ten->cookie = strtoull(json_object_get_string(val4), NULL, 10);
           // ten->cookie = atoll(json_object_get_string(val4));
+        } else if (strcmp(key4, "ciphers") == 0) {
+          ten->nsuites =
+              s_parse_suites(json_object_get_string(val4), ten->suites);
         }
       }
+      if (ten->nsuites > 0 && ten->name && streq(ten->name, "public")) {
+        fprintf(stderr, "Ignoring ciphers of the public tenant\n");
+        ten->nsuites = 0;
+      }
+      if (ten->nsuites > 1)
+        fprintf(stderr, "Tenant %s uses only its first cipher suite, %s\n",
+                ten->name ? ten->name : "?", dd_suite_name(ten->suites[0]));
 
       //      dd_debug("added keys for tenant: %s\n", ten->name);
       // add to list of tenants
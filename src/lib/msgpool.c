@@ -0,0 +1,160 @@
+/*
+ * msgpool.c --- reusable receive buffers for the broker router socket
+ *
+ * zmsg_recv allocates a zmsg_t, a list node and a zframe_t for every
+ * part, and each zmsg_popstr mallocs again. The broker instead receives
+ * into dd_rmsg_t messages taken from a pool. The first DD_RMSG_HEAD parts
+ * are zmq_msg_t that stay initialized between messages. Short parts live
+ * inside the zmq_msg_t itself, so headers such as the sockid, version,
+ * command and cookie are received and parsed without touching malloc.
+ * The parts after them are received as zframe_t, as zmsg_recv would, and
+ * rmsg_zmsg moves those into the zmsg_t that passes the payload on, so
+ * payloads are never copied. See msgpool_bench.c for the difference.
+ */
+#include "../include/msgpool.h"
+
+msgpool_t *msgpool_new(int max) {
+  msgpool_t *self = calloc(1, sizeof(msgpool_t));
+  self->free = calloc(max, sizeof(dd_rmsg_t *));
+  self->max = max;
+  return self;
+}
+
+static void s_rmsg_free(dd_rmsg_t *msg) {
+  int i;
+  for (i = 0; i < DD_RMSG_HEAD; i++)
+    zmq_msg_close(&msg->parts[i]);
+  for (i = DD_RMSG_HEAD; i < msg->size; i++)
+    zframe_destroy(&msg->frames[i - DD_RMSG_HEAD]);
+  free(msg->frames);
+  free(msg);
+}
+
+static dd_rmsg_t *s_rmsg_new() {
+  dd_rmsg_t *msg = calloc(1, sizeof(dd_rmsg_t));
+  int i;
+  for (i = 0; i < DD_RMSG_HEAD; i++)
+    zmq_msg_init(&msg->parts[i]);
+  msg->cap = DD_RMSG_FRAMES;
+  msg->frames = calloc(msg->cap, sizeof(zframe_t *));
+  return msg;
+}
+
+void msgpool_destroy(msgpool_t **self_p) {
+  assert(self_p);
+  msgpool_t *self = *self_p;
+  if (self == NULL)
+    return;
+  while (self->nfree > 0)
+    s_rmsg_free(self->free[--self->nfree]);
+  free(self->free);
+  free(self);
+  *self_p = NULL;
+}
+
+// Receives a complete multipart message, NULL on error
+dd_rmsg_t *msgpool_recv(msgpool_t *self, void *sock) {
+  dd_rmsg_t *msg;
+  if (self->nfree > 0) {
+    msg = self->free[--self->nfree];
+  } else {
+    msg = s_rmsg_new();
+    self->misses++;
+  }
+  msg->size = 0;
+  int more;
+  do {
+    if (msg->size < DD_RMSG_HEAD) {
+      if (zmq_msg_recv(&msg->parts[msg->size], sock, 0) == -1)
+        goto failed;
+      more = zmq_msg_more(&msg->parts[msg->size]);
+    } else {
+      int i = msg->size - DD_RMSG_HEAD;
+      if (i == msg->cap) {
+        msg->cap *= 2;
+        msg->frames = realloc(msg->frames, msg->cap * sizeof(zframe_t *));
+      }
+      msg->frames[i] = zframe_recv(sock);
+      if (msg->frames[i] == NULL)
+        goto failed;
+      more = zframe_more(msg->frames[i]);
+    }
+    msg->size++;
+  } while (more);
+  self->recvs++;
+  return msg;
+
+failed:
+  msgpool_release(self, &msg);
+  return NULL;
+}
+
+void msgpool_release(msgpool_t *self, dd_rmsg_t **msg_p) {
+  assert(msg_p);
+  dd_rmsg_t *msg = *msg_p;
+  if (msg == NULL)
+    return;
+  *msg_p = NULL;
+  if (self->nfree == self->max) {
+    s_rmsg_free(msg);
+    return;
+  }
+  // drop the content, keep the parts initialized
+  int i;
+  for (i = 0; i < msg->size; i++) {
+    if (i < DD_RMSG_HEAD) {
+      zmq_msg_close(&msg->parts[i]);
+      zmq_msg_init(&msg->parts[i]);
+    } else {
+      zframe_destroy(&msg->frames[i - DD_RMSG_HEAD]);
+    }
+  }
+  msg->size = 0;
+  self->free[self->nfree++] = msg;
+}
+
+void *rmsg_data(dd_rmsg_t *msg, int part) {
+  if (part >= msg->size)
+    return NULL;
+  if (part < DD_RMSG_HEAD)
+    return zmq_msg_data(&msg->parts[part]);
+  zframe_t *frame = msg->frames[part - DD_RMSG_HEAD];
+  return frame ? zframe_data(frame) : NULL;
+}
+
+size_t rmsg_size(dd_rmsg_t *msg, int part) {
+  if (part >= msg->size)
+    return 0;
+  if (part < DD_RMSG_HEAD)
+    return zmq_msg_size(&msg->parts[part]);
+  zframe_t *frame = msg->frames[part - DD_RMSG_HEAD];
+  return frame ? zframe_size(frame) : 0;
+}
+
+// Copies a part into buf as a string, NULL if the part is missing or
+// doesn't fit
+char *rmsg_str(dd_rmsg_t *msg, int part, char *buf, size_t len) {
+  void *data = rmsg_data(msg, part);
+  size_t size = rmsg_size(msg, part);
+  if (data == NULL || size >= len)
+    return NULL;
+  memcpy(buf, data, size);
+  buf[size] = '\0';
+  return buf;
+}
+
+// The parts from 'from' onwards as a zmsg_t, for passing on through czmq.
+// Header parts are copied, the frames after them are moved over and can't
+// be read from msg any more.
+zmsg_t *rmsg_zmsg(dd_rmsg_t *msg, int from) {
+  zmsg_t *zmsg = zmsg_new();
+  int i;
+  for (i = from; i < msg->size; i++) {
+    if (i < DD_RMSG_HEAD)
+      zmsg_addmem(zmsg, zmq_msg_data(&msg->parts[i]),
+                  zmq_msg_size(&msg->parts[i]));
+    else if (msg->frames[i - DD_RMSG_HEAD])
+      zmsg_append(zmsg, &msg->frames[i - DD_RMSG_HEAD]);
+  }
+  return zmsg;
+}
@@ -22,10 +22,33 @@ const uint32_t dd_cmd_unsub = DD_CMD_UNSUB;
 const uint32_t dd_cmd_sendpublic = DD_CMD_SENDPUBLIC;
 const uint32_t dd_cmd_pubpublic = DD_CMD_PUBPUBLIC;
 const uint32_t dd_cmd_sendpt = DD_CMD_SENDPT;
-const uint32_t dd_cmd_forwardpt = DD_CMD_FORWARDPT;
 const uint32_t dd_cmd_datapt = DD_CMD_DATAPT;
 const uint32_t dd_cmd_subok = DD_CMD_SUBOK;
+const uint32_t dd_cmd_activate = DD_CMD_ACTIVATE;
+const uint32_t dd_cmd_route = DD_CMD_ROUTE;
+const uint32_t dd_cmd_credit = DD_CMD_CREDIT;
+const uint32_t dd_cmd_resume = DD_CMD_RESUME;
+const uint32_t dd_cmd_submany = DD_CMD_SUBMANY;
+const uint32_t dd_cmd_unsubmany = DD_CMD_UNSUBMANY;
+const uint32_t dd_cmd_sendshm = DD_CMD_SENDSHM;
+const uint32_t dd_cmd_datashm = DD_CMD_DATASHM;
+const uint32_t dd_cmd_replay = DD_CMD_REPLAY;
 const uint32_t dd_version = DD_VERSION;
 const uint32_t dd_error_regfail = DD_ERROR_REGFAIL;
 const uint32_t dd_error_nodst = DD_ERROR_NODST;
 const uint32_t dd_error_version = DD_ERROR_VERSION;
+const uint32_t dd_error_busy = DD_ERROR_BUSY;
+const uint32_t dd_error_quota = DD_ERROR_QUOTA;
+
+// Delay before reconnect attempt number 'attempt', counting from 0. The
+// upper bound doubles from DD_BACKOFF_MIN to DD_BACKOFF_MAX and the delay is
+// picked at random from its upper half, so that clients and brokers that
+// were cut off at the same time don't all come back at the same time.
+int dd_backoff(int attempt) {
+  int cap = DD_BACKOFF_MIN;
+  while (attempt-- > 0 && cap < DD_BACKOFF_MAX)
+    cap *= 2;
+  if (cap > DD_BACKOFF_MAX)
+    cap = DD_BACKOFF_MAX;
+  return cap / 2 + randombytes_uniform(cap / 2) + 1;
+}
@@ -0,0 +1,517 @@
+/*
+ * publog.c --- durable log of publications, replayed from a sequence number
+ *
+ * The broker appends every publication to a log per pubtopic, numbered
+ * with a sequence shared by all topics, so a subscriber that was offline
+ * can ask for what it missed since the last number it saw. Each topic has
+ * a directory of memory mapped segment files, named after the first
+ * number they hold. Records are written before their length is set, so a
+ * crash leaves at most one record that is ignored on the next start. When
+ * a topic has more than max_segs segments the oldest one is removed. Only
+ * the segment being written to stays mapped. Topics are limited in all and
+ * per tenant, publications on new topics beyond that aren't logged.
+ *
+ * Records are a uint32_t length, a magic and the uint64_t sequence number
+ * followed by the source, the topic and the payload frames, padded to 8
+ * bytes. Payloads are kept as published, still encrypted for the tenant.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/publog.h"
+
+#define LOG_MAGIC 0x44444c47
+#define LOG_TOPIC 256
+#define LOG_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+struct _seg_hdr {
+  uint32_t magic;
+  uint32_t size;
+  uint64_t first;
+  char pubtopic[LOG_TOPIC];
+};
+#define LOG_HDR LOG_ALIGN(sizeof(struct _seg_hdr))
+
+struct _log_rec {
+  uint32_t len;
+  uint32_t magic;
+  uint64_t seq;
+};
+#define LOG_REC sizeof(struct _log_rec)
+
+static void s_seg_free(publog_seg_t **seg_p) {
+  publog_seg_t *seg = *seg_p;
+  if (seg == NULL)
+    return;
+  if (seg->map)
+    munmap(seg->map, seg->size);
+  free(seg->path);
+  free(seg);
+  *seg_p = NULL;
+}
+
+// The record at off, NULL past the last one
+static struct _log_rec *s_rec_at(publog_seg_t *seg, size_t off) {
+  if (off + LOG_REC > seg->size)
+    return NULL;
+  struct _log_rec *rec = (struct _log_rec *)(seg->map + off);
+  if (rec->len == 0 || rec->magic != LOG_MAGIC ||
+      off + LOG_REC + rec->len > seg->size)
+    return NULL;
+  return rec;
+}
+
+static size_t s_rec_next(struct _log_rec *rec, size_t off) {
+  return off + LOG_ALIGN(LOG_REC + rec->len);
+}
+
+// Maps a sealed segment again for a replay, -1 if it is gone
+static int s_seg_load(publog_seg_t *seg) {
+  if (seg->map)
+    return 0;
+  int fd = open(seg->path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  void *map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+  seg->map = map;
+  return 0;
+}
+
+static void s_seg_unload(publog_seg_t *seg) {
+  if (seg->map)
+    munmap(seg->map, seg->size);
+  seg->map = NULL;
+}
+
+static publog_seg_t *s_seg_map(const char *path, int fd, size_t size) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  publog_seg_t *seg = calloc(1, sizeof(publog_seg_t));
+  seg->path = strdup(path);
+  seg->map = map;
+  seg->size = size;
+  return seg;
+}
+
+// Maps an existing segment and finds its end, NULL if it isn't a segment
+static publog_seg_t *s_seg_open(const char *path) {
+  int fd = open(path, O_RDWR);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  publog_seg_t *seg = NULL;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > LOG_HDR)
+    seg = s_seg_map(path, fd, st.st_size);
+  close(fd);
+  if (seg == NULL)
+    return NULL;
+  struct _seg_hdr *hdr = (struct _seg_hdr *)seg->map;
+  if (hdr->magic != LOG_MAGIC || hdr->size != seg->size) {
+    s_seg_free(&seg);
+    return NULL;
+  }
+  hdr->pubtopic[LOG_TOPIC - 1] = '\0';
+  seg->first = hdr->first;
+  seg->last = seg->first - 1;
+  size_t off = LOG_HDR;
+  struct _log_rec *rec;
+  while ((rec = s_rec_at(seg, off))) {
+    seg->last = rec->seq;
+    off = s_rec_next(rec, off);
+  }
+  seg->used = off;
+  return seg;
+}
+
+static publog_seg_t *s_seg_create(publog_t *self, publog_topic_t *topic,
+                                  uint64_t first) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%016llx.seg", topic->dir,
+           (unsigned long long)first);
+  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd == -1)
+    return NULL;
+  publog_seg_t *seg = NULL;
+  if (ftruncate(fd, self->seg_size) == 0)
+    seg = s_seg_map(path, fd, self->seg_size);
+  close(fd);
+  if (seg == NULL) {
+    unlink(path);
+    return NULL;
+  }
+  struct _seg_hdr *hdr = (struct _seg_hdr *)seg->map;
+  hdr->size = self->seg_size;
+  hdr->first = first;
+  snprintf(hdr->pubtopic, LOG_TOPIC, "%s", topic->pubtopic);
+  __sync_synchronize();
+  hdr->magic = LOG_MAGIC;
+  seg->first = first;
+  seg->last = first - 1;
+  seg->used = LOG_HDR;
+  return seg;
+}
+
+static int s_seg_cmp(void *item1, void *item2) {
+  publog_seg_t *a = item1, *b = item2;
+  return a->first > b->first ? 1 : (a->first < b->first ? -1 : 0);
+}
+
+// The tenant of pubtopic, what comes before the first dot
+static void s_tenant(const char *pubtopic, char *buf, size_t size) {
+  const char *dot = strchr(pubtopic, '.');
+  size_t len = dot ? (size_t)(dot - pubtopic) : strlen(pubtopic);
+  if (len >= size)
+    len = size - 1;
+  memcpy(buf, pubtopic, len);
+  buf[len] = '\0';
+}
+
+// The number of topics logged for the tenant of pubtopic
+static int *s_tenant_topics(publog_t *self, const char *pubtopic) {
+  char tenant[LOG_TOPIC];
+  s_tenant(pubtopic, tenant, sizeof(tenant));
+  int *count = zhash_lookup(self->tenants, tenant);
+  if (count == NULL) {
+    count = calloc(1, sizeof(int));
+    zhash_insert(self->tenants, tenant, count);
+    zhash_freefn(self->tenants, tenant, free);
+  }
+  return count;
+}
+
+static void s_topic_free(void *data) {
+  publog_topic_t *topic = data;
+  publog_seg_t *seg;
+  while ((seg = zlist_pop(topic->segs)))
+    s_seg_free(&seg);
+  zlist_destroy(&topic->segs);
+  free(topic->pubtopic);
+  free(topic->dir);
+  free(topic);
+}
+
+// The log of pubtopic, a new one if there is none and dir is NULL. Topics
+// found on disk are counted but not limited.
+static publog_topic_t *s_topic(publog_t *self, const char *pubtopic,
+                               const char *dir) {
+  publog_topic_t *topic = zhash_lookup(self->topics, pubtopic);
+  if (topic)
+    return topic;
+  int *count = s_tenant_topics(self, pubtopic);
+  if (dir == NULL &&
+      ((self->max_topics > 0 &&
+        zhash_size(self->topics) >= (size_t)self->max_topics) ||
+       (self->tenant_max_topics > 0 && *count >= self->tenant_max_topics))) {
+    self->refused++;
+    return NULL;
+  }
+  char path[PATH_MAX];
+  if (dir == NULL) {
+    // pubtopics may contain anything, name the directory by their hash
+    unsigned char hash[8];
+    char hex[2 * sizeof(hash) + 1];
+    crypto_generichash(hash, sizeof(hash), (const unsigned char *)pubtopic,
+                       strlen(pubtopic), NULL, 0);
+    sodium_bin2hex(hex, sizeof(hex), hash, sizeof(hash));
+    snprintf(path, sizeof(path), "%s/%s", self->dir, hex);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+      return NULL;
+    dir = path;
+  }
+  (*count)++;
+  topic = calloc(1, sizeof(publog_topic_t));
+  topic->pubtopic = strdup(pubtopic);
+  topic->dir = strdup(dir);
+  topic->segs = zlist_new();
+  zhash_insert(self->topics, pubtopic, topic);
+  zhash_freefn(self->topics, pubtopic, s_topic_free);
+  return topic;
+}
+
+// Maps the segments of one topic directory
+static void s_load_dir(publog_t *self, const char *dir) {
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+  struct dirent *ent;
+  char path[PATH_MAX];
+  while ((ent = readdir(d))) {
+    size_t len = strlen(ent->d_name);
+    if (len < 4 || strcmp(ent->d_name + len - 4, ".seg") != 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    publog_seg_t *seg = s_seg_open(path);
+    if (seg == NULL)
+      continue;
+    struct _seg_hdr *hdr = (struct _seg_hdr *)seg->map;
+    publog_topic_t *topic = s_topic(self, hdr->pubtopic, dir);
+    zlist_append(topic->segs, seg);
+    if (seg->used > LOG_HDR && seg->last > self->seq)
+      self->seq = seg->last;
+  }
+  closedir(d);
+}
+
+// Opens the log in dir, creating it if needed, and picks up the segments
+// of an earlier run
+publog_t *publog_new(const char *dir, size_t seg_size, int max_segs) {
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    return NULL;
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return NULL;
+  publog_t *self = calloc(1, sizeof(publog_t));
+  self->dir = strdup(dir);
+  self->seg_size = LOG_ALIGN(seg_size > 2 * LOG_HDR ? seg_size : 2 * LOG_HDR);
+  self->max_segs = max_segs > 0 ? max_segs : 1;
+  self->topics = zhash_new();
+  self->tenants = zhash_new();
+  self->max_topics = DD_LOG_TOPICS;
+  struct dirent *ent;
+  char path[PATH_MAX];
+  while ((ent = readdir(d))) {
+    if (ent->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    s_load_dir(self, path);
+  }
+  closedir(d);
+  publog_topic_t *topic = zhash_first(self->topics);
+  while (topic) {
+    zlist_sort(topic->segs, s_seg_cmp);
+    publog_seg_t *seg = zlist_first(topic->segs);
+    while (seg) {
+      if (seg != zlist_last(topic->segs))
+        s_seg_unload(seg);
+      seg = zlist_next(topic->segs);
+    }
+    topic = zhash_next(self->topics);
+  }
+  return self;
+}
+
+void publog_destroy(publog_t **self_p) {
+  publog_t *self = *self_p;
+  if (self == NULL)
+    return;
+  zhash_destroy(&self->topics);
+  zhash_destroy(&self->tenants);
+  free(self->dir);
+  free(self);
+  *self_p = NULL;
+}
+
+static unsigned char *s_put_str(unsigned char *p, const char *str) {
+  uint16_t len = strlen(str);
+  memcpy(p, &len, sizeof(len));
+  memcpy(p + sizeof(len), str, len);
+  return p + sizeof(len) + len;
+}
+
+// Logs a publication on pubtopic, returns its sequence number or 0 if it
+// couldn't be logged
+uint64_t publog_append(publog_t *self, const char *pubtopic,
+                       const char *source, const char *topic,
+                       zmsg_t *payload) {
+  if (strlen(pubtopic) >= LOG_TOPIC || strlen(source) > UINT16_MAX ||
+      strlen(topic) > UINT16_MAX || zmsg_size(payload) > UINT16_MAX)
+    return 0;
+  size_t len = 3 * sizeof(uint16_t) + strlen(source) + strlen(topic);
+  zframe_t *frame = zmsg_first(payload);
+  while (frame) {
+    len += sizeof(uint32_t) + zframe_size(frame);
+    frame = zmsg_next(payload);
+  }
+  if (LOG_HDR + LOG_ALIGN(LOG_REC + len) > self->seg_size)
+    return 0;
+
+  publog_topic_t *t = s_topic(self, pubtopic, NULL);
+  if (t == NULL)
+    return 0;
+  uint64_t seq = self->seq + 1;
+  publog_seg_t *seg = zlist_last(t->segs);
+  if (seg == NULL || seg->used + LOG_ALIGN(LOG_REC + len) > seg->size) {
+    publog_seg_t *sealed = seg;
+    if ((seg = s_seg_create(self, t, seq)) == NULL)
+      return 0;
+    if (sealed)
+      s_seg_unload(sealed);
+    zlist_append(t->segs, seg);
+    while (zlist_size(t->segs) > (size_t)self->max_segs) {
+      publog_seg_t *old = zlist_pop(t->segs);
+      unlink(old->path);
+      s_seg_free(&old);
+    }
+  }
+
+  struct _log_rec *rec = (struct _log_rec *)(seg->map + seg->used);
+  unsigned char *p = (unsigned char *)rec + LOG_REC;
+  p = s_put_str(p, source);
+  p = s_put_str(p, topic);
+  uint16_t nframes = zmsg_size(payload);
+  memcpy(p, &nframes, sizeof(nframes));
+  p += sizeof(nframes);
+  frame = zmsg_first(payload);
+  while (frame) {
+    uint32_t flen = zframe_size(frame);
+    memcpy(p, &flen, sizeof(flen));
+    memcpy(p + sizeof(flen), zframe_data(frame), flen);
+    p += sizeof(flen) + flen;
+    frame = zmsg_next(payload);
+  }
+  rec->magic = LOG_MAGIC;
+  rec->seq = seq;
+  __sync_synchronize();
+  rec->len = len;
+  seg->used += LOG_ALIGN(LOG_REC + len);
+  seg->last = seq;
+  self->seq = seq;
+  return seq;
+}
+
+static char *s_get_str(const unsigned char **p) {
+  uint16_t len;
+  memcpy(&len, *p, sizeof(len));
+  char *str = malloc(len + 1);
+  memcpy(str, *p + sizeof(len), len);
+  str[len] = '\0';
+  *p += sizeof(len) + len;
+  return str;
+}
+
+// Where a replay is in the log of one topic
+struct _cursor {
+  publog_seg_t **segs;
+  size_t nsegs, cur, off;
+  struct _log_rec *rec;
+};
+
+static void s_cursor_fill(struct _cursor *c) {
+  c->rec = NULL;
+  while (c->cur < c->nsegs) {
+    if (s_seg_load(c->segs[c->cur]) == 0 &&
+        (c->rec = s_rec_at(c->segs[c->cur], c->off)))
+      return;
+    c->cur++;
+    c->off = LOG_HDR;
+  }
+}
+
+// Positions the cursor at the first record after from
+static void s_cursor_seek(struct _cursor *c, uint64_t from) {
+  while (c->cur < c->nsegs && c->segs[c->cur]->last <= from)
+    c->cur++;
+  c->off = LOG_HDR;
+  s_cursor_fill(c);
+  while (c->rec && c->rec->seq <= from) {
+    c->off = s_rec_next(c->rec, c->off);
+    s_cursor_fill(c);
+  }
+}
+
+static void s_cursor_advance(struct _cursor *c) {
+  c->off = s_rec_next(c->rec, c->off);
+  s_cursor_fill(c);
+}
+
+// The segment written to stays mapped, the sealed ones read are unmapped
+static void s_cursor_free(struct _cursor *c) {
+  size_t i;
+  for (i = 0; i + 1 < c->nsegs; i++)
+    s_seg_unload(c->segs[i]);
+  free(c->segs);
+}
+
+// Calls fn for at most max publications on pubtopics starting with prefix,
+// numbered after from up to until, in the order they were published.
+// Returns the number of the last one fn took, or from if none, and sets
+// done if there are no more.
+uint64_t publog_replay(publog_t *self, const char *prefix, uint64_t from,
+                       uint64_t until, int max, publog_fn *fn, void *arg,
+                       int *done) {
+  size_t plen = strlen(prefix);
+  size_t ncur = 0;
+  struct _cursor *curs = calloc(zhash_size(self->topics) + 1, sizeof(*curs));
+  publog_topic_t *topic = zhash_first(self->topics);
+  while (topic) {
+    if (strncmp(topic->pubtopic, prefix, plen) == 0 &&
+        zlist_size(topic->segs) > 0) {
+      struct _cursor *c = &curs[ncur];
+      c->segs = calloc(zlist_size(topic->segs), sizeof(publog_seg_t *));
+      publog_seg_t *seg = zlist_first(topic->segs);
+      while (seg) {
+        c->segs[c->nsegs++] = seg;
+        seg = zlist_next(topic->segs);
+      }
+      s_cursor_seek(c, from);
+      if (c->rec) {
+        ncur++;
+      } else {
+        s_cursor_free(c);
+        memset(c, 0, sizeof(*c));
+      }
+    }
+    topic = zhash_next(self->topics);
+  }
+
+  uint64_t last = from;
+  int sent = 0;
+  *done = 0;
+  while (1) {
+    // the cursors are few, finding the lowest number by scanning is enough
+    struct _cursor *next = NULL;
+    size_t i;
+    for (i = 0; i < ncur; i++)
+      if (curs[i].rec && curs[i].rec->seq <= until &&
+          (next == NULL || curs[i].rec->seq < next->rec->seq))
+        next = &curs[i];
+    if (next == NULL) {
+      *done = 1;
+      break;
+    }
+    if (sent == max)
+      break;
+
+    const unsigned char *p = (const unsigned char *)next->rec + LOG_REC;
+    char *source = s_get_str(&p);
+    char *top = s_get_str(&p);
+    uint16_t nframes;
+    memcpy(&nframes, p, sizeof(nframes));
+    p += sizeof(nframes);
+    zmsg_t *payload = zmsg_new();
+    while (nframes--) {
+      uint32_t flen;
+      memcpy(&flen, p, sizeof(flen));
+      zmsg_addmem(payload, p + sizeof(flen), flen);
+      p += sizeof(flen) + flen;
+    }
+    uint64_t seq = next->rec->seq;
+    int rc = fn(arg, seq, source, top, payload);
+    free(source);
+    free(top);
+    zmsg_destroy(&payload);
+    if (rc == -1)
+      break;
+    last = seq;
+    sent++;
+    s_cursor_advance(next);
+  }
+
+  size_t i;
+  for (i = 0; i < ncur; i++)
+    s_cursor_free(&curs[i]);
+  free(curs);
+  return last;
+}
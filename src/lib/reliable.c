@@ -0,0 +1,188 @@
+/*
+ * reliable.c --- at-least-once notifications, acknowledged end to end
+ *
+ * Reliable notifications carry a session, their sequence number and the
+ * oldest number the sender hasn't seen acknowledged, inside the encrypted
+ * payload so brokers and other clients can't forge them. The receiver
+ * only delivers them in order and answers with cumulative ACKs, one per
+ * sender after each batch it reads. The sender keeps up to DD_REL_WINDOW
+ * of them in flight per target and goes back to the oldest one when the
+ * ACKs stop moving for a while or repeat, so a single timer covers all
+ * targets. A receiver that lost its state starts over at the oldest
+ * unacknowledged number, so nothing is skipped, but it may see
+ * notifications again that it already delivered. A target with nothing
+ * unacknowledged is forgotten after DD_REL_IDLE, or sooner once there are
+ * DD_REL_PEERS of them, and gets a new session when it is used again.
+ */
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/reliable.h"
+
+static void s_out_free(void *data) {
+  rel_out_t *out = data;
+  rel_msg_t *msg;
+  while ((msg = zlist_pop(out->msgs))) {
+    free(msg->data);
+    free(msg);
+  }
+  zlist_destroy(&out->msgs);
+  free(out->target);
+  free(out);
+}
+
+static void s_in_free(void *data) {
+  rel_in_t *in = data;
+  free(in->source);
+  free(in);
+}
+
+static void s_session_key(uint64_t session, char *key) {
+  sodium_bin2hex(key, 2 * sizeof(session) + 1, (unsigned char *)&session,
+                 sizeof(session));
+}
+
+reliable_t *reliable_new() {
+  reliable_t *self = calloc(1, sizeof(reliable_t));
+  self->out = zhash_new();
+  self->sessions = zhash_new();
+  self->in = zhash_new();
+  return self;
+}
+
+void reliable_destroy(reliable_t **self_p) {
+  reliable_t *self = *self_p;
+  if (self == NULL)
+    return;
+  zhash_destroy(&self->sessions);
+  zhash_destroy(&self->out);
+  zhash_destroy(&self->in);
+  free(self);
+  *self_p = NULL;
+}
+
+// Forgets targets with nothing unacknowledged that were idle for idle
+// milliseconds, returns how many
+int reliable_expire(reliable_t *self, int64_t now, int idle) {
+  zlist_t *idlers = zlist_new();
+  rel_out_t *out = zhash_first(self->out);
+  while (out) {
+    if (zlist_size(out->msgs) == 0 && now - out->progress >= idle)
+      zlist_append(idlers, out);
+    out = zhash_next(self->out);
+  }
+  int n = zlist_size(idlers);
+  char key[2 * sizeof(uint64_t) + 1];
+  while ((out = zlist_pop(idlers))) {
+    s_session_key(out->session, key);
+    zhash_delete(self->sessions, key);
+    zhash_delete(self->out, out->target);
+  }
+  zlist_destroy(&idlers);
+  return n;
+}
+
+// The state of notifications to target, a new session if there is none
+rel_out_t *reliable_out(reliable_t *self, const char *target) {
+  rel_out_t *out = zhash_lookup(self->out, target);
+  if (out)
+    return out;
+  if (zhash_size(self->out) >= DD_REL_PEERS)
+    reliable_expire(self, zclock_mono(), 0);
+  out = calloc(1, sizeof(rel_out_t));
+  out->target = strdup(target);
+  randombytes_buf(&out->session, sizeof(out->session));
+  out->base = out->next = 1;
+  out->sent = 0;
+  out->msgs = zlist_new();
+  out->progress = zclock_mono();
+  out->rto = DD_REL_RTO;
+  zhash_insert(self->out, target, out);
+  zhash_freefn(self->out, target, s_out_free);
+  char key[2 * sizeof(uint64_t) + 1];
+  s_session_key(out->session, key);
+  zhash_insert(self->sessions, key, out);
+  return out;
+}
+
+// Queues a copy of data, returns -1 if the target is too far behind
+int reliable_queue(rel_out_t *out, const char *data, int len, uint32_t flags,
+                   uint64_t *seq) {
+  if (zlist_size(out->msgs) >= DD_REL_WINDOW + DD_REL_PENDING)
+    return -1;
+  rel_msg_t *msg = malloc(sizeof(rel_msg_t));
+  msg->seq = out->next++;
+  msg->flags = flags;
+  msg->len = len;
+  msg->data = malloc(len > 0 ? len : 1);
+  memcpy(msg->data, data, len);
+  zlist_append(out->msgs, msg);
+  if (seq)
+    *seq = msg->seq;
+  return 0;
+}
+
+// Releases what an ACK of everything up to ack covers. Returns the target
+// it was for, NULL if the session is unknown, and how many were acked.
+// Repeated ACKs for notifications in flight are counted in dupacks.
+rel_out_t *reliable_ack(reliable_t *self, uint64_t session, uint64_t ack,
+                        int *acked) {
+  char key[2 * sizeof(uint64_t) + 1];
+  s_session_key(session, key);
+  rel_out_t *out = zhash_lookup(self->sessions, key);
+  *acked = 0;
+  if (out == NULL)
+    return NULL;
+  if (ack > out->sent)
+    ack = out->sent;
+  if (ack >= out->base) {
+    rel_msg_t *msg;
+    while ((msg = zlist_first(out->msgs)) && msg->seq <= ack) {
+      zlist_pop(out->msgs);
+      free(msg->data);
+      free(msg);
+      (*acked)++;
+    }
+    out->base = ack + 1;
+    out->dupacks = 0;
+    out->rto = DD_REL_RTO;
+    out->progress = zclock_mono();
+  } else if (ack + 1 == out->base && out->base <= out->sent) {
+    out->dupacks++;
+  }
+  return out;
+}
+
+// Whether the notification seq from source should be delivered, only if
+// it is the next one in order. An ACK is due either way.
+int reliable_accept(reliable_t *self, const char *source, uint64_t session,
+                    uint64_t seq, uint64_t base) {
+  char key[256];
+  snprintf(key, sizeof(key), "%s/%016llx", source,
+           (unsigned long long)session);
+  rel_in_t *in = zhash_lookup(self->in, key);
+  if (in == NULL) {
+    if (zhash_size(self->in) >= DD_REL_PEERS) {
+      zhash_destroy(&self->in);
+      self->in = zhash_new();
+      self->acks_due = 0;
+    }
+    in = calloc(1, sizeof(rel_in_t));
+    in->source = strdup(source);
+    in->session = session;
+    in->expected = base;
+    zhash_insert(self->in, key, in);
+    zhash_freefn(self->in, key, s_in_free);
+  }
+  // the sender saw ACKs for these, from a receiver that forgot about them
+  if (base > in->expected)
+    in->expected = base;
+  if (!in->ack_due) {
+    in->ack_due = 1;
+    self->acks_due++;
+  }
+  if (seq != in->expected)
+    return 0;
+  in->expected++;
+  return 1;
+}
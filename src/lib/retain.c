@@ -0,0 +1,102 @@
+/*
+ * retain.c --- last publication per topic, for new subscribers
+ *
+ * Publications flagged DD_PAYLOAD_RETAIN are kept by the broker, one per
+ * tenant, topic and scope, and sent to a client right after it subscribes
+ * to a matching topic. The payload is kept as it was published, still
+ * encrypted for the tenant. Brokers pass their copies on to a broker that
+ * subscribes to a matching topic, since it only got the publications that
+ * matched subscriptions at the time. A copy of what is retained already
+ * is recognized by its payload, which is sealed with a fresh nonce each
+ * time it is published.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "../include/retain.h"
+
+static void s_retained_free(void *data) {
+  retained_t *r = data;
+  free(r->pubtopic);
+  free(r->source);
+  free(r->topic);
+  zmsg_destroy(&r->payload);
+  free(r);
+}
+
+retain_t *retain_new(size_t max) {
+  retain_t *self = calloc(1, sizeof(retain_t));
+  self->entries = zhash_new();
+  self->order = zlist_new();
+  self->max = max;
+  return self;
+}
+
+void retain_destroy(retain_t **self_p) {
+  retain_t *self = *self_p;
+  if (self == NULL)
+    return;
+  zlist_destroy(&self->order);
+  zhash_destroy(&self->entries);
+  free(self);
+  *self_p = NULL;
+}
+
+static int s_payload_eq(zmsg_t *a, zmsg_t *b) {
+  if (zmsg_size(a) != zmsg_size(b))
+    return 0;
+  zframe_t *fa = zmsg_first(a);
+  zframe_t *fb = zmsg_first(b);
+  while (fa && fb) {
+    if (!zframe_eq(fa, fb))
+      return 0;
+    fa = zmsg_next(a);
+    fb = zmsg_next(b);
+  }
+  return 1;
+}
+
+// Keeps a copy of payload as the value of pubtopic. Returns 0 if it is the
+// publication retained already, passed on again by another broker.
+int retain_put(retain_t *self, const char *pubtopic, const char *source,
+               const char *topic, zmsg_t *payload) {
+  retained_t *r = zhash_lookup(self->entries, pubtopic);
+  if (r && s_payload_eq(r->payload, payload))
+    return 0;
+  if (r) {
+    self->bytes -= zmsg_content_size(r->payload);
+    free(r->source);
+    free(r->topic);
+    zmsg_destroy(&r->payload);
+  } else {
+    if (zhash_size(self->entries) >= self->max) {
+      char *oldest = zlist_pop(self->order);
+      retained_t *old = zhash_lookup(self->entries, oldest);
+      self->bytes -= zmsg_content_size(old->payload);
+      zhash_delete(self->entries, oldest);
+    }
+    r = calloc(1, sizeof(retained_t));
+    r->pubtopic = strdup(pubtopic);
+    zhash_insert(self->entries, pubtopic, r);
+    zhash_freefn(self->entries, pubtopic, s_retained_free);
+    zlist_append(self->order, r->pubtopic);
+  }
+  r->source = strdup(source);
+  r->topic = strdup(topic);
+  r->payload = zmsg_dup(payload);
+  self->bytes += zmsg_content_size(r->payload);
+  return 1;
+}
+
+// Retained publications a subscription to prefix covers, the list doesn't
+// own them
+zlist_t *retain_match(retain_t *self, const char *prefix) {
+  zlist_t *found = zlist_new();
+  size_t len = strlen(prefix);
+  retained_t *r = zhash_first(self->entries);
+  while (r) {
+    if (strncmp(r->pubtopic, prefix, len) == 0)
+      zlist_append(found, r);
+    r = zhash_next(self->entries);
+  }
+  return found;
+}
@@ -0,0 +1,305 @@
+/*
+ * sfqueue.c --- notifications held for destinations that are offline
+ *
+ * A notification to a client that isn't registered anywhere is normally
+ * answered with NODST and dropped. With queueing on, the broker that would
+ * answer NODST keeps it instead if the client unregistered less than ttl
+ * milliseconds ago, see sfqueue_gone, up to max notifications and
+ * max_bytes per destination, for ttl milliseconds. Names that were never
+ * registered still get NODST, and a tenant has at most tenant_max_dests
+ * destinations queued for. When the destination registers again the queue
+ * is handed back in order, see sfqueue_take.
+ *
+ * Queues are kept in memory up to DD_SFQ_MEMORY bytes in total. Beyond
+ * that, with a spill directory, notifications go to a memory mapped file
+ * per destination, sparse and max_bytes large, which is removed once the
+ * destination is drained or its notifications expired. Spilled
+ * notifications are a uint32_t number of frames followed by each frame's
+ * uint32_t length and data.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../include/sfqueue.h"
+
+static void s_msg_free(sfq_msg_t **msg_p) {
+  sfq_msg_t *msg = *msg_p;
+  free(msg->src);
+  zmsg_destroy(&msg->payload);
+  free(msg);
+  *msg_p = NULL;
+}
+
+void sfqueue_dest_free(sfq_dest_t **dest_p) {
+  sfq_dest_t *dest = *dest_p;
+  if (dest == NULL)
+    return;
+  sfq_msg_t *msg;
+  while ((msg = zlist_pop(dest->msgs)))
+    s_msg_free(&msg);
+  zlist_destroy(&dest->msgs);
+  if (dest->map) {
+    munmap(dest->map, dest->size);
+    unlink(dest->path);
+  }
+  free(dest->path);
+  free(dest->dst);
+  free(dest);
+  *dest_p = NULL;
+}
+
+sfqueue_t *sfqueue_new(size_t max) {
+  sfqueue_t *self = calloc(1, sizeof(sfqueue_t));
+  self->dests = zhash_new();
+  self->tenants = zhash_new();
+  self->gone = zhash_new();
+  self->max = max;
+  self->max_bytes = DD_SFQ_BYTES;
+  self->ttl = DD_SFQ_TTL;
+  self->tenant_max_dests = DD_SFQ_TENANT_DESTS;
+  return self;
+}
+
+void sfqueue_destroy(sfqueue_t **self_p) {
+  sfqueue_t *self = *self_p;
+  if (self == NULL)
+    return;
+  sfq_dest_t *dest = zhash_first(self->dests);
+  while (dest) {
+    sfqueue_dest_free(&dest);
+    dest = zhash_next(self->dests);
+  }
+  zhash_destroy(&self->dests);
+  zhash_destroy(&self->tenants);
+  zhash_destroy(&self->gone);
+  free(self->spill_dir);
+  free(self);
+  *self_p = NULL;
+}
+
+// The destinations queued for in the tenant of dst
+static int *s_tenant_dests(sfqueue_t *self, const char *dst) {
+  char tenant[256];
+  const char *dot = strchr(dst, '.');
+  size_t len = dot ? (size_t)(dot - dst) : strlen(dst);
+  if (len >= sizeof(tenant))
+    len = sizeof(tenant) - 1;
+  memcpy(tenant, dst, len);
+  tenant[len] = '\0';
+  int *count = zhash_lookup(self->tenants, tenant);
+  if (count == NULL) {
+    count = calloc(1, sizeof(int));
+    zhash_insert(self->tenants, tenant, count);
+    zhash_freefn(self->tenants, tenant, free);
+  }
+  return count;
+}
+
+// Removes an empty or taken destination from the queue
+static void s_dest_remove(sfqueue_t *self, sfq_dest_t *dest) {
+  (*s_tenant_dests(self, dest->dst))--;
+  zhash_delete(self->dests, dest->dst);
+}
+
+// Maps the spill file of dest, named by the hash of its name
+static int s_spill_open(sfqueue_t *self, sfq_dest_t *dest) {
+  unsigned char hash[8];
+  char hex[2 * sizeof(hash) + 1];
+  crypto_generichash(hash, sizeof(hash), (const unsigned char *)dest->dst,
+                     strlen(dest->dst), NULL, 0);
+  sodium_bin2hex(hex, sizeof(hex), hash, sizeof(hash));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s.q", self->spill_dir, hex);
+  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd == -1)
+    return -1;
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, self->max_bytes) == 0)
+    map = mmap(NULL, self->max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    unlink(path);
+    return -1;
+  }
+  dest->path = strdup(path);
+  dest->map = map;
+  dest->size = self->max_bytes;
+  dest->used = 0;
+  return 0;
+}
+
+static int s_spill(sfqueue_t *self, sfq_dest_t *dest, sfq_msg_t *msg,
+                   zmsg_t *payload) {
+  size_t need = sizeof(uint32_t);
+  zframe_t *frame = zmsg_first(payload);
+  while (frame) {
+    need += sizeof(uint32_t) + zframe_size(frame);
+    frame = zmsg_next(payload);
+  }
+  if (dest->map == NULL && s_spill_open(self, dest) != 0)
+    return -1;
+  if (dest->used + need > dest->size)
+    return -1;
+  unsigned char *p = dest->map + dest->used;
+  uint32_t nframes = zmsg_size(payload);
+  memcpy(p, &nframes, sizeof(nframes));
+  p += sizeof(nframes);
+  frame = zmsg_first(payload);
+  while (frame) {
+    uint32_t len = zframe_size(frame);
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), zframe_data(frame), len);
+    p += sizeof(len) + len;
+    frame = zmsg_next(payload);
+  }
+  msg->off = dest->used;
+  msg->len = need;
+  dest->used += need;
+  return 0;
+}
+
+// dst unregistered at now, notifications for it are held until it is back
+// or ttl passed
+void sfqueue_gone(sfqueue_t *self, const char *dst, int64_t now) {
+  if (zhash_size(self->gone) >= DD_SFQ_GONE)
+    sfqueue_expire(self, now);
+  if (zhash_size(self->gone) >= DD_SFQ_GONE)
+    return;
+  int64_t *until = zhash_lookup(self->gone, dst);
+  if (until == NULL) {
+    until = malloc(sizeof(int64_t));
+    zhash_insert(self->gone, dst, until);
+    zhash_freefn(self->gone, dst, free);
+  }
+  *until = now + self->ttl;
+}
+
+// Keeps a copy of payload for dst, returns -1 if dst didn't unregister
+// recently or its queue is full
+int sfqueue_put(sfqueue_t *self, const char *src, const char *dst,
+                zmsg_t *payload) {
+  size_t size = zmsg_content_size(payload);
+  sfq_dest_t *dest = zhash_lookup(self->dests, dst);
+  if (dest == NULL) {
+    int64_t *until = zhash_lookup(self->gone, dst);
+    if (until == NULL || *until <= zclock_mono())
+      goto refused;
+    int *count = s_tenant_dests(self, dst);
+    if (zhash_size(self->dests) >= DD_SFQ_DESTS ||
+        (self->tenant_max_dests > 0 && *count >= self->tenant_max_dests))
+      goto refused;
+    dest = calloc(1, sizeof(sfq_dest_t));
+    dest->dst = strdup(dst);
+    dest->msgs = zlist_new();
+    zhash_insert(self->dests, dst, dest);
+    (*count)++;
+  }
+  if (zlist_size(dest->msgs) >= self->max ||
+      dest->bytes + size > self->max_bytes)
+    goto refused;
+
+  sfq_msg_t *msg = calloc(1, sizeof(sfq_msg_t));
+  msg->src = strdup(src);
+  msg->size = size;
+  msg->expires = zclock_mono() + self->ttl;
+  // keep the order, once spilling the rest of the queue is spilled too
+  if (dest->map == NULL && self->mem + size <= DD_SFQ_MEMORY) {
+    msg->payload = zmsg_dup(payload);
+    dest->mem += size;
+    self->mem += size;
+  } else if (self->spill_dir == NULL ||
+             s_spill(self, dest, msg, payload) != 0) {
+    s_msg_free(&msg);
+    goto refused;
+  }
+  dest->bytes += size;
+  zlist_append(dest->msgs, msg);
+  return 0;
+
+refused:
+  self->drops++;
+  if (dest && zlist_size(dest->msgs) == 0) {
+    s_dest_remove(self, dest);
+    sfqueue_dest_free(&dest);
+  }
+  return -1;
+}
+
+// The queue of dst, which the caller now owns, NULL if there is none.
+// dst registered again, so it isn't queued for anymore.
+sfq_dest_t *sfqueue_take(sfqueue_t *self, const char *dst) {
+  zhash_delete(self->gone, dst);
+  sfq_dest_t *dest = zhash_lookup(self->dests, dst);
+  if (dest == NULL)
+    return NULL;
+  s_dest_remove(self, dest);
+  self->mem -= dest->mem;
+  return dest;
+}
+
+// A copy of a queued notification's payload
+zmsg_t *sfqueue_payload(sfq_dest_t *dest, sfq_msg_t *msg) {
+  if (msg->payload)
+    return zmsg_dup(msg->payload);
+  zmsg_t *payload = zmsg_new();
+  const unsigned char *p = dest->map + msg->off;
+  uint32_t nframes;
+  memcpy(&nframes, p, sizeof(nframes));
+  p += sizeof(nframes);
+  while (nframes--) {
+    uint32_t len;
+    memcpy(&len, p, sizeof(len));
+    zmsg_addmem(payload, p + sizeof(len), len);
+    p += sizeof(len) + len;
+  }
+  return payload;
+}
+
+// Drops notifications that waited too long and forgets clients that left
+// too long ago, returns how many notifications were dropped
+int sfqueue_expire(sfqueue_t *self, int64_t now) {
+  int dropped = 0;
+  zlist_t *empty = zlist_new();
+  int64_t *until = zhash_first(self->gone);
+  while (until) {
+    if (*until <= now)
+      zlist_append(empty, strdup(zhash_cursor(self->gone)));
+    until = zhash_next(self->gone);
+  }
+  char *name;
+  while ((name = zlist_pop(empty))) {
+    zhash_delete(self->gone, name);
+    free(name);
+  }
+
+  sfq_dest_t *dest = zhash_first(self->dests);
+  while (dest) {
+    sfq_msg_t *msg;
+    while ((msg = zlist_first(dest->msgs)) && msg->expires <= now) {
+      zlist_pop(dest->msgs);
+      dest->bytes -= msg->size;
+      if (msg->payload) {
+        dest->mem -= msg->size;
+        self->mem -= msg->size;
+      }
+      s_msg_free(&msg);
+      dropped++;
+    }
+    if (zlist_size(dest->msgs) == 0)
+      zlist_append(empty, dest);
+    dest = zhash_next(self->dests);
+  }
+  while ((dest = zlist_pop(empty))) {
+    s_dest_remove(self, dest);
+    sfqueue_dest_free(&dest);
+  }
+  zlist_destroy(&empty);
+  self->drops += dropped;
+  return dropped;
+}
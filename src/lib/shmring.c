@@ -0,0 +1,201 @@
+/*
+ * shmring.c --- shared memory rings for payloads between local processes
+ *
+ * A client connected over ipc:// keeps its large outgoing payloads in a
+ * POSIX shared memory ring and only sends the position of each payload
+ * through ZMQ. The broker, or the receiving client on the same host, maps
+ * the ring by name and reads the payload in place, so it is not copied
+ * through the kernel on every hop.
+ *
+ * Rings are only accessible to their owner, or with a group to its
+ * members, and are only mapped if nobody else can get at them.
+ *
+ * Records are a uint32_t length and state followed by the payload, padded
+ * to 8 bytes, and never wrap around the end of the ring. Only the owner
+ * writes records and moves head and tail. Readers mark a record FREE
+ * when they are done with it, and the owner reclaims records in order
+ * from the tail the next time it needs space. A record that is never
+ * released keeps the ring from being reused, the owner then falls back
+ * to sending payloads through ZMQ.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/shmring.h"
+
+#define SHM_MAGIC 0x44445348
+#define SHM_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+struct _shm_rec {
+  uint32_t len;
+  uint32_t state;
+};
+#define SHM_REC sizeof(struct _shm_rec)
+
+static shmring_t *s_map(const char *name, int fd, size_t size, int owner) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return NULL;
+  void *mem = mmap(NULL, sizeof(struct _shmring_hdr) + size,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  shmring_t *self = calloc(1, sizeof(shmring_t));
+  snprintf(self->name, sizeof(self->name), "%s", name);
+  self->hdr = mem;
+  self->data = (unsigned char *)mem + sizeof(struct _shmring_hdr);
+  self->size = size;
+  self->owner = owner;
+  self->uid = st.st_uid;
+  self->gid = st.st_gid;
+  self->group = (st.st_mode & S_IRWXG) != 0;
+  return self;
+}
+
+// Creates a ring of size bytes, the size is rounded down to 8 bytes. Only
+// we can map it, or members of gid as well unless it is -1.
+shmring_t *shmring_create(const char *name, size_t size, int gid) {
+  size &= ~(size_t)7;
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    return NULL;
+  if (gid >= 0 && (fchown(fd, -1, gid) == -1 ||
+                   fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) == -1)) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(struct _shmring_hdr) + size) == -1) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  shmring_t *self = s_map(name, fd, size, 1);
+  close(fd);
+  if (self == NULL) {
+    shm_unlink(name);
+    return NULL;
+  }
+  self->hdr->size = size;
+  self->hdr->head = self->hdr->tail = 0;
+  __sync_synchronize();
+  self->hdr->magic = SHM_MAGIC;
+  return self;
+}
+
+// Maps another process's ring, NULL if it doesn't exist or isn't a ring.
+// It has to belong to us, or with gid other than -1 to that group, and
+// must not be accessible to anyone else.
+shmring_t *shmring_open(const char *name, int gid) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  struct _shmring_hdr hdr;
+  if (fstat(fd, &st) == -1 || (st.st_mode & S_IRWXO) != 0 ||
+      (st.st_uid != geteuid() && (gid < 0 || st.st_gid != (gid_t)gid)) ||
+      (size_t)st.st_size < sizeof(hdr) ||
+      pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != SHM_MAGIC ||
+      hdr.size != (uint64_t)st.st_size - sizeof(hdr) || hdr.size % 8 != 0) {
+    close(fd);
+    return NULL;
+  }
+  shmring_t *self = s_map(name, fd, hdr.size, 0);
+  close(fd);
+  return self;
+}
+
+// Whether the owner of peer can map self as well
+int shmring_shared(shmring_t *self, shmring_t *peer) {
+  return self->uid == peer->uid || (self->group && self->gid == peer->gid);
+}
+
+void shmring_destroy(shmring_t **self_p) {
+  shmring_t *self = *self_p;
+  if (self == NULL)
+    return;
+  munmap(self->hdr, sizeof(struct _shmring_hdr) + self->size);
+  if (self->owner)
+    shm_unlink(self->name);
+  free(self);
+  *self_p = NULL;
+}
+
+static struct _shm_rec *s_rec(shmring_t *self, uint64_t pos) {
+  return (struct _shm_rec *)(self->data + pos % self->size);
+}
+
+// Moves the tail past records the readers are done with
+static void s_reclaim(shmring_t *self) {
+  struct _shmring_hdr *hdr = self->hdr;
+  while (hdr->tail < hdr->head) {
+    struct _shm_rec *rec = s_rec(self, hdr->tail);
+    uint32_t state = __sync_fetch_and_add(&rec->state, 0);
+    if (state == SHM_REC_BUSY)
+      break;
+    uint64_t step = SHM_REC + SHM_ALIGN(rec->len);
+    // a record header overwritten by someone else, give up on the rest
+    if (step > hdr->head - hdr->tail)
+      step = hdr->head - hdr->tail;
+    hdr->tail += step;
+  }
+}
+
+// Owner only. Space for a record of len bytes, with its position in off,
+// or NULL if the ring is full.
+void *shmring_reserve(shmring_t *self, size_t len, uint64_t *off) {
+  struct _shmring_hdr *hdr = self->hdr;
+  uint64_t need = SHM_REC + SHM_ALIGN(len);
+  if (!self->owner || need > self->size)
+    return NULL;
+  s_reclaim(self);
+  uint64_t pos = hdr->head % self->size;
+  uint64_t used = hdr->head - hdr->tail;
+  // pad to the end rather than wrap a record around
+  if (self->size - pos < need) {
+    uint64_t pad = self->size - pos;
+    if (self->size - used < pad + need)
+      return NULL;
+    struct _shm_rec *rec = s_rec(self, hdr->head);
+    rec->len = pad - SHM_REC;
+    rec->state = SHM_REC_PAD;
+    hdr->head += pad;
+    used += pad;
+  }
+  if (self->size - used < need)
+    return NULL;
+  struct _shm_rec *rec = s_rec(self, hdr->head);
+  rec->len = len;
+  rec->state = SHM_REC_BUSY;
+  *off = hdr->head;
+  hdr->head += need;
+  return rec + 1;
+}
+
+static struct _shm_rec *s_check(shmring_t *self, uint64_t off, size_t len) {
+  uint64_t pos = off % self->size;
+  if (pos % 8 != 0 || self->size - pos < SHM_REC + SHM_ALIGN(len))
+    return NULL;
+  struct _shm_rec *rec = s_rec(self, off);
+  if (rec->len != len || rec->state != SHM_REC_BUSY)
+    return NULL;
+  return rec;
+}
+
+// The payload of the record at off, NULL if there is no such record
+void *shmring_get(shmring_t *self, uint64_t off, size_t len) {
+  struct _shm_rec *rec = s_check(self, off, len);
+  return rec ? rec + 1 : NULL;
+}
+
+// Hands a record back to the owner once it has been read
+void shmring_release(shmring_t *self, uint64_t off, size_t len) {
+  struct _shm_rec *rec = s_check(self, off, len);
+  if (rec)
+    __sync_bool_compare_and_swap(&rec->state, SHM_REC_BUSY, SHM_REC_FREE);
+}
@@ -0,0 +1,128 @@
+/*
+ * slab.c --- fixed size object caches for the broker hash table nodes
+ *
+ * Objects are carved out of chunks of SLAB_CHUNK and recycled through a
+ * free list, so client churn doesn't go through malloc. Objects that
+ * readers may still see after being unlinked from a hash table are
+ * released with slab_free_rcu, which collects them in batches of
+ * SLAB_BATCH and hands each batch to call_rcu. After the grace period
+ * the call_rcu thread finalizes the objects and pushes them onto the
+ * reclaimed stack, which the owner picks up in one go when its free list
+ * runs dry.
+ */
+#include "../include/slab.h"
+#include <urcu/uatomic.h>
+
+struct _slab_batch {
+  struct rcu_head head;
+  slab_t *slab;
+  int count;
+  void *objs[SLAB_BATCH];
+};
+
+slab_t *slab_new(size_t size, slab_fini_fn *fini) {
+  slab_t *self = calloc(1, sizeof(slab_t));
+  // room for the free list link, and keep the objects aligned
+  if (size < sizeof(void *))
+    size = sizeof(void *);
+  self->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  self->fini = fini;
+  self->chunks = zlist_new();
+  return self;
+}
+
+static void s_slab_grow(slab_t *self) {
+  char *chunk = malloc(self->size * SLAB_CHUNK);
+  assert(chunk);
+  zlist_append(self->chunks, chunk);
+  int i;
+  for (i = SLAB_CHUNK - 1; i >= 0; i--) {
+    void *obj = chunk + i * self->size;
+    *(void **)obj = self->free_list;
+    self->free_list = obj;
+  }
+}
+
+void *slab_alloc(slab_t *self) {
+  if (self->free_list == NULL)
+    self->free_list = uatomic_xchg(&self->reclaimed, NULL);
+  if (self->free_list == NULL)
+    s_slab_grow(self);
+  void *obj = self->free_list;
+  self->free_list = *(void **)obj;
+  memset(obj, 0, self->size);
+  self->in_use++;
+  return obj;
+}
+
+// For objects that were never visible to readers
+void slab_free(slab_t *self, void *obj) {
+  if (self->fini)
+    self->fini(obj);
+  *(void **)obj = self->free_list;
+  self->free_list = obj;
+  self->in_use--;
+}
+
+// Runs in the call_rcu thread once no reader can see the batch any more
+static void s_slab_reclaim(struct rcu_head *head) {
+  struct _slab_batch *batch = caa_container_of(head, struct _slab_batch, head);
+  slab_t *self = batch->slab;
+  int i;
+  for (i = 0; i < batch->count; i++) {
+    if (self->fini)
+      self->fini(batch->objs[i]);
+    *(void **)batch->objs[i] =
+        (i + 1 < batch->count) ? batch->objs[i + 1] : NULL;
+  }
+
+  void *first = batch->objs[0];
+  void *last = batch->objs[batch->count - 1];
+  void *old;
+  do {
+    old = uatomic_read(&self->reclaimed);
+    *(void **)last = old;
+  } while (uatomic_cmpxchg(&self->reclaimed, old, first) != old);
+  uatomic_sub(&self->waiting, batch->count);
+  free(batch);
+}
+
+void slab_free_rcu(slab_t *self, void *obj) {
+  if (self->batch == NULL) {
+    self->batch = malloc(sizeof(struct _slab_batch));
+    self->batch->slab = self;
+    self->batch->count = 0;
+  }
+  self->batch->objs[self->batch->count++] = obj;
+  self->in_use--;
+  if (self->batch->count == SLAB_BATCH)
+    slab_flush(self);
+}
+
+// Hand the objects freed so far to call_rcu, also called from a timer so
+// that a partial batch doesn't wait forever
+void slab_flush(slab_t *self) {
+  struct _slab_batch *batch = self->batch;
+  if (batch == NULL)
+    return;
+  self->batch = NULL;
+  uatomic_add(&self->waiting, batch->count);
+  call_rcu(&batch->head, s_slab_reclaim);
+}
+
+// Objects still in use are not finalized, their owners have to do that
+void slab_destroy(slab_t **self_p) {
+  assert(self_p);
+  slab_t *self = *self_p;
+  if (self == NULL)
+    return;
+  slab_flush(self);
+  if (uatomic_read(&self->waiting) > 0)
+    rcu_barrier();
+  char *chunk;
+  while ((chunk = zlist_pop(self->chunks)))
+    free(chunk);
+  zlist_destroy(&self->chunks);
+  free(self);
+  *self_p = NULL;
+}
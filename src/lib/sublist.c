@@ -29,17 +29,12 @@ static int s_sublist_cmp(const void *item1, const void *item2) {
 // -- destroy an item
 // typedef void (czmq_destructor) (void **item);
 static void s_sublist_free(void **item) {
-    // TODO
-    // There's a bug lurking here.. the new_top pointer is not the same
-    // as the the one passed to s_sublist_free..
-  
   ddtopic_t *i;
   i = (ddtopic_t *)*item;
-  //printf("s_sublist_free called p: %p t: %p s: %p \n", i, i->topic, i->scope);
   free(i->topic);
   free(i->scope);
   free(i);
-  i = NULL;
+  *item = NULL;
 }
 
 // -- duplicate an item
@@ -54,6 +49,11 @@ static void *s_sublist_dup(const void *item) {
   return new;
 }
 
+// The index maps "topic\x1fscope" to the item's handle in the list
+static char *s_sublist_key(const char *topic, const char *scope) {
+  return zsys_sprintf("%s\x1f%s", topic, scope);
+}
+
 zlistx_t *sublist_new() {
   zlistx_t *n = zlistx_new();
   zlistx_set_destructor(n, (czmq_destructor *)s_sublist_free);
@@ -67,66 +67,71 @@ void sublist_destroy(zlistx_t **self_p) {
 }
 // update or add topic/scope/active to list
 void sublist_add(dd_t *self, char *topic, char *scope, char active) {
-  ddtopic_t *item;
-  int found = 0;
-
-  while ((item = zlistx_next((zlistx_t *)dd_get_subscriptions(self)))) {
-    if (streq(item->topic, topic) && streq(item->scope, scope)) {
-      item->active = active;
-      found = 1;
-    }
-  }
-
-  // Otherwise, add new
-  if (!found) {
-    ddtopic_t *new_top = malloc(sizeof(ddtopic_t));
-
-    // TODO
-    // There's a bug lurking here.. the new_top pointer is not the same
-    // as the the one passed to s_sublist_free..
-    /* printf("sublist_add, new %p (%d) t: %p s %p \n", new_top,
-     * sizeof(ddtopic_t), */
-    /*        topic, scope); */
-
-    new_top->topic = topic;
-    new_top->scope = scope;
-    new_top->active = active;
-    zlistx_add_start((zlistx_t *)dd_get_subscriptions(self), new_top);
+  zlistx_t *list = (zlistx_t *)dd_get_subscriptions(self);
+  zhashx_t *index = dd_get_subindex(self);
+  char *key = s_sublist_key(topic, scope);
+  void *handle = zhashx_lookup(index, key);
+  if (handle) {
+    ddtopic_t *item = zlistx_handle_item(handle);
+    item->active = active;
+  } else {
+    // the list's duplicator makes the copy it keeps
+    ddtopic_t new_top;
+    new_top.topic = topic;
+    new_top.scope = scope;
+    new_top.active = active;
+    handle = zlistx_add_start(list, &new_top);
+    zhashx_insert(index, key, handle);
   }
+  free(key);
 }
 
 void sublist_delete_topic(dd_t *self, char *topic) {
-  ddtopic_t *item = zlistx_first((zlistx_t *)dd_get_subscriptions(self));
-  do {
-    if (streq(item->topic, topic)) {
-      zlistx_delete((zlistx_t *)dd_get_subscriptions(self), item);
+  zlistx_t *list = (zlistx_t *)dd_get_subscriptions(self);
+  ddtopic_t *item = zlistx_first(list);
+  while (item) {
+    void *handle = zlistx_cursor(list);
+    int match = streq(item->topic, topic);
+    if (match) {
+      char *key = s_sublist_key(item->topic, item->scope);
+      zhashx_delete(dd_get_subindex(self), key);
+      free(key);
     }
-  } while ((item = zlistx_next((zlistx_t *)dd_get_subscriptions(self))));
+    item = zlistx_next(list);
+    if (match)
+      zlistx_delete(list, handle);
+  }
 }
 
 int sublist_delete(dd_t *self, char *topic, char *scope) {
-  ddtopic_t del;
-  del.topic = topic;
-  del.scope = scope;
-  ddtopic_t *item = zlistx_find((zlistx_t *)dd_get_subscriptions(self), &del);
-  if (item)
-    return zlistx_delete((zlistx_t *)dd_get_subscriptions(self), item);
-  return -1;
+  zhashx_t *index = dd_get_subindex(self);
+  char *key = s_sublist_key(topic, scope);
+  void *handle = zhashx_lookup(index, key);
+  int rc = -1;
+  if (handle) {
+    zhashx_delete(index, key);
+    rc = zlistx_delete((zlistx_t *)dd_get_subscriptions(self), handle);
+  }
+  free(key);
+  return rc;
 }
 
 void sublist_activate(dd_t *self, char *topic, char *scope) {
-  ddtopic_t *item;
-  while ((item = zlistx_next((zlistx_t *)dd_get_subscriptions(self)))) {
-    if (strcmp(item->topic, topic) == 0 && strcmp(item->scope, scope) == 0) {
-      item->active = 1;
-    }
+  char *key = s_sublist_key(topic, scope);
+  void *handle = zhashx_lookup(dd_get_subindex(self), key);
+  if (handle) {
+    ddtopic_t *item = zlistx_handle_item(handle);
+    item->active = 1;
   }
+  free(key);
 }
 
 void sublist_deactivate_all(dd_t *self) {
-  ddtopic_t *item;
-  while ((item = zlistx_next((zlistx_t *)dd_get_subscriptions(self)))) {
+  zlistx_t *list = (zlistx_t *)dd_get_subscriptions(self);
+  ddtopic_t *item = zlistx_first(list);
+  while (item) {
     item->active = 0;
+    item = zlistx_next(list);
   }
 }
 
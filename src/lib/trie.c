@@ -61,6 +61,9 @@ static struct nn_trie_node **nn_node_next(struct nn_trie_node *self, uint8_t c);
 static int nn_node_unsubscribe(struct nn_trie_node **self, const uint8_t *data,
                                size_t size, zframe_t *, uint8_t);
 static void nn_node_term(struct nn_trie_node *self);
+static int nn_node_unsubscribe_many(struct nn_trie_node **self, char **topics,
+                                    int n, size_t pos, zframe_t *sockid);
+static struct nn_trie_node *nn_node_prune(struct nn_trie_node *self);
 static int nn_node_has_subscribers(struct nn_trie_node *self);
 static void nn_node_dump(struct nn_trie_node *self, int indent);
 static void nn_node_indent(int indent);
@@ -749,7 +752,9 @@ static int nn_node_unsubscribe(struct nn_trie_node **self, const uint8_t *data,
     new_node = malloc(sizeof(struct nn_trie_node) +
                       NN_TRIE_SPARSE_MAX * sizeof(struct nn_trie_node *));
     assert(new_node);
-    new_node->refcount = 0;
+    /*  The node keeps its own subscribers. */
+    new_node->refcount = (*self)->refcount;
+    new_node->sockids = (*self)->sockids;
     new_node->prefix_len = (*self)->prefix_len;
     memcpy(new_node->prefix, (*self)->prefix, new_node->prefix_len);
     new_node->type = NN_TRIE_SPARSE_MAX;
@@ -816,6 +821,154 @@ found:
   return 0;
 }
 
+int nn_trie_unsubscribe_many(struct nn_trie *self, char **topics, int n,
+                             zframe_t *sockid) {
+  if (!self->root || n == 0)
+    return 0;
+  return nn_node_unsubscribe_many(&self->root, topics, n, 0, sockid);
+}
+
+static int nn_node_unsubscribe_many(struct nn_trie_node **self, char **topics,
+                                    int n, size_t pos, zframe_t *sockid) {
+  struct nn_trie_node *node = *self;
+  struct nn_trie_node **ch;
+  const uint8_t *data;
+  size_t size;
+  uint8_t c;
+  int removed = 0;
+  int i = 0;
+  int j;
+
+  /*  All the topics share the first pos characters, which brought us
+      here. Those ending in this node are removed from it, the rest are
+      passed on in groups, one group per child. */
+  while (i < n) {
+    data = (const uint8_t *)topics[i] + pos;
+    size = strlen(topics[i]) - pos;
+    if (nn_node_check_prefix(node, data, size) != node->prefix_len) {
+      ++i;
+      continue;
+    }
+    data += node->prefix_len;
+    size -= node->prefix_len;
+
+    if (!size) {
+      zframe_t *t = node->sockids ? zlist_first(node->sockids) : NULL;
+      while (t) {
+        if (zframe_eq(t, sockid)) {
+          zlist_remove(node->sockids, t);
+          zframe_destroy(&t);
+          --node->refcount;
+          ++removed;
+          break;
+        }
+        t = zlist_next(node->sockids);
+      }
+      ++i;
+      continue;
+    }
+
+    /*  Sorted input keeps the topics going to the same child together. */
+    c = *data;
+    for (j = i + 1; j < n; ++j) {
+      size_t len = strlen(topics[j]);
+      if (len <= pos + node->prefix_len ||
+          (uint8_t)topics[j][pos + node->prefix_len] != c ||
+          memcmp(topics[j] + pos, topics[i] + pos, node->prefix_len) != 0)
+        break;
+    }
+    ch = nn_node_next(node, c);
+    if (ch && *ch)
+      removed += nn_node_unsubscribe_many(ch, topics + i, j - i,
+                                          pos + node->prefix_len + 1, sockid);
+    i = j;
+  }
+
+  *self = nn_node_prune(node);
+  return removed;
+}
+
+static struct nn_trie_node *nn_node_prune(struct nn_trie_node *self) {
+  /*  Drops the children that were deleted by nn_node_unsubscribe_many and
+      then deletes or compacts the node, like nn_node_unsubscribe does for
+      a single subscription. */
+  struct nn_trie_node *ch;
+  int children;
+  int n = 0;
+  int i;
+
+  if (self->type <= NN_TRIE_SPARSE_MAX) {
+    for (i = 0; i != self->type; ++i) {
+      ch = *nn_node_child(self, i);
+      if (ch) {
+        self->u.sparse.children[n] = self->u.sparse.children[i];
+        *nn_node_child(self, n) = ch;
+        ++n;
+      }
+    }
+    self->type = n;
+    children = n;
+  } else {
+    int first = -1;
+    int last = -1;
+    uint8_t min = self->u.dense.min;
+    for (i = 0; i != self->u.dense.max - min + 1; ++i) {
+      if (*nn_node_child(self, i)) {
+        if (first < 0)
+          first = i;
+        last = i;
+        ++n;
+      }
+    }
+    if (n <= NN_TRIE_SPARSE_MAX) {
+      uint8_t chars[NN_TRIE_SPARSE_MAX];
+      struct nn_trie_node *nodes[NN_TRIE_SPARSE_MAX];
+      int k = 0;
+      for (i = first; n && i <= last; ++i) {
+        ch = *nn_node_child(self, i);
+        if (ch) {
+          chars[k] = min + i;
+          nodes[k] = ch;
+          ++k;
+        }
+      }
+      self->type = n;
+      memcpy(self->u.sparse.children, chars, n);
+      for (k = 0; k != n; ++k)
+        *nn_node_child(self, k) = nodes[k];
+      children = n;
+    } else {
+      memmove(nn_node_child(self, 0), nn_node_child(self, first),
+              (last - first + 1) * sizeof(struct nn_trie_node *));
+      self->u.dense.min = min + first;
+      self->u.dense.max = min + last;
+      self->u.dense.nbr = n;
+      children = last - first + 1;
+    }
+  }
+  self = realloc(self, sizeof(struct nn_trie_node) +
+                           children * sizeof(struct nn_trie_node *));
+  assert(self);
+
+  if (nn_node_has_subscribers(self))
+    return self;
+  if (self->sockids) {
+    zframe_t *t = zlist_pop(self->sockids);
+    while (t) {
+      zframe_destroy(&t);
+      t = zlist_pop(self->sockids);
+    }
+    zlist_destroy(&self->sockids);
+  }
+
+  /*  No children and no subscribers left, delete the node. */
+  if (!self->type) {
+    free(self);
+    return NULL;
+  }
+  return nn_node_compact(self);
+}
+
 int nn_node_has_subscribers(struct nn_trie_node *node) {
   /*  Returns 1 when there are no subscribers associated with the node. */
   return node->refcount ? 1 : 0;
@@ -0,0 +1,133 @@
+/*
+ * msgpool_bench.c --- allocations per received SEND, zmsg_recv or msgpool
+ *
+ * Sends SEND shaped messages over inproc to a ROUTER and receives them
+ * the way the broker did before msgpool, with zmsg_recv and zmsg_popstr,
+ * and the way it does now, with msgpool_recv and rmsg_zmsg. malloc and
+ * friends are counted around each receive loop, so the numbers are calls
+ * per message in the broker's receive path and not in libzmq's sender.
+ *
+ *   ddmsgpool_bench [messages]
+ */
+#include <czmq.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/dd_classes.h"
+#include "../include/msgpool.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_int s_counting;
+static atomic_ulong s_allocs;
+
+void *malloc(size_t size) {
+  if (atomic_load_explicit(&s_counting, memory_order_relaxed))
+    atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (atomic_load_explicit(&s_counting, memory_order_relaxed))
+    atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (atomic_load_explicit(&s_counting, memory_order_relaxed))
+    atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+#define BATCH 1000
+
+static void s_send_batch(zsock_t *dealer, zframe_t *payload) {
+  uint64_t cookie = 0;
+  int i;
+  for (i = 0; i < BATCH; i++)
+    zsock_send(dealer, "bbbsf", &dd_version, 4, &dd_cmd_send, 4, &cookie,
+               sizeof(cookie), "tenant.dest", payload);
+}
+
+// What s_on_router_msg and s_cb_send did with a zmsg_recv'd SEND
+static void s_recv_zmsg(zsock_t *router) {
+  zmsg_t *msg = zmsg_recv(router);
+  zframe_t *sockid = zmsg_pop(msg);
+  zframe_t *version = zmsg_pop(msg);
+  zframe_t *cmd = zmsg_pop(msg);
+  zframe_t *cookie = zmsg_pop(msg);
+  char *dest = zmsg_popstr(msg);
+  free(dest);
+  zframe_destroy(&sockid);
+  zframe_destroy(&version);
+  zframe_destroy(&cmd);
+  zframe_destroy(&cookie);
+  // what is left of msg is the payload that was forwarded
+  zmsg_destroy(&msg);
+}
+
+static void s_recv_pool(zsock_t *router, msgpool_t *pool) {
+  char dest[256];
+  dd_rmsg_t *msg = msgpool_recv(pool, zsock_resolve(router));
+  rmsg_str(msg, 4, dest, sizeof(dest));
+  zmsg_t *payload = rmsg_zmsg(msg, 5);
+  msgpool_release(pool, &msg);
+  zmsg_destroy(&payload);
+}
+
+static void s_run(zsock_t *dealer, zsock_t *router, msgpool_t *pool,
+                  size_t size, int count) {
+  zframe_t *payload = zframe_new(NULL, size);
+  memset(zframe_data(payload), 'x', size);
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    unsigned long allocs = 0;
+    int64_t elapsed = 0;
+    int done;
+    for (done = 0; done < count; done += BATCH) {
+      s_send_batch(dealer, payload);
+      int64_t start = zclock_usecs();
+      atomic_store(&s_allocs, 0);
+      atomic_store(&s_counting, 1);
+      int i;
+      for (i = 0; i < BATCH; i++) {
+        if (pass == 0)
+          s_recv_zmsg(router);
+        else
+          s_recv_pool(router, pool);
+      }
+      atomic_store(&s_counting, 0);
+      allocs += atomic_load(&s_allocs);
+      elapsed += zclock_usecs() - start;
+    }
+    printf("%-8s %6zu bytes: %6.2f allocs/msg %8.1f ns/msg\n",
+           pass == 0 ? "zmsg" : "msgpool", size, (double)allocs / done,
+           1000.0 * elapsed / done);
+  }
+  zframe_destroy(&payload);
+}
+
+int main(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 100000;
+  if (count < BATCH)
+    count = BATCH;
+  size_t sizes[] = {16, 256, 4096, 65536};
+  zsock_t *router = zsock_new_router("inproc://msgpool_bench");
+  zsock_t *dealer = zsock_new_dealer("inproc://msgpool_bench");
+  zsock_set_rcvhwm(router, 0);
+  zsock_set_sndhwm(dealer, 0);
+  msgpool_t *pool = msgpool_new(64);
+  unsigned i;
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    s_run(dealer, router, pool, sizes[i], count);
+  msgpool_destroy(&pool);
+  zsock_destroy(&dealer);
+  zsock_destroy(&router);
+  return 0;
+}
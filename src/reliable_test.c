@@ -0,0 +1,116 @@
+/*
+ * reliable_test.c --- checks the bookkeeping of reliable notifications
+ *
+ * The sender keeps what it queued until a cumulative ACK covers it and
+ * notices repeated ACKs, the receiver only delivers the next number in
+ * order and skips what the sender saw acknowledged. Targets are only
+ * forgotten once they acknowledged everything. Run by make check.
+ */
+#include <assert.h>
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "reliable.h"
+
+static void test_ack() {
+  reliable_t *rel = reliable_new();
+  rel_out_t *out = reliable_out(rel, "target");
+  assert(reliable_out(rel, "target") == out);
+  uint64_t seq;
+  int i;
+  for (i = 1; i <= 5; i++) {
+    assert(reliable_queue(out, "data", 4, 0, &seq) == 0);
+    assert(seq == (uint64_t)i);
+  }
+  assert(zlist_size(out->msgs) == 5);
+  out->sent = 3;
+
+  int acked;
+  // nothing beyond what was sent is released
+  assert(reliable_ack(rel, out->session, 5, &acked) == out);
+  assert(acked == 3 && out->base == 4);
+  assert(zlist_size(out->msgs) == 2);
+  rel_msg_t *msg = zlist_first(out->msgs);
+  assert(msg->seq == 4);
+
+  // the same ACK again while 4 is in flight
+  out->sent = 5;
+  reliable_ack(rel, out->session, 3, &acked);
+  reliable_ack(rel, out->session, 3, &acked);
+  assert(acked == 0 && out->dupacks == 2);
+  reliable_ack(rel, out->session, 5, &acked);
+  assert(acked == 2 && out->dupacks == 0 && zlist_size(out->msgs) == 0);
+
+  assert(reliable_ack(rel, out->session + 1, 1, &acked) == NULL);
+  reliable_destroy(&rel);
+}
+
+static void test_full() {
+  reliable_t *rel = reliable_new();
+  rel_out_t *out = reliable_out(rel, "target");
+  int i;
+  for (i = 0; i < DD_REL_WINDOW + DD_REL_PENDING; i++)
+    assert(reliable_queue(out, "x", 1, 0, NULL) == 0);
+  assert(reliable_queue(out, "x", 1, 0, NULL) == -1);
+  reliable_destroy(&rel);
+}
+
+static void test_expire() {
+  reliable_t *rel = reliable_new();
+  rel_out_t *out = reliable_out(rel, "busy");
+  reliable_queue(out, "x", 1, 0, NULL);
+  out->sent = 1;
+  rel_out_t *done = reliable_out(rel, "done");
+  uint64_t session = done->session;
+  int64_t now = zclock_mono();
+  assert(reliable_expire(rel, now, DD_REL_IDLE) == 0);
+  // still waiting for its ACK, however long it takes
+  assert(reliable_expire(rel, now + DD_REL_IDLE, DD_REL_IDLE) == 1);
+  assert(zhash_size(rel->out) == 1 && zhash_size(rel->sessions) == 1);
+  int acked;
+  assert(reliable_ack(rel, session, 1, &acked) == NULL);
+  assert(reliable_out(rel, "done")->session != session);
+
+  // full of targets, the idle ones make room right away
+  reliable_expire(rel, zclock_mono() + DD_REL_IDLE, DD_REL_IDLE);
+  assert(zhash_size(rel->out) == 1);
+  char name[16];
+  int i;
+  for (i = 1; i < DD_REL_PEERS; i++) {
+    snprintf(name, sizeof(name), "t%d", i);
+    reliable_out(rel, name);
+  }
+  assert(zhash_size(rel->out) == DD_REL_PEERS);
+  reliable_out(rel, "new");
+  assert(zhash_size(rel->out) == 2);
+  assert(zhash_lookup(rel->out, "busy") == out);
+  reliable_ack(rel, out->session, 1, &acked);
+  assert(acked == 1);
+  reliable_destroy(&rel);
+}
+
+static void test_accept() {
+  reliable_t *rel = reliable_new();
+  assert(reliable_accept(rel, "src", 7, 1, 1));
+  assert(!reliable_accept(rel, "src", 7, 1, 1)); // again
+  assert(!reliable_accept(rel, "src", 7, 3, 1)); // out of order
+  assert(reliable_accept(rel, "src", 7, 2, 1));
+  assert(reliable_accept(rel, "src", 7, 3, 1));
+  // a new session of the same source starts at its base
+  assert(!reliable_accept(rel, "src", 8, 5, 4));
+  assert(reliable_accept(rel, "src", 8, 4, 4));
+  // the sender saw ACKs up to 9 from a receiver that forgot them
+  assert(reliable_accept(rel, "src", 8, 10, 10));
+  assert(rel->acks_due == 2);
+  reliable_destroy(&rel);
+}
+
+int main(int argc, char **argv) {
+  test_ack();
+  test_full();
+  test_expire();
+  test_accept();
+  printf("reliable_test: OK\n");
+  return 0;
+}
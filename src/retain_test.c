@@ -0,0 +1,63 @@
+/*
+ * retain_test.c --- checks what brokers retain for new subscribers
+ *
+ * The last publication per topic is kept, the oldest topic goes beyond
+ * max, and a copy of the retained publication that another broker passes
+ * on again is recognized. Run by make check.
+ */
+#include <assert.h>
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "retain.h"
+
+static zmsg_t *s_payload(const char *sealed) {
+  zmsg_t *payload = zmsg_new();
+  zmsg_addstr(payload, sealed);
+  uint32_t flags = 0;
+  zmsg_addmem(payload, &flags, sizeof(flags));
+  return payload;
+}
+
+static void test_again() {
+  retain_t *r = retain_new(10);
+  zmsg_t *one = s_payload("one");
+  zmsg_t *two = s_payload("two");
+  assert(retain_put(r, "t.a/", "src", "a", one) == 1);
+  // passed on by another broker
+  assert(retain_put(r, "t.a/", "src", "a", one) == 0);
+  assert(retain_put(r, "t.a/", "src", "a", two) == 1);
+  assert(retain_put(r, "t.a/", "src", "a", one) == 1);
+  assert(zhash_size(r->entries) == 1);
+  zmsg_destroy(&one);
+  zmsg_destroy(&two);
+  retain_destroy(&r);
+}
+
+static void test_match() {
+  retain_t *r = retain_new(2);
+  zmsg_t *payload = s_payload("x");
+  retain_put(r, "t.a/", "src", "a", payload);
+  retain_put(r, "t.ab/", "src", "ab", payload);
+  zlist_t *found = retain_match(r, "t.a");
+  assert(zlist_size(found) == 2);
+  zlist_destroy(&found);
+
+  // beyond max the oldest topic goes
+  retain_put(r, "t.b/", "src", "b", payload);
+  found = retain_match(r, "t.a");
+  assert(zlist_size(found) == 1);
+  retained_t *kept = zlist_first(found);
+  assert(streq(kept->pubtopic, "t.ab/"));
+  zlist_destroy(&found);
+  zmsg_destroy(&payload);
+  retain_destroy(&r);
+}
+
+int main(int argc, char **argv) {
+  test_again();
+  test_match();
+  printf("retain_test: OK\n");
+  return 0;
+}
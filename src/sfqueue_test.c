@@ -0,0 +1,109 @@
+/*
+ * sfqueue_test.c --- checks which notifications the root broker holds
+ *
+ * Only clients that unregistered less than ttl ago are queued for, names
+ * that never registered are refused so they get NODST. A tenant has at
+ * most tenant_max_dests destinations, and a destination gets its
+ * notifications back in order once. Run by make check.
+ */
+#include <assert.h>
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfqueue.h"
+
+static int s_put(sfqueue_t *q, const char *dst, const char *text) {
+  zmsg_t *payload = zmsg_new();
+  zmsg_addstr(payload, text);
+  int rc = sfqueue_put(q, "a.sender", dst, payload);
+  zmsg_destroy(&payload);
+  return rc;
+}
+
+static void test_unknown() {
+  sfqueue_t *q = sfqueue_new(10);
+  assert(s_put(q, "a.never", "hello") == -1);
+  assert(zhash_size(q->dests) == 0);
+  assert(sfqueue_take(q, "a.never") == NULL);
+  sfqueue_destroy(&q);
+}
+
+static void test_gone() {
+  sfqueue_t *q = sfqueue_new(10);
+  sfqueue_gone(q, "a.client", zclock_mono());
+  assert(s_put(q, "a.client", "one") == 0);
+  assert(s_put(q, "a.client", "two") == 0);
+  assert(s_put(q, "a.other", "three") == -1);
+
+  sfq_dest_t *dest = sfqueue_take(q, "a.client");
+  assert(dest && zlist_size(dest->msgs) == 2);
+  const char *expect[] = {"one", "two"};
+  int i = 0;
+  sfq_msg_t *msg = zlist_first(dest->msgs);
+  while (msg) {
+    zmsg_t *payload = sfqueue_payload(dest, msg);
+    char *text = zmsg_popstr(payload);
+    assert(streq(text, expect[i++]));
+    assert(streq(msg->src, "a.sender"));
+    free(text);
+    zmsg_destroy(&payload);
+    msg = zlist_next(dest->msgs);
+  }
+  sfqueue_dest_free(&dest);
+
+  // registered again, so it gets NODST like any unknown name
+  assert(s_put(q, "a.client", "four") == -1);
+  assert(q->mem == 0);
+  sfqueue_destroy(&q);
+}
+
+static void test_expired() {
+  sfqueue_t *q = sfqueue_new(10);
+  int64_t now = zclock_mono();
+  sfqueue_gone(q, "a.late", now - q->ttl);
+  assert(s_put(q, "a.late", "hello") == -1);
+
+  sfqueue_gone(q, "a.client", now);
+  assert(s_put(q, "a.client", "hello") == 0);
+  assert(sfqueue_expire(q, now + q->ttl + 1000) == 1);
+  assert(zhash_size(q->dests) == 0);
+  assert(zhash_size(q->gone) == 0);
+  assert(q->mem == 0);
+  assert(s_put(q, "a.client", "again") == -1);
+  sfqueue_destroy(&q);
+}
+
+static void test_limits() {
+  sfqueue_t *q = sfqueue_new(2);
+  q->tenant_max_dests = 2;
+  int64_t now = zclock_mono();
+  sfqueue_gone(q, "a.one", now);
+  sfqueue_gone(q, "a.two", now);
+  sfqueue_gone(q, "a.three", now);
+  sfqueue_gone(q, "b.one", now);
+  assert(s_put(q, "a.one", "x") == 0);
+  assert(s_put(q, "a.two", "x") == 0);
+  assert(s_put(q, "a.three", "x") == -1);
+  assert(s_put(q, "b.one", "x") == 0);
+
+  // per destination
+  assert(s_put(q, "a.one", "y") == 0);
+  assert(s_put(q, "a.one", "z") == -1);
+
+  // a taken destination makes room in its tenant
+  sfq_dest_t *dest = sfqueue_take(q, "a.two");
+  sfqueue_dest_free(&dest);
+  assert(s_put(q, "a.three", "x") == 0);
+  assert(q->drops == 2);
+  sfqueue_destroy(&q);
+}
+
+int main(int argc, char **argv) {
+  test_unknown();
+  test_gone();
+  test_expired();
+  test_limits();
+  printf("sfqueue_test: OK\n");
+  return 0;
+}
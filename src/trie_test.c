@@ -0,0 +1,247 @@
+/*
+ * trie_test.c --- checks removing many subscriptions from the topic trie
+ *
+ * nn_trie_unsubscribe_many has to leave the trie as nn_trie_unsubscribe
+ * would, one topic at a time: the same subscribers, and no node left that
+ * has neither subscribers nor children. Run by make check.
+ */
+#include <assert.h>
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trie.h"
+
+#define TOPICS 300
+
+static int s_children(struct nn_trie_node *node) {
+  return node->type <= NN_TRIE_SPARSE_MAX
+             ? node->type
+             : node->u.dense.max - node->u.dense.min + 1;
+}
+
+static struct nn_trie_node *s_child(struct nn_trie_node *node, int i) {
+  return ((struct nn_trie_node **)(node + 1))[i];
+}
+
+// Checks that node is pruned and compacted, returns its subscriptions
+static int s_check_node(struct nn_trie_node *node) {
+  if (node == NULL)
+    return 0;
+  int children = s_children(node);
+  int subs = node->refcount;
+  int n = 0, i;
+  assert(node->prefix_len <= NN_TRIE_PREFIX_MAX);
+  assert(subs > 0 || children > 0);
+  if (node->sockids)
+    assert(zlist_size(node->sockids) == node->refcount);
+  for (i = 0; i < children; i++) {
+    struct nn_trie_node *ch = s_child(node, i);
+    if (node->type <= NN_TRIE_SPARSE_MAX)
+      assert(ch);
+    if (ch) {
+      subs += s_check_node(ch);
+      n++;
+    }
+  }
+  if (node->type == NN_TRIE_DENSE_TYPE) {
+    assert(n == node->u.dense.nbr);
+    assert(n > NN_TRIE_SPARSE_MAX);
+    assert(s_child(node, 0) && s_child(node, children - 1));
+  }
+  // a single child without subscribers should have been merged into it
+  if (children == 1 && node->refcount == 0)
+    assert(node->prefix_len + s_child(node, 0)->prefix_len + 1 >
+           NN_TRIE_PREFIX_MAX);
+  return subs;
+}
+
+static int s_subscriptions(struct nn_trie *trie) {
+  return s_check_node(trie->root);
+}
+
+// The same without the checks, for a trie nn_trie_unsubscribe changed
+static int s_count_node(struct nn_trie_node *node) {
+  if (node == NULL)
+    return 0;
+  int subs = node->refcount;
+  int i;
+  for (i = 0; i < s_children(node); i++)
+    subs += s_count_node(s_child(node, i));
+  return subs;
+}
+
+static void s_sub(struct nn_trie *trie, const char *topic, zframe_t *sockid) {
+  nn_trie_subscribe(trie, (const uint8_t *)topic, strlen(topic), sockid, 1);
+}
+
+// Whether sockid gets publications on topic
+static int s_gets(struct nn_trie *trie, const char *topic, zframe_t *sockid) {
+  zlist_t *socks = nn_trie_tree(trie, (const uint8_t *)topic, strlen(topic));
+  int found = 0;
+  if (socks) {
+    zframe_t *t = zlist_first(socks);
+    while (t) {
+      if (zframe_eq(t, sockid))
+        found = 1;
+      t = zlist_next(socks);
+    }
+    zlist_destroy(&socks);
+  }
+  return found;
+}
+
+static int s_cmp(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+static int s_unsub_many(struct nn_trie *trie, char **topics, int n,
+                        zframe_t *sockid) {
+  qsort(topics, n, sizeof(char *), s_cmp);
+  return nn_trie_unsubscribe_many(trie, topics, n, sockid);
+}
+
+static void test_shared_prefixes(zframe_t *a, zframe_t *b) {
+  struct nn_trie trie;
+  nn_trie_init(&trie);
+  char *topics[] = {"t.abc", "t.a/1/2/", "t.b", "t.ab", "t.a/1/"};
+  int i;
+  for (i = 0; i < 5; i++)
+    s_sub(&trie, topics[i], a);
+  s_sub(&trie, "t.a/1/", b);
+  s_sub(&trie, "t.abc", b);
+  assert(s_subscriptions(&trie) == 7);
+
+  assert(s_unsub_many(&trie, topics, 5, a) == 5);
+  assert(s_subscriptions(&trie) == 2);
+  for (i = 0; i < 5; i++)
+    assert(!s_gets(&trie, topics[i], a));
+  assert(s_gets(&trie, "t.a/1/2/", b));
+  assert(s_gets(&trie, "t.abc", b));
+  assert(!s_gets(&trie, "t.ab", b));
+  assert(!s_gets(&trie, "t.b", b));
+  nn_trie_term(&trie);
+}
+
+static void test_missing(zframe_t *a, zframe_t *b) {
+  struct nn_trie trie;
+  nn_trie_init(&trie);
+  s_sub(&trie, "t.x", a);
+  s_sub(&trie, "t.y", a);
+  char *topics[] = {"t.xx", "u", "t.x", "t.w", "t."};
+  assert(s_unsub_many(&trie, topics, 5, a) == 1);
+  assert(s_subscriptions(&trie) == 1);
+  assert(!s_gets(&trie, "t.x", a));
+  assert(s_gets(&trie, "t.y", a));
+
+  // not subscribed at all
+  char *others[] = {"t.y"};
+  assert(s_unsub_many(&trie, others, 1, b) == 0);
+  assert(s_gets(&trie, "t.y", a));
+  assert(nn_trie_unsubscribe_many(&trie, others, 0, a) == 0);
+  assert(s_subscriptions(&trie) == 1);
+  nn_trie_term(&trie);
+
+  // nothing to remove from an empty trie
+  nn_trie_init(&trie);
+  assert(nn_trie_unsubscribe_many(&trie, others, 1, a) == 0);
+  assert(trie.root == NULL);
+}
+
+// Enough children for a dense node, which goes back to sparse
+static void test_dense(zframe_t *a) {
+  struct nn_trie trie;
+  nn_trie_init(&trie);
+  char names[20][8];
+  char *topics[20];
+  int i;
+  for (i = 0; i < 20; i++) {
+    snprintf(names[i], sizeof(names[i]), "d.%c", 'A' + 3 * i);
+    topics[i] = names[i];
+    s_sub(&trie, topics[i], a);
+  }
+  assert(s_subscriptions(&trie) == 20);
+  // keep the first, the last and three in between
+  char *gone[15];
+  int n = 0;
+  for (i = 0; i < 20; i++)
+    if (i != 0 && i != 19 && i % 6 != 3)
+      gone[n++] = topics[i];
+  assert(n == 15);
+  assert(s_unsub_many(&trie, gone, n, a) == 15);
+  assert(s_subscriptions(&trie) == 5);
+  for (i = 0; i < 20; i++)
+    assert(s_gets(&trie, names[i], a) == (i == 0 || i == 19 || i % 6 == 3));
+  nn_trie_term(&trie);
+}
+
+// Removing everything leaves nothing behind
+static void test_prune_all(zframe_t *a, zframe_t *b) {
+  struct nn_trie trie;
+  nn_trie_init(&trie);
+  char names[TOPICS][64];
+  char *topics[TOPICS];
+  int i;
+  for (i = 0; i < TOPICS; i++) {
+    snprintf(names[i], sizeof(names[i]), "tenant.topic%d/%d/%d/", i % 17,
+             i % 5, i);
+    topics[i] = names[i];
+    s_sub(&trie, topics[i], a);
+  }
+  s_sub(&trie, topics[7], b);
+  assert(s_unsub_many(&trie, topics, TOPICS, a) == TOPICS);
+  assert(s_subscriptions(&trie) == 1);
+  assert(s_gets(&trie, names[7], b));
+  char *last[] = {names[7]};
+  assert(s_unsub_many(&trie, last, 1, b) == 1);
+  assert(trie.root == NULL);
+}
+
+// The same as removing the topics one by one
+static void test_same_as_single(zframe_t *a, zframe_t *b) {
+  struct nn_trie many, single;
+  nn_trie_init(&many);
+  nn_trie_init(&single);
+  char names[TOPICS][64];
+  char *topics[TOPICS];
+  char *gone[TOPICS];
+  int n = 0, i;
+  for (i = 0; i < TOPICS; i++) {
+    snprintf(names[i], sizeof(names[i]), "ten.%x%s/%d/", i * 7919 % 4093,
+             i % 3 ? "long.topic.name" : "", i % 4);
+    topics[i] = names[i];
+    s_sub(&many, topics[i], a);
+    s_sub(&single, topics[i], a);
+    if (i % 2) {
+      s_sub(&many, topics[i], b);
+      s_sub(&single, topics[i], b);
+    }
+    if (i % 3 != 1)
+      gone[n++] = topics[i];
+  }
+  for (i = 0; i < n; i++)
+    nn_trie_unsubscribe(&single, (const uint8_t *)gone[i], strlen(gone[i]),
+                        a, 1);
+  assert(s_unsub_many(&many, gone, n, a) == n);
+  assert(s_subscriptions(&many) == s_count_node(single.root));
+  for (i = 0; i < TOPICS; i++) {
+    assert(s_gets(&many, names[i], a) == s_gets(&single, names[i], a));
+    assert(s_gets(&many, names[i], b) == s_gets(&single, names[i], b));
+  }
+  nn_trie_term(&many);
+  nn_trie_term(&single);
+}
+
+int main(int argc, char **argv) {
+  zframe_t *a = zframe_new("\x00\x01\x02\x03\x04", 5);
+  zframe_t *b = zframe_new("\x00\x01\x02\x03\x05", 5);
+  test_shared_prefixes(a, b);
+  test_missing(a, b);
+  test_dense(a);
+  test_prune_all(a, b);
+  test_same_as_single(a, b);
+  zframe_destroy(&a);
+  zframe_destroy(&b);
+  printf("trie_test: OK\n");
+  return 0;
+}